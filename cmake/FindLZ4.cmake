@@ -0,0 +1,50 @@
+# - Find LZ4
+# Find the LZ4 compression library
+#
+# Module defines:
+#   LZ4_FOUND          - library and includes were found
+#   LZ4_INCLUDE_DIRS   - include directories
+#   LZ4_LIBRARIES      - lz4 libraries
+#
+# Environment variables:
+#   LZ4_ROOTDIR        - optional - rootdir of the lz4 installation
+#
+# Cache entries:
+#   LZ4_LIBRARY        - detected lz4 library
+#   LZ4_INCLUDE_DIR    - detected lz4 include dir
+#
+#=============================================================================
+# Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#=============================================================================
+
+find_library(LZ4_LIBRARY
+							NAMES "lz4"
+							PATHS "/usr" "/usr/local" "/opt" ENV LZ4_ROOTDIR
+							PATH_SUFFIXES "lib")
+mark_as_advanced(LZ4_LIBRARY)
+
+find_path(LZ4_INCLUDE_DIR
+							NAMES "lz4.h"
+							PATHS "/usr" "/usr/local" "/opt" ENV LZ4_ROOTDIR
+							PATH_SUFFIXES "include")
+mark_as_advanced(LZ4_INCLUDE_DIR)
+
+include(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(LZ4 DEFAULT_MSG LZ4_LIBRARY LZ4_INCLUDE_DIR)
+
+if (LZ4_FOUND)
+	set(LZ4_LIBRARIES ${LZ4_LIBRARY})
+	set(LZ4_INCLUDE_DIRS ${LZ4_INCLUDE_DIR})
+endif(LZ4_FOUND)
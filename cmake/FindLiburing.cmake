@@ -0,0 +1,50 @@
+# - Find Liburing
+# Find the liburing io_uring library
+#
+# Module defines:
+#   LIBURING_FOUND          - library and includes were found
+#   LIBURING_INCLUDE_DIRS   - include directories
+#   LIBURING_LIBRARIES      - liburing libraries
+#
+# Environment variables:
+#   LIBURING_ROOTDIR        - optional - rootdir of the liburing installation
+#
+# Cache entries:
+#   LIBURING_LIBRARY        - detected liburing library
+#   LIBURING_INCLUDE_DIR    - detected liburing include dir
+#
+#=============================================================================
+# Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#=============================================================================
+
+find_library(LIBURING_LIBRARY
+							NAMES "uring"
+							PATHS "/usr" "/usr/local" "/opt" ENV LIBURING_ROOTDIR
+							PATH_SUFFIXES "lib")
+mark_as_advanced(LIBURING_LIBRARY)
+
+find_path(LIBURING_INCLUDE_DIR
+							NAMES "liburing.h"
+							PATHS "/usr" "/usr/local" "/opt" ENV LIBURING_ROOTDIR
+							PATH_SUFFIXES "include")
+mark_as_advanced(LIBURING_INCLUDE_DIR)
+
+include(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(Liburing DEFAULT_MSG LIBURING_LIBRARY LIBURING_INCLUDE_DIR)
+
+if (LIBURING_FOUND)
+	set(LIBURING_LIBRARIES ${LIBURING_LIBRARY})
+	set(LIBURING_INCLUDE_DIRS ${LIBURING_INCLUDE_DIR})
+endif(LIBURING_FOUND)
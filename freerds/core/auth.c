@@ -24,6 +24,10 @@
 
 #include <winpr/crt.h>
 #include <winpr/path.h>
+#include <winpr/synch.h>
+#include <winpr/thread.h>
+#include <winpr/sysinfo.h>
+#include <winpr/collections.h>
 
 #include <security/pam_appl.h>
 
@@ -31,8 +35,8 @@
 
 struct t_user_pass
 {
-	char user[256];
-	char pass[256];
+	char* user;
+	char* pass;
 };
 
 struct t_auth_info
@@ -98,20 +102,55 @@ static int verify_pam_conv(int num_msg, const struct pam_message **msg, struct p
 	return PAM_SUCCESS;
 }
 
+static void free_auth_info(struct t_auth_info* auth_info)
+{
+	if (auth_info->ph)
+		pam_end(auth_info->ph, PAM_SUCCESS);
+
+	free(auth_info->user_pass.user);
+
+	if (auth_info->user_pass.pass)
+	{
+		SecureZeroMemory(auth_info->user_pass.pass, strlen(auth_info->user_pass.pass));
+		free(auth_info->user_pass.pass);
+	}
+
+	free(auth_info);
+}
+
 long freerds_authenticate(char* username, char* password, int* errorcode)
 {
 	int error;
 	char service_name[256];
 	struct t_auth_info* auth_info;
 
+	if (!username || !password)
+	{
+		if (errorcode != NULL)
+			*errorcode = PAM_AUTH_ERR;
+
+		return 0;
+	}
+
 	get_service_name(service_name);
 	auth_info = malloc(sizeof(struct t_auth_info));
+
+	if (!auth_info)
+		return 0;
+
 	ZeroMemory(auth_info, sizeof(struct t_auth_info));
-	strcpy(auth_info->user_pass.user, username);
-	strcpy(auth_info->user_pass.pass, password);
+	auth_info->user_pass.user = _strdup(username);
+	auth_info->user_pass.pass = _strdup(password);
+
+	if (!auth_info->user_pass.user || !auth_info->user_pass.pass)
+	{
+		free_auth_info(auth_info);
+		return 0;
+	}
+
 	auth_info->pamc.conv = &verify_pam_conv;
 	auth_info->pamc.appdata_ptr = &(auth_info->user_pass);
-	error = pam_start(service_name, 0, &(auth_info->pamc), &(auth_info->ph));
+	error = pam_start(service_name, username, &(auth_info->pamc), &(auth_info->ph));
 
 	if (error != PAM_SUCCESS)
 	{
@@ -119,7 +158,7 @@ long freerds_authenticate(char* username, char* password, int* errorcode)
 			*errorcode = error;
 
 		printf("pam_start failed: %s\n", pam_strerror(auth_info->ph, error));
-		free(auth_info);
+		free_auth_info(auth_info);
 		return 0;
 	}
 
@@ -131,7 +170,7 @@ long freerds_authenticate(char* username, char* password, int* errorcode)
 			*errorcode = error;
 
 		printf("pam_authenticate failed: %s\n", pam_strerror(auth_info->ph, error));
-		free(auth_info);
+		free_auth_info(auth_info);
 		return 0;
 	}
 
@@ -143,9 +182,350 @@ long freerds_authenticate(char* username, char* password, int* errorcode)
 			*errorcode = error;
 
 		printf("pam_acct_mgmt failed: %s\n", pam_strerror(auth_info->ph, error));
-		free(auth_info);
+		free_auth_info(auth_info);
+		return 0;
+	}
+
+	free_auth_info(auth_info);
+
+	return 1;
+}
+
+/**
+ * Authentication worker pool
+ *
+ * PAM conversations can block for seconds on remote backends (sssd, LDAP),
+ * so they are run on a small pool of worker threads instead of the connection
+ * thread. Requests are queued in a bounded queue and completed through a
+ * callback. A request which is still pending past its deadline completes with
+ * RDS_AUTH_STATUS_TIMEOUT; the caller can also cancel it at any time.
+ */
+
+struct rds_auth_request
+{
+	char* username;
+	char* password;
+	DWORD QueueTime;
+	DWORD Deadline;
+	BOOL Cancelled;
+	BOOL Completed;
+	int status;
+	int errorcode;
+	pRdsAuthCompletion Completion;
+	void* context;
+};
+
+struct rds_auth_pool
+{
+	int WorkerCount;
+	HANDLE* Workers;
+	HANDLE StopEvent;
+	wQueue* Requests;
+	CRITICAL_SECTION lock;
+	rdsAuthStats stats;
+};
+typedef struct rds_auth_pool rdsAuthPool;
+
+static rdsAuthPool* g_AuthPool = NULL;
+
+static void freerds_auth_request_free(rdsAuthRequest* request)
+{
+	free(request->username);
+
+	if (request->password)
+	{
+		SecureZeroMemory(request->password, strlen(request->password));
+		free(request->password);
+	}
+
+	free(request);
+}
+
+static void freerds_auth_request_complete(rdsAuthPool* pool, rdsAuthRequest* request, int status, int errorcode)
+{
+	DWORD latency;
+
+	latency = GetTickCount() - request->QueueTime;
+
+	EnterCriticalSection(&pool->lock);
+
+	pool->stats.QueueDepth--;
+	pool->stats.Completed++;
+
+	if (status == RDS_AUTH_STATUS_TIMEOUT)
+		pool->stats.TimedOut++;
+
+	pool->stats.TotalLatency += latency;
+
+	if (latency > pool->stats.MaxLatency)
+		pool->stats.MaxLatency = latency;
+
+	if (request->Cancelled)
+	{
+		LeaveCriticalSection(&pool->lock);
+		freerds_auth_request_free(request);
+		return;
+	}
+
+	request->status = status;
+	request->errorcode = errorcode;
+	request->Completed = TRUE;
+
+	if (request->Completion)
+		request->Completion(request, request->context);
+
+	LeaveCriticalSection(&pool->lock);
+}
+
+static void* freerds_auth_worker_thread(void* arg)
+{
+	int status;
+	int errorcode;
+	HANDLE events[2];
+	rdsAuthRequest* request;
+	rdsAuthPool* pool = (rdsAuthPool*) arg;
+
+	events[0] = pool->StopEvent;
+	events[1] = Queue_Event(pool->Requests);
+
+	while (1)
+	{
+		WaitForMultipleObjects(2, events, FALSE, INFINITE);
+
+		if (WaitForSingleObject(pool->StopEvent, 0) == WAIT_OBJECT_0)
+			break;
+
+		request = (rdsAuthRequest*) Queue_Dequeue(pool->Requests);
+
+		if (!request)
+			continue;
+
+		if (request->Cancelled)
+		{
+			freerds_auth_request_complete(pool, request, RDS_AUTH_STATUS_FAILURE, 0);
+			continue;
+		}
+
+		if ((LONG) (GetTickCount() - request->Deadline) >= 0)
+		{
+			freerds_auth_request_complete(pool, request, RDS_AUTH_STATUS_TIMEOUT, 0);
+			continue;
+		}
+
+		errorcode = 0;
+		status = freerds_authenticate(request->username, request->password, &errorcode) ?
+				RDS_AUTH_STATUS_SUCCESS : RDS_AUTH_STATUS_FAILURE;
+
+		SecureZeroMemory(request->password, strlen(request->password));
+
+		if ((status == RDS_AUTH_STATUS_SUCCESS) && ((LONG) (GetTickCount() - request->Deadline) >= 0))
+			status = RDS_AUTH_STATUS_TIMEOUT;
+
+		freerds_auth_request_complete(pool, request, status, errorcode);
+	}
+
+	return NULL;
+}
+
+int freerds_auth_pool_start(int workers, int maxQueueDepth)
+{
+	int index;
+	rdsAuthPool* pool;
+
+	if (g_AuthPool)
 		return 0;
+
+	if (workers < 1)
+		workers = 1;
+
+	pool = (rdsAuthPool*) malloc(sizeof(rdsAuthPool));
+
+	if (!pool)
+		return -1;
+
+	ZeroMemory(pool, sizeof(rdsAuthPool));
+
+	pool->WorkerCount = workers;
+	pool->stats.MaxQueueDepth = maxQueueDepth;
+
+	InitializeCriticalSectionAndSpinCount(&pool->lock, 4000);
+	pool->StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	pool->Requests = Queue_New(TRUE, -1, -1);
+
+	pool->Workers = (HANDLE*) malloc(sizeof(HANDLE) * workers);
+
+	for (index = 0; index < workers; index++)
+	{
+		pool->Workers[index] = CreateThread(NULL, 0,
+				(LPTHREAD_START_ROUTINE) freerds_auth_worker_thread, (void*) pool, 0, NULL);
+	}
+
+	g_AuthPool = pool;
+
+	return 0;
+}
+
+void freerds_auth_pool_stop(void)
+{
+	int index;
+	rdsAuthPool* pool = g_AuthPool;
+	rdsAuthRequest* request;
+
+	if (!pool)
+		return;
+
+	SetEvent(pool->StopEvent);
+
+	for (index = 0; index < pool->WorkerCount; index++)
+	{
+		WaitForSingleObject(pool->Workers[index], INFINITE);
+		CloseHandle(pool->Workers[index]);
+	}
+
+	while ((request = (rdsAuthRequest*) Queue_Dequeue(pool->Requests)) != NULL)
+		freerds_auth_request_complete(pool, request, RDS_AUTH_STATUS_FAILURE, 0);
+
+	printf("auth pool: %d requests, %d rejected, %d timed out, peak queue depth %d, latency avg %d ms max %d ms\n",
+			pool->stats.Submitted, pool->stats.Rejected, pool->stats.TimedOut, pool->stats.PeakQueueDepth,
+			pool->stats.Completed ? (int) (pool->stats.TotalLatency / pool->stats.Completed) : 0,
+			(int) pool->stats.MaxLatency);
+
+	g_AuthPool = NULL;
+
+	Queue_Free(pool->Requests);
+	CloseHandle(pool->StopEvent);
+	DeleteCriticalSection(&pool->lock);
+
+	free(pool->Workers);
+	free(pool);
+}
+
+rdsAuthRequest* freerds_auth_submit(char* username, char* password, DWORD timeout,
+		pRdsAuthCompletion completion, void* context)
+{
+	rdsAuthPool* pool = g_AuthPool;
+	rdsAuthRequest* request;
+
+	if (!pool || !username || !password)
+		return NULL;
+
+	EnterCriticalSection(&pool->lock);
+
+	if (pool->stats.QueueDepth >= pool->stats.MaxQueueDepth)
+	{
+		pool->stats.Rejected++;
+		LeaveCriticalSection(&pool->lock);
+		printf("auth pool: queue full (%d pending), rejecting logon for %s\n",
+				pool->stats.QueueDepth, username);
+		return NULL;
+	}
+
+	LeaveCriticalSection(&pool->lock);
+
+	request = (rdsAuthRequest*) malloc(sizeof(rdsAuthRequest));
+
+	if (!request)
+		return NULL;
+
+	ZeroMemory(request, sizeof(rdsAuthRequest));
+
+	request->username = _strdup(username);
+	request->password = _strdup(password);
+
+	if (!request->username || !request->password)
+	{
+		freerds_auth_request_free(request);
+		return NULL;
+	}
+
+	request->QueueTime = GetTickCount();
+	request->Deadline = request->QueueTime + timeout;
+	request->Completion = completion;
+	request->context = context;
+
+	EnterCriticalSection(&pool->lock);
+
+	pool->stats.Submitted++;
+	pool->stats.QueueDepth++;
+
+	if (pool->stats.QueueDepth > pool->stats.PeakQueueDepth)
+		pool->stats.PeakQueueDepth = pool->stats.QueueDepth;
+
+	LeaveCriticalSection(&pool->lock);
+
+	Queue_Enqueue(pool->Requests, (void*) request);
+
+	return request;
+}
+
+int freerds_auth_request_release(rdsAuthRequest* request, int* errorcode)
+{
+	int status;
+	rdsAuthPool* pool = g_AuthPool;
+
+	if (!pool || !request)
+		return RDS_AUTH_STATUS_FAILURE;
+
+	EnterCriticalSection(&pool->lock);
+
+	if (!request->Completed)
+	{
+		/* the worker owns the request until it completes and will free it */
+		request->Cancelled = TRUE;
+		LeaveCriticalSection(&pool->lock);
+		return RDS_AUTH_STATUS_PENDING;
 	}
 
-	return (long) auth_info;
+	LeaveCriticalSection(&pool->lock);
+
+	status = request->status;
+
+	if (errorcode)
+		*errorcode = request->errorcode;
+
+	freerds_auth_request_free(request);
+
+	return status;
+}
+
+int freerds_auth_pool_get_stats(rdsAuthStats* stats)
+{
+	rdsAuthPool* pool = g_AuthPool;
+
+	if (!pool)
+		return -1;
+
+	EnterCriticalSection(&pool->lock);
+	CopyMemory(stats, &pool->stats, sizeof(rdsAuthStats));
+	LeaveCriticalSection(&pool->lock);
+
+	return 0;
+}
+
+/**
+ * Written on SIGUSR1 next to the statistics of the sessions.
+ */
+
+void freerds_auth_pool_dump_stats(void)
+{
+	FILE* fp;
+	rdsAuthStats stats;
+
+	if (freerds_auth_pool_get_stats(&stats) < 0)
+		return;
+
+	fp = g_open_stats_file("stats-auth.txt");
+
+	if (!fp)
+		return;
+
+	fprintf(fp, "auth pool: queue depth %d (peak %d, max %d)\n",
+			stats.QueueDepth, stats.PeakQueueDepth, stats.MaxQueueDepth);
+	fprintf(fp, "\tsubmitted %d, completed %d (of which timed out %d), rejected %d\n",
+			stats.Submitted, stats.Completed, stats.TimedOut, stats.Rejected);
+	fprintf(fp, "\tlatency: average %u ms, max %u ms\n",
+			stats.Completed ? (unsigned int) (stats.TotalLatency / stats.Completed) : 0,
+			(unsigned int) stats.MaxLatency);
+
+	fclose(fp);
 }
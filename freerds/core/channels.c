@@ -25,11 +25,21 @@
 
 #include <freerds/icp_client_stubs.h>
 
+/**
+ * Called once the session is known. The channel policy normally comes with
+ * GetUserSession, so this doesn't cost a round trip per channel.
+ */
 int freerds_channels_post_connect(rdsConnection* session)
 {
 	int i;
+	UINT32 sessionId;
 	rdpSettings* settings = session->settings;
 
+	if (!session->connector)
+		return -1;
+
+	sessionId = (UINT32) session->connector->SessionId;
+
 	for (i = 0; i < settings->ChannelCount; i++)
 	{
 
@@ -37,7 +47,7 @@ int freerds_channels_post_connect(rdsConnection* session)
 		{
 			BOOL allowed = FALSE;
 
-			freerds_icp_IsChannelAllowed(session->id, settings->ChannelDefArray[i].Name, &allowed);
+			freerds_icp_IsChannelAllowedCached(sessionId, settings->ChannelDefArray[i].Name, &allowed);
 			printf("channel %s is %s\n", settings->ChannelDefArray[i].Name, allowed ? "allowed" : "not allowed");
 #if 0
 			if (strncmp(settings->ChannelDefArray[i].Name, "cliprdr", 7) == 0)
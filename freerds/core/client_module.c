@@ -32,9 +32,31 @@
 
 #include <freerdp/freerdp.h>
 
+/**
+ * Written on SIGUSR1, so that the statistics of every session can be read
+ * at runtime even when freerds runs as a daemon without a console.
+ */
+
+static void freerds_client_dump_stats(rdsModuleConnector* connector)
+{
+	FILE* fp;
+	char name[64];
+
+	sprintf_s(name, sizeof(name), "stats-%d.txt", (int) connector->SessionId);
+
+	fp = g_open_stats_file(name);
+
+	if (!fp)
+		return;
+
+	freerds_stats_print(connector, fp);
+	fclose(fp);
+}
+
 void* freerds_client_thread(void* arg)
 {
 	int fps;
+	LONG statsGeneration;
 	DWORD status;
 	DWORD nCount;
 	HANDLE events[8];
@@ -48,10 +70,12 @@ void* freerds_client_thread(void* arg)
 	due.QuadPart = 0;
 	SetWaitableTimer(PackTimer, &due, 1000 / fps, NULL, NULL, 0);
 
+	statsGeneration = g_get_stats_generation();
+
 	nCount = 0;
 	events[nCount++] = PackTimer;
 	events[nCount++] = connector->StopEvent;
-	events[nCount++] = connector->hClientPipe;
+	events[nCount++] = freerds_transport_get_event_handle(connector);
 
 	while (1)
 	{
@@ -62,7 +86,7 @@ void* freerds_client_thread(void* arg)
 			break;
 		}
 
-		if (WaitForSingleObject(connector->hClientPipe, 0) == WAIT_OBJECT_0)
+		if (WaitForSingleObject(freerds_transport_get_event_handle(connector), 0) == WAIT_OBJECT_0)
 		{
 			if (freerds_transport_receive(connector) < 0)
 				break;
@@ -71,6 +95,12 @@ void* freerds_client_thread(void* arg)
 		if (status == WAIT_OBJECT_0)
 		{
 			freerds_message_server_queue_pack(connector);
+
+			if (g_get_stats_generation() != statsGeneration)
+			{
+				statsGeneration = g_get_stats_generation();
+				freerds_client_dump_stats(connector);
+			}
 		}
 
 		if (connector->fps != fps)
@@ -83,6 +113,47 @@ void* freerds_client_thread(void* arg)
 
 	CloseHandle(PackTimer);
 
+	freerds_stats_print(connector, stdout);
+
+	return NULL;
+}
+
+/**
+ * The encoder thread drains the server queue filled by freerds_client_thread
+ * and performs the (potentially slow) codec work, keeping the connection
+ * thread free to forward client input to the module without delay.
+ */
+
+void* freerds_encoder_thread(void* arg)
+{
+	DWORD nCount;
+	HANDLE events[8];
+	rdsConnection* connection;
+	rdsModuleConnector* connector = (rdsModuleConnector*) arg;
+
+	connection = connector->connection;
+
+	while (1)
+	{
+		nCount = 0;
+		events[nCount++] = connector->StopEvent;
+		connector->GetEventHandles(connector, events, &nCount);
+
+		WaitForMultipleObjects(nCount, events, FALSE, INFINITE);
+
+		if (WaitForSingleObject(connector->StopEvent, 0) == WAIT_OBJECT_0)
+		{
+			break;
+		}
+
+		if (connector->CheckEventHandles(connector) < 0)
+		{
+			fprintf(stderr, "ModuleClient->CheckEventHandles failure\n");
+			SetEvent(connection->TermEvent);
+			break;
+		}
+	}
+
 	return NULL;
 }
 
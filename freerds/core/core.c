@@ -22,6 +22,8 @@
 #endif
 
 #include <winpr/crt.h>
+#include <winpr/sysinfo.h>
+#include <winpr/interlocked.h>
 
 #include <freerdp/freerdp.h>
 #include <freerdp/listener.h>
@@ -973,3 +975,101 @@ int freerds_window_delete(rdsConnection* connection, RDS_MSG_WINDOW_DELETE* msg)
 	//printf("%s\n", __FUNCTION__);
 	return 0;
 }
+
+/**
+ * Input latency instrumentation
+ *
+ * Input is stamped on the input thread and the latency is computed on the
+ * encoder thread. Each slot holds the sequence along with the timestamp and
+ * is written and read as one 64-bit value, so a slot reused for a newer
+ * input in the meantime is recognized instead of giving a torn timestamp.
+ */
+
+UINT32 freerds_input_stamp(rdsConnection* connection)
+{
+	UINT32 sequence;
+	LONGLONG slot;
+	LONGLONG value;
+	volatile LONGLONG* timestamp;
+
+	sequence = connection->InputSequence + 1;
+
+	if (!sequence)
+		sequence = 1;
+
+	timestamp = &(connection->InputTimestamps[sequence % RDS_INPUT_TIMESTAMP_COUNT]);
+	value = (LONGLONG) (((UINT64) sequence << 32) | GetTickCount());
+
+	do
+	{
+		slot = *timestamp;
+	}
+	while (InterlockedCompareExchange64(timestamp, value, slot) != slot);
+
+	connection->InputSequence = sequence;
+
+	return sequence;
+}
+
+int freerds_input_latency(rdsConnection* connection, UINT32 sequence, DWORD* latency)
+{
+	UINT64 slot;
+
+	if (!sequence || (sequence <= connection->LatencySequence))
+		return -1;
+
+	slot = (UINT64) InterlockedCompareExchange64(
+			&(connection->InputTimestamps[sequence % RDS_INPUT_TIMESTAMP_COUNT]), 0, 0);
+
+	if ((UINT32) (slot >> 32) != sequence)
+		return -1;
+
+	*latency = GetTickCount() - (DWORD) (slot & 0xFFFFFFFF);
+
+	return 0;
+}
+
+void freerds_latency_record(rdsLatencyHistogram* histogram, DWORD latency)
+{
+	int index = 0;
+
+	while ((index < RDS_LATENCY_BUCKETS - 1) && (latency >> index))
+		index++;
+
+	histogram->buckets[index]++;
+	histogram->count++;
+	histogram->total += latency;
+
+	if (latency > histogram->max)
+		histogram->max = latency;
+}
+
+static void freerds_latency_print_histogram(const char* name, rdsLatencyHistogram* histogram)
+{
+	int index;
+
+	if (!histogram->count)
+		return;
+
+	printf("%s: %d samples, avg %d ms, max %d ms\n", name, (int) histogram->count,
+			(int) (histogram->total / histogram->count), (int) histogram->max);
+
+	for (index = 0; index < RDS_LATENCY_BUCKETS; index++)
+	{
+		if (!histogram->buckets[index])
+			continue;
+
+		if (index == 0)
+			printf("\t< 1 ms: %d\n", (int) histogram->buckets[index]);
+		else if (index == RDS_LATENCY_BUCKETS - 1)
+			printf("\t>= %d ms: %d\n", 1 << (index - 1), (int) histogram->buckets[index]);
+		else
+			printf("\t%d-%d ms: %d\n", 1 << (index - 1), (1 << index) - 1, (int) histogram->buckets[index]);
+	}
+}
+
+void freerds_latency_print(rdsConnection* connection)
+{
+	freerds_latency_print_histogram("input to encode latency", &(connection->InputToEncode));
+	freerds_latency_print_histogram("input to send latency", &(connection->InputToSend));
+}
@@ -56,6 +56,23 @@ struct RDS_RECT
 };
 typedef struct RDS_RECT xrdpRect;
 
+/**
+ * Input latency histogram: bucket 0 counts samples below 1 ms,
+ * bucket n counts samples in [2^(n-1), 2^n) ms, the last bucket is open ended.
+ */
+
+#define RDS_LATENCY_BUCKETS		12
+#define RDS_INPUT_TIMESTAMP_COUNT	1024
+
+struct rds_latency_histogram
+{
+	UINT32 count;
+	UINT64 total;
+	UINT32 max;
+	UINT32 buckets[RDS_LATENCY_BUCKETS];
+};
+typedef struct rds_latency_histogram rdsLatencyHistogram;
+
 struct rds_connection
 {
 	rdpContext context;
@@ -64,6 +81,9 @@ struct rds_connection
 	rdsModuleConnector* connector;
 	HANDLE Thread;
 	HANDLE TermEvent;
+	HANDLE AuthEvent;
+	DWORD AuthDeadline;
+	rdsAuthRequest* AuthRequest;
 	freerdp_peer* client;
 	rdpSettings* settings;
 
@@ -82,6 +102,13 @@ struct rds_connection
 	UINT32 frameId;
 	wListDictionary* FrameList;
 
+	UINT32 InputSequence;
+	UINT32 LatencySequence;
+	/* (sequence << 32) | tick count, stamped by the input thread and read by the encoder */
+	volatile LONGLONG InputTimestamps[RDS_INPUT_TIMESTAMP_COUNT];
+	rdsLatencyHistogram InputToEncode;
+	rdsLatencyHistogram InputToSend;
+
 	WTSVirtualChannelManager* vcm;
 	CliprdrServerContext* cliprdr;
 	RdpdrServerContext* rdpdr;
@@ -170,6 +197,11 @@ FREERDP_API int freerds_window_new_update(rdsConnection* connection, RDS_MSG_WIN
 
 FREERDP_API int freerds_window_delete(rdsConnection* connection, RDS_MSG_WINDOW_DELETE* msg);
 
+FREERDP_API UINT32 freerds_input_stamp(rdsConnection* connection);
+FREERDP_API int freerds_input_latency(rdsConnection* connection, UINT32 sequence, DWORD* latency);
+FREERDP_API void freerds_latency_record(rdsLatencyHistogram* histogram, DWORD latency);
+FREERDP_API void freerds_latency_print(rdsConnection* connection);
+
 #ifdef __cplusplus
 }
 #endif
@@ -28,8 +28,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "freerds.h"
 
@@ -45,6 +50,9 @@
 
 char* RdsModuleName = NULL;
 static HANDLE g_TermEvent = NULL;
+static HANDLE g_ReloadEvent = NULL;
+static HANDLE g_StatsEvent = NULL;
+static volatile LONG g_StatsGeneration = 0;
 static xrdpListener* g_listen = NULL;
 
 COMMAND_LINE_ARGUMENT_A freerds_args[] =
@@ -52,6 +60,10 @@ COMMAND_LINE_ARGUMENT_A freerds_args[] =
 	{ "kill", COMMAND_LINE_VALUE_FLAG, "", NULL, NULL, -1, NULL, "kill daemon" },
 	{ "nodaemon", COMMAND_LINE_VALUE_FLAG, "", NULL, NULL, -1, NULL, "no daemon" },
 	{ "module", COMMAND_LINE_VALUE_REQUIRED, "<module name>", NULL, NULL, -1, NULL, "module name" },
+	{ "listen", COMMAND_LINE_VALUE_REQUIRED, "<[address:]port>[,<[address:]port>...]", NULL, NULL, -1, NULL, "listen endpoints" },
+	{ "acceptors", COMMAND_LINE_VALUE_REQUIRED, "<count>", NULL, NULL, -1, NULL, "number of acceptor threads" },
+	{ "replay", COMMAND_LINE_VALUE_REQUIRED, "<capture file>", NULL, NULL, -1, NULL, "encode a connector capture and exit" },
+	{ "replay-fast", COMMAND_LINE_VALUE_FLAG, "", NULL, NULL, -1, NULL, "replay without waiting between messages" },
 	{ NULL, 0, NULL, NULL, NULL, -1, NULL, NULL }
 };
 
@@ -68,6 +80,22 @@ void freerds_shutdown(int sig)
 		SetEvent(g_TermEvent);
 }
 
+void freerds_reload(int sig)
+{
+	printf("reloading server certificate\n");
+
+	if (g_ReloadEvent)
+		SetEvent(g_ReloadEvent);
+}
+
+void freerds_dump_stats(int sig)
+{
+	InterlockedIncrement(&g_StatsGeneration);
+
+	if (g_StatsEvent)
+		SetEvent(g_StatsEvent);
+}
+
 int g_is_term(void)
 {
 	return (WaitForSingleObject(g_TermEvent, 0) == WAIT_OBJECT_0) ? 1 : 0;
@@ -86,6 +114,105 @@ HANDLE g_get_term_event(void)
 	return g_TermEvent;
 }
 
+HANDLE g_get_reload_event(void)
+{
+	return g_ReloadEvent;
+}
+
+HANDLE g_get_stats_event(void)
+{
+	return g_StatsEvent;
+}
+
+LONG g_get_stats_generation(void)
+{
+	return g_StatsGeneration;
+}
+
+/**
+ * Opens a statistics dump for writing. The dumps live in a freerds directory
+ * under the log path, only accessible to the owner, and a link planted in
+ * place of a dump is never followed.
+ */
+
+FILE* g_open_stats_file(const char* name)
+{
+	int fd;
+	FILE* fp;
+	char path[256];
+	char filename[256];
+
+	sprintf_s(path, sizeof(path), "%s/freerds", FREERDS_LOG_PATH);
+
+	if ((mkdir(path, 0700) < 0) && (errno != EEXIST))
+	{
+		fprintf(stderr, "failed to create %s\n", path);
+		return NULL;
+	}
+
+	sprintf_s(filename, sizeof(filename), "%s/%s", path, name);
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+
+	if (fd < 0)
+	{
+		fprintf(stderr, "failed to open %s\n", filename);
+		return NULL;
+	}
+
+	fp = fdopen(fd, "w");
+
+	if (!fp)
+	{
+		fprintf(stderr, "failed to open %s\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	return fp;
+}
+
+/**
+ * Readiness notification for service managers (sd_notify protocol):
+ * send "READY=1" to the datagram socket named by $NOTIFY_SOCKET, if any.
+ */
+
+void freerds_notify_ready(void)
+{
+	int sockfd;
+	size_t length;
+	const char* path;
+	const char* state = "READY=1";
+	struct sockaddr_un addr;
+
+	path = getenv("NOTIFY_SOCKET");
+
+	if (!path || ((path[0] != '/') && (path[0] != '@')))
+		return;
+
+	length = strlen(path);
+
+	if (length >= sizeof(addr.sun_path))
+		return;
+
+	sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+
+	if (sockfd == -1)
+		return;
+
+	ZeroMemory(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	CopyMemory(addr.sun_path, path, length);
+
+	if (addr.sun_path[0] == '@')
+		addr.sun_path[0] = '\0'; /* abstract namespace */
+
+	sendto(sockfd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr*) &addr,
+			offsetof(struct sockaddr_un, sun_path) + length);
+
+	close(sockfd);
+}
+
 void pipe_sig(int sig_num)
 {
 	printf("FreeRDS SIGPIPE (%d)\n", sig_num);
@@ -99,11 +226,19 @@ int main(int argc, char** argv)
 	DWORD flags;
 	int no_daemon;
 	int kill_process;
+	int acceptors;
+	int replay_fast;
+	char* endpoints;
+	char* replay_file;
 	char text[256];
 	char pid_file[256];
 	COMMAND_LINE_ARGUMENT_A* arg;
 
 	no_daemon = kill_process = 0;
+	acceptors = 1;
+	endpoints = NULL;
+	replay_fast = 0;
+	replay_file = NULL;
 
 	flags = COMMAND_LINE_SEPARATOR_SPACE;
 	flags |= COMMAND_LINE_SIGIL_DASH | COMMAND_LINE_SIGIL_DOUBLE_DASH;
@@ -132,11 +267,35 @@ int main(int argc, char** argv)
 		{
 			RdsModuleName = _strdup(arg->Value);
 		}
+		CommandLineSwitchCase(arg, "listen")
+		{
+			endpoints = _strdup(arg->Value);
+		}
+		CommandLineSwitchCase(arg, "acceptors")
+		{
+			acceptors = atoi(arg->Value);
+		}
+		CommandLineSwitchCase(arg, "replay")
+		{
+			replay_file = _strdup(arg->Value);
+		}
+		CommandLineSwitchCase(arg, "replay-fast")
+		{
+			replay_fast = 1;
+		}
 
 		CommandLineSwitchEnd(arg)
 	}
 	while ((arg = CommandLineFindNextArgumentA(arg)) != NULL);
 
+	if (replay_file)
+	{
+		/* replays run in the foreground and leave the pid file of a running server alone */
+		status = freerds_replay_main(replay_file, !replay_fast);
+		free(replay_file);
+		return status;
+	}
+
 	sprintf_s(pid_file, 255, "%s/freerds.pid", FREERDS_PID_PATH);
 
 	if (kill_process)
@@ -224,8 +383,6 @@ int main(int argc, char** argv)
 			return 0;
 		}
 
-		Sleep(1000);
-
 		/* write the pid to file */
 		pid = GetCurrentProcessId();
 		fd = fopen(pid_file, "w+");
@@ -242,7 +399,6 @@ int main(int argc, char** argv)
 			fclose(fd);
 		}
 
-		Sleep(1000);
 		close(0);
 		close(1);
 		close(2);
@@ -252,7 +408,8 @@ int main(int argc, char** argv)
 		/* end of daemonizing code */
 	}
 
-	g_listen = freerds_listener_create();
+	g_listen = freerds_listener_create(endpoints, acceptors);
+	free(endpoints);
 
 	signal(SIGINT, freerds_shutdown);
 	signal(SIGKILL, freerds_shutdown);
@@ -262,14 +419,34 @@ int main(int argc, char** argv)
 	pid = GetCurrentProcessId();
 
 	g_TermEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-	printf("starting icp and waiting for session manager \n");
+	g_ReloadEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	g_StatsEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (freerds_certificate_reload() < 0)
+	{
+		printf("unable to load or generate the server certificate, quitting\n");
+		return 1;
+	}
+
+	signal(SIGHUP, freerds_reload);
+	signal(SIGUSR1, freerds_dump_stats);
+
+	/* the session manager link comes up in the background */
+	printf("starting icp\n");
 	freerds_icp_start();
-	printf("connected to session manager\n");
+
+	freerds_auth_pool_start(RDS_AUTH_POOL_WORKERS, RDS_AUTH_POOL_QUEUE_DEPTH);
 
 	freerds_listener_main_loop(g_listen);
 	freerds_listener_delete(g_listen);
 
+	freerds_auth_pool_stop();
+
 	CloseHandle(g_TermEvent);
+	CloseHandle(g_ReloadEvent);
+	CloseHandle(g_StatsEvent);
+
+	freerds_certificate_uninit();
 
 	/* only main process should delete pid file */
 	if ((!no_daemon) && (pid == GetCurrentProcessId()))
@@ -37,6 +37,7 @@
 #include <pixman.h>
 
 typedef struct xrdp_listener xrdpListener;
+typedef struct rds_auth_request rdsAuthRequest;
 
 #include "core.h"
 
@@ -44,12 +45,25 @@ int g_is_term(void);
 void g_set_term(int in_val);
 HANDLE g_get_term_event(void);
 
+void freerds_peer_context_new(freerdp_peer* client, rdsConnection* context);
+void freerds_peer_context_free(freerdp_peer* client, rdsConnection* context);
+void freerds_update_frame_acknowledge(rdpContext* context, UINT32 frameId);
+
 rdsConnection* freerds_connection_create(freerdp_peer* client);
 void freerds_connection_delete(rdsConnection* self);
 HANDLE freerds_connection_get_term_event(rdsConnection* self);
 void* freerds_connection_main_thread(void* arg);
 
-xrdpListener* freerds_listener_create(void);
+int freerds_certificate_reload(void);
+void freerds_certificate_uninit(void);
+int freerds_certificate_apply(rdpSettings* settings);
+HANDLE g_get_reload_event(void);
+HANDLE g_get_stats_event(void);
+LONG g_get_stats_generation(void);
+FILE* g_open_stats_file(const char* name);
+void freerds_notify_ready(void);
+
+xrdpListener* freerds_listener_create(const char* endpoints, int acceptors);
 void freerds_listener_delete(xrdpListener* self);
 int freerds_listener_main_loop(xrdpListener* self);
 
@@ -58,15 +72,52 @@ void freerds_module_free(rdsModuleConnector* connector);
 
 long freerds_authenticate(char* username, char* password, int* errorcode);
 
+#define RDS_AUTH_STATUS_SUCCESS		0
+#define RDS_AUTH_STATUS_FAILURE		1
+#define RDS_AUTH_STATUS_TIMEOUT		2
+#define RDS_AUTH_STATUS_PENDING		3
+
+#define RDS_AUTH_POOL_WORKERS		4
+#define RDS_AUTH_POOL_QUEUE_DEPTH	64
+#define RDS_AUTH_TIMEOUT		30000
+
+typedef void (*pRdsAuthCompletion)(rdsAuthRequest* request, void* context);
+
+struct rds_auth_stats
+{
+	int QueueDepth;
+	int MaxQueueDepth;
+	int PeakQueueDepth;
+	int Submitted;
+	int Completed;
+	int Rejected;
+	int TimedOut;
+	UINT64 TotalLatency;
+	DWORD MaxLatency;
+};
+typedef struct rds_auth_stats rdsAuthStats;
+
+int freerds_auth_pool_start(int workers, int maxQueueDepth);
+void freerds_auth_pool_stop(void);
+int freerds_auth_pool_get_stats(rdsAuthStats* stats);
+void freerds_auth_pool_dump_stats(void);
+rdsAuthRequest* freerds_auth_submit(char* username, char* password, DWORD timeout,
+		pRdsAuthCompletion completion, void* context);
+int freerds_auth_request_release(rdsAuthRequest* request, int* errorcode);
+
 void* freerds_client_thread(void* arg);
+void* freerds_encoder_thread(void* arg);
 int freerds_client_get_event_handles(rdsModuleConnector* connector, HANDLE* events, DWORD* nCount);
 int freerds_client_check_event_handles(rdsModuleConnector* connector);
 
 int freerds_client_inbound_connector_init(rdsModuleConnector* connector);
+void freerds_client_inbound_release_snapshot(rdsModuleConnector* connector);
 int freerds_message_server_connector_init(rdsModuleConnector* connector);
 
 int freerds_message_server_queue_pack(rdsModuleConnector* connector);
 int freerds_message_server_queue_process_pending_messages(rdsModuleConnector* connector);
 int freerds_message_server_module_init(rdsModuleConnector* connector);
 
+int freerds_replay_main(const char* filename, BOOL realtime);
+
 #endif /* RDS_H */
@@ -25,73 +25,481 @@
 #include "freerds.h"
 
 #include <winpr/crt.h>
+#include <winpr/synch.h>
 #include <winpr/thread.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
 #include <sys/select.h>
 #include <sys/signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
-void freerds_peer_accepted(freerdp_listener* instance, freerdp_peer* client)
+#define RDS_LISTENER_MAX_SOCKETS	32
+#define RDS_LISTENER_DEFAULT_PORT	"3389"
+
+#define RDS_LISTEN_FDS_START		3
+
+/**
+ * The listener binds every configured endpoint ("address:port", "[v6]:port",
+ * "port" or "address") and runs a pool of acceptor threads. When the platform
+ * supports SO_REUSEPORT each acceptor binds its own set of sockets, so the
+ * kernel balances incoming connections between them; otherwise all acceptors
+ * share the same sockets. Accepted peers get their own connection thread,
+ * as before.
+ */
+
+struct rds_acceptor
 {
+	xrdpListener* listener;
+	int count;
+	int sockfds[RDS_LISTENER_MAX_SOCKETS];
+	HANDLE events[RDS_LISTENER_MAX_SOCKETS];
+	HANDLE Thread;
+	BOOL owner;
+};
+typedef struct rds_acceptor rdsAcceptor;
+
+struct xrdp_listener
+{
+	char* endpoints;
+	int acceptorCount;
+	rdsAcceptor* acceptors;
+};
+
+void freerds_peer_accepted(int sockfd, struct sockaddr_storage* peer_addr)
+{
+	void* sin_addr;
+	freerdp_peer* client;
+	int option_value = 1;
+
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (void*) &option_value, sizeof(option_value));
+
+	client = freerdp_peer_new(sockfd);
+
+	if (!client)
+	{
+		close(sockfd);
+		return;
+	}
+
+	if (peer_addr->ss_family == AF_INET)
+		sin_addr = &(((struct sockaddr_in*) peer_addr)->sin_addr);
+	else
+		sin_addr = &(((struct sockaddr_in6*) peer_addr)->sin6_addr);
+
+	inet_ntop(peer_addr->ss_family, sin_addr, client->hostname, sizeof(client->hostname));
+
 	freerds_connection_create(client);
 }
 
-xrdpListener* freerds_listener_create(void)
+static int freerds_listener_parse_endpoint(const char* endpoint, char** address, char** port)
+{
+	char* p;
+	char* str;
+
+	*address = NULL;
+	*port = NULL;
+
+	str = _strdup(endpoint);
+
+	if (!str)
+		return -1;
+
+	if (str[0] == '[')
+	{
+		p = strchr(str, ']');
+
+		if (!p)
+		{
+			free(str);
+			return -1;
+		}
+
+		*p = '\0';
+		*address = _strdup(&str[1]);
+
+		if (p[1] == ':')
+			*port = _strdup(&p[2]);
+	}
+	else if (strspn(str, "0123456789") == strlen(str))
+	{
+		*port = _strdup(str);
+	}
+	else if ((p = strrchr(str, ':')) && (strchr(str, ':') == p))
+	{
+		*p = '\0';
+
+		if (*str && strcmp(str, "*"))
+			*address = _strdup(str);
+
+		*port = _strdup(&p[1]);
+	}
+	else
+	{
+		*address = _strdup(str);
+	}
+
+	if (!*port || !**port)
+	{
+		free(*port);
+		*port = _strdup(RDS_LISTENER_DEFAULT_PORT);
+	}
+
+	free(str);
+
+	return 0;
+}
+
+static int freerds_acceptor_add_socket(rdsAcceptor* acceptor, int sockfd)
+{
+	if (acceptor->count >= RDS_LISTENER_MAX_SOCKETS)
+	{
+		close(sockfd);
+		return -1;
+	}
+
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
+	acceptor->sockfds[acceptor->count] = sockfd;
+	acceptor->events[acceptor->count] = CreateFileDescriptorEvent(NULL, FALSE, FALSE, sockfd);
+	acceptor->count++;
+
+	return 0;
+}
+
+static int freerds_acceptor_bind(rdsAcceptor* acceptor, const char* endpoint, BOOL reusePort)
+{
+	int status;
+	int sockfd;
+	int count = 0;
+	char* port;
+	char* address;
+	int option_value;
+	struct addrinfo hints;
+	struct addrinfo* res;
+	struct addrinfo* ai;
+
+	if (freerds_listener_parse_endpoint(endpoint, &address, &port) < 0)
+	{
+		fprintf(stderr, "Invalid listen endpoint: %s\n", endpoint);
+		return -1;
+	}
+
+	ZeroMemory(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	status = getaddrinfo(address, port, &hints, &res);
+
+	if (status != 0)
+	{
+		fprintf(stderr, "getaddrinfo(%s): %s\n", endpoint, gai_strerror(status));
+		free(address);
+		free(port);
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next)
+	{
+		if ((ai->ai_family != AF_INET) && (ai->ai_family != AF_INET6))
+			continue;
+
+		sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+		if (sockfd == -1)
+			continue;
+
+		option_value = 1;
+		setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void*) &option_value, sizeof(option_value));
+
+#ifdef SO_REUSEPORT
+		if (reusePort)
+			setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (void*) &option_value, sizeof(option_value));
+#endif
+
+		if (ai->ai_family == AF_INET6)
+			setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, (void*) &option_value, sizeof(option_value));
+
+		if ((bind(sockfd, ai->ai_addr, ai->ai_addrlen) != 0) || (listen(sockfd, SOMAXCONN) != 0))
+		{
+			fprintf(stderr, "Failed to listen on %s: %s\n", endpoint, strerror(errno));
+			close(sockfd);
+			continue;
+		}
+
+		if (freerds_acceptor_add_socket(acceptor, sockfd) == 0)
+			count++;
+	}
+
+	freeaddrinfo(res);
+	free(address);
+	free(port);
+
+	return (count > 0) ? 0 : -1;
+}
+
+/**
+ * Socket activation: adopt the listening sockets passed by the service
+ * manager ($LISTEN_FDS sockets starting at fd 3, for $LISTEN_PID).
+ */
+
+static int freerds_acceptor_inherit(rdsAcceptor* acceptor)
+{
+	int fd;
+	int count;
+	char* value;
+
+	value = getenv("LISTEN_PID");
+
+	if (!value || (atoi(value) != (int) getpid()))
+		return 0;
+
+	value = getenv("LISTEN_FDS");
+	count = value ? atoi(value) : 0;
+
+	for (fd = RDS_LISTEN_FDS_START; fd < RDS_LISTEN_FDS_START + count; fd++)
+	{
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		freerds_acceptor_add_socket(acceptor, fd);
+	}
+
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+
+	return acceptor->count;
+}
+
+static void* freerds_acceptor_thread(void* arg)
 {
-	freerdp_listener* listener;
+	int index;
+	int sockfd;
+	DWORD nCount;
+	HANDLE events[RDS_LISTENER_MAX_SOCKETS + 1];
+	HANDLE TermEvent;
+	socklen_t peer_addr_size;
+	struct sockaddr_storage peer_addr;
+	rdsAcceptor* acceptor = (rdsAcceptor*) arg;
+
+	TermEvent = g_get_term_event();
+
+	nCount = 0;
+	events[nCount++] = TermEvent;
+
+	for (index = 0; index < acceptor->count; index++)
+		events[nCount++] = acceptor->events[index];
+
+	while (1)
+	{
+		WaitForMultipleObjects(nCount, events, FALSE, INFINITE);
+
+		if (WaitForSingleObject(TermEvent, 0) == WAIT_OBJECT_0)
+			break;
+
+		for (index = 0; index < acceptor->count; index++)
+		{
+			if (WaitForSingleObject(acceptor->events[index], 0) != WAIT_OBJECT_0)
+				continue;
 
-	listener = freerdp_listener_new();
-	listener->PeerAccepted = freerds_peer_accepted;
+			while (1)
+			{
+				peer_addr_size = sizeof(peer_addr);
+				sockfd = accept(acceptor->sockfds[index], (struct sockaddr*) &peer_addr, &peer_addr_size);
 
-	return (xrdpListener*) listener;
+				if (sockfd == -1)
+				{
+					if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) && (errno != ECONNABORTED))
+						fprintf(stderr, "accept failed: %s\n", strerror(errno));
+
+					break;
+				}
+
+				freerds_peer_accepted(sockfd, &peer_addr);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+xrdpListener* freerds_listener_create(const char* endpoints, int acceptors)
+{
+	xrdpListener* listener;
+
+	listener = (xrdpListener*) malloc(sizeof(xrdpListener));
+
+	if (!listener)
+		return NULL;
+
+	ZeroMemory(listener, sizeof(xrdpListener));
+
+	if (acceptors < 1)
+		acceptors = 1;
+
+	listener->endpoints = _strdup(endpoints ? endpoints : RDS_LISTENER_DEFAULT_PORT);
+	listener->acceptorCount = acceptors;
+	listener->acceptors = (rdsAcceptor*) malloc(sizeof(rdsAcceptor) * acceptors);
+	ZeroMemory(listener->acceptors, sizeof(rdsAcceptor) * acceptors);
+
+	return listener;
 }
 
 void freerds_listener_delete(xrdpListener* self)
 {
-	freerdp_listener_free((freerdp_listener*) self);
+	int index;
+	int acceptor;
+
+	if (!self)
+		return;
+
+	for (acceptor = 0; acceptor < self->acceptorCount; acceptor++)
+	{
+		for (index = 0; index < self->acceptors[acceptor].count; index++)
+		{
+			CloseHandle(self->acceptors[acceptor].events[index]);
+
+			if (self->acceptors[acceptor].owner)
+				close(self->acceptors[acceptor].sockfds[index]);
+		}
+	}
+
+	free(self->acceptors);
+	free(self->endpoints);
+	free(self);
+}
+
+static int freerds_listener_open(xrdpListener* self)
+{
+	int index;
+	int count;
+	char* endpoint;
+	char* endpoints;
+	char* context = NULL;
+	BOOL inherited = FALSE;
+	BOOL reusePort = FALSE;
+	rdsAcceptor* acceptor;
+
+	acceptor = &(self->acceptors[0]);
+
+	if (freerds_acceptor_inherit(acceptor) > 0)
+	{
+		/* inherited sockets are shared between all acceptors */
+		acceptor->owner = TRUE;
+		inherited = TRUE;
+	}
+
+#ifdef SO_REUSEPORT
+	reusePort = ((self->acceptorCount > 1) && !inherited) ? TRUE : FALSE;
+#endif
+
+	for (index = 0; index < self->acceptorCount; index++)
+	{
+		acceptor = &(self->acceptors[index]);
+		acceptor->listener = self;
+
+		if ((index == 0) && inherited)
+			continue;
+
+		if ((index > 0) && !reusePort)
+		{
+			/* no SO_REUSEPORT: all acceptors share the sockets of the first one */
+			for (count = 0; count < self->acceptors[0].count; count++)
+			{
+				acceptor->sockfds[count] = self->acceptors[0].sockfds[count];
+				acceptor->events[count] = CreateFileDescriptorEvent(NULL, FALSE, FALSE, acceptor->sockfds[count]);
+			}
+
+			acceptor->count = self->acceptors[0].count;
+			continue;
+		}
+
+		acceptor->owner = TRUE;
+		endpoints = _strdup(self->endpoints);
+		endpoint = strtok_r(endpoints, ",", &context);
+
+		while (endpoint)
+		{
+			freerds_acceptor_bind(acceptor, endpoint, reusePort);
+			endpoint = strtok_r(NULL, ",", &context);
+		}
+
+		free(endpoints);
+
+		if (acceptor->count < 1)
+		{
+			fprintf(stderr, "Failed to listen on %s\n", self->endpoints);
+			return -1;
+		}
+	}
+
+	printf("Listening on %s with %d acceptor(s)%s\n", inherited ? "inherited sockets" : self->endpoints,
+			self->acceptorCount, reusePort ? " using SO_REUSEPORT" : "");
+
+	return 0;
 }
 
 int freerds_listener_main_loop(xrdpListener* self)
 {
-	DWORD status;
+	int index;
 	DWORD nCount;
-	HANDLE events[32];
+	HANDLE events[3];
 	HANDLE TermEvent;
-	freerdp_listener* listener;
-
-	listener = (freerdp_listener*) self;
+	HANDLE ReloadEvent;
+	HANDLE StatsEvent;
 
-	listener->Open(listener, NULL, 3389);
+	if (freerds_listener_open(self) < 0)
+		return -1;
 
 	TermEvent = g_get_term_event();
+	ReloadEvent = g_get_reload_event();
+	StatsEvent = g_get_stats_event();
+
+	for (index = 0; index < self->acceptorCount; index++)
+	{
+		self->acceptors[index].Thread = CreateThread(NULL, 0,
+				(LPTHREAD_START_ROUTINE) freerds_acceptor_thread, (void*) &(self->acceptors[index]), 0, NULL);
+	}
+
+	freerds_notify_ready();
 
 	while (1)
 	{
 		nCount = 0;
 		events[nCount++] = TermEvent;
+		events[nCount++] = ReloadEvent;
+		events[nCount++] = StatsEvent;
+
+		WaitForMultipleObjects(nCount, events, FALSE, INFINITE);
 
-		if (listener->GetEventHandles(listener, events, &nCount) < 0)
+		if (WaitForSingleObject(TermEvent, 0) == WAIT_OBJECT_0)
 		{
-			fprintf(stderr, "Failed to get FreeRDP file descriptor\n");
 			break;
 		}
 
-		status = WaitForMultipleObjects(nCount, events, FALSE, INFINITE);
-
-		if (WaitForSingleObject(TermEvent, 0) == WAIT_OBJECT_0)
+		if (WaitForSingleObject(ReloadEvent, 0) == WAIT_OBJECT_0)
 		{
-			break;
+			ResetEvent(ReloadEvent);
+			freerds_certificate_reload();
 		}
 
-		if (listener->CheckFileDescriptor(listener) != TRUE)
+		/* the sessions dump their own statistics from their client thread */
+		if (WaitForSingleObject(StatsEvent, 0) == WAIT_OBJECT_0)
 		{
-			fprintf(stderr, "Failed to check FreeRDP file descriptor\n");
-			break;
+			ResetEvent(StatsEvent);
+			freerds_auth_pool_dump_stats();
 		}
 	}
 
-	listener->Close(listener);
+	for (index = 0; index < self->acceptorCount; index++)
+	{
+		WaitForSingleObject(self->acceptors[index].Thread, INFINITE);
+		CloseHandle(self->acceptors[index].Thread);
+	}
 
 	return 0;
 }
-
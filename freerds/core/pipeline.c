@@ -80,6 +80,24 @@ int freerds_message_server_paint_rect(rdsModuleConnector* connector, RDS_MSG_PAI
 	return freerds_server_message_enqueue(connector, (RDS_MSG_COMMON*) msg);
 }
 
+int freerds_message_server_paint_rects(rdsModuleConnector* connector, RDS_MSG_PAINT_RECTS* msg)
+{
+	msg->type = RDS_SERVER_PAINT_RECTS;
+	return freerds_server_message_enqueue(connector, (RDS_MSG_COMMON*) msg);
+}
+
+int freerds_message_server_screen_blt_rects(rdsModuleConnector* connector, RDS_MSG_SCREEN_BLT_RECTS* msg)
+{
+	msg->type = RDS_SERVER_SCREEN_BLT_RECTS;
+	return freerds_server_message_enqueue(connector, (RDS_MSG_COMMON*) msg);
+}
+
+int freerds_message_server_frame_ready(rdsModuleConnector* connector, RDS_MSG_FRAME_READY* msg)
+{
+	msg->type = RDS_SERVER_FRAME_READY;
+	return freerds_server_message_enqueue(connector, (RDS_MSG_COMMON*) msg);
+}
+
 int freerds_message_server_patblt(rdsModuleConnector* connector, RDS_MSG_PATBLT* msg)
 {
 	msg->type = RDS_SERVER_PATBLT;
@@ -218,6 +236,14 @@ int freerds_message_server_queue_process_message(rdsModuleConnector* connector,
 			status = ServerProxy->PaintRect(connector, (RDS_MSG_PAINT_RECT*) message->wParam);
 			break;
 
+		case RDS_SERVER_PAINT_RECTS:
+			status = ServerProxy->PaintRects(connector, (RDS_MSG_PAINT_RECTS*) message->wParam);
+			break;
+
+		case RDS_SERVER_SCREEN_BLT_RECTS:
+			status = ServerProxy->ScreenBltRects(connector, (RDS_MSG_SCREEN_BLT_RECTS*) message->wParam);
+			break;
+
 		case RDS_SERVER_PATBLT:
 			status = ServerProxy->PatBlt(connector, (RDS_MSG_PATBLT*) message->wParam);
 			break;
@@ -333,10 +359,32 @@ int freerds_message_server_align_rect(rdsModuleConnector* connector, RDS_RECT* r
 	return 0;
 }
 
+static void freerds_message_server_add_tile_run(void* context, RDS_RECT* rect)
+{
+	pixman_region32_t* region = (pixman_region32_t*) context;
+
+	pixman_region32_union_rect(region, region, rect->x, rect->y, rect->width, rect->height);
+}
+
+/* whether the pack posts the message to the encoder thread rather than merging it into the damage */
+static BOOL freerds_message_server_queue_posts(RDS_MSG_COMMON* node, int ChainedMode)
+{
+	if (node->type == RDS_SERVER_FRAME_READY)
+		return FALSE;
+
+	if ((!ChainedMode) && (node->msgFlags & RDS_MSG_FLAG_RECT))
+		return ((node->type == RDS_SERVER_PAINT_RECT) && ((RDS_MSG_PAINT_RECT*) node)->bitmapDataLength) ? TRUE : FALSE;
+
+	return TRUE;
+}
+
 int freerds_message_server_queue_pack(rdsModuleConnector* connector)
 {
+	int count;
+	LONG credits;
 	RDS_RECT rect;
 	int ChainedMode;
+	UINT32 inputSequence;
 	wLinkedList* list;
 	rdsConnection* connection;
 	RDS_MSG_COMMON* node;
@@ -345,30 +393,107 @@ int freerds_message_server_queue_pack(rdsModuleConnector* connector)
 	pixman_region32_t region;
 
 	ChainedMode = 0;
+	inputSequence = 0;
 	connection = connector->connection;
 
+	/**
+	 * The encoder thread is falling behind: leave the pending messages
+	 * in the server list so that their damage gets merged into the next pack.
+	 */
+
+	if (connector->ServerQueueDepth >= connector->MaxServerQueueDepth)
+		return 0;
+
 	list = connector->ServerList;
 
+	count = LinkedList_Count(list);
+	freerds_stats_record(&(connector->Stats.PackQueueDepth), count);
+
 	pixman_region32_init(&region);
 
-	LinkedList_Enumerator_Reset(list);
+	/**
+	 * Every message posted to the encoder thread counts against the queue depth,
+	 * once it is reached the rest of the list, in order, waits for the next pack.
+	 */
 
-	while (LinkedList_Enumerator_MoveNext(list))
+	while (LinkedList_Count(list) > 0)
 	{
-		node = (RDS_MSG_COMMON*) LinkedList_Enumerator_Current(list);
+		node = (RDS_MSG_COMMON*) LinkedList_First(list);
+
+		if (freerds_message_server_queue_posts(node, ChainedMode) &&
+				(connector->ServerQueueDepth >= connector->MaxServerQueueDepth))
+			break;
+
+		LinkedList_RemoveFirst(list);
+
+		if (node->type == RDS_SERVER_FRAME_READY)
+		{
+			/* the damage is in the tile bitmap, collected below */
+			connector->FrameReadyPending = TRUE;
 
-		if ((!ChainedMode) && (node->msgFlags & RDS_MSG_FLAG_RECT))
+			if ((node->msgFlags & RDS_MSG_FLAG_INPUT) && (node->inputSequence > inputSequence))
+				inputSequence = node->inputSequence;
+
+			freerds_server_message_free(node);
+		}
+		else if ((!ChainedMode) && (node->msgFlags & RDS_MSG_FLAG_RECT))
 		{
 			status = pixman_region32_union_rect(&region, &region,
 					node->rect.x, node->rect.y, node->rect.width, node->rect.height);
+
+			if ((node->msgFlags & RDS_MSG_FLAG_INPUT) && (node->inputSequence > inputSequence))
+				inputSequence = node->inputSequence;
+
+			if ((node->type == RDS_SERVER_PAINT_RECT) && ((RDS_MSG_PAINT_RECT*) node)->bitmapDataLength)
+			{
+				/* the pixels of a remote framebuffer, stored by the encoder thread before the merged paint */
+				InterlockedIncrement(&(connector->ServerQueueDepth));
+				MessageQueue_Post(connector->ServerQueue, (void*) connector, node->type, (void*) node, NULL);
+			}
+			else
+			{
+				/* merged into the framebuffer paint, the copy is no longer needed */
+				freerds_server_message_free(node);
+			}
 		}
 		else
 		{
+			InterlockedIncrement(&(connector->ServerQueueDepth));
 			MessageQueue_Post(connector->ServerQueue, (void*) connector, node->type, (void*) node, NULL);
 		}
 	}
 
-	LinkedList_Clear(list);
+	/**
+	 * The tiles are only available once the encoder thread has attached the
+	 * framebuffer, until then the bits stay set and the scan stays pending.
+	 * A framebuffer attached without a valid tile bitmap is painted whole,
+	 * the module has no other way to report its damage.
+	 */
+
+	EnterCriticalSection(&(connector->FramebufferLock));
+
+	if (connector->FrameReadyPending && connector->framebuffer.tiles)
+	{
+		freerds_tile_bitmap_collect(&(connector->framebuffer), freerds_message_server_add_tile_run, &region);
+		connector->FrameReadyPending = FALSE;
+	}
+	else if (connector->FrameReadyPending && connector->framebuffer.fbAttached)
+	{
+		pixman_region32_union_rect(&region, &region, 0, 0,
+				connector->framebuffer.fbWidth, connector->framebuffer.fbHeight);
+		connector->FrameReadyPending = FALSE;
+	}
+
+	LeaveCriticalSection(&(connector->FramebufferLock));
+
+	/* hand back the credits of everything consumed, the messages left in the list keep theirs */
+	credits = connector->FlowControlPending - LinkedList_Count(list);
+
+	if (credits > 0)
+	{
+		connector->client->FlowControl(connector, (UINT32) credits);
+		connector->FlowControlPending -= credits;
+	}
 
 	if (!ChainedMode)
 	{
@@ -387,6 +512,11 @@ int freerds_message_server_queue_pack(rdsModuleConnector* connector)
 			RDS_MSG_PAINT_RECT paintRect;
 
 			paintRect.type = RDS_SERVER_PAINT_RECT;
+			paintRect.msgFlags = 0;
+			paintRect.inputSequence = inputSequence;
+
+			if (inputSequence)
+				paintRect.msgFlags |= RDS_MSG_FLAG_INPUT;
 
 			paintRect.nXSrc = 0;
 			paintRect.nYSrc = 0;
@@ -402,8 +532,17 @@ int freerds_message_server_queue_pack(rdsModuleConnector* connector)
 
 			msg = freerds_server_message_copy((RDS_MSG_COMMON*) &paintRect);
 
+			InterlockedIncrement(&(connector->ServerQueueDepth));
 			MessageQueue_Post(connector->ServerQueue, (void*) connector, msg->type, (void*) msg, NULL);
 		}
+
+		/* the paint point of a capture, freerds_replay_main packs again here */
+		if (connector->Capture && (count || (rect.width * rect.height)))
+		{
+			EnterCriticalSection(&(connector->FramebufferLock));
+			freerds_capture_write_framebuffer(connector->Capture, &(connector->framebuffer), &rect);
+			LeaveCriticalSection(&(connector->FramebufferLock));
+		}
 	}
 
 	pixman_region32_fini(&region);
@@ -424,9 +563,12 @@ int freerds_message_server_queue_process_pending_messages(rdsModuleConnector* co
 
 	while (MessageQueue_Peek(queue, &message, TRUE))
 	{
+		if (message.id != WMQ_QUIT)
+			InterlockedDecrement(&(connector->ServerQueueDepth));
+
 		status = freerds_message_server_queue_process_message(connector, &message);
 
-		if (!status)
+		if (status < 0)
 			break;
 
 		count++;
@@ -469,11 +611,17 @@ int freerds_message_server_connector_init(rdsModuleConnector* connector)
 		connector->server->PaintOffscreenSurface = freerds_message_server_paint_offscreen_surface;
 		connector->server->WindowNewUpdate = freerds_message_server_window_new_update;
 		connector->server->WindowDelete = freerds_message_server_window_delete;
+		connector->server->PaintRects = freerds_message_server_paint_rects;
+		connector->server->ScreenBltRects = freerds_message_server_screen_blt_rects;
+		connector->server->FrameReady = freerds_message_server_frame_ready;
 	}
 
 	connector->MaxFps = connector->fps = 60;
 	connector->ServerList = LinkedList_New();
 	connector->ServerQueue = MessageQueue_New();
 
+	connector->ServerQueueDepth = 0;
+	connector->MaxServerQueueDepth = 16;
+
 	return 0;
 }
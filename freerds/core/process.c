@@ -29,6 +29,7 @@
 #include <winpr/path.h>
 #include <winpr/synch.h>
 #include <winpr/thread.h>
+#include <winpr/sysinfo.h>
 
 #include <freerdp/freerdp.h>
 #include <freerdp/listener.h>
@@ -76,6 +77,7 @@ rdsConnection* freerds_connection_create(freerdp_peer* client)
 	xfp = (rdsConnection*) client->context;
 
 	xfp->TermEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	xfp->AuthEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 
 	xfp->Thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) freerds_connection_main_thread, client, 0, NULL);
 
@@ -85,6 +87,7 @@ rdsConnection* freerds_connection_create(freerdp_peer* client)
 void freerds_connection_delete(rdsConnection* self)
 {
 	CloseHandle(self->TermEvent);
+	CloseHandle(self->AuthEvent);
 }
 
 HANDLE freerds_connection_get_term_event(rdsConnection* self)
@@ -145,18 +148,20 @@ BOOL freerds_peer_post_connect(freerdp_peer* client)
 		return TRUE;
 	}
 
-	freerds_channels_post_connect(connection);
-
 	return TRUE;
 }
 
+void freerds_peer_auth_completion(rdsAuthRequest* request, void* context)
+{
+	rdsConnection* connection = (rdsConnection*) context;
+
+	SetEvent(connection->AuthEvent);
+}
+
 BOOL freerds_peer_activate(freerdp_peer* client)
 {
 	rdpSettings* settings;
 	rdsConnection* connection = (rdsConnection*) client->context;
-	int auth_status;
-	int error_code;
-	HANDLE hClientPipe;
 
 	settings = client->settings;
 	settings->BitmapCacheVersion = 2;
@@ -167,7 +172,48 @@ BOOL freerds_peer_activate(freerdp_peer* client)
 	if (settings->RemoteFxCodec || settings->NSCodec)
 		connection->codecMode = TRUE;
 
-	auth_status = freerds_authenticate(settings->Username, settings->Password, &error_code);
+	if (connection->connector || connection->AuthRequest)
+		return TRUE;
+
+	/**
+	 * Authentication runs on the auth worker pool, the logon
+	 * continues in freerds_connection_logon() once it completes.
+	 */
+
+	connection->AuthDeadline = GetTickCount() + RDS_AUTH_TIMEOUT;
+	connection->AuthRequest = freerds_auth_submit(settings->Username, settings->Password,
+			RDS_AUTH_TIMEOUT, freerds_peer_auth_completion, (void*) connection);
+
+	if (!connection->AuthRequest)
+	{
+		fprintf(stderr, "Failed to queue authentication request for %s\n", settings->Username);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL freerds_connection_logon(rdsConnection* connection)
+{
+	int auth_status;
+	int error_code;
+	rdpSettings* settings;
+	RDS_MSG_CAPABILITIES capabilities;
+
+	settings = connection->settings;
+
+	error_code = 0;
+	auth_status = freerds_auth_request_release(connection->AuthRequest, &error_code);
+	connection->AuthRequest = NULL;
+
+	if (auth_status == RDS_AUTH_STATUS_TIMEOUT)
+	{
+		fprintf(stderr, "Authentication of %s timed out\n", settings->Username);
+		return FALSE;
+	}
+
+	if (auth_status != RDS_AUTH_STATUS_SUCCESS)
+		fprintf(stderr, "Authentication of %s failed (%d)\n", settings->Username, error_code);
 
 	if (!connection->connector)
 		connection->connector = freerds_module_connector_new(connection);
@@ -179,16 +225,24 @@ BOOL freerds_peer_activate(freerdp_peer* client)
 		printf("freerds_icp_GetUserSession failed %d\n", error_code);
 		return FALSE;
 	}
-	hClientPipe = freerds_named_pipe_connect(connection->connector->Endpoint, 20);
-
-	if (!hClientPipe)
+	if (!freerds_transport_connect(connection->connector, 20))
 	{
-		fprintf(stderr, "Failed to create named pipe %s\n", connection->connector->Endpoint);
+		fprintf(stderr, "Failed to create named pipe %.*s\n", RDS_TCP_ENDPOINT_ADDRESS(connection->connector->Endpoint));
 		return FALSE;
 	}
 	printf("Connected to session %d\n", connection->connector->SessionId);
 
-	connection->connector->hClientPipe = hClientPipe;
+	freerds_channels_post_connect(connection);
+
+	/* modules which do not understand capabilities stay on protocol version 1 */
+	ZeroMemory(&capabilities, sizeof(RDS_MSG_CAPABILITIES));
+	capabilities.DesktopWidth = settings->DesktopWidth;
+	capabilities.DesktopHeight = settings->DesktopHeight;
+	capabilities.ColorDepth = settings->ColorDepth;
+	capabilities.Version = RDS_PROTOCOL_VERSION;
+
+	connection->connector->client->Capabilities(connection->connector, &capabilities);
+
 	connection->connector->GetEventHandles = freerds_client_get_event_handles;
 	connection->connector->CheckEventHandles = freerds_client_check_event_handles;
 
@@ -197,6 +251,12 @@ BOOL freerds_peer_activate(freerdp_peer* client)
 
 	freerds_client_inbound_connector_init(connection->connector);
 
+	if (!connection->connector->EncoderThread)
+	{
+		connection->connector->EncoderThread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) freerds_encoder_thread,
+				(void*) connection->connector, 0, NULL);
+	}
+
 	ResumeThread(connection->connector->ServerThread);
 
 	printf("Client Activated\n");
@@ -214,7 +274,12 @@ const char* makecert_argv[4] =
 
 int makecert_argc = (sizeof(makecert_argv) / sizeof(char*));
 
-int freerds_generate_certificate(rdpSettings* settings)
+static char* g_CertificateFile = NULL;
+static char* g_PrivateKeyFile = NULL;
+static CRITICAL_SECTION g_CertificateLock;
+static BOOL g_CertificateLockInitialized = FALSE;
+
+int freerds_generate_certificate(const char* config_path, char** certificate_file, char** private_key_file)
 {
 	char* config_home;
 	char* server_file_path;
@@ -227,19 +292,19 @@ int freerds_generate_certificate(rdpSettings* settings)
 
 	free(config_home);
 
-	if (!PathFileExistsA(settings->ConfigPath))
-		CreateDirectoryA(settings->ConfigPath, 0);
+	if (!PathFileExistsA(config_path))
+		CreateDirectoryA(config_path, 0);
 
-	server_file_path = GetCombinedPath(settings->ConfigPath, "server");
+	server_file_path = GetCombinedPath(config_path, "server");
 
 	if (!PathFileExistsA(server_file_path))
 		CreateDirectoryA(server_file_path, 0);
 
-	settings->CertificateFile = GetCombinedPath(server_file_path, "server.crt");
-	settings->PrivateKeyFile = GetCombinedPath(server_file_path, "server.key");
+	*certificate_file = GetCombinedPath(server_file_path, "server.crt");
+	*private_key_file = GetCombinedPath(server_file_path, "server.key");
 
-	if ((!PathFileExistsA(settings->CertificateFile)) ||
-			(!PathFileExistsA(settings->PrivateKeyFile)))
+	if ((!PathFileExistsA(*certificate_file)) ||
+			(!PathFileExistsA(*private_key_file)))
 	{
 		context = makecert_context_new();
 
@@ -247,10 +312,10 @@ int freerds_generate_certificate(rdpSettings* settings)
 
 		makecert_context_set_output_file_name(context, "server");
 
-		if (!PathFileExistsA(settings->CertificateFile))
+		if (!PathFileExistsA(*certificate_file))
 			makecert_context_output_certificate_file(context, server_file_path);
 
-		if (!PathFileExistsA(settings->PrivateKeyFile))
+		if (!PathFileExistsA(*private_key_file))
 			makecert_context_output_private_key_file(context, server_file_path);
 
 		makecert_context_free(context);
@@ -258,6 +323,91 @@ int freerds_generate_certificate(rdpSettings* settings)
 
 	free(server_file_path);
 
+	if ((!PathFileExistsA(*certificate_file)) || (!PathFileExistsA(*private_key_file)))
+	{
+		free(*certificate_file);
+		free(*private_key_file);
+		*certificate_file = *private_key_file = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * The server certificate is checked (and generated if needed) once at
+ * startup and again on SIGHUP, instead of once per incoming connection.
+ * Connections only copy the resulting paths into their settings.
+ */
+
+int freerds_certificate_reload(void)
+{
+	int status;
+	char* config_path;
+	char* certificate_file = NULL;
+	char* private_key_file = NULL;
+
+	if (!g_CertificateLockInitialized)
+	{
+		InitializeCriticalSectionAndSpinCount(&g_CertificateLock, 4000);
+		g_CertificateLockInitialized = TRUE;
+	}
+
+	config_path = GetKnownSubPath(KNOWN_PATH_XDG_CONFIG_HOME, "freerdp");
+
+	status = freerds_generate_certificate(config_path, &certificate_file, &private_key_file);
+
+	free(config_path);
+
+	if (status < 0)
+	{
+		fprintf(stderr, "Failed to load server certificate, keeping the current one\n");
+		return -1;
+	}
+
+	EnterCriticalSection(&g_CertificateLock);
+
+	free(g_CertificateFile);
+	free(g_PrivateKeyFile);
+
+	g_CertificateFile = certificate_file;
+	g_PrivateKeyFile = private_key_file;
+
+	LeaveCriticalSection(&g_CertificateLock);
+
+	printf("Using server certificate %s\n", certificate_file);
+
+	return 0;
+}
+
+void freerds_certificate_uninit(void)
+{
+	if (!g_CertificateLockInitialized)
+		return;
+
+	free(g_CertificateFile);
+	free(g_PrivateKeyFile);
+	g_CertificateFile = g_PrivateKeyFile = NULL;
+
+	DeleteCriticalSection(&g_CertificateLock);
+	g_CertificateLockInitialized = FALSE;
+}
+
+int freerds_certificate_apply(rdpSettings* settings)
+{
+	if (!g_CertificateLockInitialized)
+		return -1;
+
+	EnterCriticalSection(&g_CertificateLock);
+
+	free(settings->CertificateFile);
+	free(settings->PrivateKeyFile);
+
+	settings->CertificateFile = g_CertificateFile ? _strdup(g_CertificateFile) : NULL;
+	settings->PrivateKeyFile = g_PrivateKeyFile ? _strdup(g_PrivateKeyFile) : NULL;
+
+	LeaveCriticalSection(&g_CertificateLock);
+
 	return 0;
 }
 
@@ -270,6 +420,7 @@ void freerds_input_synchronize_event(rdpInput* input, UINT32 flags)
 	{
 		if (connector->client->SynchronizeKeyboardEvent)
 		{
+			connector->InputSequence = freerds_input_stamp(connection);
 			connector->client->SynchronizeKeyboardEvent(connector, flags);
 		}
 	}
@@ -284,6 +435,7 @@ void freerds_input_keyboard_event(rdpInput* input, UINT16 flags, UINT16 code)
 	{
 		if (connector->client->ScancodeKeyboardEvent)
 		{
+			connector->InputSequence = freerds_input_stamp(connection);
 			connector->client->ScancodeKeyboardEvent(connector, flags, code, connection->settings->KeyboardType);
 		}
 	}
@@ -298,6 +450,7 @@ void freerds_input_unicode_keyboard_event(rdpInput* input, UINT16 flags, UINT16
 	{
 		if (connector->client->UnicodeKeyboardEvent)
 		{
+			connector->InputSequence = freerds_input_stamp(connection);
 			connector->client->UnicodeKeyboardEvent(connector, flags, code);
 		}
 	}
@@ -312,6 +465,7 @@ void freerds_input_mouse_event(rdpInput* input, UINT16 flags, UINT16 x, UINT16 y
 	{
 		if (connector->client->MouseEvent)
 		{
+			connector->InputSequence = freerds_input_stamp(connection);
 			connector->client->MouseEvent(connector, flags, x, y);
 		}
 	}
@@ -326,6 +480,7 @@ void freerds_input_extended_mouse_event(rdpInput* input, UINT16 flags, UINT16 x,
 	{
 		if (connector->client->ExtendedMouseEvent)
 		{
+			connector->InputSequence = freerds_input_stamp(connection);
 			connector->client->ExtendedMouseEvent(connector, flags, x, y);
 		}
 	}
@@ -358,6 +513,7 @@ void* freerds_connection_main_thread(void* arg)
 {
 	DWORD status;
 	DWORD nCount;
+	DWORD timeout;
 	HANDLE events[32];
 	HANDLE ClientEvent;
 	HANDLE ChannelEvent;
@@ -373,7 +529,7 @@ void* freerds_connection_main_thread(void* arg)
 	connection = (rdsConnection*) client->context;
 	settings = client->settings;
 
-	freerds_generate_certificate(settings);
+	freerds_certificate_apply(settings);
 
 	settings->RdpSecurity = FALSE;
 	settings->TlsSecurity = TRUE;
@@ -402,16 +558,19 @@ void* freerds_connection_main_thread(void* arg)
 		events[nCount++] = ChannelEvent;
 		events[nCount++] = GlobalTermEvent;
 		events[nCount++] = LocalTermEvent;
+		events[nCount++] = connection->AuthEvent;
+
+		timeout = INFINITE;
 
-		if (client->activated)
+		if (connection->AuthRequest)
 		{
-			connector = (rdsModuleConnector*) connection->connector;
+			timeout = connection->AuthDeadline - GetTickCount();
 
-			if (connector)
-				connector->GetEventHandles(connection->connector, events, &nCount);
+			if ((LONG) timeout < 0)
+				timeout = 0;
 		}
 
-		status = WaitForMultipleObjects(nCount, events, FALSE, INFINITE);
+		status = WaitForMultipleObjects(nCount, events, FALSE, timeout);
 
 		if (WaitForSingleObject(GlobalTermEvent, 0) == WAIT_OBJECT_0)
 		{
@@ -423,6 +582,19 @@ void* freerds_connection_main_thread(void* arg)
 			break;
 		}
 
+		if (WaitForSingleObject(connection->AuthEvent, 0) == WAIT_OBJECT_0)
+		{
+			ResetEvent(connection->AuthEvent);
+
+			if (freerds_connection_logon(connection) != TRUE)
+				break;
+		}
+		else if ((status == WAIT_TIMEOUT) && connection->AuthRequest)
+		{
+			fprintf(stderr, "Authentication of %s timed out\n", settings->Username);
+			break;
+		}
+
 		if (WaitForSingleObject(ClientEvent, 0) == WAIT_OBJECT_0)
 		{
 			if (client->CheckFileDescriptor(client) != TRUE)
@@ -430,6 +602,10 @@ void* freerds_connection_main_thread(void* arg)
 				fprintf(stderr, "Failed to check freerdp file descriptor\n");
 				break;
 			}
+
+			/* write the input batch received from the client to the module */
+			if (connection->connector && connection->connector->hClientPipe)
+				freerds_client_outbound_flush(connection->connector);
 		}
 
 		if (WaitForSingleObject(ChannelEvent, 0) == WAIT_OBJECT_0)
@@ -440,23 +616,36 @@ void* freerds_connection_main_thread(void* arg)
 				break;
 			}
 		}
+	}
 
-		if (client->activated)
-		{
-			connector = (rdsModuleConnector*) connection->connector;
+	fprintf(stderr, "Client %s disconnected.\n", client->hostname);
 
-			if (connector)
-			{
-				if (connector->CheckEventHandles(connection->connector) < 0)
-				{
-					fprintf(stderr, "ModuleClient->CheckEventHandles failure\n");
-					break;
-				}
-			}
-		}
+	freerds_latency_print(connection);
+
+	if (connection->AuthRequest)
+	{
+		/* cancels the request if it is still pending */
+		freerds_auth_request_release(connection->AuthRequest, NULL);
+		connection->AuthRequest = NULL;
 	}
 
-	fprintf(stderr, "Client %s disconnected.\n", client->hostname);
+	connector = (rdsModuleConnector*) connection->connector;
+
+	if (connector)
+	{
+		freerds_icp_ReleaseChannelPolicy(connector->SessionId);
+
+		SetEvent(connector->StopEvent);
+
+		if (connector->EncoderThread)
+		{
+			WaitForSingleObject(connector->EncoderThread, INFINITE);
+			CloseHandle(connector->EncoderThread);
+			connector->EncoderThread = NULL;
+		}
+
+		freerds_client_inbound_release_snapshot(connector);
+	}
 
 	client->Disconnect(client);
 
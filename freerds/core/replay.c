@@ -0,0 +1,396 @@
+/**
+ * xrdp: A Remote Desktop Protocol server.
+ * Connector Capture Replay
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "freerds.h"
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/sysinfo.h>
+
+#include <freerds/module_connector.h>
+
+/**
+ * Capture Replay
+ *
+ * A capture made with FREERDS_CAPTURE_DIR is fed back into the graphics
+ * pipeline of a connection without a module or a client: inbound messages
+ * are dispatched as if they had been read from the transport, and at every
+ * recorded paint point the pixels are restored, the server list is packed
+ * and the server queue is encoded synchronously. The peer only counts what
+ * the encoder would have sent.
+ */
+
+struct rds_replay_counters
+{
+	UINT32 messages;
+	UINT32 paints;
+	UINT32 frames;
+	UINT32 orders;
+	UINT64 pixels;
+	UINT64 encodedBytes;
+};
+typedef struct rds_replay_counters rdsReplayCounters;
+
+static rdsReplayCounters g_ReplayCounters;
+
+static void freerds_replay_begin_paint(rdpContext* context)
+{
+
+}
+
+static void freerds_replay_end_paint(rdpContext* context)
+{
+
+}
+
+static void freerds_replay_bitmap_update(rdpContext* context, BITMAP_UPDATE* bitmap)
+{
+	UINT32 index;
+
+	for (index = 0; index < bitmap->number; index++)
+		g_ReplayCounters.encodedBytes += bitmap->rectangles[index].bitmapLength;
+}
+
+static void freerds_replay_surface_bits(rdpContext* context, SURFACE_BITS_COMMAND* cmd)
+{
+	g_ReplayCounters.encodedBytes += cmd->bitmapDataLength;
+}
+
+static void freerds_replay_surface_frame_marker(rdpContext* context, SURFACE_FRAME_MARKER* surfaceFrameMarker)
+{
+	if (surfaceFrameMarker->frameAction != SURFACECMD_FRAMEACTION_END)
+		return;
+
+	/* acknowledge right away, the frame rate must not adapt to a client that is not there */
+	freerds_update_frame_acknowledge(context, surfaceFrameMarker->frameId);
+
+	g_ReplayCounters.frames++;
+}
+
+static void freerds_replay_order(rdpContext* context, void* order)
+{
+	g_ReplayCounters.orders++;
+}
+
+static void freerds_replay_register_callbacks(rdpUpdate* update)
+{
+	update->BeginPaint = freerds_replay_begin_paint;
+	update->EndPaint = freerds_replay_end_paint;
+	update->SetBounds = (pSetBounds) freerds_replay_order;
+	update->BitmapUpdate = freerds_replay_bitmap_update;
+	update->SurfaceBits = freerds_replay_surface_bits;
+	update->SurfaceFrameMarker = freerds_replay_surface_frame_marker;
+
+	update->pointer->PointerSystem = (pPointerSystem) freerds_replay_order;
+	update->pointer->PointerColor = (pPointerColor) freerds_replay_order;
+	update->pointer->PointerNew = (pPointerNew) freerds_replay_order;
+	update->pointer->PointerCached = (pPointerCached) freerds_replay_order;
+
+	update->primary->DstBlt = (pDstBlt) freerds_replay_order;
+	update->primary->PatBlt = (pPatBlt) freerds_replay_order;
+	update->primary->ScrBlt = (pScrBlt) freerds_replay_order;
+	update->primary->OpaqueRect = (pOpaqueRect) freerds_replay_order;
+	update->primary->LineTo = (pLineTo) freerds_replay_order;
+	update->primary->MemBlt = (pMemBlt) freerds_replay_order;
+	update->primary->GlyphIndex = (pGlyphIndex) freerds_replay_order;
+
+	update->secondary->CacheBitmap = (pCacheBitmap) freerds_replay_order;
+	update->secondary->CacheBitmapV2 = (pCacheBitmapV2) freerds_replay_order;
+	update->secondary->CacheBitmapV3 = (pCacheBitmapV3) freerds_replay_order;
+	update->secondary->CacheColorTable = (pCacheColorTable) freerds_replay_order;
+	update->secondary->CacheGlyph = (pCacheGlyph) freerds_replay_order;
+	update->secondary->CacheGlyphV2 = (pCacheGlyphV2) freerds_replay_order;
+	update->secondary->CacheBrush = (pCacheBrush) freerds_replay_order;
+
+	update->altsec->CreateOffscreenBitmap = (pCreateOffscreenBitmap) freerds_replay_order;
+	update->altsec->SwitchSurface = (pSwitchSurface) freerds_replay_order;
+}
+
+static void freerds_replay_release_framebuffer(RDS_FRAMEBUFFER* framebuffer)
+{
+	if (framebuffer->image)
+		pixman_image_unref((pixman_image_t*) framebuffer->image);
+
+	free(framebuffer->fbSharedMemory);
+
+	ZeroMemory(framebuffer, sizeof(RDS_FRAMEBUFFER));
+}
+
+/**
+ * Replaces the shared framebuffer of the module with private memory,
+ * which the recorded pixels are written to at every paint point.
+ */
+
+static int freerds_replay_shared_framebuffer(rdsModuleConnector* connector, RDS_MSG_SHARED_FRAMEBUFFER* msg)
+{
+	RDS_FRAMEBUFFER* framebuffer = &(connector->framebuffer);
+
+	if (framebuffer->fbAttached && !msg->attach)
+		freerds_replay_release_framebuffer(framebuffer);
+
+	if (!framebuffer->fbAttached && msg->attach)
+	{
+		framebuffer->fbWidth = msg->width;
+		framebuffer->fbHeight = msg->height;
+		framebuffer->fbScanline = msg->scanline;
+		framebuffer->fbSegmentId = msg->segmentId;
+		framebuffer->fbBitsPerPixel = msg->bitsPerPixel;
+		framebuffer->fbBytesPerPixel = msg->bytesPerPixel;
+
+		framebuffer->fbSharedMemory = (BYTE*) calloc(1, (size_t) msg->scanline * msg->height);
+
+		if (!framebuffer->fbSharedMemory)
+			return -1;
+
+		framebuffer->fbAttached = TRUE;
+
+		framebuffer->image = (void*) pixman_image_create_bits(PIXMAN_x8r8g8b8,
+				framebuffer->fbWidth, framebuffer->fbHeight,
+				(uint32_t*) framebuffer->fbSharedMemory, framebuffer->fbScanline);
+	}
+
+	return 0;
+}
+
+/**
+ * The desktop size is taken from the capabilities freerds sent to the module.
+ */
+
+static void freerds_replay_outbound(rdsModuleConnector* connector, RDS_CAPTURE_RECORD* record)
+{
+	wStream* s;
+	rdpSettings* settings;
+	RDS_MSG_CAPABILITIES msg;
+	rdsConnection* connection;
+
+	connection = connector->connection;
+	settings = connection->settings;
+
+	s = Stream_New(record->data, record->length);
+
+	if ((freerds_read_common_header(s, (RDS_MSG_COMMON*) &msg) >= 0) && (msg.type == RDS_CLIENT_CAPABILITIES))
+	{
+		freerds_read_capabilities(s, &msg);
+
+		settings->DesktopWidth = msg.DesktopWidth;
+		settings->DesktopHeight = msg.DesktopHeight;
+
+		connection->rfx_context->width = msg.DesktopWidth;
+		connection->rfx_context->height = msg.DesktopHeight;
+	}
+
+	Stream_Free(s, FALSE);
+}
+
+static int freerds_replay_inbound(rdsModuleConnector* connector, RDS_CAPTURE_RECORD* record)
+{
+	wStream* s;
+	int status;
+	RDS_MSG_COMMON common;
+
+	s = Stream_New(record->data, record->length);
+
+	status = freerds_read_common_header(s, &common);
+
+	if (status >= 0)
+		status = freerds_receive_server_message(connector, s, &common);
+
+	Stream_Free(s, FALSE);
+
+	g_ReplayCounters.messages++;
+
+	return status;
+}
+
+static int freerds_replay_paint(rdsModuleConnector* connector, RDS_CAPTURE_RECORD* record)
+{
+	int y;
+	wStream* s;
+	RDS_RECT rect;
+	UINT32 rowLength;
+	UINT32 bytesPerPixel;
+	RDS_MSG_PAINT_RECT paintRect;
+	RDS_FRAMEBUFFER* framebuffer = &(connector->framebuffer);
+
+	if (record->length < RDS_CAPTURE_FRAMEBUFFER_LENGTH)
+		return -1;
+
+	s = Stream_New(record->data, record->length);
+	Stream_Read_UINT32(s, rect.x);
+	Stream_Read_UINT32(s, rect.y);
+	Stream_Read_UINT32(s, rect.width);
+	Stream_Read_UINT32(s, rect.height);
+	Stream_Read_UINT32(s, bytesPerPixel);
+	Stream_Free(s, FALSE);
+
+	if (rect.width && rect.height)
+	{
+		rowLength = rect.width * bytesPerPixel;
+
+		if (!framebuffer->fbAttached || (bytesPerPixel != framebuffer->fbBytesPerPixel) ||
+				(rect.x < 0) || (rect.y < 0) ||
+				((rect.x + rect.width) > (UINT32) framebuffer->fbWidth) ||
+				((rect.y + rect.height) > (UINT32) framebuffer->fbHeight) ||
+				(record->length != RDS_CAPTURE_FRAMEBUFFER_LENGTH + (rowLength * rect.height)))
+		{
+			fprintf(stderr, "freerds_replay_paint: paint does not match the framebuffer\n");
+			return -1;
+		}
+
+		for (y = 0; y < (int) rect.height; y++)
+		{
+			CopyMemory(&(framebuffer->fbSharedMemory[((rect.y + y) * framebuffer->fbScanline) +
+					(rect.x * bytesPerPixel)]),
+					&(record->data[RDS_CAPTURE_FRAMEBUFFER_LENGTH + (y * rowLength)]), rowLength);
+		}
+
+		/* the recorded area already includes the damage taken from the dirty tile bitmap */
+		ZeroMemory(&paintRect, sizeof(RDS_MSG_PAINT_RECT));
+		paintRect.msgFlags = RDS_MSG_FLAG_RECT;
+		CopyMemory(&(paintRect.rect), &rect, sizeof(RDS_RECT));
+		paintRect.nLeftRect = rect.x;
+		paintRect.nTopRect = rect.y;
+		paintRect.nWidth = rect.width;
+		paintRect.nHeight = rect.height;
+		paintRect.fbSegmentId = framebuffer->fbSegmentId;
+		paintRect.framebuffer = framebuffer;
+
+		connector->server->PaintRect(connector, &paintRect);
+
+		g_ReplayCounters.paints++;
+		g_ReplayCounters.pixels += rect.width * rect.height;
+	}
+
+	freerds_message_server_queue_pack(connector);
+
+	return freerds_message_server_queue_process_pending_messages(connector);
+}
+
+int freerds_replay_main(const char* filename, BOOL realtime)
+{
+	int status;
+	DWORD elapsed;
+	DWORD sessionId;
+	DWORD startTime;
+	freerdp_peer* client;
+	rdsCapture* capture;
+	rdpSettings* settings;
+	rdsConnection* connection;
+	rdsModuleConnector* connector;
+	RDS_CAPTURE_RECORD record;
+
+	capture = freerds_capture_open(filename, &sessionId);
+
+	if (!capture)
+	{
+		fprintf(stderr, "failed to open capture %s\n", filename);
+		return 1;
+	}
+
+	ZeroMemory(&g_ReplayCounters, sizeof(rdsReplayCounters));
+
+	client = freerdp_peer_new(-1);
+
+	client->ContextSize = sizeof(rdsConnection);
+	client->ContextNew = (psPeerContextNew) freerds_peer_context_new;
+	client->ContextFree = (psPeerContextFree) freerds_peer_context_free;
+	freerdp_peer_context_new(client);
+
+	connection = (rdsConnection*) client->context;
+	settings = connection->settings;
+
+	freerds_replay_register_callbacks(client->update);
+
+	if (settings->RemoteFxCodec || settings->NSCodec)
+		connection->codecMode = TRUE;
+
+	connector = freerds_module_connector_new(connection);
+	connector->SessionId = sessionId;
+	connector->ProtocolVersion = RDS_PROTOCOL_VERSION_1;
+	connector->OutboundFd = -1;
+	connection->connector = connector;
+
+	freerds_client_inbound_connector_init(connector);
+	connector->ServerProxy->SharedFramebuffer = freerds_replay_shared_framebuffer;
+
+	printf("replaying session %d from %s%s\n", (int) sessionId, filename,
+			realtime ? "" : " as fast as possible");
+
+	status = 0;
+	startTime = GetTickCount();
+
+	while (freerds_capture_read(capture, &record) > 0)
+	{
+		if (realtime)
+		{
+			elapsed = GetTickCount() - startTime;
+
+			if (record.timestamp > elapsed)
+				Sleep(record.timestamp - elapsed);
+		}
+
+		switch (record.type)
+		{
+			case RDS_CAPTURE_INBOUND:
+				status = freerds_replay_inbound(connector, &record);
+				break;
+
+			case RDS_CAPTURE_OUTBOUND:
+				freerds_replay_outbound(connector, &record);
+				break;
+
+			case RDS_CAPTURE_FRAMEBUFFER:
+				status = freerds_replay_paint(connector, &record);
+				break;
+
+			default:
+				break;
+		}
+
+		if (status < 0)
+		{
+			fprintf(stderr, "replay stopped at %u ms\n", (unsigned int) record.timestamp);
+			break;
+		}
+	}
+
+	elapsed = GetTickCount() - startTime;
+
+	printf("replayed %u messages, %u paints (%llu pixels) in %u ms\n",
+			(unsigned int) g_ReplayCounters.messages, (unsigned int) g_ReplayCounters.paints,
+			(unsigned long long) g_ReplayCounters.pixels, (unsigned int) elapsed);
+	printf("encoded %u frames, %llu bytes, %u orders\n",
+			(unsigned int) g_ReplayCounters.frames, (unsigned long long) g_ReplayCounters.encodedBytes,
+			(unsigned int) g_ReplayCounters.orders);
+
+	freerds_capture_free(capture);
+
+	freerds_replay_release_framebuffer(&(connector->framebuffer));
+	freerds_client_inbound_release_snapshot(connector);
+	freerds_module_connector_free(connector);
+
+	freerdp_peer_context_free(client);
+	freerdp_peer_free(client);
+
+	return (status < 0) ? 1 : 0;
+}
@@ -70,19 +70,136 @@ int freerds_client_inbound_screen_blt(rdsModuleConnector* connector, RDS_MSG_SCR
 	return 0;
 }
 
+void freerds_client_inbound_release_snapshot(rdsModuleConnector* connector)
+{
+	RDS_FRAMEBUFFER* snapshot = &(connector->snapshot);
+
+	if (snapshot->image)
+		pixman_image_unref((pixman_image_t*) snapshot->image);
+
+	free(snapshot->fbSharedMemory);
+
+	ZeroMemory(snapshot, sizeof(RDS_FRAMEBUFFER));
+}
+
+/**
+ * A double buffered framebuffer is encoded from a private copy of the area,
+ * taken under the frame sequence lock so that a frame the module is still
+ * presenting is never sent half way.
+ */
+
+static RDS_FRAMEBUFFER* freerds_client_inbound_snapshot(rdsModuleConnector* connector, RDS_MSG_PAINT_RECT* msg)
+{
+	RDS_RECT rect;
+	RDS_FRAMEBUFFER* framebuffer = msg->framebuffer;
+	RDS_FRAMEBUFFER* snapshot = &(connector->snapshot);
+
+	if (snapshot->fbSharedMemory && ((snapshot->fbScanline != framebuffer->fbScanline) ||
+			(snapshot->fbHeight != framebuffer->fbHeight)))
+	{
+		freerds_client_inbound_release_snapshot(connector);
+	}
+
+	if (!snapshot->fbSharedMemory)
+	{
+		CopyMemory(snapshot, framebuffer, sizeof(RDS_FRAMEBUFFER));
+
+		snapshot->fbMappedSize = 0;
+		snapshot->tiles = NULL;
+		snapshot->fbSharedMemory = (BYTE*) malloc((size_t) framebuffer->fbScanline * framebuffer->fbHeight);
+
+		if (!snapshot->fbSharedMemory)
+		{
+			ZeroMemory(snapshot, sizeof(RDS_FRAMEBUFFER));
+			return NULL;
+		}
+
+		snapshot->image = (void*) pixman_image_create_bits(PIXMAN_x8r8g8b8,
+				snapshot->fbWidth, snapshot->fbHeight,
+				(uint32_t*) snapshot->fbSharedMemory, snapshot->fbScanline);
+	}
+
+	rect.x = msg->nLeftRect;
+	rect.y = msg->nTopRect;
+	rect.width = msg->nWidth;
+	rect.height = msg->nHeight;
+
+	freerds_frame_read_rect(framebuffer, snapshot->fbSharedMemory, &rect);
+
+	return snapshot;
+}
+
+/**
+ * Pixels sent along with a PaintRect are stored in the private copy of a
+ * remote framebuffer, they are encoded by the paint merged from their area.
+ */
+
+static int freerds_client_inbound_store_rect(rdsModuleConnector* connector, RDS_MSG_PAINT_RECT* msg)
+{
+	int y;
+	UINT32 rowLength;
+	RDS_FRAMEBUFFER* framebuffer = &(connector->framebuffer);
+
+	if (!framebuffer->fbAttached || (framebuffer->fbSegmentId != RDS_FRAMEBUFFER_SEGMENT_REMOTE))
+		return 0;
+
+	if ((msg->nLeftRect < 0) || (msg->nTopRect < 0) || (msg->nWidth < 1) || (msg->nHeight < 1) ||
+			((msg->nLeftRect + msg->nWidth) > framebuffer->fbWidth) ||
+			((msg->nTopRect + msg->nHeight) > framebuffer->fbHeight))
+		return 0;
+
+	rowLength = msg->nWidth * framebuffer->fbBytesPerPixel;
+
+	if (msg->bitmapDataLength < (rowLength * msg->nHeight))
+		return 0;
+
+	for (y = 0; y < msg->nHeight; y++)
+	{
+		CopyMemory(&(framebuffer->fbSharedMemory[((msg->nTopRect + y) * framebuffer->fbScanline) +
+				(msg->nLeftRect * framebuffer->fbBytesPerPixel)]), &(msg->bitmapData[y * rowLength]), rowLength);
+	}
+
+	return 0;
+}
+
 int freerds_client_inbound_paint_rect(rdsModuleConnector* connector, RDS_MSG_PAINT_RECT* msg)
 {
 	int bpp;
 	int inFlightFrames;
+	BOOL inputStamped;
+	DWORD inputLatency;
 	SURFACE_FRAME* frame;
 	rdsConnection* connection;
 	rdpSettings* settings;
+	RDS_MSG_PAINT_RECT stable;
+
+	if (!msg->fbSegmentId)
+		return freerds_client_inbound_store_rect(connector, msg);
 
 	connection = connector->connection;
 	settings = connection->settings;
 
+	if (msg->fbSegmentId && msg->framebuffer->tiles &&
+			(msg->framebuffer->tilesFlags & RDS_TILE_BITMAP_FLAG_DOUBLE_BUFFER))
+	{
+		CopyMemory(&stable, msg, sizeof(RDS_MSG_PAINT_RECT));
+		stable.framebuffer = freerds_client_inbound_snapshot(connector, msg);
+
+		if (stable.framebuffer)
+			msg = &stable;
+	}
+
 	bpp = msg->framebuffer->fbBitsPerPixel;
 
+	inputStamped = FALSE;
+
+	if ((msg->msgFlags & RDS_MSG_FLAG_INPUT) &&
+			(freerds_input_latency(connection, msg->inputSequence, &inputLatency) == 0))
+	{
+		inputStamped = TRUE;
+		freerds_latency_record(&(connection->InputToEncode), inputLatency);
+	}
+
 	if (connection->codecMode)
 	{
 		inFlightFrames = ListDictionary_Count(connection->FrameList);
@@ -109,6 +226,99 @@ int freerds_client_inbound_paint_rect(rdsModuleConnector* connector, RDS_MSG_PAI
 		freerds_send_bitmap_update(connection, bpp, msg);
 	}
 
+	if (inputStamped)
+	{
+		if (freerds_input_latency(connection, msg->inputSequence, &inputLatency) == 0)
+			freerds_latency_record(&(connection->InputToSend), inputLatency);
+
+		connection->LatencySequence = msg->inputSequence;
+	}
+
+	return 0;
+}
+
+int freerds_client_inbound_paint_rects(rdsModuleConnector* connector, RDS_MSG_PAINT_RECTS* msg)
+{
+	UINT32 index;
+	RDS_MSG_PAINT_RECT paintRect;
+
+	if (!msg->rects || !msg->numberOfRects)
+		return 0;
+
+	ZeroMemory(&paintRect, sizeof(RDS_MSG_PAINT_RECT));
+
+	paintRect.type = RDS_SERVER_PAINT_RECT;
+	paintRect.msgFlags = msg->msgFlags;
+	paintRect.inputSequence = msg->inputSequence;
+	paintRect.fbSegmentId = msg->fbSegmentId;
+	paintRect.framebuffer = msg->framebuffer;
+
+	for (index = 0; index < msg->numberOfRects; index++)
+	{
+		paintRect.nLeftRect = msg->rects[index].left;
+		paintRect.nTopRect = msg->rects[index].top;
+		paintRect.nWidth = msg->rects[index].right - msg->rects[index].left;
+		paintRect.nHeight = msg->rects[index].bottom - msg->rects[index].top;
+
+		freerds_client_inbound_paint_rect(connector, &paintRect);
+	}
+
+	return 0;
+}
+
+struct _RDS_TILE_PAINT_CONTEXT
+{
+	rdsModuleConnector* connector;
+	RDS_MSG_PAINT_RECT paintRect;
+};
+typedef struct _RDS_TILE_PAINT_CONTEXT RDS_TILE_PAINT_CONTEXT;
+
+static void freerds_client_inbound_paint_tile_run(void* context, RDS_RECT* rect)
+{
+	RDS_TILE_PAINT_CONTEXT* paint = (RDS_TILE_PAINT_CONTEXT*) context;
+
+	paint->paintRect.nLeftRect = rect->x;
+	paint->paintRect.nTopRect = rect->y;
+	paint->paintRect.nWidth = rect->width;
+	paint->paintRect.nHeight = rect->height;
+
+	freerds_client_inbound_paint_rect(paint->connector, &(paint->paintRect));
+}
+
+int freerds_client_inbound_frame_ready(rdsModuleConnector* connector, RDS_MSG_FRAME_READY* msg)
+{
+	RDS_TILE_PAINT_CONTEXT paint;
+
+	if (!connector->framebuffer.fbAttached)
+		return 0;
+
+	ZeroMemory(&paint, sizeof(RDS_TILE_PAINT_CONTEXT));
+
+	paint.connector = connector;
+	paint.paintRect.type = RDS_SERVER_PAINT_RECT;
+	paint.paintRect.msgFlags = msg->msgFlags;
+	paint.paintRect.inputSequence = msg->inputSequence;
+	paint.paintRect.fbSegmentId = connector->framebuffer.fbSegmentId;
+	paint.paintRect.framebuffer = &(connector->framebuffer);
+
+	if (!connector->framebuffer.tiles)
+	{
+		/* the tile bitmap did not attach, the damage is unknown */
+		paint.paintRect.nWidth = connector->framebuffer.fbWidth;
+		paint.paintRect.nHeight = connector->framebuffer.fbHeight;
+
+		return freerds_client_inbound_paint_rect(connector, &(paint.paintRect));
+	}
+
+	freerds_tile_bitmap_collect(&(connector->framebuffer), freerds_client_inbound_paint_tile_run, &paint);
+
+	return 0;
+}
+
+int freerds_client_inbound_screen_blt_rects(rdsModuleConnector* connector, RDS_MSG_SCREEN_BLT_RECTS* msg)
+{
+	/* TODO */
+
 	return 0;
 }
 
@@ -171,7 +381,34 @@ int freerds_client_inbound_glyph_index(rdsModuleConnector* connector, RDS_MSG_GL
 	return 0;
 }
 
-int freerds_client_inbound_shared_framebuffer(rdsModuleConnector* connector, RDS_MSG_SHARED_FRAMEBUFFER* msg)
+/**
+ * Looks for the dirty tile bitmap a module may have placed after the pixels.
+ */
+
+static RDS_TILE_BITMAP* freerds_client_inbound_attach_tiles(RDS_FRAMEBUFFER* framebuffer)
+{
+	size_t offset;
+	size_t length;
+	struct shmid_ds ds;
+
+	offset = RDS_TILE_BITMAP_OFFSET((size_t) framebuffer->fbScanline * framebuffer->fbHeight);
+	length = framebuffer->fbMappedSize;
+
+	if (!length && (shmctl(framebuffer->fbSegmentId, IPC_STAT, &ds) == 0))
+		length = ds.shm_segsz;
+
+	if (length <= offset)
+		return NULL;
+
+	return freerds_tile_bitmap_attach(framebuffer, &(framebuffer->fbSharedMemory[offset]), length - offset);
+}
+
+/**
+ * Runs on the encoder thread, the client thread collects the dirty tiles and
+ * captures the framebuffer under the same lock.
+ */
+
+static int freerds_client_inbound_update_framebuffer(rdsModuleConnector* connector, RDS_MSG_SHARED_FRAMEBUFFER* msg)
 {
 	connector->framebuffer.fbWidth = msg->width;
 	connector->framebuffer.fbHeight = msg->height;
@@ -185,11 +422,50 @@ int freerds_client_inbound_shared_framebuffer(rdsModuleConnector* connector, RDS
 
 	if (!connector->framebuffer.fbAttached && msg->attach)
 	{
-		connector->framebuffer.fbSharedMemory = (BYTE*) shmat(connector->framebuffer.fbSegmentId, 0, 0);
+		if (msg->segmentId == RDS_FRAMEBUFFER_SEGMENT_REMOTE)
+		{
+			connector->framebuffer.fbSharedMemory = (BYTE*) calloc(1,
+					(size_t) connector->framebuffer.fbScanline * connector->framebuffer.fbHeight);
+		}
+		else if (msg->segmentId == RDS_FRAMEBUFFER_SEGMENT_MEMFD)
+		{
+			if (msg->fd < 0)
+			{
+				fprintf(stderr, "shared framebuffer file descriptor was not received\n");
+				return -1;
+			}
+
+			connector->framebuffer.fbSharedMemory = freerds_framebuffer_memfd_map(msg->fd,
+					connector->framebuffer.fbScanline * connector->framebuffer.fbHeight,
+					&(connector->framebuffer.fbMappedSize));
+
+			close(msg->fd);
+			msg->fd = -1;
+		}
+		else
+		{
+			connector->framebuffer.fbSharedMemory = (BYTE*) shmat(connector->framebuffer.fbSegmentId, 0, 0);
+
+			if (connector->framebuffer.fbSharedMemory == (BYTE*) -1)
+				connector->framebuffer.fbSharedMemory = NULL;
+		}
+
+		if (!connector->framebuffer.fbSharedMemory)
+		{
+			fprintf(stderr, "failed to map shared framebuffer %d\n", connector->framebuffer.fbSegmentId);
+			return -1;
+		}
+
 		connector->framebuffer.fbAttached = TRUE;
 
-		printf("attached segment %d to %p\n",
-				connector->framebuffer.fbSegmentId, connector->framebuffer.fbSharedMemory);
+		if (msg->segmentId != RDS_FRAMEBUFFER_SEGMENT_REMOTE)
+			connector->framebuffer.tiles = freerds_client_inbound_attach_tiles(&(connector->framebuffer));
+
+		printf("attached segment %d to %p%s%s\n",
+				connector->framebuffer.fbSegmentId, connector->framebuffer.fbSharedMemory,
+				connector->framebuffer.tiles ? " with dirty tile bitmap" : "",
+				(connector->framebuffer.tiles && (connector->framebuffer.tilesFlags &
+						RDS_TILE_BITMAP_FLAG_DOUBLE_BUFFER)) ? ", double buffered" : "");
 
 		connector->framebuffer.image = (void*) pixman_image_create_bits(PIXMAN_x8r8g8b8,
 				connector->framebuffer.fbWidth, connector->framebuffer.fbHeight,
@@ -198,11 +474,28 @@ int freerds_client_inbound_shared_framebuffer(rdsModuleConnector* connector, RDS
 
 	if (connector->framebuffer.fbAttached && !msg->attach)
 	{
-		shmdt(connector->framebuffer.fbSharedMemory);
-		connector->framebuffer.fbAttached = FALSE;
-		connector->framebuffer.fbSharedMemory = 0;
+		freerds_framebuffer_detach(&(connector->framebuffer));
+		freerds_client_inbound_release_snapshot(connector);
 	}
 
+	return 0;
+}
+
+int freerds_client_inbound_shared_framebuffer(rdsModuleConnector* connector, RDS_MSG_SHARED_FRAMEBUFFER* msg)
+{
+	int status;
+
+	EnterCriticalSection(&(connector->FramebufferLock));
+	status = freerds_client_inbound_update_framebuffer(connector, msg);
+	LeaveCriticalSection(&(connector->FramebufferLock));
+
+	/* a memfd which was not mapped, e.g. when already attached */
+	if (msg->fd >= 0)
+		close(msg->fd);
+
+	if (status < 0)
+		return status;
+
 	connector->client->VBlankEvent(connector);
 
 	return 0;
@@ -286,6 +579,9 @@ int freerds_client_inbound_connector_init(rdsModuleConnector* connector)
 		connector->server->WindowDelete = freerds_client_inbound_window_delete;
 		connector->server->LogonUser = freerds_client_inbound_logon_user;
 		connector->server->LogoffUser = freerds_client_inbound_logoff_user;
+		connector->server->PaintRects = freerds_client_inbound_paint_rects;
+		connector->server->ScreenBltRects = freerds_client_inbound_screen_blt_rects;
+		connector->server->FrameReady = freerds_client_inbound_frame_ready;
 	}
 
 	freerds_message_server_connector_init(connector);
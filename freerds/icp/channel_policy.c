@@ -0,0 +1,217 @@
+/**
+ * Freerds internal communication protocol
+ * Channel policy cache
+ *
+ * Copyright 2013 Thinstuff Technologies GmbH
+ * Copyright 2013 Bernhard Miklautz <bmiklautz@thinstuff.at>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <winpr/synch.h>
+#include "channel_policy.h"
+
+struct icp_channel_policy
+{
+	UINT32 sessionId;
+	BOOL defaultAllowed;
+	UINT32 count;
+	char **names;
+	BOOL *allowed;
+	struct icp_channel_policy *next;
+};
+typedef struct icp_channel_policy icpChannelPolicy;
+
+static icpChannelPolicy *g_Policies = NULL;
+static UINT32 g_PolicyGeneration = 0;
+static CRITICAL_SECTION g_PolicyLock;
+
+static void freerds_channel_policy_free(icpChannelPolicy *entry)
+{
+	UINT32 i;
+
+	for (i = 0; i < entry->count; i++)
+		free(entry->names[i]);
+
+	free(entry->names);
+	free(entry->allowed);
+	free(entry);
+}
+
+static icpChannelPolicy *freerds_channel_policy_new(UINT32 sessionId, Freerds__Icp__ChannelPolicy *policy)
+{
+	size_t i;
+	icpChannelPolicy *entry;
+
+	entry = (icpChannelPolicy *)calloc(1, sizeof(icpChannelPolicy));
+	if (!entry)
+		return NULL;
+
+	entry->sessionId = sessionId;
+	entry->defaultAllowed = policy->defaultallowed;
+
+	if (policy->n_rules)
+	{
+		entry->names = (char **)calloc(policy->n_rules, sizeof(char *));
+		entry->allowed = (BOOL *)calloc(policy->n_rules, sizeof(BOOL));
+
+		if (!entry->names || !entry->allowed)
+		{
+			freerds_channel_policy_free(entry);
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < policy->n_rules; i++)
+	{
+		entry->names[i] = strdup(policy->rules[i]->channelname);
+		if (!entry->names[i])
+		{
+			freerds_channel_policy_free(entry);
+			return NULL;
+		}
+		entry->allowed[i] = policy->rules[i]->channelallowed;
+		entry->count++;
+	}
+
+	return entry;
+}
+
+/* must be called with g_PolicyLock held */
+static void freerds_channel_policy_remove(UINT32 sessionId)
+{
+	icpChannelPolicy *entry;
+	icpChannelPolicy **link = &g_Policies;
+
+	while ((entry = *link))
+	{
+		if ((sessionId != 0) && (entry->sessionId != sessionId))
+		{
+			link = &(entry->next);
+			continue;
+		}
+
+		*link = entry->next;
+		freerds_channel_policy_free(entry);
+	}
+}
+
+void freerds_channel_policy_init()
+{
+	InitializeCriticalSectionAndSpinCount(&g_PolicyLock, 4000);
+}
+
+void freerds_channel_policy_uninit()
+{
+	EnterCriticalSection(&g_PolicyLock);
+	freerds_channel_policy_remove(0);
+	LeaveCriticalSection(&g_PolicyLock);
+
+	DeleteCriticalSection(&g_PolicyLock);
+}
+
+UINT32 freerds_channel_policy_generation()
+{
+	UINT32 generation;
+
+	EnterCriticalSection(&g_PolicyLock);
+	generation = g_PolicyGeneration;
+	LeaveCriticalSection(&g_PolicyLock);
+
+	return generation;
+}
+
+/* generation is what freerds_channel_policy_generation returned before policy was requested */
+void freerds_channel_policy_store(UINT32 sessionId, Freerds__Icp__ChannelPolicy *policy, UINT32 generation)
+{
+	icpChannelPolicy *entry;
+
+	if (!policy)
+		return;
+
+	entry = freerds_channel_policy_new(sessionId, policy);
+	if (!entry)
+		return;
+
+	EnterCriticalSection(&g_PolicyLock);
+
+	if (generation != g_PolicyGeneration)
+	{
+		/* changed while it was on its way */
+		LeaveCriticalSection(&g_PolicyLock);
+		freerds_channel_policy_free(entry);
+		return;
+	}
+
+	freerds_channel_policy_remove(sessionId);
+	entry->next = g_Policies;
+	g_Policies = entry;
+
+	LeaveCriticalSection(&g_PolicyLock);
+}
+
+/* sessionId 0 drops every cached policy */
+void freerds_channel_policy_invalidate(UINT32 sessionId)
+{
+	EnterCriticalSection(&g_PolicyLock);
+	g_PolicyGeneration++;
+	freerds_channel_policy_remove(sessionId);
+	LeaveCriticalSection(&g_PolicyLock);
+}
+
+/* drops the policy of a session which is no longer connected, the policy did not change */
+void freerds_channel_policy_release(UINT32 sessionId)
+{
+	if (!sessionId)
+		return;
+
+	EnterCriticalSection(&g_PolicyLock);
+	freerds_channel_policy_remove(sessionId);
+	LeaveCriticalSection(&g_PolicyLock);
+}
+
+/* returns -1 if no policy is cached for the session */
+int freerds_channel_policy_lookup(UINT32 sessionId, const char *channelName, BOOL *isAllowed)
+{
+	UINT32 i;
+	icpChannelPolicy *entry;
+
+	EnterCriticalSection(&g_PolicyLock);
+
+	for (entry = g_Policies; entry; entry = entry->next)
+	{
+		if (entry->sessionId == sessionId)
+			break;
+	}
+
+	if (!entry)
+	{
+		LeaveCriticalSection(&g_PolicyLock);
+		return -1;
+	}
+
+	*isAllowed = entry->defaultAllowed;
+
+	for (i = 0; i < entry->count; i++)
+	{
+		if (strcmp(entry->names[i], channelName) == 0)
+		{
+			*isAllowed = entry->allowed[i];
+			break;
+		}
+	}
+
+	LeaveCriticalSection(&g_PolicyLock);
+	return 0;
+}
@@ -0,0 +1,42 @@
+/**
+ * Freerds internal communication protocol
+ * Channel policy cache
+ *
+ * Copyright 2013 Thinstuff Technologies GmbH
+ * Copyright 2013 Bernhard Miklautz <bmiklautz@thinstuff.at>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _ICP_CHANNEL_POLICY_H
+#define _ICP_CHANNEL_POLICY_H
+#include <winpr/wtypes.h>
+#include "ICP.pb-c.h"
+
+/**
+ * The channel policy of a session arrives with GetUserSession (or through
+ * GetChannelPolicy) and is kept until the session manager reports a change
+ * with ChannelPolicyChanged, the link to it is reestablished, or the
+ * connection to the session closes. Every invalidation bumps a generation
+ * counter, a policy fetched before an invalidation is not stored.
+ */
+
+void freerds_channel_policy_init();
+void freerds_channel_policy_uninit();
+
+UINT32 freerds_channel_policy_generation();
+void freerds_channel_policy_store(UINT32 sessionId, Freerds__Icp__ChannelPolicy *policy, UINT32 generation);
+void freerds_channel_policy_invalidate(UINT32 sessionId);
+void freerds_channel_policy_release(UINT32 sessionId);
+int freerds_channel_policy_lookup(UINT32 sessionId, const char *channelName, BOOL *isAllowed);
+
+#endif // _ICP_CHANNEL_POLICY_H
@@ -21,6 +21,7 @@
 #include "pbrpc.h"
 #include "pipe_transport.h"
 #include "icp_server_stubs.h"
+#include "channel_policy.h"
 #include "ICP.pb-c.h"
 
 struct icp_context
@@ -34,17 +35,27 @@ static struct icp_context *icpContext = NULL;
 static pbRPCMethod icpMethods[] =
 {
 	{FREERDS__ICP__MSGTYPE__Ping, ping},
+	{FREERDS__ICP__MSGTYPE__ChannelPolicyChanged, channel_policy_changed},
 	{0, NULL}
 };
 
+/* ChannelPolicyChanged notifications may have been lost with the connection */
+static void icp_reconnected(void)
+{
+	freerds_channel_policy_invalidate(0);
+}
+
 int freerds_icp_start()
 {
 
+	freerds_channel_policy_init();
+
 	icpContext = malloc(sizeof(struct icp_context));
 	icpContext->tpcontext = tp_npipe_new();
 	icpContext->pbcontext = pbrpc_server_new(icpContext->tpcontext);
 
 	pbrpc_register_methods(icpContext->pbcontext, icpMethods);
+	pbrpc_register_reconnect_callback(icpContext->pbcontext, icp_reconnected);
 	pbrpc_server_start(icpContext->pbcontext);
 	return 0;
 }
@@ -55,6 +66,7 @@ int freerds_icp_shutdown()
 	pbrpc_server_free(icpContext->pbcontext);
 	tp_npipe_free(icpContext->tpcontext);
 	free(icpContext);
+	freerds_channel_policy_uninit();
 	return 0;
 }
 
@@ -22,9 +22,14 @@
 #include "ICP.pb-c.h"
 #include "pbrpc.h"
 #include "pbrpc_utils.h"
+#include "channel_policy.h"
+
+/* requests up to this size are packed on the stack */
+#define ICP_CLIENT_STUB_BUFFER_SIZE 512
 
 #define ICP_CLIENT_STUB_SETUP(camel, expanded) \
     UINT32 type = FREERDS__ICP__MSGTYPE__##camel ; \
+	BYTE buffer[ICP_CLIENT_STUB_BUFFER_SIZE]; \
 	pbRPCPayload pbrequest; \
 	pbRPCPayload *pbresponse = NULL; \
 	int ret; \
@@ -37,7 +42,7 @@
 
 #define ICP_CLIENT_STUB_CALL(camel, expanded) \
 	pbrequest.dataLen = freerds__icp__##expanded ##_request__get_packed_size(&request); \
-	pbrequest.data = malloc(pbrequest.dataLen); \
+	pbrequest.data = (pbrequest.dataLen <= sizeof(buffer)) ? (char *)buffer : malloc(pbrequest.dataLen); \
 	ret = freerds__icp__##expanded ##_request__pack(&request, (uint8_t *)pbrequest.data); \
 	if (ret == pbrequest.dataLen) \
 	{ \
@@ -47,14 +52,18 @@
 	{ \
 		ret = PBRPC_BAD_REQEST_DATA; \
 	} \
-	free(pbrequest.data);
+	if (pbrequest.data != (char *)buffer) \
+		free(pbrequest.data);
 
+/* the response is unpacked into the arena of its transaction */
 #define ICP_CLIENT_STUB_UNPACK_RESPONSE(camel, expanded) \
-	response = freerds__icp__##expanded ##_response__unpack(NULL, pbresponse->dataLen, (uint8_t *)pbresponse->data); \
-	pbrpc_free_payload(pbresponse);
+	response = freerds__icp__##expanded ##_response__unpack(pbrpc_payload_allocator(pbresponse), pbresponse->dataLen, (uint8_t *)pbresponse->data); \
+	if (!response) \
+		pbrpc_free_payload(pbresponse);
 
 #define ICP_CLIENT_STUB_CLEANUP(camel, expanded) \
-	freerds__icp__##expanded ##_response__free_unpacked(response, NULL);
+	freerds__icp__##expanded ##_response__free_unpacked(response, pbrpc_payload_allocator(pbresponse)); \
+	pbrpc_free_payload(pbresponse);
 
 
 int freerds_icp_IsChannelAllowed(int sessionId, char *channelName, BOOL *isAllowed)
@@ -120,6 +129,7 @@ int freerds_icp_Ping(BOOL *pong)
 
 int freerds_icp_GetUserSession(char *username, char * domain, UINT32 *sessionID, char **serviceEndpoint)
 {
+	UINT32 policyGeneration = freerds_channel_policy_generation();
 	ICP_CLIENT_STUB_SETUP(GetUserSession, get_user_session)
 
 	request.domainname = domain;
@@ -145,8 +155,64 @@ int freerds_icp_GetUserSession(char *username, char * domain, UINT32 *sessionID,
 	*sessionID = response->sessionid;
 	*serviceEndpoint = strdup(response->serviceendpoint);
 
+	// the channel policy comes along, saving a round trip per channel
+	freerds_channel_policy_store(response->sessionid, response->channelpolicy, policyGeneration);
+
 	// free function specific stuff
 
 	ICP_CLIENT_STUB_CLEANUP(GetUserSession, get_user_session)
 	return PBRPC_SUCCESS;
 }
+
+int freerds_icp_GetChannelPolicy(UINT32 sessionId)
+{
+	UINT32 policyGeneration = freerds_channel_policy_generation();
+	ICP_CLIENT_STUB_SETUP(GetChannelPolicy, get_channel_policy)
+
+	request.sessionid = sessionId;
+
+	ICP_CLIENT_STUB_CALL(GetChannelPolicy, get_channel_policy)
+	if (ret != 0)
+	{
+		// handle function specific frees
+		return ret;
+	}
+
+	ICP_CLIENT_STUB_UNPACK_RESPONSE(GetChannelPolicy, get_channel_policy)
+	if (NULL == response)
+	{
+		// unpack error
+		// free function specific stuff
+		return PBRPC_BAD_RESPONSE;
+	}
+
+	freerds_channel_policy_store(sessionId, response->channelpolicy, policyGeneration);
+
+	ICP_CLIENT_STUB_CLEANUP(GetChannelPolicy, get_channel_policy)
+	return PBRPC_SUCCESS;
+}
+
+/* called when a connection to the session closes, the next one fetches the policy again */
+void freerds_icp_ReleaseChannelPolicy(UINT32 sessionId)
+{
+	freerds_channel_policy_release(sessionId);
+}
+
+/* answers from the cached policy, which is fetched once if missing */
+int freerds_icp_IsChannelAllowedCached(UINT32 sessionId, char *channelName, BOOL *isAllowed)
+{
+	int ret;
+
+	if (freerds_channel_policy_lookup(sessionId, channelName, isAllowed) == 0)
+		return PBRPC_SUCCESS;
+
+	ret = freerds_icp_GetChannelPolicy(sessionId);
+	if (ret != 0)
+		return ret;
+
+	if (freerds_channel_policy_lookup(sessionId, channelName, isAllowed) == 0)
+		return PBRPC_SUCCESS;
+
+	// invalidated again right away
+	return PBRPC_FAILED;
+}
@@ -20,6 +20,7 @@
 #include "icp_server_stubs.h"
 #include "ICP.pb-c.h"
 #include "pbrpc_utils.h"
+#include "channel_policy.h"
 
 #define ICP_SERVER_STUB_SETUP(camel, expanded) \
 	Freerds__Icp__##camel ##Request *request; \
@@ -27,14 +28,14 @@
 	pbRPCPayload *payload; \
 	int ret = 0; \
 	freerds__icp__##expanded ##_response__init(&response); \
-	request = freerds__icp__##expanded ##_request__unpack(NULL, pbrequest->dataLen, (uint8_t*)pbrequest->data);\
+	request = freerds__icp__##expanded ##_request__unpack(pbrpc_payload_allocator(pbrequest), pbrequest->dataLen, (uint8_t*)pbrequest->data);\
 	if (!request) \
 	{ \
 		return PBRPC_BAD_REQEST_DATA; \
 	}
 
 #define ICP_SERVER_STUB_RESPOND(camel, expanded) \
-	freerds__icp__##expanded ##_request__free_unpacked(request, NULL); \
+	freerds__icp__##expanded ##_request__free_unpacked(request, pbrpc_payload_allocator(pbrequest)); \
 	payload = pbrpc_payload_new(); \
 	payload->dataLen = freerds__icp__##expanded ##_response__get_packed_size(&response); \
 	payload->data = malloc(payload->dataLen); \
@@ -59,3 +60,15 @@ int ping(pbRPCPayload *pbrequest, pbRPCPayload **pbresponse)
 
 	return PBRPC_SUCCESS;
 }
+
+int channel_policy_changed(pbRPCPayload *pbrequest, pbRPCPayload **pbresponse)
+{
+	ICP_SERVER_STUB_SETUP(ChannelPolicyChanged, channel_policy_changed)
+
+	// the next lookup fetches the new policy
+	freerds_channel_policy_invalidate(request->sessionid);
+
+	ICP_SERVER_STUB_RESPOND(ChannelPolicyChanged, channel_policy_changed)
+
+	return PBRPC_SUCCESS;
+}
@@ -22,4 +22,5 @@
 #include "pbrpc.h"
 
 int ping(pbRPCPayload *request, pbRPCPayload **response);
+int channel_policy_changed(pbRPCPayload *request, pbRPCPayload **response);
 #endif //_ICP_SERVER_STUBS_H
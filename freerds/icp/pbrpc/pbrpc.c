@@ -31,97 +31,346 @@
 #include "pbrpc_utils.h"
 #include "pbRPC.pb-c.h"
 
+/**
+ * Transactions live in a table allocated with the context, a call takes the
+ * slot its tag maps to so a response finds its caller without a search. The
+ * slot event is only used by synchronous calls, asynchronous ones carry a
+ * callback and a deadline instead.
+ */
 struct pbrpc_transaction
 {
+	pbRPCContext *context;
+	UINT32 tag;
+	BOOL inUse;
+	BOOL completed;
 	HANDLE Event;
-	Freerds__Pbrpc__RPCBase *response;
+	DWORD deadline;
+	pbRPCResponseCallback callback;
+	void *callbackArgs;
+	BOOL hasResponse;
+	UINT32 status;
+	pbRPCPayload response;
+	pbRPCArena arena;
 	UINT32 errorReason;
 };
-typedef struct pbrpc_transaction pbRPCTransaction;
 
-pbRPCTransaction *pbrpc_transaction_new()
+#define PBRPC_TRANSACTION_MASK (PBRPC_MAX_TRANSACTIONS - 1)
+
+/* how often the mainloop looks for asynchronous calls past their deadline */
+#define PBRPC_EXPIRE_INTERVAL 1000
+
+static void queu_item_free(void *obj)
 {
-	pbRPCTransaction *ta = malloc(sizeof(pbRPCTransaction));
-	ZeroMemory(ta, sizeof(pbRPCTransaction));
-	return ta;
+	Stream_Free((wStream *)obj, TRUE);
 }
 
-void pbrpc_transaction_free(pbRPCTransaction* ta)
+/**
+ * Outgoing requests are packed into streams taken from a small pool, the
+ * pbrpc thread gives them back once written.
+ */
+static wStream *pbrpc_stream_take(pbRPCContext *context, size_t size)
 {
-	if (!ta)
+	wStream *s = (wStream *)Queue_Dequeue(context->streamPool);
+
+	if (!s)
+		return Stream_New(NULL, size);
+
+	Stream_SetPosition(s, 0);
+	Stream_EnsureCapacity(s, size);
+	return s;
+}
+
+static void pbrpc_stream_release(pbRPCContext *context, wStream *s)
+{
+	if ((Stream_Capacity(s) > PBRPC_STREAM_POOL_MAX_CAPACITY) ||
+			(Queue_Count(context->streamPool) >= PBRPC_STREAM_POOL_SIZE))
+	{
+		Stream_Free(s, TRUE);
 		return;
-	free(ta);
+	}
+
+	Queue_Enqueue(context->streamPool, s);
 }
 
-static void queu_item_free(void *obj)
+/* packs msg behind its length prefix, the stream is left positioned at the end */
+static BOOL pbrpc_message_pack(wStream *s, Freerds__Pbrpc__RPCBase *msg)
 {
-	pbrpc_message_free((Freerds__Pbrpc__RPCBase *)obj, FALSE);
+	UINT32 msgLenWire;
+	size_t msgLen = freerds__pbrpc__rpcbase__get_packed_size(msg);
+
+	if (msgLen > PBRPC_MAX_MESSAGE_LENGTH)
+		return FALSE;
+
+	Stream_EnsureCapacity(s, Stream_GetPosition(s) + 4 + msgLen);
+	msgLenWire = htonl((UINT32) msgLen);
+	Stream_Write(s, &msgLenWire, 4);
+
+	if (freerds__pbrpc__rpcbase__pack(msg, Stream_Pointer(s)) != msgLen)
+		return FALSE;
+
+	Stream_Seek(s, msgLen);
+	return TRUE;
 }
 
-static void list_dictionary_item_free(void *item)
+/* must be called with transactionsLock held */
+static pbRPCTransaction *pbrpc_transaction_get(pbRPCContext *context, UINT32 tag)
 {
-	wListDictionaryItem *di = (wListDictionaryItem *)item;
-	pbrpc_transaction_free((pbRPCTransaction *)(di->value));
+	pbRPCTransaction *ta = &(context->transactions[tag & PBRPC_TRANSACTION_MASK]);
+
+	if (!ta->inUse || (ta->tag != tag))
+		return NULL;
+
+	return ta;
+}
+
+/**
+ * Tags the message and claims its slot. The slot of a fresh tag is only busy
+ * when that many calls are outstanding, so a few retries are enough to step
+ * over a long running one.
+ */
+static pbRPCTransaction *pbrpc_transaction_alloc(pbRPCContext *context, Freerds__Pbrpc__RPCBase *message,
+		pbRPCResponseCallback callback, void *args)
+{
+	int i;
+	pbRPCTransaction *ta;
+
+	EnterCriticalSection(&(context->transactionsLock));
+
+	for (i = 0; i < PBRPC_MAX_TRANSACTIONS; i++)
+	{
+		pbrpc_prepare_request(context, message);
+		ta = &(context->transactions[message->tag & PBRPC_TRANSACTION_MASK]);
+
+		if (ta->inUse)
+			continue;
+
+		ta->tag = message->tag;
+		ta->inUse = TRUE;
+		ta->completed = FALSE;
+		ta->deadline = GetTickCount() + PBRPC_TIMEOUT;
+		ta->callback = callback;
+		ta->callbackArgs = args;
+		ta->hasResponse = FALSE;
+		ta->errorReason = 0;
+		ResetEvent(ta->Event);
+
+		LeaveCriticalSection(&(context->transactionsLock));
+		return ta;
+	}
+
+	LeaveCriticalSection(&(context->transactionsLock));
+	return NULL;
+}
+
+/* must be called with transactionsLock held */
+static void pbrpc_transaction_set_response(pbRPCTransaction *ta, Freerds__Pbrpc__RPCBase *response)
+{
+	pbRPCPayload *pl = &(ta->response);
+
+	ZeroMemory(pl, sizeof(pbRPCPayload));
+	pl->arena = &(ta->arena);
+	pl->transaction = ta;
+
+	pl->dataLen = response->payload.len;
+	pl->data = pbrpc_arena_alloc(&(ta->arena), pl->dataLen + 1);
+	if (pl->data && pl->dataLen)
+		CopyMemory(pl->data, response->payload.data, pl->dataLen);
+
+	if (response->errordescription)
+	{
+		pl->errorDescription = pbrpc_arena_alloc(&(ta->arena), strlen(response->errordescription) + 1);
+		if (pl->errorDescription)
+			strcpy(pl->errorDescription, response->errordescription);
+	}
+
+	ta->status = response->status;
+	ta->hasResponse = (pl->data != NULL);
+}
+
+/* must be called with transactionsLock held */
+static void pbrpc_transaction_free_slot(pbRPCTransaction *ta)
+{
+	ta->inUse = FALSE;
+	ta->hasResponse = FALSE;
+	pbrpc_arena_reset(&(ta->arena));
+}
+
+/* gives back a transaction whose response the caller was handed */
+void pbrpc_transaction_release(pbRPCTransaction *ta)
+{
+	pbRPCContext *context = ta->context;
+
+	EnterCriticalSection(&(context->transactionsLock));
+	pbrpc_transaction_free_slot(ta);
+	LeaveCriticalSection(&(context->transactionsLock));
+}
+
+/**
+ * Hands a response (or, without one, errorReason) to the call waiting on tag.
+ * The response is copied into the transaction arena, so the caller can let
+ * go of it. Returns FALSE if nobody is waiting anymore.
+ */
+static BOOL pbrpc_transaction_complete(pbRPCContext *context, UINT32 tag,
+		Freerds__Pbrpc__RPCBase *response, UINT32 errorReason)
+{
+	UINT32 reason;
+	void *args;
+	pbRPCPayload *payload = NULL;
+	pbRPCResponseCallback callback;
+	pbRPCTransaction *ta;
+
+	EnterCriticalSection(&(context->transactionsLock));
+
+	ta = pbrpc_transaction_get(context, tag);
+
+	if (!ta || ta->completed)
+	{
+		LeaveCriticalSection(&(context->transactionsLock));
+		return FALSE;
+	}
+
+	if (response)
+		pbrpc_transaction_set_response(ta, response);
+
+	ta->errorReason = errorReason;
+	ta->completed = TRUE;
+
+	if (!ta->callback)
+	{
+		/* the caller frees the slot once it picked up the result */
+		SetEvent(ta->Event);
+		LeaveCriticalSection(&(context->transactionsLock));
+		return TRUE;
+	}
+
+	callback = ta->callback;
+	args = ta->callbackArgs;
+
+	if (ta->hasResponse)
+	{
+		/* the callback releases the slot along with the payload */
+		payload = &(ta->response);
+		reason = ta->status;
+	}
+	else
+	{
+		reason = errorReason ? errorReason : PBRPC_FAILED;
+		pbrpc_transaction_free_slot(ta);
+	}
+
+	LeaveCriticalSection(&(context->transactionsLock));
+
+	callback(reason, payload, args);
+	return TRUE;
+}
+
+/* fails every call in flight whose deadline passed, or all of them if now is 0 */
+static void pbrpc_transaction_expire(pbRPCContext *context, DWORD now, UINT32 errorReason)
+{
+	int i;
+	UINT32 tag;
+	BOOL expired;
+	pbRPCTransaction *ta;
+
+	for (i = 0; i < PBRPC_MAX_TRANSACTIONS; i++)
+	{
+		ta = &(context->transactions[i]);
+
+		EnterCriticalSection(&(context->transactionsLock));
+		tag = ta->tag;
+		expired = ta->inUse && !ta->completed;
+
+		/* synchronous calls time out on their own */
+		if (now && (!ta->callback || ((INT32) (now - ta->deadline) < 0)))
+			expired = FALSE;
+
+		LeaveCriticalSection(&(context->transactionsLock));
+
+		if (expired)
+			pbrpc_transaction_complete(context, tag, NULL, errorReason);
+	}
 }
 
 pbRPCContext *pbrpc_server_new(pbRPCTransportContext *transport)
 {
+	int i;
 	pbRPCContext *context = malloc(sizeof(pbRPCContext));
 	ZeroMemory(context, sizeof(pbRPCContext));
 	context->stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	context->connectedEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 	context->transport = transport;
-	context->transactions = ListDictionary_New(TRUE);
-	context->transactions->object.fnObjectFree = list_dictionary_item_free;
+	context->transactions = calloc(PBRPC_MAX_TRANSACTIONS, sizeof(pbRPCTransaction));
+	for (i = 0; i < PBRPC_MAX_TRANSACTIONS; i++)
+	{
+		context->transactions[i].context = context;
+		context->transactions[i].Event = CreateEvent(NULL, TRUE, FALSE, NULL);
+		pbrpc_arena_init(&(context->transactions[i].arena));
+	}
+	InitializeCriticalSectionAndSpinCount(&(context->transactionsLock), 4000);
 	context->writeQueue = Queue_New(TRUE, -1, -1);
 	context->writeQueue->object.fnObjectFree = queu_item_free;
+	context->streamPool = Queue_New(TRUE, -1, -1);
+	context->streamPool->object.fnObjectFree = queu_item_free;
+	context->inStream = Stream_New(NULL, 1024);
+	context->outStream = Stream_New(NULL, 1024);
+	context->arena = malloc(sizeof(pbRPCArena));
+	pbrpc_arena_init(context->arena);
 	return context;
 }
 
 void pbrpc_server_free(pbRPCContext *context)
 {
+	int i;
 	if (!context)
 		return;
 	CloseHandle(context->stopEvent);
+	CloseHandle(context->connectedEvent);
 	CloseHandle(context->thread);
-	ListDictionary_Free(context->transactions);
+	for (i = 0; i < PBRPC_MAX_TRANSACTIONS; i++)
+	{
+		CloseHandle(context->transactions[i].Event);
+		pbrpc_arena_uninit(&(context->transactions[i].arena));
+	}
+	free(context->transactions);
+	DeleteCriticalSection(&(context->transactionsLock));
 	Queue_Free(context->writeQueue);
+	Queue_Free(context->streamPool);
+	Stream_Free(context->inStream, TRUE);
+	Stream_Free(context->outStream, TRUE);
+	pbrpc_arena_uninit(context->arena);
+	free(context->arena);
 	free(context);
 }
 
 // errors < 0 transport erros, errors > 0 pb errors
-int pbrpc_receive_message(pbRPCContext *context, char **msg, int *msgLen)
+int pbrpc_receive_message(pbRPCContext *context, UINT32 *msgLen)
 {
-  UINT32  msgLenWire, len;
-  char *recvbuffer;
-  int ret = 0;
-
-  ret = context->transport->read(context->transport, (char *)&msgLenWire, 4);
-  if (ret < 0)
-	  return ret;
-
-  len = ntohl(msgLenWire);
-  *msgLen = len;
-  recvbuffer = malloc(len);
-  ret = context->transport->read(context->transport, recvbuffer, len);
-  if (ret < 0)
-  {
-	  free(recvbuffer);
-	  return ret;
-  }
-  *msg = recvbuffer;
-  return ret;
+	UINT32 msgLenWire, len;
+	wStream *s = context->inStream;
+	int ret = 0;
+
+	ret = context->transport->read(context->transport, (char *)&msgLenWire, 4);
+	if (ret < 0)
+		return ret;
+
+	len = ntohl(msgLenWire);
+	if (len > PBRPC_MAX_MESSAGE_LENGTH)
+		return -1;
+
+	Stream_SetPosition(s, 0);
+	Stream_EnsureCapacity(s, len);
+	ret = context->transport->read(context->transport, (char *)Stream_Buffer(s), len);
+	if (ret < 0)
+		return ret;
+	*msgLen = len;
+	return ret;
 }
 
-int pbrpc_send_message(pbRPCContext *context, char *msg, UINT32 msgLen)
+int pbrpc_send_message(pbRPCContext *context, wStream *s)
 {
-	UINT32 msgLenWire;
 	int ret;
 
-	msgLenWire = htonl(msgLen);
-	ret = context->transport->write(context->transport, (char *)&msgLenWire, 4);
-	if (ret < 0)
-		return ret;
-	ret = context->transport->write(context->transport, msg, msgLen);
+	ret = context->transport->write(context->transport, (char *)Stream_Buffer(s), Stream_GetPosition(s));
 	if (ret < 0)
 		return ret;
 	return 0;
@@ -129,34 +378,23 @@ int pbrpc_send_message(pbRPCContext *context, char *msg, UINT32 msgLen)
 
 static int pbrpc_process_response(pbRPCContext *context, Freerds__Pbrpc__RPCBase *rpcmessage)
 {
-	pbRPCTransaction *ta = ListDictionary_GetItemValue(context->transactions, (void *)((UINT_PTR)rpcmessage->tag));
-	if (!ta)
+	if (!pbrpc_transaction_complete(context, rpcmessage->tag, rpcmessage, 0))
 	{
 		fprintf(stderr,"unsoliciated response - ignoring (tag %d)\n", rpcmessage->tag);
-		freerds__pbrpc__rpcbase__free_unpacked(rpcmessage, NULL);
 		return 1;
 	}
-	ListDictionary_Remove(context->transactions, (void *)((UINT_PTR)rpcmessage->tag));
-	ta->response = rpcmessage;
-	SetEvent(ta->Event);
 	return 0;
 }
 
 int pbrpc_process_message_out(pbRPCContext *context, Freerds__Pbrpc__RPCBase *msg)
 {
-	char msgLen = freerds__pbrpc__rpcbase__get_packed_size(msg);
-	char *buf = malloc(msgLen);
-	int ret;
-	ret = freerds__pbrpc__rpcbase__pack(msg, (uint8_t *)buf);
+	wStream *s = context->outStream;
+
+	Stream_SetPosition(s, 0);
 	// packing failed..
-	if (ret != msgLen)
-	{
-		free(buf);
+	if (!pbrpc_message_pack(s, msg))
 		return 1;
-	}
-	ret = pbrpc_send_message(context, buf, msgLen);
-	free(buf);
-	return ret;
+	return pbrpc_send_message(context, s);
 }
 
 pbRPCCallback pbrpc_callback_find(pbRPCContext *context, UINT32 type)
@@ -176,72 +414,68 @@ pbRPCCallback pbrpc_callback_find(pbRPCContext *context, UINT32 type)
 }
 
 
-static pbRPCPayload* pbrpc_fill_payload(Freerds__Pbrpc__RPCBase *message)
-{
-	pbRPCPayload *pl = pbrpc_payload_new();
-	pl->data = (char *)(message->payload.data);
-	pl->dataLen = message->payload.len;
-	pl->errorDescription = message->errordescription;
-	return pl;
-}
-
 static int pbrpc_process_request(pbRPCContext *context, Freerds__Pbrpc__RPCBase *rpcmessage)
 {
 	int ret = 0;
 	pbRPCCallback cb;
-	pbRPCPayload *request = NULL;
+	pbRPCPayload request;
 	pbRPCPayload *response = NULL;
-	Freerds__Pbrpc__RPCBase *pbresponse = pbrpc_message_new();
-	pbrpc_prepare_response(pbresponse, rpcmessage->tag);
-	pbresponse->msgtype = rpcmessage->msgtype;
+	Freerds__Pbrpc__RPCBase pbresponse;
+	freerds__pbrpc__rpcbase__init(&pbresponse);
+	pbrpc_prepare_response(&pbresponse, rpcmessage->tag);
+	pbresponse.msgtype = rpcmessage->msgtype;
 	cb = pbrpc_callback_find(context, rpcmessage->msgtype);
 	if (NULL == cb)
 	{
-		pbresponse->status = FREERDS__PBRPC__RPCBASE__RPCSTATUS__NOTFOUND;
-		ret = pbrpc_process_message_out(context, pbresponse);
-		pbrpc_message_free(pbresponse, TRUE);
-		freerds__pbrpc__rpcbase__free_unpacked(rpcmessage, NULL);
-		return ret;
+		pbresponse.status = FREERDS__PBRPC__RPCBASE__RPCSTATUS__NOTFOUND;
+		return pbrpc_process_message_out(context, &pbresponse);
 	}
-	request = pbrpc_fill_payload(rpcmessage);
-	ret = cb(request, &response);
-	free(request);
-	freerds__pbrpc__rpcbase__free_unpacked(rpcmessage, NULL);
-	pbresponse->status = ret;
+	/* the request stays in the context arena while the callback runs */
+	ZeroMemory(&request, sizeof(pbRPCPayload));
+	request.data = (char *)(rpcmessage->payload.data);
+	request.dataLen = rpcmessage->payload.len;
+	request.errorDescription = rpcmessage->errordescription;
+	request.arena = context->arena;
+	ret = cb(&request, &response);
+	pbresponse.status = ret;
+	if (!response)
+		return pbrpc_process_message_out(context, &pbresponse);
 	if (ret == 0)
 	{
-		pbresponse->has_payload = 1;
-		pbresponse->payload.data = (unsigned char *)response->data;
-		pbresponse->payload.len = response->dataLen;
+		pbresponse.has_payload = 1;
+		pbresponse.payload.data = (unsigned char *)response->data;
+		pbresponse.payload.len = response->dataLen;
 	}
 	else
 	{
-		pbresponse->errordescription = response->errorDescription;
+		pbresponse.errordescription = response->errorDescription;
 	}
-	ret = pbrpc_process_message_out(context, pbresponse);
+	ret = pbrpc_process_message_out(context, &pbresponse);
 	pbrpc_free_payload(response);
-	pbrpc_message_free(pbresponse, FALSE);
 	return ret;
 }
 
 int pbrpc_process_message_in(pbRPCContext *context)
 {
-	char *msg;
-	int msgLen;
+	UINT32 msgLen;
 	int ret = 0;
 	Freerds__Pbrpc__RPCBase *rpcmessage;
-	if (pbrpc_receive_message(context, &msg, &msgLen) < 0)
+	if (pbrpc_receive_message(context, &msgLen) < 0)
 		return -1;
 
-	rpcmessage = freerds__pbrpc__rpcbase__unpack(NULL, msgLen, (uint8_t *)msg);
-	free(msg);
+	rpcmessage = freerds__pbrpc__rpcbase__unpack(&(context->arena->allocator), msgLen,
+			(uint8_t *)Stream_Buffer(context->inStream));
 	if (rpcmessage == NULL)
+	{
+		pbrpc_arena_reset(context->arena);
 		return 1;
+	}
 
 	if(rpcmessage->isresponse)
 		ret = pbrpc_process_response(context, rpcmessage);
 	else
 		ret = pbrpc_process_request(context, rpcmessage);
+	pbrpc_arena_reset(context->arena);
 	return ret;
 }
 
@@ -254,36 +488,45 @@ static int pbrpc_transport_open(pbRPCContext *context)
 		{
 			return 0;
 		}
-		if (WaitForSingleObject(context->stopEvent, 0) == WAIT_OBJECT_0)
+		if (WaitForSingleObject(context->stopEvent, sleepInterval) == WAIT_OBJECT_0)
 		{
 			return -1;
 		}
-		Sleep(sleepInterval);
 	}
 	return 0;
 }
 
 static void pbrpc_reconnect(pbRPCContext *context)
 {
-	pbRPCTransaction *ta = NULL;
 	context->isConnected = FALSE;
+	ResetEvent(context->connectedEvent);
 	context->transport->close(context->transport);
 	Queue_Clear(context->writeQueue);
-	while ((ta = ListDictionary_Remove_Head(context->transactions)))
-	{
-		ta->errorReason  = PBRCP_TRANSPORT_ERROR;
-		SetEvent(ta->Event);
-	}
+	pbrpc_transaction_expire(context, 0, PBRCP_TRANSPORT_ERROR);
 	if (0 != pbrpc_transport_open(context))
 		return;
+	if (context->reconnectCallback)
+		context->reconnectCallback();
 	context->isConnected = TRUE;
+	SetEvent(context->connectedEvent);
 }
 
 static void pbrpc_mainloop(pbRPCContext *context)
 {
 	int status;
 	DWORD nCount;
+	DWORD now;
+	DWORD expireTime;
 	HANDLE events[32];
+
+	/* connect in the background, callers wait on connectedEvent */
+	if (pbrpc_transport_open(context) < 0)
+		return;
+	context->isConnected = TRUE;
+	SetEvent(context->connectedEvent);
+	fprintf(stderr, "connected to session manager\n");
+	expireTime = GetTickCount() + PBRPC_EXPIRE_INTERVAL;
+
 	while (1)
 	{
 		nCount = 0;
@@ -291,7 +534,7 @@ static void pbrpc_mainloop(pbRPCContext *context)
 		events[nCount++] = context->stopEvent;
 		events[nCount++] = Queue_Event(context->writeQueue);
 		events[nCount++] = thandle;
-		status = WaitForMultipleObjects(nCount, events, FALSE, INFINITE);
+		status = WaitForMultipleObjects(nCount, events, FALSE, PBRPC_EXPIRE_INTERVAL);
 		if (status == WAIT_FAILED)
 		{
 			continue;
@@ -301,6 +544,13 @@ static void pbrpc_mainloop(pbRPCContext *context)
 			break;
 		}
 
+		now = GetTickCount();
+		if ((INT32) (now - expireTime) >= 0)
+		{
+			pbrpc_transaction_expire(context, now, PBRCP_CALL_TIMEOUT);
+			expireTime = now + PBRPC_EXPIRE_INTERVAL;
+		}
+
 		if (WaitForSingleObject(thandle, 0) == WAIT_OBJECT_0)
 		{
 			status = pbrpc_process_message_in(context);
@@ -314,11 +564,11 @@ static void pbrpc_mainloop(pbRPCContext *context)
 
 		if (WaitForSingleObject(Queue_Event(context->writeQueue), 0) == WAIT_OBJECT_0)
 		{
-			Freerds__Pbrpc__RPCBase *msg = NULL;
-			while((msg = Queue_Dequeue(context->writeQueue)))
+			wStream *s = NULL;
+			while((s = Queue_Dequeue(context->writeQueue)))
 			{
-				status = pbrpc_process_message_out(context, msg);
-				pbrpc_message_free(msg, FALSE);
+				status = pbrpc_send_message(context, s);
+				pbrpc_stream_release(context, s);
 			}
 			if (status < 0)
 			{
@@ -332,9 +582,6 @@ static void pbrpc_mainloop(pbRPCContext *context)
 
 int pbrpc_server_start(pbRPCContext *context)
 {
-	if (pbrpc_transport_open(context) < 0)
-		return -1;
-	context->isConnected = TRUE;
 	context->thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) pbrpc_mainloop, context, 0, NULL);
 	return 0;
 }
@@ -345,69 +592,112 @@ int pbrpc_server_stop(pbRPCContext *context)
 	SetEvent(context->stopEvent);
 	WaitForSingleObject(context->thread, INFINITE);
 	context->transport->close(context->transport);
+	Queue_Clear(context->writeQueue);
+	pbrpc_transaction_expire(context, 0, PBRCP_TRANSPORT_ERROR);
 	return 0;
 }
 
+/**
+ * Claims a transaction for the request and queues it, packed on the calling
+ * thread so the caller may free its payload as soon as this returns.
+ */
+static pbRPCTransaction *pbrpc_request_queue(pbRPCContext *context, UINT32 type, pbRPCPayload *request,
+		pbRPCResponseCallback callback, void *args)
+{
+	wStream *s;
+	pbRPCTransaction *ta;
+	Freerds__Pbrpc__RPCBase message;
+
+	freerds__pbrpc__rpcbase__init(&message);
+	message.payload.data = (unsigned char *)request->data;
+	message.payload.len = request->dataLen;
+	message.has_payload = 1;
+	message.msgtype = type;
+
+	ta = pbrpc_transaction_alloc(context, &message, callback, args);
+	if (!ta)
+		return NULL;
+
+	s = pbrpc_stream_take(context, 4 + request->dataLen + 32);
+	if (!s || !pbrpc_message_pack(s, &message))
+	{
+		if (s)
+			pbrpc_stream_release(context, s);
+		pbrpc_transaction_release(ta);
+		return NULL;
+	}
+
+	Queue_Enqueue(context->writeQueue, s);
+	return ta;
+}
+
 int pbrpc_call_method(pbRPCContext *context, UINT32 type, pbRPCPayload *request, pbRPCPayload **response)
 {
-	Freerds__Pbrpc__RPCBase *message;
 	pbRPCTransaction *ta = NULL;
 	UINT32 ret = PBRPC_FAILED;
-	UINT32 tag;
-	DWORD wait_ret;
 	if (!context->isConnected)
 	{
-		return PBRCP_TRANSPORT_ERROR;
+		/* the link might still be coming up, give it a chance */
+		if (WaitForSingleObject(context->connectedEvent, PBRPC_TIMEOUT) != WAIT_OBJECT_0)
+			return PBRCP_TRANSPORT_ERROR;
 	}
-	message = pbrpc_message_new();
-	pbrpc_prepare_request(context, message);
-	message->payload.data = (unsigned char*)request->data;
-	message->payload.len = request->dataLen;
-	message->has_payload = 1;
-	message->msgtype = type;
-	tag = message->tag;
-
-	ta = pbrpc_transaction_new();
-	ta->Event = CreateEvent(NULL, TRUE, FALSE, NULL);
-	ListDictionary_Add(context->transactions, (void *)((UINT_PTR)(message->tag)), ta);
-	Queue_Enqueue(context->writeQueue, message);
-
-	wait_ret = WaitForSingleObject(ta->Event,PBRPC_TIMEOUT);
-	if (wait_ret != WAIT_OBJECT_0)
+	ta = pbrpc_request_queue(context, type, request, NULL, NULL);
+	if (!ta)
+		return PBRPC_FAILED;
+
+	WaitForSingleObject(ta->Event, PBRPC_TIMEOUT);
+
+	/* a response arriving after this point finds the slot released and is dropped */
+	EnterCriticalSection(&(context->transactionsLock));
+	if (!ta->completed)
+		ret = PBRCP_CALL_TIMEOUT;
+	else if (!ta->hasResponse)
+		ret = ta->errorReason ? ta->errorReason : PBRPC_FAILED;
+	else
+		ret = ta->status;
+
+	if (ret == 0)
 	{
-		if(!ListDictionary_Remove(context->transactions, (void *)((UINT_PTR)(tag))))
-		{
-			// special case - timeout occurred but request is already processing
-			WaitForSingleObject(ta->Event,INFINITE);
-		}
-		else
-		{
-			CloseHandle(ta->Event);
-			pbrpc_transaction_free(ta);
-			return PBRCP_CALL_TIMEOUT;
-		}
+		/* the slot is released along with the payload */
+		*response = &(ta->response);
 	}
-
-	CloseHandle(ta->Event);
-	message = ta->response;
-	if (!message)
+	else
 	{
-		if (ta->errorReason)
-
-			ret = ta->errorReason;
-		else
-			ret = PBRPC_FAILED;
-		pbrpc_transaction_free(ta);
-		return ret;
+		pbrpc_transaction_free_slot(ta);
 	}
-	*response = pbrpc_fill_payload(message);
-	ret = message->status;
-	pbrpc_transaction_free(ta);
-	pbrpc_message_free(message, FALSE);
+	LeaveCriticalSection(&(context->transactionsLock));
+
 	return ret;
 }
 
+/**
+ * Queues a call and returns without waiting for it, any number of calls can
+ * be pipelined this way up to PBRPC_MAX_TRANSACTIONS. callback is invoked
+ * exactly once if PBRPC_SUCCESS is returned: with the response, or with
+ * PBRCP_CALL_TIMEOUT or PBRCP_TRANSPORT_ERROR if none arrives. Unlike the
+ * synchronous call it doesn't wait for the link to come up.
+ */
+int pbrpc_call_method_async(pbRPCContext *context, UINT32 type, pbRPCPayload *request,
+		pbRPCResponseCallback callback, void *args)
+{
+	if (!callback)
+		return PBRPC_FAILED;
+
+	if (!context->isConnected)
+		return PBRCP_TRANSPORT_ERROR;
+
+	if (!pbrpc_request_queue(context, type, request, callback, args))
+		return PBRPC_FAILED;
+
+	return PBRPC_SUCCESS;
+}
+
 void pbrpc_register_methods(pbRPCContext *context, pbRPCMethod *methods)
 {
 	context->methods = methods;
 }
+
+void pbrpc_register_reconnect_callback(pbRPCContext *context, pbRPCReconnectCallback callback)
+{
+	context->reconnectCallback = callback;
+}
@@ -20,24 +20,51 @@
 #define _PBRPC_H
 #include <winpr/synch.h>
 #include <winpr/wtypes.h>
+#include <winpr/stream.h>
 #include <winpr/collections.h>
 
 #include "pbrpc_transport.h"
 
 #define PBRPC_TIMEOUT 10000
 
+/* anything longer means the stream is out of sync */
+#define PBRPC_MAX_MESSAGE_LENGTH 0x4000000
+
+/* send buffers kept around for reuse */
+#define PBRPC_STREAM_POOL_SIZE 32
+#define PBRPC_STREAM_POOL_MAX_CAPACITY 0x10000
+
+/* calls in flight at once, must be a power of two */
+#define PBRPC_MAX_TRANSACTIONS 256
+
 typedef struct pbrpc_method pbRPCMethod;
+typedef struct pbrpc_transaction pbRPCTransaction;
+typedef struct pbrpc_arena pbRPCArena;
+
+/**
+ * Invoked from the pbrpc thread once the transport has been reopened after a
+ * failure, before any call can go out on the new connection. Anything the
+ * peer might have told us in the meantime has been lost.
+ */
+typedef void (*pbRPCReconnectCallback)(void);
 
 struct  pbrpc_context
 {
 	HANDLE stopEvent;
+	HANDLE connectedEvent;
 	HANDLE thread;
 	pbRPCTransportContext *transport;
-	wListDictionary *transactions;
+	pbRPCTransaction *transactions;
+	CRITICAL_SECTION transactionsLock;
 	wQueue *writeQueue;
+	wQueue *streamPool;
+	wStream *inStream;
+	wStream *outStream;
+	pbRPCArena *arena;
 	BOOL isConnected;
 	LONG tag;
 	pbRPCMethod *methods;
+	pbRPCReconnectCallback reconnectCallback;
 };
 typedef struct pbrpc_context pbRPCContext;
 
@@ -45,11 +72,22 @@ struct pbrpc_payload {
 	char *data;
 	UINT32 dataLen;
 	char *errorDescription;
+	pbRPCArena *arena;
+	pbRPCTransaction *transaction;
 };
 typedef struct pbrpc_payload pbRPCPayload;
 
 typedef int (*pbRPCCallback)(pbRPCPayload *pbrequest,pbRPCPayload **pbresponse);
 
+/**
+ * Completion of an asynchronous call, invoked from the pbrpc thread so it
+ * must not block. reason is the call status as pbrpc_call_method would have
+ * returned it, the callback owns response (which may be NULL) and releases
+ * it with pbrpc_free_payload. The response lives in the transaction, which
+ * stays busy until then.
+ */
+typedef void (*pbRPCResponseCallback)(UINT32 reason, pbRPCPayload *response, void *args);
+
 struct pbrpc_method {
 	UINT32 type;
 	pbRPCCallback cb;
@@ -71,6 +109,8 @@ void pbrpc_server_free(pbRPCContext *context);
 int pbrpc_server_start(pbRPCContext *context);
 int pbrpc_server_stop(pbRPCContext *context);
 int pbrpc_call_method(pbRPCContext *context, UINT32 type, pbRPCPayload *request, pbRPCPayload **response);
+int pbrpc_call_method_async(pbRPCContext *context, UINT32 type, pbRPCPayload *request, pbRPCResponseCallback callback, void *args);
 void pbrpc_register_methods(pbRPCContext *context, pbRPCMethod *methods);
+void pbrpc_register_reconnect_callback(pbRPCContext *context, pbRPCReconnectCallback callback);
 
 #endif //_PBRPC_H
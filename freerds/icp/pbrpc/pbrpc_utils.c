@@ -88,8 +88,106 @@ void pbrpc_free_payload(pbRPCPayload *response)
 {
 	if (!response)
 		return;
+	/* responses to our own calls live in their transaction */
+	if (response->transaction)
+	{
+		pbrpc_transaction_release(response->transaction);
+		return;
+	}
 	free(response->data);
 	if (response->errorDescription)
 		free(response->errorDescription);
 	free(response);
 }
+
+/* allocator to unpack a payload with, NULL (malloc) unless it lives in an arena */
+ProtobufCAllocator *pbrpc_payload_allocator(pbRPCPayload *payload)
+{
+	if (!payload || !payload->arena)
+		return NULL;
+	return &(payload->arena->allocator);
+}
+
+#define PBRPC_ARENA_ALIGNMENT 8
+
+static void *pbrpc_arena_allocator_alloc(void *allocator_data, size_t size)
+{
+	return pbrpc_arena_alloc((pbRPCArena *)allocator_data, size);
+}
+
+static void pbrpc_arena_allocator_free(void *allocator_data, void *pointer)
+{
+	/* released with the arena */
+}
+
+void pbrpc_arena_init(pbRPCArena *arena)
+{
+	ZeroMemory(arena, sizeof(pbRPCArena));
+	arena->allocator.alloc = pbrpc_arena_allocator_alloc;
+	arena->allocator.free = pbrpc_arena_allocator_free;
+#if !defined(PROTOBUF_C_VERSION_NUMBER) || (PROTOBUF_C_VERSION_NUMBER < 1000000)
+	arena->allocator.tmp_alloc = pbrpc_arena_allocator_alloc;
+	arena->allocator.max_alloca = 0;
+#endif
+	arena->allocator.allocator_data = arena;
+}
+
+void pbrpc_arena_uninit(pbRPCArena *arena)
+{
+	pbrpc_arena_reset(arena);
+	free(arena->buffer);
+	arena->buffer = NULL;
+	arena->size = 0;
+}
+
+void *pbrpc_arena_alloc(pbRPCArena *arena, size_t size)
+{
+	void *ptr;
+	void **block;
+
+	size = (size + PBRPC_ARENA_ALIGNMENT - 1) & ~((size_t)PBRPC_ARENA_ALIGNMENT - 1);
+
+	if (arena->size - arena->offset >= size)
+	{
+		ptr = arena->buffer + arena->offset;
+		arena->offset += size;
+		return ptr;
+	}
+
+	block = malloc(sizeof(void *) + size);
+	if (!block)
+		return NULL;
+	*block = arena->blocks;
+	arena->blocks = block;
+	arena->overflow += size;
+	return block + 1;
+}
+
+void pbrpc_arena_reset(pbRPCArena *arena)
+{
+	size_t size;
+	void **block;
+
+	while ((block = arena->blocks))
+	{
+		arena->blocks = *block;
+		free(block);
+	}
+
+	if (arena->overflow && (arena->size < PBRPC_ARENA_MAX_SIZE))
+	{
+		size = arena->offset + arena->overflow;
+		size = (size + 0xFF) & ~((size_t)0xFF);
+		if (size < arena->size * 2)
+			size = arena->size * 2;
+		if (size > PBRPC_ARENA_MAX_SIZE)
+			size = PBRPC_ARENA_MAX_SIZE;
+
+		free(arena->buffer);
+		arena->buffer = malloc(size);
+		arena->size = arena->buffer ? size : 0;
+	}
+
+	arena->overflow = 0;
+	arena->offset = 0;
+}
@@ -22,6 +22,25 @@
 #include "pbrpc.h"
 #include "pbRPC.pb-c.h"
 
+/* arenas start empty and grow to what a call needed, up to this size */
+#define PBRPC_ARENA_MAX_SIZE 0x10000
+
+/**
+ * Bump allocator handed to protobuf-c. Nothing is freed individually, a reset
+ * releases everything at once. Allocations that don't fit are taken from the
+ * heap and make the next reset grow the arena, so a steady stream of similar
+ * calls stops allocating after the first one.
+ */
+struct pbrpc_arena
+{
+	ProtobufCAllocator allocator;
+	BYTE *buffer;
+	size_t size;
+	size_t offset;
+	size_t overflow;
+	void *blocks;
+};
+
 DWORD pbrpc_getTag(pbRPCContext *context);
 Freerds__Pbrpc__RPCBase *pbrpc_message_new();
 void pbrpc_message_free(Freerds__Pbrpc__RPCBase *msg, BOOL freePayload);
@@ -30,5 +49,13 @@ void pbrpc_prepare_response(Freerds__Pbrpc__RPCBase *msg, UINT32 tag);
 void pbrpc_prepare_error(Freerds__Pbrpc__RPCBase *msg, UINT32 tag, char *error);
 pbRPCPayload *pbrpc_payload_new();
 void pbrpc_free_payload(pbRPCPayload *response);
+ProtobufCAllocator *pbrpc_payload_allocator(pbRPCPayload *payload);
+
+void pbrpc_arena_init(pbRPCArena *arena);
+void pbrpc_arena_uninit(pbRPCArena *arena);
+void *pbrpc_arena_alloc(pbRPCArena *arena, size_t size);
+void pbrpc_arena_reset(pbRPCArena *arena);
+
+void pbrpc_transaction_release(pbRPCTransaction *ta);
 
 #endif // _PBRPC_UTILS_H
@@ -0,0 +1,323 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * FreeRDS module connector capture
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <winpr/crt.h>
+#include <winpr/path.h>
+#include <winpr/synch.h>
+#include <winpr/sysinfo.h>
+
+#include <freerds/freerds.h>
+
+#define RDS_CAPTURE_MAX_RECORD_LENGTH	0x10000000
+
+struct rds_capture
+{
+	FILE* fp;
+	DWORD startTime;
+	BYTE* buffer;
+	UINT32 bufferSize;
+	CRITICAL_SECTION lock;
+};
+
+static rdsCapture* freerds_capture_create(FILE* fp)
+{
+	rdsCapture* capture;
+
+	capture = (rdsCapture*) malloc(sizeof(rdsCapture));
+	ZeroMemory(capture, sizeof(rdsCapture));
+
+	capture->fp = fp;
+	capture->startTime = GetTickCount();
+
+	InitializeCriticalSectionAndSpinCount(&(capture->lock), 4000);
+
+	return capture;
+}
+
+/**
+ * Creates a capture file for writing. The file holds everything typed in
+ * the session, it is only readable by its owner and never replaces an
+ * existing file or follows a link planted in its place.
+ */
+
+rdsCapture* freerds_capture_new(const char* filename, DWORD sessionId)
+{
+	int fd;
+	FILE* fp;
+	wStream* s;
+	BYTE header[RDS_CAPTURE_HEADER_LENGTH];
+
+	fd = open(filename, O_CREAT | O_EXCL | O_WRONLY | O_NOFOLLOW | O_CLOEXEC, 0600);
+
+	if (fd < 0)
+		return NULL;
+
+	fp = fdopen(fd, "wb");
+
+	if (!fp)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	s = Stream_New(header, RDS_CAPTURE_HEADER_LENGTH);
+	Stream_Write_UINT32(s, RDS_CAPTURE_MAGIC);
+	Stream_Write_UINT32(s, RDS_CAPTURE_VERSION);
+	Stream_Write_UINT32(s, sessionId);
+	Stream_Write_UINT32(s, 0);
+	Stream_Free(s, FALSE);
+
+	if (fwrite(header, RDS_CAPTURE_HEADER_LENGTH, 1, fp) != 1)
+	{
+		fclose(fp);
+		return NULL;
+	}
+
+	return freerds_capture_create(fp);
+}
+
+/**
+ * Opens an existing capture file for reading.
+ */
+
+rdsCapture* freerds_capture_open(const char* filename, DWORD* sessionId)
+{
+	FILE* fp;
+	wStream* s;
+	UINT32 magic;
+	UINT32 version;
+	UINT32 session;
+	BYTE header[RDS_CAPTURE_HEADER_LENGTH];
+
+	fp = fopen(filename, "rb");
+
+	if (!fp)
+		return NULL;
+
+	if (fread(header, RDS_CAPTURE_HEADER_LENGTH, 1, fp) != 1)
+	{
+		fclose(fp);
+		return NULL;
+	}
+
+	s = Stream_New(header, RDS_CAPTURE_HEADER_LENGTH);
+	Stream_Read_UINT32(s, magic);
+	Stream_Read_UINT32(s, version);
+	Stream_Read_UINT32(s, session);
+	Stream_Free(s, FALSE);
+
+	if ((magic != RDS_CAPTURE_MAGIC) || (version != RDS_CAPTURE_VERSION))
+	{
+		fprintf(stderr, "freerds_capture_open: %s is not a version %d capture\n",
+				filename, RDS_CAPTURE_VERSION);
+		fclose(fp);
+		return NULL;
+	}
+
+	if (sessionId)
+		*sessionId = session;
+
+	return freerds_capture_create(fp);
+}
+
+void freerds_capture_free(rdsCapture* capture)
+{
+	if (!capture)
+		return;
+
+	fclose(capture->fp);
+	DeleteCriticalSection(&(capture->lock));
+
+	free(capture->buffer);
+	free(capture);
+}
+
+/**
+ * Starts recording the connector if FREERDS_CAPTURE_DIR is set.
+ */
+
+void freerds_capture_start(rdsModuleConnector* connector)
+{
+	char* path;
+	char filename[256];
+
+	path = getenv("FREERDS_CAPTURE_DIR");
+
+	if (!path || !path[0] || connector->Capture)
+		return;
+
+	if (!PathFileExistsA(path))
+		CreateDirectoryA(path, NULL);
+
+	sprintf_s(filename, sizeof(filename), "%s/freerds-%d-%u.rdscap",
+			path, (int) connector->SessionId, (unsigned int) GetTickCount());
+
+	connector->Capture = freerds_capture_new(filename, connector->SessionId);
+
+	if (!connector->Capture)
+	{
+		fprintf(stderr, "freerds_capture_start: failed to create %s\n", filename);
+		return;
+	}
+
+	fprintf(stderr, "freerds_capture_start: recording session %d to %s\n",
+			(int) connector->SessionId, filename);
+}
+
+static int freerds_capture_write_header(rdsCapture* capture, UINT32 type, UINT32 length)
+{
+	wStream* s;
+	BYTE header[RDS_CAPTURE_RECORD_LENGTH];
+
+	s = Stream_New(header, RDS_CAPTURE_RECORD_LENGTH);
+	Stream_Write_UINT32(s, type);
+	Stream_Write_UINT32(s, GetTickCount() - capture->startTime);
+	Stream_Write_UINT32(s, length);
+	Stream_Free(s, FALSE);
+
+	if (fwrite(header, RDS_CAPTURE_RECORD_LENGTH, 1, capture->fp) != 1)
+		return -1;
+
+	return 0;
+}
+
+int freerds_capture_write(rdsCapture* capture, UINT32 type, BYTE* data, UINT32 length)
+{
+	int status = 0;
+
+	EnterCriticalSection(&(capture->lock));
+
+	if (freerds_capture_write_header(capture, type, length) < 0)
+		status = -1;
+	else if (length && (fwrite(data, length, 1, capture->fp) != 1))
+		status = -1;
+
+	LeaveCriticalSection(&(capture->lock));
+
+	return status;
+}
+
+/**
+ * Records the area of the framebuffer posted to the encoder, rect may be
+ * empty when the server list was packed without painting anything.
+ */
+
+int freerds_capture_write_framebuffer(rdsCapture* capture, RDS_FRAMEBUFFER* framebuffer, RDS_RECT* rect)
+{
+	int y;
+	wStream* s;
+	int status = 0;
+	RDS_RECT area;
+	UINT32 rowLength;
+	BYTE header[RDS_CAPTURE_FRAMEBUFFER_LENGTH];
+
+	ZeroMemory(&area, sizeof(RDS_RECT));
+
+	if (framebuffer && framebuffer->fbAttached && rect->width && rect->height &&
+			(rect->x >= 0) && (rect->y >= 0) &&
+			((rect->x + rect->width) <= (UINT32) framebuffer->fbWidth) &&
+			((rect->y + rect->height) <= (UINT32) framebuffer->fbHeight))
+	{
+		CopyMemory(&area, rect, sizeof(RDS_RECT));
+	}
+
+	rowLength = framebuffer ? area.width * framebuffer->fbBytesPerPixel : 0;
+
+	s = Stream_New(header, RDS_CAPTURE_FRAMEBUFFER_LENGTH);
+	Stream_Write_UINT32(s, area.x);
+	Stream_Write_UINT32(s, area.y);
+	Stream_Write_UINT32(s, area.width);
+	Stream_Write_UINT32(s, area.height);
+	Stream_Write_UINT32(s, framebuffer ? framebuffer->fbBytesPerPixel : 0);
+	Stream_Free(s, FALSE);
+
+	EnterCriticalSection(&(capture->lock));
+
+	if (freerds_capture_write_header(capture, RDS_CAPTURE_FRAMEBUFFER,
+			RDS_CAPTURE_FRAMEBUFFER_LENGTH + (rowLength * area.height)) < 0)
+		status = -1;
+	else if (fwrite(header, RDS_CAPTURE_FRAMEBUFFER_LENGTH, 1, capture->fp) != 1)
+		status = -1;
+
+	for (y = 0; (status == 0) && (y < (int) area.height); y++)
+	{
+		if (fwrite(&(framebuffer->fbSharedMemory[((area.y + y) * framebuffer->fbScanline) +
+				(area.x * framebuffer->fbBytesPerPixel)]), rowLength, 1, capture->fp) != 1)
+			status = -1;
+	}
+
+	LeaveCriticalSection(&(capture->lock));
+
+	return status;
+}
+
+/**
+ * Reads the next record, its data stays valid until the next call.
+ * Returns 1 for a record, 0 at the end of the capture and -1 on error.
+ */
+
+int freerds_capture_read(rdsCapture* capture, RDS_CAPTURE_RECORD* record)
+{
+	wStream* s;
+	size_t count;
+	BYTE header[RDS_CAPTURE_RECORD_LENGTH];
+
+	count = fread(header, 1, RDS_CAPTURE_RECORD_LENGTH, capture->fp);
+
+	if (count == 0)
+		return 0;
+
+	if (count != RDS_CAPTURE_RECORD_LENGTH)
+		return -1;
+
+	s = Stream_New(header, RDS_CAPTURE_RECORD_LENGTH);
+	Stream_Read_UINT32(s, record->type);
+	Stream_Read_UINT32(s, record->timestamp);
+	Stream_Read_UINT32(s, record->length);
+	Stream_Free(s, FALSE);
+
+	if (record->length > RDS_CAPTURE_MAX_RECORD_LENGTH)
+		return -1;
+
+	if (record->length > capture->bufferSize)
+	{
+		BYTE* buffer = (BYTE*) realloc(capture->buffer, record->length);
+
+		if (!buffer)
+			return -1;
+
+		capture->buffer = buffer;
+		capture->bufferSize = record->length;
+	}
+
+	record->data = capture->buffer;
+
+	if (record->length && (fread(record->data, record->length, 1, capture->fp) != 1))
+		return -1;
+
+	return 1;
+}
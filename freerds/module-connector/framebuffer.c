@@ -0,0 +1,514 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * FreeRDS module connector shared framebuffer
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <winpr/crt.h>
+
+#include <freerds/freerds.h>
+
+/**
+ * Memfd Framebuffer
+ *
+ * The module creates the framebuffer as an anonymous memfd, seals its size
+ * and passes the file descriptor to freerds over the connector. Unlike SysV
+ * segments it does not count against the kernel shm limits and goes away
+ * with the last mapping, even if either process dies.
+ *
+ * Huge pages are tried first (hugetlb, then transparent huge pages through
+ * madvise), setting FREERDS_FRAMEBUFFER_HUGE_PAGES=0 disables both.
+ */
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001
+#define MFD_ALLOW_SEALING	0x0002
+#endif
+
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB		0x0004
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		1033
+#define F_GET_SEALS		1034
+#define F_SEAL_SEAL		0x0001
+#define F_SEAL_SHRINK		0x0002
+#define F_SEAL_GROW		0x0004
+#endif
+
+#define RDS_FRAMEBUFFER_SEALS	(F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+static BOOL freerds_framebuffer_huge_pages_enabled(void)
+{
+	char* value = getenv("FREERDS_FRAMEBUFFER_HUGE_PAGES");
+
+	if (value && (strcmp(value, "0") == 0))
+		return FALSE;
+
+	return TRUE;
+}
+
+static void freerds_framebuffer_advise(BYTE* data, size_t size)
+{
+#ifdef MADV_HUGEPAGE
+	if (freerds_framebuffer_huge_pages_enabled())
+		madvise(data, size, MADV_HUGEPAGE);
+#endif
+}
+
+static int freerds_memfd_create(const char* name, unsigned int flags)
+{
+#ifdef __NR_memfd_create
+	return syscall(__NR_memfd_create, name, flags);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int freerds_framebuffer_memfd_open(size_t size, unsigned int flags, size_t* mappedSize, BYTE** data)
+{
+	int fd;
+	void* address;
+	struct stat sb;
+
+	fd = freerds_memfd_create("FreeRDS framebuffer", MFD_CLOEXEC | MFD_ALLOW_SEALING | flags);
+
+	if (fd < 0)
+		return -1;
+
+	/* hugetlbfs reports the huge page size as block size, mappings must be a multiple of it */
+	if (fstat(fd, &sb) < 0)
+		goto fail;
+
+	if (sb.st_blksize > 0)
+		size = ((size + sb.st_blksize - 1) / sb.st_blksize) * sb.st_blksize;
+
+	if (ftruncate(fd, size) < 0)
+		goto fail;
+
+	if (fcntl(fd, F_ADD_SEALS, RDS_FRAMEBUFFER_SEALS) < 0)
+		goto fail;
+
+	/* fails right away if the hugetlb pool cannot back the whole mapping */
+	address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (address == MAP_FAILED)
+		goto fail;
+
+	*mappedSize = size;
+	*data = (BYTE*) address;
+
+	return fd;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+/**
+ * Called by the module, returns the file descriptor to pass to freerds
+ * or -1 if memfd is not available, in which case SysV is used instead.
+ */
+
+int freerds_framebuffer_memfd_create(size_t size, size_t* mappedSize, BYTE** data)
+{
+	int fd = -1;
+
+	if (freerds_framebuffer_huge_pages_enabled())
+		fd = freerds_framebuffer_memfd_open(size, MFD_HUGETLB, mappedSize, data);
+
+	if (fd < 0)
+	{
+		fd = freerds_framebuffer_memfd_open(size, 0, mappedSize, data);
+
+		if (fd < 0)
+			return -1;
+
+		freerds_framebuffer_advise(*data, *mappedSize);
+	}
+
+	return fd;
+}
+
+/**
+ * Called by freerds with the file descriptor received from the module.
+ * The descriptor can be closed once mapped.
+ */
+
+BYTE* freerds_framebuffer_memfd_map(int fd, size_t size, size_t* mappedSize)
+{
+	int seals;
+	void* address;
+	struct stat sb;
+
+	/* without the shrink seal the module could truncate the file and fault us with SIGBUS */
+	seals = fcntl(fd, F_GET_SEALS);
+
+	if ((seals < 0) || ((seals & RDS_FRAMEBUFFER_SEALS) != RDS_FRAMEBUFFER_SEALS))
+	{
+		fprintf(stderr, "freerds_framebuffer_memfd_map: framebuffer is not sealed\n");
+		return NULL;
+	}
+
+	if ((fstat(fd, &sb) < 0) || (sb.st_size < (off_t) size))
+	{
+		fprintf(stderr, "freerds_framebuffer_memfd_map: framebuffer is too small\n");
+		return NULL;
+	}
+
+	address = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (address == MAP_FAILED)
+		return NULL;
+
+	*mappedSize = sb.st_size;
+	freerds_framebuffer_advise((BYTE*) address, *mappedSize);
+
+	return (BYTE*) address;
+}
+
+void freerds_framebuffer_detach(RDS_FRAMEBUFFER* framebuffer)
+{
+	if (!framebuffer->fbAttached)
+		return;
+
+	if (framebuffer->fbSegmentId == RDS_FRAMEBUFFER_SEGMENT_REMOTE)
+		free(framebuffer->fbSharedMemory);
+	else if (framebuffer->fbMappedSize)
+		munmap(framebuffer->fbSharedMemory, framebuffer->fbMappedSize);
+	else
+		shmdt(framebuffer->fbSharedMemory);
+
+	framebuffer->fbAttached = FALSE;
+	framebuffer->fbSharedMemory = NULL;
+	framebuffer->fbMappedSize = 0;
+	framebuffer->tiles = NULL;
+	framebuffer->tilesWidth = framebuffer->tilesHeight = 0;
+	framebuffer->tilesX = framebuffer->tilesY = 0;
+	framebuffer->tilesStride = 0;
+	framebuffer->tilesFlags = 0;
+}
+
+/**
+ * Dirty Tile Bitmap
+ */
+
+#define RDS_TILE_BITMAP_MAX_STRIDE	32
+
+size_t freerds_tile_bitmap_size(int width, int height)
+{
+	UINT32 tilesX = (width + RDS_TILE_SIZE - 1) / RDS_TILE_SIZE;
+	UINT32 tilesY = (height + RDS_TILE_SIZE - 1) / RDS_TILE_SIZE;
+	UINT32 stride = (tilesX + 31) / 32;
+
+	return sizeof(RDS_TILE_BITMAP) + ((stride * tilesY) * sizeof(UINT32));
+}
+
+/**
+ * Called by the module on the memory following the pixels.
+ */
+
+RDS_TILE_BITMAP* freerds_tile_bitmap_init(BYTE* data, int width, int height)
+{
+	RDS_TILE_BITMAP* tiles = (RDS_TILE_BITMAP*) data;
+
+	ZeroMemory(tiles, freerds_tile_bitmap_size(width, height));
+
+	tiles->width = width;
+	tiles->height = height;
+	tiles->tilesX = (width + RDS_TILE_SIZE - 1) / RDS_TILE_SIZE;
+	tiles->tilesY = (height + RDS_TILE_SIZE - 1) / RDS_TILE_SIZE;
+	tiles->stride = (tiles->tilesX + 31) / 32;
+
+	if (tiles->stride > RDS_TILE_BITMAP_MAX_STRIDE)
+		return NULL;
+
+	__sync_synchronize();
+	tiles->magic = RDS_TILE_BITMAP_MAGIC;
+
+	return tiles;
+}
+
+/**
+ * Called by freerds on the memory following the pixels, size is what
+ * remains of the mapping. Returns NULL if the module did not set up a bitmap.
+ *
+ * The header lives in memory the module can write at any time, so only the
+ * geometry computed here from the framebuffer size is used afterwards.
+ */
+
+RDS_TILE_BITMAP* freerds_tile_bitmap_attach(RDS_FRAMEBUFFER* framebuffer, BYTE* data, size_t size)
+{
+	UINT32 tilesX;
+	UINT32 tilesY;
+	UINT32 stride;
+	int width = framebuffer->fbWidth;
+	int height = framebuffer->fbHeight;
+	RDS_TILE_BITMAP* tiles = (RDS_TILE_BITMAP*) data;
+
+	framebuffer->tiles = NULL;
+
+	if ((width < 1) || (height < 1))
+		return NULL;
+
+	tilesX = (width + RDS_TILE_SIZE - 1) / RDS_TILE_SIZE;
+	tilesY = (height + RDS_TILE_SIZE - 1) / RDS_TILE_SIZE;
+	stride = (tilesX + 31) / 32;
+
+	if ((stride > RDS_TILE_BITMAP_MAX_STRIDE) || (size < freerds_tile_bitmap_size(width, height)))
+		return NULL;
+
+	if ((tiles->magic != RDS_TILE_BITMAP_MAGIC) ||
+			(tiles->width != (UINT32) width) || (tiles->height != (UINT32) height))
+		return NULL;
+
+	if ((tiles->tilesX != tilesX) || (tiles->tilesY != tilesY) || (tiles->stride != stride))
+		return NULL;
+
+	framebuffer->tilesWidth = width;
+	framebuffer->tilesHeight = height;
+	framebuffer->tilesX = tilesX;
+	framebuffer->tilesY = tilesY;
+	framebuffer->tilesStride = stride;
+	framebuffer->tilesFlags = tiles->flags;
+	framebuffer->tiles = tiles;
+
+	return tiles;
+}
+
+void freerds_tile_bitmap_mark(RDS_TILE_BITMAP* tiles, int x, int y, int width, int height)
+{
+	UINT32 mask;
+	UINT32 index;
+	UINT32 tx, ty;
+	UINT32 tx1, tx2;
+	UINT32 ty1, ty2;
+	volatile UINT32* row;
+
+	if (x < 0)
+	{
+		width += x;
+		x = 0;
+	}
+
+	if (y < 0)
+	{
+		height += y;
+		y = 0;
+	}
+
+	if ((x + width) > (int) tiles->width)
+		width = tiles->width - x;
+
+	if ((y + height) > (int) tiles->height)
+		height = tiles->height - y;
+
+	if ((width < 1) || (height < 1))
+		return;
+
+	tx1 = x / RDS_TILE_SIZE;
+	tx2 = (x + width - 1) / RDS_TILE_SIZE;
+	ty1 = y / RDS_TILE_SIZE;
+	ty2 = (y + height - 1) / RDS_TILE_SIZE;
+
+	for (ty = ty1; ty <= ty2; ty++)
+	{
+		row = &(tiles->words[ty * tiles->stride]);
+
+		for (tx = tx1; tx <= tx2; tx = (index + 1) * 32)
+		{
+			index = tx / 32;
+
+			mask = 0xFFFFFFFF << (tx % 32);
+
+			if ((tx2 / 32) == index)
+				mask &= 0xFFFFFFFF >> (31 - (tx2 % 32));
+
+			/* tiles are usually already dirty, avoid bouncing the cache line when they are */
+			if ((row[index] & mask) != mask)
+				__sync_fetch_and_or(&row[index], mask);
+		}
+	}
+}
+
+/**
+ * Takes the dirty tiles, clearing them, and reports them as one rectangle
+ * per horizontal run of tiles. Returns the number of dirty tiles.
+ */
+
+int freerds_tile_bitmap_collect(RDS_FRAMEBUFFER* framebuffer, pRdsTileBitmapRect callback, void* context)
+{
+	int count = 0;
+	UINT32 index;
+	UINT32 tx, ty;
+	UINT32 start;
+	RDS_RECT rect;
+	BOOL dirty;
+	volatile UINT32* row;
+	UINT32 words[RDS_TILE_BITMAP_MAX_STRIDE];
+	RDS_TILE_BITMAP* tiles = framebuffer->tiles;
+
+	if (!tiles || (framebuffer->tilesStride > RDS_TILE_BITMAP_MAX_STRIDE))
+		return 0;
+
+	for (ty = 0; ty < framebuffer->tilesY; ty++)
+	{
+		row = &(tiles->words[ty * framebuffer->tilesStride]);
+		dirty = FALSE;
+
+		for (index = 0; index < framebuffer->tilesStride; index++)
+		{
+			words[index] = row[index] ? __sync_fetch_and_and(&row[index], 0) : 0;
+
+			if (words[index])
+				dirty = TRUE;
+		}
+
+		if (!dirty)
+			continue;
+
+		rect.y = ty * RDS_TILE_SIZE;
+		rect.height = framebuffer->tilesHeight - rect.y;
+
+		if (rect.height > RDS_TILE_SIZE)
+			rect.height = RDS_TILE_SIZE;
+
+		tx = 0;
+
+		while (tx < framebuffer->tilesX)
+		{
+			if (!(words[tx / 32] & ((UINT32) 1 << (tx % 32))))
+			{
+				tx++;
+				continue;
+			}
+
+			start = tx;
+
+			while ((tx < framebuffer->tilesX) && (words[tx / 32] & ((UINT32) 1 << (tx % 32))))
+				tx++;
+
+			count += tx - start;
+
+			rect.x = start * RDS_TILE_SIZE;
+			rect.width = (tx * RDS_TILE_SIZE) - rect.x;
+
+			if ((rect.x + rect.width) > framebuffer->tilesWidth)
+				rect.width = framebuffer->tilesWidth - rect.x;
+
+			callback(context, &rect);
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Frame Sequence Lock
+ */
+
+#define RDS_FRAME_READ_RETRIES		16
+
+/**
+ * Called by the module before copying a frame into the shared pixels.
+ */
+
+void freerds_frame_write_begin(RDS_TILE_BITMAP* tiles)
+{
+	tiles->sequence++;
+	__sync_synchronize();
+}
+
+/**
+ * Called by the module once the frame is complete, returns its sequence.
+ */
+
+UINT32 freerds_frame_write_end(RDS_TILE_BITMAP* tiles)
+{
+	__sync_synchronize();
+	tiles->sequence++;
+
+	return tiles->sequence;
+}
+
+/**
+ * Copies an area of the shared pixels to the same place in data, which has
+ * the layout of the framebuffer. Returns the number of retries, or -1 if the
+ * area kept being torn, in which case the module is still presenting a frame
+ * that marks it dirty again and the copy is only used until then.
+ */
+
+int freerds_frame_read_rect(RDS_FRAMEBUFFER* framebuffer, BYTE* data, RDS_RECT* rect)
+{
+	int y;
+	int retries;
+	size_t offset;
+	size_t length;
+	UINT32 sequence;
+	RDS_TILE_BITMAP* tiles = framebuffer->tiles;
+
+	if ((rect->x < 0) || (rect->y < 0) || (rect->width < 1) || (rect->height < 1) ||
+			((rect->x + rect->width) > framebuffer->fbWidth) ||
+			((rect->y + rect->height) > framebuffer->fbHeight))
+	{
+		return -1;
+	}
+
+	offset = ((size_t) rect->y * framebuffer->fbScanline) + (rect->x * framebuffer->fbBytesPerPixel);
+	length = rect->width * framebuffer->fbBytesPerPixel;
+
+	for (retries = 0; ; retries++)
+	{
+		sequence = tiles->sequence;
+		__sync_synchronize();
+
+		if ((sequence & 1) && (retries < RDS_FRAME_READ_RETRIES))
+		{
+			/* a frame is being presented, it is only a few rectangles long */
+			sched_yield();
+			continue;
+		}
+
+		for (y = 0; y < rect->height; y++)
+		{
+			CopyMemory(&data[offset + (y * framebuffer->fbScanline)],
+					&(framebuffer->fbSharedMemory[offset + (y * framebuffer->fbScanline)]), length);
+		}
+
+		__sync_synchronize();
+
+		if (!(sequence & 1) && (tiles->sequence == sequence))
+			return retries;
+
+		if (retries >= RDS_FRAME_READ_RETRIES)
+			return -1;
+	}
+}
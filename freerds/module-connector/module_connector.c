@@ -47,6 +47,8 @@ rdsModuleConnector* freerds_module_connector_new(rdsConnection* connection)
 
 	connector->OutboundStream = Stream_New(NULL, 8192);
 	connector->InboundStream = Stream_New(NULL, 8192);
+	InitializeCriticalSectionAndSpinCount(&(connector->OutboundLock), 4000);
+	InitializeCriticalSectionAndSpinCount(&(connector->FramebufferLock), 4000);
 
 	connector->InboundTotalLength = 0;
 	connector->InboundTotalCount = 0;
@@ -66,8 +68,19 @@ void freerds_module_connector_free(rdsModuleConnector* connector)
 	WaitForSingleObject(connector->ServerThread, INFINITE);
 	CloseHandle(connector->ServerThread);
 
+	if (connector->EncoderThread)
+	{
+		WaitForSingleObject(connector->EncoderThread, INFINITE);
+		CloseHandle(connector->EncoderThread);
+	}
+
 	Stream_Free(connector->OutboundStream, TRUE);
 	Stream_Free(connector->InboundStream, TRUE);
+	DeleteCriticalSection(&(connector->OutboundLock));
+
+	freerds_transport_close(connector);
+	freerds_framebuffer_detach(&(connector->framebuffer));
+	DeleteCriticalSection(&(connector->FramebufferLock));
 
 	CloseHandle(connector->StopEvent);
 	CloseHandle(connector->hClientPipe);
@@ -27,173 +27,339 @@
 
 #include "outbound.h"
 
+/**
+ * Client input is not written to the module pipe one message at a time:
+ * messages are appended to the outbound stream and written in a single
+ * batch by freerds_client_outbound_flush(), which the connection thread
+ * calls once it has dispatched all input received from the client.
+ *
+ * Consecutive pure pointer motion events are coalesced into the latest
+ * position. Any other message (buttons, wheel, keyboard) closes the
+ * pending motion event so that ordering is strictly preserved.
+ */
+
+int freerds_client_outbound_flush(rdsModuleConnector* connector)
+{
+	int status = 0;
+	wStream* s;
+
+	EnterCriticalSection(&(connector->OutboundLock));
+
+	s = connector->OutboundStream;
+
+	if (Stream_GetPosition(s) > 0)
+	{
+		status = freerds_transport_write(connector, Stream_Buffer(s), Stream_GetPosition(s));
+		Stream_SetPosition(s, 0);
+	}
+
+	connector->OutboundMotionPending = FALSE;
+
+	LeaveCriticalSection(&(connector->OutboundLock));
+
+	return status;
+}
+
+static wStream* freerds_client_outbound_begin(rdsModuleConnector* connector, int length)
+{
+	wStream* s;
+
+	EnterCriticalSection(&(connector->OutboundLock));
+
+	s = connector->OutboundStream;
+	Stream_EnsureRemainingCapacity(s, length);
+	connector->OutboundMotionPending = FALSE;
+
+	return s;
+}
+
+static int freerds_client_outbound_end(rdsModuleConnector* connector, BOOL flush)
+{
+	int status = 0;
+	wStream* s = connector->OutboundStream;
+
+	if (flush || (Stream_GetPosition(s) >= RDS_OUTBOUND_FLUSH_THRESHOLD))
+	{
+		status = freerds_transport_write(connector, Stream_Buffer(s), Stream_GetPosition(s));
+		Stream_SetPosition(s, 0);
+		connector->OutboundMotionPending = FALSE;
+	}
+
+	LeaveCriticalSection(&(connector->OutboundLock));
+
+	return status;
+}
+
+/**
+ * Input messages carry the sequence number of the client input
+ * they were generated from, see freerds_server_outbound_write_message.
+ */
+
+static void freerds_outbound_stamp_input(rdsModuleConnector* connector, RDS_MSG_COMMON* msg)
+{
+	if (connector->InputSequence)
+	{
+		msg->msgFlags |= RDS_MSG_FLAG_INPUT;
+		msg->inputSequence = connector->InputSequence;
+	}
+}
+
+/**
+ * Once both sides agreed on protocol version 2, messages are written
+ * in the compact encoding, see freerds_write_common_header.
+ */
+
+static void freerds_outbound_stamp_encoding(rdsModuleConnector* connector, RDS_MSG_COMMON* msg)
+{
+	if (connector->ProtocolVersion >= RDS_PROTOCOL_VERSION_2)
+		msg->msgFlags |= RDS_MSG_FLAG_COMPACT;
+}
+
 int freerds_client_outbound_synchronize_keyboard_event(rdsModuleConnector* connector, DWORD flags)
 {
 	int length;
-	int status;
 	wStream* s;
 	RDS_MSG_SYNCHRONIZE_KEYBOARD_EVENT msg;
 
 	msg.msgFlags = 0;
 	msg.type = RDS_CLIENT_SYNCHRONIZE_KEYBOARD_EVENT;
+	freerds_outbound_stamp_encoding(connector, (RDS_MSG_COMMON*) &msg);
+	freerds_outbound_stamp_input(connector, (RDS_MSG_COMMON*) &msg);
 
 	msg.flags = flags;
 
-	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
-
 	length = freerds_write_synchronize_keyboard_event(NULL, &msg);
-	freerds_write_synchronize_keyboard_event(s, &msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), length);
+	s = freerds_client_outbound_begin(connector, length);
+	freerds_write_synchronize_keyboard_event(s, &msg);
 
-	return status;
+	return freerds_client_outbound_end(connector, FALSE);
 }
 
 int freerds_client_outbound_scancode_keyboard_event(rdsModuleConnector* connector, DWORD flags, DWORD code, DWORD keyboardType)
 {
 	int length;
-	int status;
 	wStream* s;
 	RDS_MSG_SCANCODE_KEYBOARD_EVENT msg;
 
 	msg.msgFlags = 0;
 	msg.type = RDS_CLIENT_SCANCODE_KEYBOARD_EVENT;
+	freerds_outbound_stamp_encoding(connector, (RDS_MSG_COMMON*) &msg);
+	freerds_outbound_stamp_input(connector, (RDS_MSG_COMMON*) &msg);
 
 	msg.flags = flags;
 	msg.code = code;
 	msg.keyboardType = keyboardType;
 
-	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
-
 	length = freerds_write_scancode_keyboard_event(NULL, &msg);
-	freerds_write_scancode_keyboard_event(s, &msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), length);
+	s = freerds_client_outbound_begin(connector, length);
+	freerds_write_scancode_keyboard_event(s, &msg);
 
-	return status;
+	return freerds_client_outbound_end(connector, FALSE);
 }
 
 int freerds_client_outbound_virtual_keyboard_event(rdsModuleConnector* connector, DWORD flags, DWORD code)
 {
 	int length;
-	int status;
 	wStream* s;
 	RDS_MSG_VIRTUAL_KEYBOARD_EVENT msg;
 
 	msg.msgFlags = 0;
 	msg.type = RDS_CLIENT_VIRTUAL_KEYBOARD_EVENT;
+	freerds_outbound_stamp_encoding(connector, (RDS_MSG_COMMON*) &msg);
+	freerds_outbound_stamp_input(connector, (RDS_MSG_COMMON*) &msg);
 
 	msg.flags = flags;
 	msg.code = code;
 
-	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
-
 	length = freerds_write_virtual_keyboard_event(NULL, &msg);
-	freerds_write_virtual_keyboard_event(s, &msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), length);
+	s = freerds_client_outbound_begin(connector, length);
+	freerds_write_virtual_keyboard_event(s, &msg);
 
-	return status;
+	return freerds_client_outbound_end(connector, FALSE);
 }
 
 int freerds_client_outbound_unicode_keyboard_event(rdsModuleConnector* connector, DWORD flags, DWORD code)
 {
 	int length;
-	int status;
 	wStream* s;
 	RDS_MSG_UNICODE_KEYBOARD_EVENT msg;
 
 	msg.msgFlags = 0;
 	msg.type = RDS_CLIENT_UNICODE_KEYBOARD_EVENT;
+	freerds_outbound_stamp_encoding(connector, (RDS_MSG_COMMON*) &msg);
+	freerds_outbound_stamp_input(connector, (RDS_MSG_COMMON*) &msg);
 
 	msg.flags = flags;
 	msg.code = code;
 
-	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
-
 	length = freerds_write_unicode_keyboard_event(NULL, &msg);
-	freerds_write_unicode_keyboard_event(s, &msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), length);
+	s = freerds_client_outbound_begin(connector, length);
+	freerds_write_unicode_keyboard_event(s, &msg);
 
-	return status;
+	return freerds_client_outbound_end(connector, FALSE);
 }
 
 int freerds_client_outbound_mouse_event(rdsModuleConnector* connector, DWORD flags, DWORD x, DWORD y)
 {
 	int length;
-	int status;
 	wStream* s;
 	RDS_MSG_MOUSE_EVENT msg;
 
 	msg.msgFlags = 0;
 	msg.type = RDS_CLIENT_MOUSE_EVENT;
+	freerds_outbound_stamp_encoding(connector, (RDS_MSG_COMMON*) &msg);
+	freerds_outbound_stamp_input(connector, (RDS_MSG_COMMON*) &msg);
 
 	msg.flags = flags;
 	msg.x = x;
 	msg.y = y;
 
+	length = freerds_write_mouse_event(NULL, &msg);
+
+	EnterCriticalSection(&(connector->OutboundLock));
+
 	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
 
-	length = freerds_write_mouse_event(NULL, &msg);
-	freerds_write_mouse_event(s, &msg);
+	if ((flags == PTR_FLAGS_MOVE) && connector->OutboundMotionPending &&
+			(connector->OutboundMotionType == RDS_CLIENT_MOUSE_EVENT))
+	{
+		/* the pending motion event is always the last message in the stream, replace it */
+		Stream_SetPosition(s, connector->OutboundMotionOffset);
+		Stream_EnsureRemainingCapacity(s, length);
+		freerds_write_mouse_event(s, &msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), length);
+		LeaveCriticalSection(&(connector->OutboundLock));
 
-	return status;
+		return 0;
+	}
+
+	LeaveCriticalSection(&(connector->OutboundLock));
+
+	s = freerds_client_outbound_begin(connector, length);
+
+	if (flags == PTR_FLAGS_MOVE)
+	{
+		connector->OutboundMotionPending = TRUE;
+		connector->OutboundMotionType = RDS_CLIENT_MOUSE_EVENT;
+		connector->OutboundMotionOffset = Stream_GetPosition(s);
+	}
+
+	freerds_write_mouse_event(s, &msg);
+
+	return freerds_client_outbound_end(connector, FALSE);
 }
 
 int freerds_client_outbound_extended_mouse_event(rdsModuleConnector* connector, DWORD flags, DWORD x, DWORD y)
 {
 	int length;
-	int status;
 	wStream* s;
 	RDS_MSG_EXTENDED_MOUSE_EVENT msg;
 
 	msg.msgFlags = 0;
 	msg.type = RDS_CLIENT_EXTENDED_MOUSE_EVENT;
+	freerds_outbound_stamp_encoding(connector, (RDS_MSG_COMMON*) &msg);
+	freerds_outbound_stamp_input(connector, (RDS_MSG_COMMON*) &msg);
 
 	msg.flags = flags;
 	msg.x = x;
 	msg.y = y;
 
+	length = freerds_write_extended_mouse_event(NULL, &msg);
+
+	EnterCriticalSection(&(connector->OutboundLock));
+
 	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
 
-	length = freerds_write_extended_mouse_event(NULL, &msg);
-	freerds_write_extended_mouse_event(s, &msg);
+	if ((flags == PTR_FLAGS_MOVE) && connector->OutboundMotionPending &&
+			(connector->OutboundMotionType == RDS_CLIENT_EXTENDED_MOUSE_EVENT))
+	{
+		/* the pending motion event is always the last message in the stream, replace it */
+		Stream_SetPosition(s, connector->OutboundMotionOffset);
+		Stream_EnsureRemainingCapacity(s, length);
+		freerds_write_extended_mouse_event(s, &msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), length);
+		LeaveCriticalSection(&(connector->OutboundLock));
 
-	return status;
+		return 0;
+	}
+
+	LeaveCriticalSection(&(connector->OutboundLock));
+
+	s = freerds_client_outbound_begin(connector, length);
+
+	if (flags == PTR_FLAGS_MOVE)
+	{
+		connector->OutboundMotionPending = TRUE;
+		connector->OutboundMotionType = RDS_CLIENT_EXTENDED_MOUSE_EVENT;
+		connector->OutboundMotionOffset = Stream_GetPosition(s);
+	}
+
+	freerds_write_extended_mouse_event(s, &msg);
+
+	return freerds_client_outbound_end(connector, FALSE);
 }
 
 int freerds_client_outbound_vblank_event(rdsModuleConnector* connector)
 {
 	int length;
-	int status;
 	wStream* s;
 	RDS_MSG_VBLANK_EVENT msg;
 
 	msg.msgFlags = 0;
 	msg.type = RDS_CLIENT_VBLANK_EVENT;
-
-	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
+	freerds_outbound_stamp_encoding(connector, (RDS_MSG_COMMON*) &msg);
 
 	length = freerds_write_vblank_event(NULL, &msg);
+
+	s = freerds_client_outbound_begin(connector, length);
 	freerds_write_vblank_event(s, &msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), length);
+	return freerds_client_outbound_end(connector, TRUE);
+}
 
-	return status;
+int freerds_client_outbound_flow_control(rdsModuleConnector* connector, UINT32 credits)
+{
+	int length;
+	wStream* s;
+	RDS_MSG_FLOW_CONTROL msg;
+
+	msg.msgFlags = 0;
+	msg.type = RDS_CLIENT_FLOW_CONTROL;
+	freerds_outbound_stamp_encoding(connector, (RDS_MSG_COMMON*) &msg);
+	msg.credits = credits;
+
+	length = freerds_write_flow_control(NULL, &msg);
+
+	s = freerds_client_outbound_begin(connector, length);
+	freerds_write_flow_control(s, &msg);
+
+	return freerds_client_outbound_end(connector, TRUE);
 }
 
+/**
+ * Capabilities are always written in the legacy encoding,
+ * the protocol version is only switched once the module replied.
+ */
+
+int freerds_client_outbound_capabilities(rdsModuleConnector* connector, RDS_MSG_CAPABILITIES* msg)
+{
+	int length;
+	wStream* s;
+
+	msg->msgFlags = 0;
+	msg->type = RDS_CLIENT_CAPABILITIES;
+
+	length = freerds_write_capabilities(NULL, msg);
+
+	s = freerds_client_outbound_begin(connector, length);
+	freerds_write_capabilities(s, msg);
+
+	return freerds_client_outbound_end(connector, TRUE);
+}
 
 rdsClientInterface* freerds_client_outbound_interface_new()
 {
@@ -212,11 +378,32 @@ rdsClientInterface* freerds_client_outbound_interface_new()
 		client->MouseEvent = freerds_client_outbound_mouse_event;
 		client->ExtendedMouseEvent = freerds_client_outbound_extended_mouse_event;
 		client->VBlankEvent = freerds_client_outbound_vblank_event;
+		client->FlowControl = freerds_client_outbound_flow_control;
+		client->Capabilities = freerds_client_outbound_capabilities;
 	}
 
 	return client;
 }
 
+/**
+ * Serializes a server message at the current position of s without writing
+ * it to the pipe, so that modules can batch several messages into one write.
+ */
+
+int freerds_server_outbound_append_message(rdsModuleConnector* connector, wStream* s, RDS_MSG_COMMON* msg)
+{
+	/* stamp server messages with the latest input received from freerds */
+	msg->msgFlags = 0;
+	freerds_outbound_stamp_input(connector, msg);
+	freerds_outbound_stamp_encoding(connector, msg);
+
+	freerds_server_message_write(s, msg);
+
+	InterlockedDecrement(&(connector->FlowControlCredits));
+
+	return msg->length;
+}
+
 int freerds_server_outbound_write_message(rdsModuleConnector* connector, RDS_MSG_COMMON* msg)
 {
 	int status;
@@ -225,11 +412,9 @@ int freerds_server_outbound_write_message(rdsModuleConnector* connector, RDS_MSG
 	s = connector->OutboundStream;
 	Stream_SetPosition(s, 0);
 
-	freerds_server_message_write(NULL, msg);
-	Stream_EnsureRemainingCapacity(s, msg->length);
-	freerds_server_message_write(s, msg);
+	freerds_server_outbound_append_message(connector, s, msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), msg->length);
+	status = freerds_transport_write(connector, Stream_Buffer(s), msg->length);
 
 	return status;
 }
@@ -275,6 +460,24 @@ int freerds_server_outbound_paint_rect(rdsModuleConnector* connector, RDS_MSG_PA
 	return freerds_server_outbound_write_message(connector, (RDS_MSG_COMMON*) msg);
 }
 
+int freerds_server_outbound_paint_rects(rdsModuleConnector* connector, RDS_MSG_PAINT_RECTS* msg)
+{
+	msg->type = RDS_SERVER_PAINT_RECTS;
+	return freerds_server_outbound_write_message(connector, (RDS_MSG_COMMON*) msg);
+}
+
+int freerds_server_outbound_screen_blt_rects(rdsModuleConnector* connector, RDS_MSG_SCREEN_BLT_RECTS* msg)
+{
+	msg->type = RDS_SERVER_SCREEN_BLT_RECTS;
+	return freerds_server_outbound_write_message(connector, (RDS_MSG_COMMON*) msg);
+}
+
+int freerds_server_outbound_frame_ready(rdsModuleConnector* connector, RDS_MSG_FRAME_READY* msg)
+{
+	msg->type = RDS_SERVER_FRAME_READY;
+	return freerds_server_outbound_write_message(connector, (RDS_MSG_COMMON*) msg);
+}
+
 int freerds_server_outbound_patblt(rdsModuleConnector* connector, RDS_MSG_PATBLT* msg)
 {
 	msg->type = RDS_SERVER_PATBLT;
@@ -411,6 +614,9 @@ rdsServerInterface* freerds_server_outbound_interface_new()
 		server->PaintOffscreenSurface = freerds_server_outbound_paint_offscreen_surface;
 		server->WindowNewUpdate = freerds_server_outbound_window_new_update;
 		server->WindowDelete = freerds_server_outbound_window_delete;
+		server->PaintRects = freerds_server_outbound_paint_rects;
+		server->ScreenBltRects = freerds_server_outbound_screen_blt_rects;
+		server->FrameReady = freerds_server_outbound_frame_ready;
 	}
 
 	return server;
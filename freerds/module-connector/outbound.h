@@ -22,4 +22,6 @@
 
 #include <freerds/freerds.h>
 
+#define RDS_OUTBOUND_FLUSH_THRESHOLD	4096
+
 #endif /* RDS_NG_OUTBOUND_H */
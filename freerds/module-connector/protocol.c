@@ -21,14 +21,60 @@
 #include "config.h"
 #endif
 
+#include <stddef.h>
+
 #include <freerds/freerds.h>
 
 #include "protocol.h"
 
 typedef int (*pXrdpMessageRead)(wStream* s, RDS_MSG_COMMON* msg);
 typedef int (*pXrdpMessageWrite)(wStream* s, RDS_MSG_COMMON* msg);
-typedef void* (*pXrdpMessageCopy)(RDS_MSG_COMMON* msg);
-typedef void (*pXrdpMessageFree)(RDS_MSG_COMMON* msg);
+
+/**
+ * Message Description
+ *
+ * Server messages made of plain fields have no codec of their own, they are
+ * described by a table of fields instead, see freerds_read_fields. A field
+ * entry covers Count consecutive 32-bit members which take Size bytes each
+ * in the fixed-width body and are coded as given by Compact in compact bodies:
+ *
+ * RDS_FIELD_FIXED: as in the fixed-width body
+ * RDS_FIELD_VARINT: varint
+ * RDS_FIELD_ZIGZAG: zigzag varint
+ * RDS_FIELD_RECT: left out, four members taken from the header rect
+ * RDS_FIELD_DELTA: zigzag varint relative to the members at offset Base
+ *
+ * Messages with a RDS_FIELD_RECT entry always carry the header rect.
+ * Buffer entries list the memory owned by a message, so that copying and
+ * releasing messages is generic as well.
+ */
+
+#define RDS_FIELD_FIXED		0
+#define RDS_FIELD_VARINT	1
+#define RDS_FIELD_ZIGZAG	2
+#define RDS_FIELD_RECT		3
+#define RDS_FIELD_DELTA		4
+
+struct _RDS_MSG_FIELD
+{
+	UINT16 Offset;
+	BYTE Count;
+	BYTE Size;
+	BYTE Compact;
+	UINT16 Base;
+};
+typedef struct _RDS_MSG_FIELD RDS_MSG_FIELD;
+
+struct _RDS_MSG_BUFFER
+{
+	UINT16 Offset;
+	UINT16 Length;
+	UINT16 ElementSize;
+	UINT16 Terminator;
+};
+typedef struct _RDS_MSG_BUFFER RDS_MSG_BUFFER;
+
+#define RDS_MSG_ENTRIES(_table)		_table, (sizeof(_table) / sizeof(_table[0]))
 
 struct _RDS_MSG_DEFINITION
 {
@@ -36,207 +82,410 @@ struct _RDS_MSG_DEFINITION
 	const char* Name;
 	pXrdpMessageRead Read;
 	pXrdpMessageWrite Write;
-	pXrdpMessageCopy Copy;
-	pXrdpMessageFree Free;
+	const RDS_MSG_FIELD* Fields;
+	int FieldCount;
+	const RDS_MSG_BUFFER* Buffers;
+	int BufferCount;
 };
 typedef struct _RDS_MSG_DEFINITION RDS_MSG_DEFINITION;
 
 UINT32 freerds_peek_common_header_length(BYTE* data)
 {
-	UINT32 length;
+	UINT32 length = 0;
+
+	if (data[0] & RDS_COMPACT_HEADER_MARKER)
+	{
+		freerds_peek_message_length(data, RDS_VARINT_MAX_LENGTH + 1, &length);
+		return length;
+	}
+
 	length = *((UINT32*) &(data[2]));
 	return length;
 }
 
-int freerds_read_common_header(wStream* s, RDS_MSG_COMMON* msg)
+/**
+ * Returns 1 and the total message length once enough bytes are available
+ * to know it, 0 if more bytes are needed or -1 if the header is invalid.
+ */
+
+int freerds_peek_message_length(BYTE* data, size_t size, UINT32* length)
 {
-	Stream_Read_UINT16(s, msg->type);
-	Stream_Read_UINT32(s, msg->length);
-	Stream_Read_UINT32(s, msg->msgFlags);
+	int shift = 0;
+	size_t offset = 1;
+	UINT32 value = 0;
 
-	if (msg->msgFlags & RDS_MSG_FLAG_RECT)
+	if (size < 1)
+		return 0;
+
+	if (!(data[0] & RDS_COMPACT_HEADER_MARKER))
 	{
-		Stream_Read_UINT32(s, msg->rect.x);
-		Stream_Read_UINT32(s, msg->rect.y);
-		Stream_Read_UINT32(s, msg->rect.width);
-		Stream_Read_UINT32(s, msg->rect.height);
+		if (size < 6)
+			return 0;
+
+		*length = *((UINT32*) &(data[2]));
+
+		return (*length < RDS_ORDER_HEADER_LENGTH) ? -1 : 1;
 	}
 
-	return 0;
+	while (1)
+	{
+		if (offset >= size)
+			return 0;
+
+		if (offset > RDS_VARINT_MAX_LENGTH)
+			return -1;
+
+		value |= ((UINT32) (data[offset] & 0x7F)) << shift;
+
+		if (!(data[offset++] & 0x80))
+			break;
+
+		shift += 7;
+	}
+
+	*length = value;
+
+	return (*length < RDS_COMPACT_HEADER_LENGTH) ? -1 : 1;
 }
 
-int freerds_write_common_header(wStream* s, RDS_MSG_COMMON* msg)
+/**
+ * Returns 1 and the message type, or 0 if more bytes are needed.
+ */
+
+int freerds_peek_message_type(BYTE* data, size_t size, UINT32* type)
 {
-	if (!s)
+	size_t offset = 1;
+
+	if (size < 2)
+		return 0;
+
+	if (!(data[0] & RDS_COMPACT_HEADER_MARKER))
 	{
-		return RDS_ORDER_HEADER_LENGTH +
-			((msg->msgFlags & RDS_MSG_FLAG_RECT) ? 16 : 0);
+		*type = *((UINT16*) &(data[0]));
+		return 1;
 	}
 
-	Stream_Write_UINT16(s, msg->type);
-	Stream_Write_UINT32(s, msg->length);
-	Stream_Write_UINT32(s, msg->msgFlags);
+	/* skip the varint length */
+	while ((offset < size) && (data[offset] & 0x80))
+		offset++;
 
-	if (msg->msgFlags & RDS_MSG_FLAG_RECT)
+	if (++offset >= size)
+		return 0;
+
+	*type = data[offset];
+
+	return 1;
+}
+
+/**
+ * Compact Encoding
+ *
+ * Used once both sides agreed on RDS_PROTOCOL_VERSION_2 and recognizable by the
+ * high bit of the first byte, which is always clear in the fixed-width header:
+ *
+ * flags (1 byte): RDS_COMPACT_HEADER_MARKER | RDS_MSG_FLAG_RECT | RDS_MSG_FLAG_INPUT
+ * length (varint): total message length, including the header
+ * type (1 byte)
+ * rect (optional): zigzag varint x, y, varint width, height
+ * inputSequence (optional): varint
+ *
+ * Message bodies use varints as well, do not repeat fields already carried
+ * by the header rect, code source coordinates and rectangle lists as deltas
+ * and leave out fields holding their default value. Messages without a
+ * compact body keep their fixed-width body after the compact header.
+ */
+
+static int freerds_varint_length(UINT32 value)
+{
+	int length = 1;
+
+	while (value >= 0x80)
 	{
-		Stream_Write_UINT32(s, msg->rect.x);
-		Stream_Write_UINT32(s, msg->rect.y);
-		Stream_Write_UINT32(s, msg->rect.width);
-		Stream_Write_UINT32(s, msg->rect.height);
+		value >>= 7;
+		length++;
 	}
 
-	return 0;
+	return length;
 }
 
-/* Client Messages */
-
-int freerds_read_synchronize_keyboard_event(wStream* s, RDS_MSG_SYNCHRONIZE_KEYBOARD_EVENT* msg)
+static void freerds_write_varint(wStream* s, UINT32 value)
 {
-	if (Stream_GetRemainingLength(s) < 4)
-		return -1;
-	Stream_Read_UINT32(s, msg->flags);
+	while (value >= 0x80)
+	{
+		Stream_Write_UINT8(s, (BYTE) (value | 0x80));
+		value >>= 7;
+	}
 
-	return 0;
+	Stream_Write_UINT8(s, (BYTE) value);
 }
 
-int freerds_write_synchronize_keyboard_event(wStream* s, RDS_MSG_SYNCHRONIZE_KEYBOARD_EVENT* msg)
+static int freerds_read_varint(wStream* s, UINT32* value)
 {
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 4;
+	BYTE byte;
+	int shift = 0;
 
-	if (!s)
-		return msg->length;
+	*value = 0;
 
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+	do
+	{
+		if ((shift > 28) || (Stream_GetRemainingLength(s) < 1))
+			return -1;
 
-	Stream_Write_UINT32(s, msg->flags);
+		Stream_Read_UINT8(s, byte);
+		*value |= ((UINT32) (byte & 0x7F)) << shift;
+		shift += 7;
+	}
+	while (byte & 0x80);
 
 	return 0;
 }
 
-int freerds_read_scancode_keyboard_event(wStream* s, RDS_MSG_SCANCODE_KEYBOARD_EVENT* msg)
+static UINT32 freerds_zigzag_encode(INT32 value)
 {
-	if (Stream_GetRemainingLength(s) < 12)
-		return -1;
-	Stream_Read_UINT32(s, msg->flags);
-	Stream_Read_UINT32(s, msg->code);
-	Stream_Read_UINT32(s, msg->keyboardType);
-
-	return 0;
+	return (((UINT32) value) << 1) ^ ((UINT32) (value >> 31));
 }
 
-int freerds_write_scancode_keyboard_event(wStream* s, RDS_MSG_SCANCODE_KEYBOARD_EVENT* msg)
+static INT32 freerds_zigzag_decode(UINT32 value)
 {
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 12;
+	return (INT32) ((value >> 1) ^ (~(value & 1) + 1));
+}
 
-	if (!s)
-		return msg->length;
+static int freerds_read_zigzag(wStream* s, INT32* value)
+{
+	UINT32 encoded;
 
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+	if (freerds_read_varint(s, &encoded) < 0)
+		return -1;
 
-	Stream_Write_UINT32(s, msg->flags);
-	Stream_Write_UINT32(s, msg->code);
-	Stream_Write_UINT32(s, msg->keyboardType);
+	*value = freerds_zigzag_decode(encoded);
 
 	return 0;
 }
 
-int freerds_read_virtual_keyboard_event(wStream* s, RDS_MSG_VIRTUAL_KEYBOARD_EVENT* msg)
-{
-	if (Stream_GetRemainingLength(s) < 8)
-		return -1;
-	Stream_Read_UINT32(s, msg->flags);
-	Stream_Read_UINT32(s, msg->code);
+/**
+ * Fields repeating the header rect are left out of compact bodies.
+ */
 
-	return 0;
+static void freerds_read_header_rect(RDS_MSG_COMMON* msg, INT32* x, INT32* y, INT32* width, INT32* height)
+{
+	*x = msg->rect.x;
+	*y = msg->rect.y;
+	*width = msg->rect.width;
+	*height = msg->rect.height;
 }
 
-int freerds_write_virtual_keyboard_event(wStream* s, RDS_MSG_VIRTUAL_KEYBOARD_EVENT* msg)
+/**
+ * Source points are coded relative to the destination, so that in-place
+ * operations and short moves take one byte per coordinate.
+ */
+
+static int freerds_write_source_delta(wStream* s, INT32 x, INT32 y, INT32 xSrc, INT32 ySrc)
 {
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 8;
+	UINT32 dx = freerds_zigzag_encode(xSrc - x);
+	UINT32 dy = freerds_zigzag_encode(ySrc - y);
 
 	if (!s)
-		return msg->length;
-
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+		return freerds_varint_length(dx) + freerds_varint_length(dy);
 
-	Stream_Write_UINT32(s, msg->flags);
-	Stream_Write_UINT32(s, msg->code);
+	freerds_write_varint(s, dx);
+	freerds_write_varint(s, dy);
 
 	return 0;
 }
 
-int freerds_read_unicode_keyboard_event(wStream* s, RDS_MSG_UNICODE_KEYBOARD_EVENT* msg)
+static int freerds_read_source_delta(wStream* s, INT32 x, INT32 y, INT32* xSrc, INT32* ySrc)
 {
-	if (Stream_GetRemainingLength(s) < 8)
+	INT32 dx;
+	INT32 dy;
+
+	if ((freerds_read_zigzag(s, &dx) < 0) || (freerds_read_zigzag(s, &dy) < 0))
 		return -1;
-	Stream_Read_UINT32(s, msg->flags);
-	Stream_Read_UINT32(s, msg->code);
+
+	*xSrc = x + dx;
+	*ySrc = y + dy;
 
 	return 0;
 }
 
-int freerds_write_unicode_keyboard_event(wStream* s, RDS_MSG_UNICODE_KEYBOARD_EVENT* msg)
+/**
+ * Total length of a message made of the common header and a body of the given size.
+ */
+
+static UINT32 freerds_message_length(RDS_MSG_COMMON* msg, UINT32 bodyLength)
 {
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 8;
+	UINT32 length;
+	int lengthSize = 1;
 
-	if (!s)
-		return msg->length;
+	if (!(msg->msgFlags & RDS_MSG_FLAG_COMPACT))
+		return freerds_write_common_header(NULL, msg) + bodyLength;
 
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+	/* the length field is part of the length it encodes */
+	length = freerds_write_common_header(NULL, msg) + bodyLength;
 
-	Stream_Write_UINT32(s, msg->flags);
-	Stream_Write_UINT32(s, msg->code);
+	while (freerds_varint_length(length + lengthSize) > lengthSize)
+		lengthSize++;
 
-	return 0;
+	return length + lengthSize;
 }
 
-int freerds_read_mouse_event(wStream* s, RDS_MSG_MOUSE_EVENT* msg)
+int freerds_read_common_header(wStream* s, RDS_MSG_COMMON* msg)
 {
-	if (Stream_GetRemainingLength(s) < 12)
+	BYTE flags;
+	BYTE type;
+
+	Stream_Peek_UINT8(s, flags);
+
+	if (!(flags & RDS_COMPACT_HEADER_MARKER))
+	{
+		Stream_Read_UINT16(s, msg->type);
+		Stream_Read_UINT32(s, msg->length);
+		Stream_Read_UINT32(s, msg->msgFlags);
+
+		msg->msgFlags &= ~RDS_MSG_FLAG_COMPACT;
+
+		if (msg->msgFlags & RDS_MSG_FLAG_RECT)
+		{
+			Stream_Read_UINT32(s, msg->rect.x);
+			Stream_Read_UINT32(s, msg->rect.y);
+			Stream_Read_UINT32(s, msg->rect.width);
+			Stream_Read_UINT32(s, msg->rect.height);
+		}
+
+		if (msg->msgFlags & RDS_MSG_FLAG_INPUT)
+			Stream_Read_UINT32(s, msg->inputSequence);
+
+		return 0;
+	}
+
+	Stream_Seek_UINT8(s);
+	msg->msgFlags = RDS_MSG_FLAG_COMPACT | (flags & (RDS_MSG_FLAG_RECT | RDS_MSG_FLAG_INPUT));
+
+	if (freerds_read_varint(s, &msg->length) < 0)
 		return -1;
-	Stream_Read_UINT32(s, msg->flags);
-	Stream_Read_UINT32(s, msg->x);
-	Stream_Read_UINT32(s, msg->y);
+
+	if (Stream_GetRemainingLength(s) < 1)
+		return -1;
+
+	Stream_Read_UINT8(s, type);
+	msg->type = type;
+
+	if (msg->msgFlags & RDS_MSG_FLAG_RECT)
+	{
+		if ((freerds_read_zigzag(s, &msg->rect.x) < 0) ||
+				(freerds_read_zigzag(s, &msg->rect.y) < 0) ||
+				(freerds_read_varint(s, &msg->rect.width) < 0) ||
+				(freerds_read_varint(s, &msg->rect.height) < 0))
+			return -1;
+	}
+
+	if (msg->msgFlags & RDS_MSG_FLAG_INPUT)
+	{
+		if (freerds_read_varint(s, &msg->inputSequence) < 0)
+			return -1;
+	}
 
 	return 0;
 }
 
-int freerds_write_mouse_event(wStream* s, RDS_MSG_MOUSE_EVENT* msg)
+int freerds_write_common_header(wStream* s, RDS_MSG_COMMON* msg)
 {
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 12;
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		if (!s)
+		{
+			/* without the length field, see freerds_message_length */
+			int length = 2;
+
+			if (msg->msgFlags & RDS_MSG_FLAG_RECT)
+			{
+				length += freerds_varint_length(freerds_zigzag_encode(msg->rect.x)) +
+						freerds_varint_length(freerds_zigzag_encode(msg->rect.y)) +
+						freerds_varint_length(msg->rect.width) +
+						freerds_varint_length(msg->rect.height);
+			}
+
+			if (msg->msgFlags & RDS_MSG_FLAG_INPUT)
+				length += freerds_varint_length(msg->inputSequence);
+
+			return length;
+		}
+
+		Stream_Write_UINT8(s, RDS_COMPACT_HEADER_MARKER |
+				(msg->msgFlags & (RDS_MSG_FLAG_RECT | RDS_MSG_FLAG_INPUT)));
+		freerds_write_varint(s, msg->length);
+		Stream_Write_UINT8(s, (BYTE) msg->type);
+
+		if (msg->msgFlags & RDS_MSG_FLAG_RECT)
+		{
+			freerds_write_varint(s, freerds_zigzag_encode(msg->rect.x));
+			freerds_write_varint(s, freerds_zigzag_encode(msg->rect.y));
+			freerds_write_varint(s, msg->rect.width);
+			freerds_write_varint(s, msg->rect.height);
+		}
+
+		if (msg->msgFlags & RDS_MSG_FLAG_INPUT)
+			freerds_write_varint(s, msg->inputSequence);
+
+		return 0;
+	}
 
 	if (!s)
-		return msg->length;
+	{
+		return RDS_ORDER_HEADER_LENGTH +
+			((msg->msgFlags & RDS_MSG_FLAG_RECT) ? 16 : 0) +
+			((msg->msgFlags & RDS_MSG_FLAG_INPUT) ? 4 : 0);
+	}
 
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+	Stream_Write_UINT16(s, msg->type);
+	Stream_Write_UINT32(s, msg->length);
+	Stream_Write_UINT32(s, msg->msgFlags);
 
-	Stream_Write_UINT32(s, msg->flags);
-	Stream_Write_UINT32(s, msg->x);
-	Stream_Write_UINT32(s, msg->y);
+	if (msg->msgFlags & RDS_MSG_FLAG_RECT)
+	{
+		Stream_Write_UINT32(s, msg->rect.x);
+		Stream_Write_UINT32(s, msg->rect.y);
+		Stream_Write_UINT32(s, msg->rect.width);
+		Stream_Write_UINT32(s, msg->rect.height);
+	}
+
+	if (msg->msgFlags & RDS_MSG_FLAG_INPUT)
+		Stream_Write_UINT32(s, msg->inputSequence);
 
 	return 0;
 }
 
-int freerds_read_extended_mouse_event(wStream* s, RDS_MSG_EXTENDED_MOUSE_EVENT* msg)
+/* Client Messages */
+
+int freerds_read_synchronize_keyboard_event(wStream* s, RDS_MSG_SYNCHRONIZE_KEYBOARD_EVENT* msg)
 {
-	if (Stream_GetRemainingLength(s) < 12)
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+		return freerds_read_varint(s, &msg->flags);
+
+	if (Stream_GetRemainingLength(s) < 4)
 		return -1;
 	Stream_Read_UINT32(s, msg->flags);
-	Stream_Read_UINT32(s, msg->x);
-	Stream_Read_UINT32(s, msg->y);
 
 	return 0;
 }
 
-int freerds_write_extended_mouse_event(wStream* s, RDS_MSG_EXTENDED_MOUSE_EVENT* msg)
+int freerds_write_synchronize_keyboard_event(wStream* s, RDS_MSG_SYNCHRONIZE_KEYBOARD_EVENT* msg)
 {
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 12;
+	msg->msgFlags &= (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT);
+
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, freerds_varint_length(msg->flags));
+
+		if (!s)
+			return msg->length;
+
+		freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+		freerds_write_varint(s, msg->flags);
+
+		return 0;
+	}
+
+	msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, 4);
 
 	if (!s)
 		return msg->length;
@@ -244,396 +493,565 @@ int freerds_write_extended_mouse_event(wStream* s, RDS_MSG_EXTENDED_MOUSE_EVENT*
 	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
 
 	Stream_Write_UINT32(s, msg->flags);
-	Stream_Write_UINT32(s, msg->x);
-	Stream_Write_UINT32(s, msg->y);
 
 	return 0;
 }
 
-int freerds_read_vblank_event(wStream* s, RDS_MSG_VBLANK_EVENT* msg)
-{
-	return 0;
-}
+/**
+ * The keyboard type is left out of compact scancode events when it is
+ * the IBM enhanced (101/102-key) keyboard, which clients nearly always use.
+ */
 
-int freerds_write_vblank_event(wStream* s, RDS_MSG_VBLANK_EVENT* msg)
-{
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON *)msg);
+#define RDS_DEFAULT_KEYBOARD_TYPE	4
+#define RDS_COMPACT_KEYBOARD_TYPE	0x80000000
 
-	if (!s)
-		return msg->length;
+int freerds_read_scancode_keyboard_event(wStream* s, RDS_MSG_SCANCODE_KEYBOARD_EVENT* msg)
+{
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		if ((freerds_read_varint(s, &msg->flags) < 0) || (freerds_read_varint(s, &msg->code) < 0))
+			return -1;
 
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+		msg->keyboardType = RDS_DEFAULT_KEYBOARD_TYPE;
 
-	return 0;
-}
+		if (msg->flags & RDS_COMPACT_KEYBOARD_TYPE)
+		{
+			msg->flags &= ~RDS_COMPACT_KEYBOARD_TYPE;
+			return freerds_read_varint(s, &msg->keyboardType);
+		}
 
+		return 0;
+	}
 
-int freerds_read_capabilities(wStream* s, RDS_MSG_CAPABILITIES* msg)
-{
 	if (Stream_GetRemainingLength(s) < 12)
 		return -1;
-	Stream_Read_UINT32(s, msg->DesktopWidth);
-	Stream_Read_UINT32(s, msg->DesktopHeight);
-	Stream_Read_UINT32(s, msg->ColorDepth);
+	Stream_Read_UINT32(s, msg->flags);
+	Stream_Read_UINT32(s, msg->code);
+	Stream_Read_UINT32(s, msg->keyboardType);
 
 	return 0;
 }
 
-int freerds_write_capabilities(wStream* s, RDS_MSG_CAPABILITIES* msg)
+int freerds_write_scancode_keyboard_event(wStream* s, RDS_MSG_SCANCODE_KEYBOARD_EVENT* msg)
 {
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 12;
+	msg->msgFlags &= (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT);
 
-	if (!s)
-		return msg->length;
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		UINT32 flags = msg->flags;
 
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+		if (msg->keyboardType != RDS_DEFAULT_KEYBOARD_TYPE)
+			flags |= RDS_COMPACT_KEYBOARD_TYPE;
 
-	Stream_Write_UINT32(s, msg->DesktopWidth);
-	Stream_Write_UINT32(s, msg->DesktopHeight);
-	Stream_Write_UINT32(s, msg->ColorDepth);
-
-	return 0;
-}
+		msg->length = freerds_message_length((RDS_MSG_COMMON*) msg,
+				freerds_varint_length(flags) + freerds_varint_length(msg->code) +
+				((flags & RDS_COMPACT_KEYBOARD_TYPE) ? freerds_varint_length(msg->keyboardType) : 0));
 
-int freerds_read_refresh_rect(wStream* s, RDS_MSG_REFRESH_RECT* msg)
-{
-	int index;
+		if (!s)
+			return msg->length;
 
-	if (Stream_GetRemainingLength(s) < 2)
-		return -1;
-	Stream_Read_UINT16(s, msg->numberOfAreas);
+		freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+		freerds_write_varint(s, flags);
+		freerds_write_varint(s, msg->code);
 
-	msg->areasToRefresh = (RECTANGLE_16*) Stream_Pointer(s);
-	if (Stream_GetRemainingLength(s) < 8 * msg->numberOfAreas)
-		return -1;
+		if (flags & RDS_COMPACT_KEYBOARD_TYPE)
+			freerds_write_varint(s, msg->keyboardType);
 
-	for (index = 0; index < msg->numberOfAreas; index++)
-	{
-		Stream_Read_UINT16(s, msg->areasToRefresh[index].left);
-		Stream_Read_UINT16(s, msg->areasToRefresh[index].top);
-		Stream_Read_UINT16(s, msg->areasToRefresh[index].right);
-		Stream_Read_UINT16(s, msg->areasToRefresh[index].bottom);
+		return 0;
 	}
 
-	return 0;
-}
-
-int freerds_write_refresh_rect(wStream* s, RDS_MSG_REFRESH_RECT* msg)
-{
-	int index;
-
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 2 + (msg->numberOfAreas * 8);
+	msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, 12);
 
 	if (!s)
 		return msg->length;
 
 	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
 
-	Stream_Write_UINT16(s, msg->numberOfAreas);
-
-	for (index = 0; index < msg->numberOfAreas; index++)
-	{
-		Stream_Write_UINT16(s, msg->areasToRefresh[index].left);
-		Stream_Write_UINT16(s, msg->areasToRefresh[index].top);
-		Stream_Write_UINT16(s, msg->areasToRefresh[index].right);
-		Stream_Write_UINT16(s, msg->areasToRefresh[index].bottom);
-	}
+	Stream_Write_UINT32(s, msg->flags);
+	Stream_Write_UINT32(s, msg->code);
+	Stream_Write_UINT32(s, msg->keyboardType);
 
 	return 0;
 }
 
 /**
- * Server Messages
- */
-
-/**
- * BeginUpdate
+ * Keyboard events made of a flags and a code field.
  */
 
-int freerds_read_begin_update(wStream* s, RDS_MSG_BEGIN_UPDATE* msg)
+static int freerds_read_key_event(wStream* s, RDS_MSG_COMMON* msg, UINT32* flags, UINT32* code)
 {
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		if ((freerds_read_varint(s, flags) < 0) || (freerds_read_varint(s, code) < 0))
+			return -1;
+
+		return 0;
+	}
+
+	if (Stream_GetRemainingLength(s) < 8)
+		return -1;
+	Stream_Read_UINT32(s, *flags);
+	Stream_Read_UINT32(s, *code);
+
 	return 0;
 }
 
-int freerds_write_begin_update(wStream* s, RDS_MSG_BEGIN_UPDATE* msg)
+static int freerds_write_key_event(wStream* s, RDS_MSG_COMMON* msg, UINT32 flags, UINT32 code)
 {
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg);
+	msg->msgFlags &= (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT);
+
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+		msg->length = freerds_message_length(msg, freerds_varint_length(flags) + freerds_varint_length(code));
+	else
+		msg->length = freerds_message_length(msg, 8);
 
 	if (!s)
 		return msg->length;
 
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+	freerds_write_common_header(s, msg);
+
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		freerds_write_varint(s, flags);
+		freerds_write_varint(s, code);
+	}
+	else
+	{
+		Stream_Write_UINT32(s, flags);
+		Stream_Write_UINT32(s, code);
+	}
 
 	return 0;
 }
 
-void* freerds_begin_update_copy(RDS_MSG_BEGIN_UPDATE* msg)
+int freerds_read_virtual_keyboard_event(wStream* s, RDS_MSG_VIRTUAL_KEYBOARD_EVENT* msg)
 {
-	RDS_MSG_BEGIN_UPDATE* dup = NULL;
-
-	dup = (RDS_MSG_BEGIN_UPDATE*) malloc(sizeof(RDS_MSG_BEGIN_UPDATE));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_BEGIN_UPDATE));
+	return freerds_read_key_event(s, (RDS_MSG_COMMON*) msg, &msg->flags, &msg->code);
+}
 
-	return (void*) dup;
+int freerds_write_virtual_keyboard_event(wStream* s, RDS_MSG_VIRTUAL_KEYBOARD_EVENT* msg)
+{
+	return freerds_write_key_event(s, (RDS_MSG_COMMON*) msg, msg->flags, msg->code);
 }
 
-void freerds_begin_update_free(RDS_MSG_BEGIN_UPDATE* msg)
+int freerds_read_unicode_keyboard_event(wStream* s, RDS_MSG_UNICODE_KEYBOARD_EVENT* msg)
 {
-	free(msg);
+	return freerds_read_key_event(s, (RDS_MSG_COMMON*) msg, &msg->flags, &msg->code);
 }
 
-static RDS_MSG_DEFINITION RDS_MSG_BEGIN_UPDATE_DEFINITION =
+int freerds_write_unicode_keyboard_event(wStream* s, RDS_MSG_UNICODE_KEYBOARD_EVENT* msg)
 {
-	sizeof(RDS_MSG_BEGIN_UPDATE), "BeginUpdate",
-	(pXrdpMessageRead) freerds_read_begin_update,
-	(pXrdpMessageWrite) freerds_write_begin_update,
-	(pXrdpMessageCopy) freerds_begin_update_copy,
-	(pXrdpMessageFree) freerds_begin_update_free
-};
+	return freerds_write_key_event(s, (RDS_MSG_COMMON*) msg, msg->flags, msg->code);
+}
 
 /**
- * EndUpdate
+ * Pointer events made of a flags field and a position.
  */
 
-int freerds_read_end_update(wStream* s, RDS_MSG_END_UPDATE* msg)
+static int freerds_read_pointer_event(wStream* s, RDS_MSG_COMMON* msg, DWORD* flags, DWORD* x, DWORD* y)
 {
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		UINT32 value[3];
+
+		if ((freerds_read_varint(s, &value[0]) < 0) ||
+				(freerds_read_varint(s, &value[1]) < 0) ||
+				(freerds_read_varint(s, &value[2]) < 0))
+			return -1;
+
+		*flags = value[0];
+		*x = value[1];
+		*y = value[2];
+
+		return 0;
+	}
+
+	if (Stream_GetRemainingLength(s) < 12)
+		return -1;
+	Stream_Read_UINT32(s, *flags);
+	Stream_Read_UINT32(s, *x);
+	Stream_Read_UINT32(s, *y);
+
 	return 0;
 }
 
-int freerds_write_end_update(wStream* s, RDS_MSG_END_UPDATE* msg)
+static int freerds_write_pointer_event(wStream* s, RDS_MSG_COMMON* msg, DWORD flags, DWORD x, DWORD y)
 {
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg);
+	msg->msgFlags &= (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT);
+
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		msg->length = freerds_message_length(msg, freerds_varint_length(flags) +
+				freerds_varint_length(x) + freerds_varint_length(y));
+	}
+	else
+	{
+		msg->length = freerds_message_length(msg, 12);
+	}
 
 	if (!s)
 		return msg->length;
 
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+	freerds_write_common_header(s, msg);
+
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		freerds_write_varint(s, flags);
+		freerds_write_varint(s, x);
+		freerds_write_varint(s, y);
+	}
+	else
+	{
+		Stream_Write_UINT32(s, flags);
+		Stream_Write_UINT32(s, x);
+		Stream_Write_UINT32(s, y);
+	}
 
 	return 0;
 }
 
-void* freerds_end_update_copy(RDS_MSG_END_UPDATE* msg)
+int freerds_read_mouse_event(wStream* s, RDS_MSG_MOUSE_EVENT* msg)
 {
-	RDS_MSG_END_UPDATE* dup = NULL;
-
-	dup = (RDS_MSG_END_UPDATE*) malloc(sizeof(RDS_MSG_END_UPDATE));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_END_UPDATE));
-
-	return (void*) dup;
+	return freerds_read_pointer_event(s, (RDS_MSG_COMMON*) msg, &msg->flags, &msg->x, &msg->y);
 }
 
-void freerds_end_update_free(RDS_MSG_END_UPDATE* msg)
+int freerds_write_mouse_event(wStream* s, RDS_MSG_MOUSE_EVENT* msg)
 {
-	free(msg);
+	return freerds_write_pointer_event(s, (RDS_MSG_COMMON*) msg, msg->flags, msg->x, msg->y);
 }
 
-static RDS_MSG_DEFINITION RDS_MSG_END_UPDATE_DEFINITION =
+int freerds_read_extended_mouse_event(wStream* s, RDS_MSG_EXTENDED_MOUSE_EVENT* msg)
 {
-	sizeof(RDS_MSG_END_UPDATE), "EndUpdate",
-	(pXrdpMessageRead) freerds_read_end_update,
-	(pXrdpMessageWrite) freerds_write_end_update,
-	(pXrdpMessageCopy) freerds_end_update_copy,
-	(pXrdpMessageFree) freerds_end_update_free
-};
-
-/**
- * SetClippingRegion
- */
+	return freerds_read_pointer_event(s, (RDS_MSG_COMMON*) msg, &msg->flags, &msg->x, &msg->y);
+}
 
-int freerds_read_set_clipping_region(wStream* s, RDS_MSG_SET_CLIPPING_REGION* msg)
+int freerds_write_extended_mouse_event(wStream* s, RDS_MSG_EXTENDED_MOUSE_EVENT* msg)
 {
-	if (Stream_GetRemainingLength(s) < 10)
-		return -1;
-
-	Stream_Read_UINT16(s, msg->bNullRegion);
-	Stream_Read_UINT16(s, msg->nLeftRect);
-	Stream_Read_UINT16(s, msg->nTopRect);
-	Stream_Read_UINT16(s, msg->nWidth);
-	Stream_Read_UINT16(s, msg->nHeight);
+	return freerds_write_pointer_event(s, (RDS_MSG_COMMON*) msg, msg->flags, msg->x, msg->y);
+}
 
+int freerds_read_vblank_event(wStream* s, RDS_MSG_VBLANK_EVENT* msg)
+{
 	return 0;
 }
 
-int freerds_write_set_clipping_region(wStream* s, RDS_MSG_SET_CLIPPING_REGION* msg)
+int freerds_write_vblank_event(wStream* s, RDS_MSG_VBLANK_EVENT* msg)
 {
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 10;
+	msg->msgFlags &= (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT);
+	msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, 0);
 
 	if (!s)
 		return msg->length;
 
 	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
 
-	Stream_Write_UINT16(s, msg->bNullRegion);
-	Stream_Write_UINT16(s, msg->nLeftRect);
-	Stream_Write_UINT16(s, msg->nTopRect);
-	Stream_Write_UINT16(s, msg->nWidth);
-	Stream_Write_UINT16(s, msg->nHeight);
-
 	return 0;
 }
 
-void* freerds_set_clipping_region_copy(RDS_MSG_SET_CLIPPING_REGION* msg)
+int freerds_read_flow_control(wStream* s, RDS_MSG_FLOW_CONTROL* msg)
 {
-	RDS_MSG_SET_CLIPPING_REGION* dup = NULL;
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+		return freerds_read_varint(s, &msg->credits);
 
-	dup = (RDS_MSG_SET_CLIPPING_REGION*) malloc(sizeof(RDS_MSG_SET_CLIPPING_REGION));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_SET_CLIPPING_REGION));
+	if (Stream_GetRemainingLength(s) < 4)
+		return -1;
+	Stream_Read_UINT32(s, msg->credits);
 
-	return (void*) dup;
+	return 0;
 }
 
-void freerds_set_clipping_region_free(RDS_MSG_SET_CLIPPING_REGION* msg)
+int freerds_write_flow_control(wStream* s, RDS_MSG_FLOW_CONTROL* msg)
 {
-	free(msg);
-}
+	msg->msgFlags &= (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT);
 
-static RDS_MSG_DEFINITION RDS_MSG_SET_CLIPPING_REGION_DEFINITION =
-{
-	sizeof(RDS_MSG_SET_CLIPPING_REGION), "SetClippingRegion",
-	(pXrdpMessageRead) freerds_read_set_clipping_region,
-	(pXrdpMessageWrite) freerds_write_set_clipping_region,
-	(pXrdpMessageCopy) freerds_set_clipping_region_copy,
-	(pXrdpMessageFree) freerds_set_clipping_region_free
-};
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+		msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, freerds_varint_length(msg->credits));
+	else
+		msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, 4);
+
+	if (!s)
+		return msg->length;
+
+	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+		freerds_write_varint(s, msg->credits);
+	else
+		Stream_Write_UINT32(s, msg->credits);
+
+	return 0;
+}
 
 /**
- * OpaqueRect
+ * Capabilities are exchanged before the protocol version is agreed on and
+ * always use the fixed-width encoding. The version was added at the end,
+ * peers which do not send it speak version 1.
  */
 
-int freerds_read_opaque_rect(wStream* s, RDS_MSG_OPAQUE_RECT* msg)
+int freerds_read_capabilities(wStream* s, RDS_MSG_CAPABILITIES* msg)
 {
 	if (Stream_GetRemainingLength(s) < 12)
 		return -1;
+	Stream_Read_UINT32(s, msg->DesktopWidth);
+	Stream_Read_UINT32(s, msg->DesktopHeight);
+	Stream_Read_UINT32(s, msg->ColorDepth);
 
-	Stream_Read_UINT16(s, msg->nLeftRect);
-	Stream_Read_UINT16(s, msg->nTopRect);
-	Stream_Read_UINT16(s, msg->nWidth);
-	Stream_Read_UINT16(s, msg->nHeight);
-	Stream_Read_UINT32(s, msg->color);
+	msg->Version = RDS_PROTOCOL_VERSION_1;
+
+	if (msg->length >= freerds_message_length((RDS_MSG_COMMON*) msg, 16))
+	{
+		if (Stream_GetRemainingLength(s) < 4)
+			return -1;
+		Stream_Read_UINT32(s, msg->Version);
+	}
 
 	return 0;
 }
 
-int freerds_write_opaque_rect(wStream* s, RDS_MSG_OPAQUE_RECT* msg)
+int freerds_write_capabilities(wStream* s, RDS_MSG_CAPABILITIES* msg)
 {
-	msg->msgFlags = RDS_MSG_FLAG_RECT;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 12;
+	msg->msgFlags &= RDS_MSG_FLAG_INPUT;
+	msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, 16);
 
 	if (!s)
 		return msg->length;
 
-	msg->rect.x = msg->nLeftRect;
-	msg->rect.y = msg->nTopRect;
-	msg->rect.width = msg->nWidth;
-	msg->rect.height = msg->nHeight;
-
 	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
 
-	Stream_Write_UINT16(s, msg->nLeftRect);
-	Stream_Write_UINT16(s, msg->nTopRect);
-	Stream_Write_UINT16(s, msg->nWidth);
-	Stream_Write_UINT16(s, msg->nHeight);
-	Stream_Write_UINT32(s, msg->color);
+	Stream_Write_UINT32(s, msg->DesktopWidth);
+	Stream_Write_UINT32(s, msg->DesktopHeight);
+	Stream_Write_UINT32(s, msg->ColorDepth);
+	Stream_Write_UINT32(s, msg->Version);
 
 	return 0;
 }
 
-void* freerds_opaque_rect_copy(RDS_MSG_OPAQUE_RECT* msg)
-{
-	RDS_MSG_OPAQUE_RECT* dup = NULL;
-
-	dup = (RDS_MSG_OPAQUE_RECT*) malloc(sizeof(RDS_MSG_OPAQUE_RECT));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_OPAQUE_RECT));
-
-	return (void*) dup;
-}
-
-void freerds_opaque_rect_free(RDS_MSG_OPAQUE_RECT* msg)
+static RDS_MSG_DEFINITION RDS_MSG_CAPABILITIES_DEFINITION =
 {
-	free(msg);
-}
+	sizeof(RDS_MSG_CAPABILITIES), "Capabilities",
+	(pXrdpMessageRead) freerds_read_capabilities,
+	(pXrdpMessageWrite) freerds_write_capabilities,
+	NULL, 0,
+	NULL, 0
+};
 
-static RDS_MSG_DEFINITION RDS_MSG_OPAQUE_RECT_DEFINITION =
+int freerds_read_refresh_rect(wStream* s, RDS_MSG_REFRESH_RECT* msg)
 {
-	sizeof(RDS_MSG_OPAQUE_RECT), "OpaqueRect",
-	(pXrdpMessageRead) freerds_read_opaque_rect,
-	(pXrdpMessageWrite) freerds_write_opaque_rect,
-	(pXrdpMessageCopy) freerds_opaque_rect_copy,
-	(pXrdpMessageFree) freerds_opaque_rect_free
-};
+	int index;
 
-/**
- * ScreenBlt
- */
+	if (Stream_GetRemainingLength(s) < 2)
+		return -1;
+	Stream_Read_UINT16(s, msg->numberOfAreas);
 
-int freerds_read_screen_blt(wStream* s, RDS_MSG_SCREEN_BLT* msg)
-{
-	if (Stream_GetRemainingLength(s) < 12)
+	msg->areasToRefresh = (RECTANGLE_16*) Stream_Pointer(s);
+	if (Stream_GetRemainingLength(s) < 8 * msg->numberOfAreas)
 		return -1;
 
-	Stream_Read_UINT16(s, msg->nLeftRect);
-	Stream_Read_UINT16(s, msg->nTopRect);
-	Stream_Read_UINT16(s, msg->nWidth);
-	Stream_Read_UINT16(s, msg->nHeight);
-	Stream_Read_UINT16(s, msg->nXSrc);
-	Stream_Read_UINT16(s, msg->nYSrc);
+	for (index = 0; index < msg->numberOfAreas; index++)
+	{
+		Stream_Read_UINT16(s, msg->areasToRefresh[index].left);
+		Stream_Read_UINT16(s, msg->areasToRefresh[index].top);
+		Stream_Read_UINT16(s, msg->areasToRefresh[index].right);
+		Stream_Read_UINT16(s, msg->areasToRefresh[index].bottom);
+	}
 
 	return 0;
 }
 
-int freerds_write_screen_blt(wStream* s, RDS_MSG_SCREEN_BLT* msg)
+int freerds_write_refresh_rect(wStream* s, RDS_MSG_REFRESH_RECT* msg)
 {
-	msg->msgFlags = RDS_MSG_FLAG_RECT;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 12;
+	int index;
+
+	msg->msgFlags &= (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT);
+	msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, 2 + (msg->numberOfAreas * 8));
 
 	if (!s)
 		return msg->length;
 
-	msg->rect.x = msg->nLeftRect;
-	msg->rect.y = msg->nTopRect;
-	msg->rect.width = msg->nWidth;
-	msg->rect.height = msg->nHeight;
-
 	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
 
-	Stream_Write_UINT16(s, msg->nLeftRect);
-	Stream_Write_UINT16(s, msg->nTopRect);
-	Stream_Write_UINT16(s, msg->nWidth);
-	Stream_Write_UINT16(s, msg->nHeight);
-	Stream_Write_UINT16(s, msg->nXSrc);
-	Stream_Write_UINT16(s, msg->nYSrc);
+	Stream_Write_UINT16(s, msg->numberOfAreas);
+
+	for (index = 0; index < msg->numberOfAreas; index++)
+	{
+		Stream_Write_UINT16(s, msg->areasToRefresh[index].left);
+		Stream_Write_UINT16(s, msg->areasToRefresh[index].top);
+		Stream_Write_UINT16(s, msg->areasToRefresh[index].right);
+		Stream_Write_UINT16(s, msg->areasToRefresh[index].bottom);
+	}
 
 	return 0;
 }
 
-void* freerds_screen_blt_copy(RDS_MSG_SCREEN_BLT* msg)
-{
-	RDS_MSG_SCREEN_BLT* dup = NULL;
+/**
+ * Server Messages
+ */
 
-	dup = (RDS_MSG_SCREEN_BLT*) malloc(sizeof(RDS_MSG_SCREEN_BLT));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_SCREEN_BLT));
+/**
+ * BeginUpdate
+ */
 
-	return (void*) dup;
+static RDS_MSG_DEFINITION RDS_MSG_BEGIN_UPDATE_DEFINITION =
+{
+	sizeof(RDS_MSG_BEGIN_UPDATE), "BeginUpdate",
+	NULL, NULL,
+	NULL, 0,
+	NULL, 0
+};
+
+/**
+ * EndUpdate
+ */
+
+static RDS_MSG_DEFINITION RDS_MSG_END_UPDATE_DEFINITION =
+{
+	sizeof(RDS_MSG_END_UPDATE), "EndUpdate",
+	NULL, NULL,
+	NULL, 0,
+	NULL, 0
+};
+
+/**
+ * SetClippingRegion
+ */
+
+int freerds_read_set_clipping_region(wStream* s, RDS_MSG_SET_CLIPPING_REGION* msg)
+{
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		BYTE bNullRegion;
+		UINT32 width;
+		UINT32 height;
+
+		if (Stream_GetRemainingLength(s) < 1)
+			return -1;
+
+		Stream_Read_UINT8(s, bNullRegion);
+		msg->bNullRegion = bNullRegion;
+		msg->nLeftRect = msg->nTopRect = msg->nWidth = msg->nHeight = 0;
+
+		if (msg->bNullRegion)
+			return 0;
+
+		if ((freerds_read_zigzag(s, &msg->nLeftRect) < 0) ||
+				(freerds_read_zigzag(s, &msg->nTopRect) < 0) ||
+				(freerds_read_varint(s, &width) < 0) ||
+				(freerds_read_varint(s, &height) < 0))
+			return -1;
+
+		msg->nWidth = width;
+		msg->nHeight = height;
+
+		return 0;
+	}
+
+	if (Stream_GetRemainingLength(s) < 10)
+		return -1;
+
+	Stream_Read_UINT16(s, msg->bNullRegion);
+	Stream_Read_UINT16(s, msg->nLeftRect);
+	Stream_Read_UINT16(s, msg->nTopRect);
+	Stream_Read_UINT16(s, msg->nWidth);
+	Stream_Read_UINT16(s, msg->nHeight);
+
+	return 0;
 }
 
-void freerds_screen_blt_free(RDS_MSG_SCREEN_BLT* msg)
+int freerds_write_set_clipping_region(wStream* s, RDS_MSG_SET_CLIPPING_REGION* msg)
 {
-	free(msg);
+	msg->msgFlags &= (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT);
+
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		/* the rectangle of a null region is left out */
+		UINT32 length = 1;
+
+		if (!msg->bNullRegion)
+		{
+			length += freerds_varint_length(freerds_zigzag_encode(msg->nLeftRect)) +
+					freerds_varint_length(freerds_zigzag_encode(msg->nTopRect)) +
+					freerds_varint_length(msg->nWidth) + freerds_varint_length(msg->nHeight);
+		}
+
+		msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, length);
+
+		if (!s)
+			return msg->length;
+
+		freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+
+		Stream_Write_UINT8(s, msg->bNullRegion ? 1 : 0);
+
+		if (!msg->bNullRegion)
+		{
+			freerds_write_varint(s, freerds_zigzag_encode(msg->nLeftRect));
+			freerds_write_varint(s, freerds_zigzag_encode(msg->nTopRect));
+			freerds_write_varint(s, msg->nWidth);
+			freerds_write_varint(s, msg->nHeight);
+		}
+
+		return 0;
+	}
+
+	msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, 10);
+
+	if (!s)
+		return msg->length;
+
+	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+
+	Stream_Write_UINT16(s, msg->bNullRegion);
+	Stream_Write_UINT16(s, msg->nLeftRect);
+	Stream_Write_UINT16(s, msg->nTopRect);
+	Stream_Write_UINT16(s, msg->nWidth);
+	Stream_Write_UINT16(s, msg->nHeight);
+
+	return 0;
 }
 
+static RDS_MSG_DEFINITION RDS_MSG_SET_CLIPPING_REGION_DEFINITION =
+{
+	sizeof(RDS_MSG_SET_CLIPPING_REGION), "SetClippingRegion",
+	(pXrdpMessageRead) freerds_read_set_clipping_region,
+	(pXrdpMessageWrite) freerds_write_set_clipping_region,
+	NULL, 0,
+	NULL, 0
+};
+
+/**
+ * OpaqueRect
+ */
+
+static const RDS_MSG_FIELD RDS_MSG_OPAQUE_RECT_FIELDS[] =
+{
+	{ offsetof(RDS_MSG_OPAQUE_RECT, nLeftRect), 4, 2, RDS_FIELD_RECT, 0 },
+	{ offsetof(RDS_MSG_OPAQUE_RECT, color), 1, 4, RDS_FIELD_VARINT, 0 }
+};
+
+static RDS_MSG_DEFINITION RDS_MSG_OPAQUE_RECT_DEFINITION =
+{
+	sizeof(RDS_MSG_OPAQUE_RECT), "OpaqueRect",
+	NULL, NULL,
+	RDS_MSG_ENTRIES(RDS_MSG_OPAQUE_RECT_FIELDS),
+	NULL, 0
+};
+
+/**
+ * ScreenBlt
+ */
+
+static const RDS_MSG_FIELD RDS_MSG_SCREEN_BLT_FIELDS[] =
+{
+	{ offsetof(RDS_MSG_SCREEN_BLT, nLeftRect), 4, 2, RDS_FIELD_RECT, 0 },
+	{ offsetof(RDS_MSG_SCREEN_BLT, nXSrc), 2, 2, RDS_FIELD_DELTA, offsetof(RDS_MSG_SCREEN_BLT, nLeftRect) }
+};
+
 static RDS_MSG_DEFINITION RDS_MSG_SCREEN_BLT_DEFINITION =
 {
 	sizeof(RDS_MSG_SCREEN_BLT), "ScreenBlt",
-	(pXrdpMessageRead) freerds_read_screen_blt,
-	(pXrdpMessageWrite) freerds_write_screen_blt,
-	(pXrdpMessageCopy) freerds_screen_blt_copy,
-	(pXrdpMessageFree) freerds_screen_blt_free
+	NULL, NULL,
+	RDS_MSG_ENTRIES(RDS_MSG_SCREEN_BLT_FIELDS),
+	NULL, 0
 };
 
 /**
@@ -642,6 +1060,30 @@ static RDS_MSG_DEFINITION RDS_MSG_SCREEN_BLT_DEFINITION =
 
 int freerds_read_paint_rect(wStream* s, RDS_MSG_PAINT_RECT* msg)
 {
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		freerds_read_header_rect((RDS_MSG_COMMON*) msg, &msg->nLeftRect, &msg->nTopRect, &msg->nWidth, &msg->nHeight);
+
+		if (freerds_read_varint(s, &msg->bitmapDataLength) < 0)
+			return -1;
+
+		if (msg->bitmapDataLength)
+		{
+			if (Stream_GetRemainingLength(s) < msg->bitmapDataLength)
+				return -1;
+
+			Stream_GetPointer(s, msg->bitmapData);
+			Stream_Seek(s, msg->bitmapDataLength);
+		}
+		else
+		{
+			if (freerds_read_varint(s, &msg->fbSegmentId) < 0)
+				return -1;
+		}
+
+		return freerds_read_source_delta(s, msg->nLeftRect, msg->nTopRect, &msg->nXSrc, &msg->nYSrc);
+	}
+
 	if (Stream_GetRemainingLength(s) < 12)
 		return -1;
 
@@ -678,22 +1120,60 @@ int freerds_read_paint_rect(wStream* s, RDS_MSG_PAINT_RECT* msg)
 
 int freerds_write_paint_rect(wStream* s, RDS_MSG_PAINT_RECT* msg)
 {
-	msg->msgFlags = RDS_MSG_FLAG_RECT;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 20;
-
-	if (msg->fbSegmentId)
-		msg->length += 4;
-	else
-		msg->length += msg->bitmapDataLength;
+	UINT32 length;
 
-	if (!s)
-		return msg->length;
+	msg->msgFlags = RDS_MSG_FLAG_RECT | (msg->msgFlags & (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT));
 
 	msg->rect.x = msg->nLeftRect;
 	msg->rect.y = msg->nTopRect;
 	msg->rect.width = msg->nWidth;
 	msg->rect.height = msg->nHeight;
 
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		/* the destination rectangle is the header rect, the size is not repeated */
+		length = freerds_write_source_delta(NULL, msg->nLeftRect, msg->nTopRect, msg->nXSrc, msg->nYSrc);
+
+		if (msg->fbSegmentId)
+			length += 1 + freerds_varint_length(msg->fbSegmentId);
+		else
+			length += freerds_varint_length(msg->bitmapDataLength) + msg->bitmapDataLength;
+
+		msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, length);
+
+		if (!s)
+			return msg->length;
+
+		freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+
+		if (msg->fbSegmentId)
+		{
+			freerds_write_varint(s, 0);
+			freerds_write_varint(s, msg->fbSegmentId);
+		}
+		else
+		{
+			freerds_write_varint(s, msg->bitmapDataLength);
+			Stream_Write(s, msg->bitmapData, msg->bitmapDataLength);
+		}
+
+		freerds_write_source_delta(s, msg->nLeftRect, msg->nTopRect, msg->nXSrc, msg->nYSrc);
+
+		return 0;
+	}
+
+	length = 20;
+
+	if (msg->fbSegmentId)
+		length += 4;
+	else
+		length += msg->bitmapDataLength;
+
+	msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, length);
+
+	if (!s)
+		return msg->length;
+
 	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
 
 	Stream_Write_UINT16(s, msg->nLeftRect);
@@ -720,37 +1200,18 @@ int freerds_write_paint_rect(wStream* s, RDS_MSG_PAINT_RECT* msg)
 	return 0;
 }
 
-void* freerds_paint_rect_copy(RDS_MSG_PAINT_RECT* msg)
-{
-	RDS_MSG_PAINT_RECT* dup = NULL;
-
-	dup = (RDS_MSG_PAINT_RECT*) malloc(sizeof(RDS_MSG_PAINT_RECT));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_PAINT_RECT));
-
-	if (msg->bitmapDataLength)
-	{
-		dup->bitmapData = (BYTE*) malloc(msg->bitmapDataLength);
-		CopyMemory(dup->bitmapData, msg->bitmapData, msg->bitmapDataLength);
-	}
-
-	return (void*) dup;
-}
-
-void freerds_paint_rect_free(RDS_MSG_PAINT_RECT* msg)
+static const RDS_MSG_BUFFER RDS_MSG_PAINT_RECT_BUFFERS[] =
 {
-	if (msg->bitmapDataLength)
-		free(msg->bitmapData);
-
-	free(msg);
-}
+	{ offsetof(RDS_MSG_PAINT_RECT, bitmapData), offsetof(RDS_MSG_PAINT_RECT, bitmapDataLength), 1, 0 }
+};
 
 static RDS_MSG_DEFINITION RDS_MSG_PAINT_RECT_DEFINITION =
 {
 	sizeof(RDS_MSG_PAINT_RECT), "PaintRect",
 	(pXrdpMessageRead) freerds_read_paint_rect,
 	(pXrdpMessageWrite) freerds_write_paint_rect,
-	(pXrdpMessageCopy) freerds_paint_rect_copy,
-	(pXrdpMessageFree) freerds_paint_rect_free
+	NULL, 0,
+	RDS_MSG_ENTRIES(RDS_MSG_PAINT_RECT_BUFFERS)
 };
 
 /**
@@ -759,93 +1220,46 @@ static RDS_MSG_DEFINITION RDS_MSG_PAINT_RECT_DEFINITION =
 
 int freerds_read_patblt(wStream* s, RDS_MSG_PATBLT* msg)
 {
-	if (Stream_GetRemainingLength(s) < 60)
-		return -1;
-
-	Stream_Read_UINT32(s, msg->nLeftRect);
-	Stream_Read_UINT32(s, msg->nTopRect);
-	Stream_Read_UINT32(s, msg->nWidth);
-	Stream_Read_UINT32(s, msg->nHeight);
-	Stream_Read_UINT32(s, msg->bRop);
-	Stream_Read_UINT32(s, msg->backColor);
-	Stream_Read_UINT32(s, msg->foreColor);
-
-	Stream_Read_UINT32(s, msg->brush.x);
-	Stream_Read_UINT32(s, msg->brush.y);
-	Stream_Read_UINT32(s, msg->brush.bpp);
-	Stream_Read_UINT32(s, msg->brush.style);
-	Stream_Read_UINT32(s, msg->brush.hatch);
-	Stream_Read_UINT32(s, msg->brush.index);
-	Stream_Read(s, msg->brush.data, 8);
-
-	return 0;
-}
-
-int freerds_write_patblt(wStream* s, RDS_MSG_PATBLT* msg)
-{
-	msg->msgFlags = RDS_MSG_FLAG_RECT;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 60;
-
-	if (!s)
-		return msg->length;
-
-	msg->rect.x = msg->nLeftRect;
-	msg->rect.y = msg->nTopRect;
-	msg->rect.width = msg->nWidth;
-	msg->rect.height = msg->nHeight;
-
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		BYTE hasBrush;
 
-	Stream_Write_UINT32(s, msg->nLeftRect);
-	Stream_Write_UINT32(s, msg->nTopRect);
-	Stream_Write_UINT32(s, msg->nWidth);
-	Stream_Write_UINT32(s, msg->nHeight);
-	Stream_Write_UINT32(s, msg->bRop);
-	Stream_Write_UINT32(s, msg->backColor);
-	Stream_Write_UINT32(s, msg->foreColor);
+		freerds_read_header_rect((RDS_MSG_COMMON*) msg, &msg->nLeftRect, &msg->nTopRect, &msg->nWidth, &msg->nHeight);
 
-	Stream_Write_UINT32(s, msg->brush.x);
-	Stream_Write_UINT32(s, msg->brush.y);
-	Stream_Write_UINT32(s, msg->brush.bpp);
-	Stream_Write_UINT32(s, msg->brush.style);
-	Stream_Write_UINT32(s, msg->brush.hatch);
-	Stream_Write_UINT32(s, msg->brush.index);
-	Stream_Write(s, msg->brush.data, 8);
+		if ((freerds_read_varint(s, &msg->bRop) < 0) ||
+				(freerds_read_varint(s, &msg->backColor) < 0) ||
+				(freerds_read_varint(s, &msg->foreColor) < 0))
+			return -1;
 
-	return 0;
-}
+		if (Stream_GetRemainingLength(s) < 1)
+			return -1;
 
-void* freerds_patblt_copy(RDS_MSG_PATBLT* msg)
-{
-	RDS_MSG_PATBLT* dup = NULL;
+		Stream_Read_UINT8(s, hasBrush);
 
-	dup = (RDS_MSG_PATBLT*) malloc(sizeof(RDS_MSG_PATBLT));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_PATBLT));
+		if (!hasBrush)
+		{
+			msg->brush.x = msg->brush.y = msg->brush.bpp = 0;
+			msg->brush.style = msg->brush.hatch = msg->brush.index = 0;
+			return 0;
+		}
 
-	return (void*) dup;
-}
+		if ((freerds_read_varint(s, &msg->brush.x) < 0) ||
+				(freerds_read_varint(s, &msg->brush.y) < 0) ||
+				(freerds_read_varint(s, &msg->brush.bpp) < 0) ||
+				(freerds_read_varint(s, &msg->brush.style) < 0) ||
+				(freerds_read_varint(s, &msg->brush.hatch) < 0) ||
+				(freerds_read_varint(s, &msg->brush.index) < 0))
+			return -1;
 
-void freerds_patblt_free(RDS_MSG_PATBLT* msg)
-{
-	free(msg);
-}
+		if (Stream_GetRemainingLength(s) < 8)
+			return -1;
 
-static RDS_MSG_DEFINITION RDS_MSG_PATBLT_DEFINITION =
-{
-	sizeof(RDS_MSG_PATBLT), "PatBlt",
-	(pXrdpMessageRead) freerds_read_patblt,
-	(pXrdpMessageWrite) freerds_write_patblt,
-	(pXrdpMessageCopy) freerds_patblt_copy,
-	(pXrdpMessageFree) freerds_patblt_free
-};
+		Stream_Read(s, msg->brush.data, 8);
 
-/**
- * DstBlt
- */
+		return 0;
+	}
 
-int freerds_read_dstblt(wStream* s, RDS_MSG_DSTBLT* msg)
-{
-	if (Stream_GetRemainingLength(s) < 20)
+	if (Stream_GetRemainingLength(s) < 60)
 		return -1;
 
 	Stream_Read_UINT32(s, msg->nLeftRect);
@@ -853,351 +1267,215 @@ int freerds_read_dstblt(wStream* s, RDS_MSG_DSTBLT* msg)
 	Stream_Read_UINT32(s, msg->nWidth);
 	Stream_Read_UINT32(s, msg->nHeight);
 	Stream_Read_UINT32(s, msg->bRop);
+	Stream_Read_UINT32(s, msg->backColor);
+	Stream_Read_UINT32(s, msg->foreColor);
 
-	return 0;
-}
-
-int freerds_write_dstblt(wStream* s, RDS_MSG_DSTBLT* msg)
-{
-	msg->msgFlags = RDS_MSG_FLAG_RECT;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 20;
-
-	if (!s)
-		return msg->length;
-
-	msg->rect.x = msg->nLeftRect;
-	msg->rect.y = msg->nTopRect;
-	msg->rect.width = msg->nWidth;
-	msg->rect.height = msg->nHeight;
-
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
-
-	Stream_Write_UINT32(s, msg->nLeftRect);
-	Stream_Write_UINT32(s, msg->nTopRect);
-	Stream_Write_UINT32(s, msg->nWidth);
-	Stream_Write_UINT32(s, msg->nHeight);
-	Stream_Write_UINT32(s, msg->bRop);
-
-	return 0;
-}
-
-void* freerds_dstblt_copy(RDS_MSG_DSTBLT* msg)
-{
-	RDS_MSG_DSTBLT* dup = NULL;
-
-	dup = (RDS_MSG_DSTBLT*) malloc(sizeof(RDS_MSG_DSTBLT));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_DSTBLT));
-
-	return (void*) dup;
-}
-
-void freerds_dstblt_free(RDS_MSG_DSTBLT* msg)
-{
-	free(msg);
-}
-
-static RDS_MSG_DEFINITION RDS_MSG_DSTBLT_DEFINITION =
-{
-	sizeof(RDS_MSG_DSTBLT), "DstBlt",
-	(pXrdpMessageRead) freerds_read_dstblt,
-	(pXrdpMessageWrite) freerds_write_dstblt,
-	(pXrdpMessageCopy) freerds_dstblt_copy,
-	(pXrdpMessageFree) freerds_dstblt_free
-};
-
-/**
- * LineTo
- */
-
-int freerds_read_line_to(wStream* s, RDS_MSG_LINE_TO* msg)
-{
-	if (Stream_GetRemainingLength(s) < 8 * 4)
-		return -1;
-
-	Stream_Read_UINT32(s, msg->nXStart);
-	Stream_Read_UINT32(s, msg->nYStart);
-	Stream_Read_UINT32(s, msg->nXEnd);
-	Stream_Read_UINT32(s, msg->nYEnd);
-	Stream_Read_UINT32(s, msg->bRop2);
-	Stream_Read_UINT32(s, msg->penStyle);
-	Stream_Read_UINT32(s, msg->penWidth);
-	Stream_Read_UINT32(s, msg->penColor);
-
-	return 0;
-}
-
-int freerds_write_line_to(wStream* s, RDS_MSG_LINE_TO* msg)
-{
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 32;
-
-	if (!s)
-		return msg->length;
-
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
-
-	Stream_Write_UINT32(s, msg->nXStart);
-	Stream_Write_UINT32(s, msg->nYStart);
-	Stream_Write_UINT32(s, msg->nXEnd);
-	Stream_Write_UINT32(s, msg->nYEnd);
-	Stream_Write_UINT32(s, msg->bRop2);
-	Stream_Write_UINT32(s, msg->penStyle);
-	Stream_Write_UINT32(s, msg->penWidth);
-	Stream_Write_UINT32(s, msg->penColor);
-
-	return 0;
-}
-
-void* freerds_line_to_copy(RDS_MSG_LINE_TO* msg)
-{
-	RDS_MSG_LINE_TO* dup = NULL;
-
-	dup = (RDS_MSG_LINE_TO*) malloc(sizeof(RDS_MSG_LINE_TO));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_LINE_TO));
-
-	return (void*) dup;
-}
-
-void freerds_line_to_free(RDS_MSG_LINE_TO* msg)
-{
-	free(msg);
-}
-
-static RDS_MSG_DEFINITION RDS_MSG_LINE_TO_DEFINITION =
-{
-	sizeof(RDS_MSG_LINE_TO), "LineTo",
-	(pXrdpMessageRead) freerds_read_line_to,
-	(pXrdpMessageWrite) freerds_write_line_to,
-	(pXrdpMessageCopy) freerds_line_to_copy,
-	(pXrdpMessageFree) freerds_line_to_free
-};
-
-/**
- * CreateOffscreenSurface
- */
-
-int freerds_read_create_offscreen_surface(wStream* s, RDS_MSG_CREATE_OFFSCREEN_SURFACE* msg)
-{
-	if (Stream_GetRemainingLength(s) < 8)
-		return -1;
-
-	Stream_Read_UINT32(s, msg->cacheIndex);
-	Stream_Read_UINT16(s, msg->nWidth);
-	Stream_Read_UINT16(s, msg->nHeight);
+	Stream_Read_UINT32(s, msg->brush.x);
+	Stream_Read_UINT32(s, msg->brush.y);
+	Stream_Read_UINT32(s, msg->brush.bpp);
+	Stream_Read_UINT32(s, msg->brush.style);
+	Stream_Read_UINT32(s, msg->brush.hatch);
+	Stream_Read_UINT32(s, msg->brush.index);
+	Stream_Read(s, msg->brush.data, 8);
 
 	return 0;
 }
 
-int freerds_write_create_offscreen_surface(wStream* s, RDS_MSG_CREATE_OFFSCREEN_SURFACE* msg)
+int freerds_write_patblt(wStream* s, RDS_MSG_PATBLT* msg)
 {
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 8;
-
-	if (!s)
-		return msg->length;
-
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+	msg->msgFlags = RDS_MSG_FLAG_RECT | (msg->msgFlags & (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT));
 
-	Stream_Write_UINT32(s, msg->cacheIndex);
-	Stream_Write_UINT16(s, msg->nWidth);
-	Stream_Write_UINT16(s, msg->nHeight);
+	msg->rect.x = msg->nLeftRect;
+	msg->rect.y = msg->nTopRect;
+	msg->rect.width = msg->nWidth;
+	msg->rect.height = msg->nHeight;
 
-	return 0;
-}
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		UINT32 length;
+		BOOL hasBrush;
 
-void* freerds_create_offscreen_surface_copy(RDS_MSG_CREATE_OFFSCREEN_SURFACE* msg)
-{
-	RDS_MSG_CREATE_OFFSCREEN_SURFACE* dup = NULL;
+		/* solid fills carry no brush, which is then left out */
+		hasBrush = msg->brush.x || msg->brush.y || msg->brush.bpp || msg->brush.style ||
+				msg->brush.hatch || msg->brush.index;
 
-	dup = (RDS_MSG_CREATE_OFFSCREEN_SURFACE*) malloc(sizeof(RDS_MSG_CREATE_OFFSCREEN_SURFACE));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_CREATE_OFFSCREEN_SURFACE));
+		length = freerds_varint_length(msg->bRop) + freerds_varint_length(msg->backColor) +
+				freerds_varint_length(msg->foreColor) + 1;
 
-	return (void*) dup;
-}
+		if (hasBrush)
+		{
+			length += freerds_varint_length(msg->brush.x) + freerds_varint_length(msg->brush.y) +
+					freerds_varint_length(msg->brush.bpp) + freerds_varint_length(msg->brush.style) +
+					freerds_varint_length(msg->brush.hatch) + freerds_varint_length(msg->brush.index) + 8;
+		}
 
-void freerds_create_offscreen_surface_free(RDS_MSG_CREATE_OFFSCREEN_SURFACE* msg)
-{
-	free(msg);
-}
+		msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, length);
 
-static RDS_MSG_DEFINITION RDS_MSG_CREATE_OFFSCREEN_SURFACE_DEFINITION =
-{
-	sizeof(RDS_MSG_CREATE_OFFSCREEN_SURFACE), "CreateOffscreenSurface",
-	(pXrdpMessageRead) freerds_read_create_offscreen_surface,
-	(pXrdpMessageWrite) freerds_write_create_offscreen_surface,
-	(pXrdpMessageCopy) freerds_create_offscreen_surface_copy,
-	(pXrdpMessageFree) freerds_create_offscreen_surface_free
-};
+		if (!s)
+			return msg->length;
 
-/**
- * SwitchOffscreenSurface
- */
+		freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
 
-int freerds_read_switch_offscreen_surface(wStream* s, RDS_MSG_SWITCH_OFFSCREEN_SURFACE* msg)
-{
-	if (Stream_GetRemainingLength(s) < 4)
-		return -1;
+		freerds_write_varint(s, msg->bRop);
+		freerds_write_varint(s, msg->backColor);
+		freerds_write_varint(s, msg->foreColor);
+		Stream_Write_UINT8(s, hasBrush ? 1 : 0);
 
-	Stream_Read_UINT32(s, msg->cacheIndex);
+		if (hasBrush)
+		{
+			freerds_write_varint(s, msg->brush.x);
+			freerds_write_varint(s, msg->brush.y);
+			freerds_write_varint(s, msg->brush.bpp);
+			freerds_write_varint(s, msg->brush.style);
+			freerds_write_varint(s, msg->brush.hatch);
+			freerds_write_varint(s, msg->brush.index);
+			Stream_Write(s, msg->brush.data, 8);
+		}
 
-	return 0;
-}
+		return 0;
+	}
 
-int freerds_write_switch_offscreen_surface(wStream* s, RDS_MSG_SWITCH_OFFSCREEN_SURFACE* msg)
-{
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 4;
+	msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, 60);
 
 	if (!s)
 		return msg->length;
 
 	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
 
-	Stream_Write_UINT32(s, msg->cacheIndex);
+	Stream_Write_UINT32(s, msg->nLeftRect);
+	Stream_Write_UINT32(s, msg->nTopRect);
+	Stream_Write_UINT32(s, msg->nWidth);
+	Stream_Write_UINT32(s, msg->nHeight);
+	Stream_Write_UINT32(s, msg->bRop);
+	Stream_Write_UINT32(s, msg->backColor);
+	Stream_Write_UINT32(s, msg->foreColor);
+
+	Stream_Write_UINT32(s, msg->brush.x);
+	Stream_Write_UINT32(s, msg->brush.y);
+	Stream_Write_UINT32(s, msg->brush.bpp);
+	Stream_Write_UINT32(s, msg->brush.style);
+	Stream_Write_UINT32(s, msg->brush.hatch);
+	Stream_Write_UINT32(s, msg->brush.index);
+	Stream_Write(s, msg->brush.data, 8);
 
 	return 0;
 }
 
-void* freerds_switch_offscreen_surface_copy(RDS_MSG_SWITCH_OFFSCREEN_SURFACE* msg)
+static RDS_MSG_DEFINITION RDS_MSG_PATBLT_DEFINITION =
 {
-	RDS_MSG_SWITCH_OFFSCREEN_SURFACE* dup = NULL;
-
-	dup = (RDS_MSG_SWITCH_OFFSCREEN_SURFACE*) malloc(sizeof(RDS_MSG_SWITCH_OFFSCREEN_SURFACE));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_SWITCH_OFFSCREEN_SURFACE));
+	sizeof(RDS_MSG_PATBLT), "PatBlt",
+	(pXrdpMessageRead) freerds_read_patblt,
+	(pXrdpMessageWrite) freerds_write_patblt,
+	NULL, 0,
+	NULL, 0
+};
 
-	return (void*) dup;
-}
+/**
+ * DstBlt
+ */
 
-void freerds_switch_offscreen_surface_free(RDS_MSG_SWITCH_OFFSCREEN_SURFACE* msg)
+static const RDS_MSG_FIELD RDS_MSG_DSTBLT_FIELDS[] =
 {
-	free(msg);
-}
+	{ offsetof(RDS_MSG_DSTBLT, nLeftRect), 4, 4, RDS_FIELD_RECT, 0 },
+	{ offsetof(RDS_MSG_DSTBLT, bRop), 1, 4, RDS_FIELD_VARINT, 0 }
+};
 
-static RDS_MSG_DEFINITION RDS_MSG_SWITCH_OFFSCREEN_SURFACE_DEFINITION =
+static RDS_MSG_DEFINITION RDS_MSG_DSTBLT_DEFINITION =
 {
-	sizeof(RDS_MSG_SWITCH_OFFSCREEN_SURFACE), "SwitchOffscreenSurface",
-	(pXrdpMessageRead) freerds_read_switch_offscreen_surface,
-	(pXrdpMessageWrite) freerds_write_switch_offscreen_surface,
-	(pXrdpMessageCopy) freerds_switch_offscreen_surface_copy,
-	(pXrdpMessageFree) freerds_switch_offscreen_surface_free
+	sizeof(RDS_MSG_DSTBLT), "DstBlt",
+	NULL, NULL,
+	RDS_MSG_ENTRIES(RDS_MSG_DSTBLT_FIELDS),
+	NULL, 0
 };
 
 /**
- * DeleteOffscreenSurface
+ * LineTo
  */
 
-int freerds_read_delete_offscreen_surface(wStream* s, RDS_MSG_DELETE_OFFSCREEN_SURFACE* msg)
+static const RDS_MSG_FIELD RDS_MSG_LINE_TO_FIELDS[] =
 {
-	if (Stream_GetRemainingLength(s) < 4)
-		return -1;
-	Stream_Read_UINT32(s, msg->cacheIndex);
-
-	return 0;
-}
+	{ offsetof(RDS_MSG_LINE_TO, nXStart), 2, 4, RDS_FIELD_ZIGZAG, 0 },
+	{ offsetof(RDS_MSG_LINE_TO, nXEnd), 2, 4, RDS_FIELD_DELTA, offsetof(RDS_MSG_LINE_TO, nXStart) },
+	{ offsetof(RDS_MSG_LINE_TO, bRop2), 4, 4, RDS_FIELD_VARINT, 0 }
+};
 
-int freerds_write_delete_offscreen_surface(wStream* s, RDS_MSG_DELETE_OFFSCREEN_SURFACE* msg)
+static RDS_MSG_DEFINITION RDS_MSG_LINE_TO_DEFINITION =
 {
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 4;
+	sizeof(RDS_MSG_LINE_TO), "LineTo",
+	NULL, NULL,
+	RDS_MSG_ENTRIES(RDS_MSG_LINE_TO_FIELDS),
+	NULL, 0
+};
 
-	if (!s)
-		return msg->length;
+/**
+ * CreateOffscreenSurface
+ */
 
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+static const RDS_MSG_FIELD RDS_MSG_CREATE_OFFSCREEN_SURFACE_FIELDS[] =
+{
+	{ offsetof(RDS_MSG_CREATE_OFFSCREEN_SURFACE, cacheIndex), 1, 4, RDS_FIELD_FIXED, 0 },
+	{ offsetof(RDS_MSG_CREATE_OFFSCREEN_SURFACE, nWidth), 2, 2, RDS_FIELD_FIXED, 0 }
+};
 
-	Stream_Write_UINT32(s, msg->cacheIndex);
+static RDS_MSG_DEFINITION RDS_MSG_CREATE_OFFSCREEN_SURFACE_DEFINITION =
+{
+	sizeof(RDS_MSG_CREATE_OFFSCREEN_SURFACE), "CreateOffscreenSurface",
+	NULL, NULL,
+	RDS_MSG_ENTRIES(RDS_MSG_CREATE_OFFSCREEN_SURFACE_FIELDS),
+	NULL, 0
+};
 
-	return 0;
-}
+/**
+ * SwitchOffscreenSurface
+ */
 
-void* freerds_delete_offscreen_surface_copy(RDS_MSG_DELETE_OFFSCREEN_SURFACE* msg)
+static const RDS_MSG_FIELD RDS_MSG_SWITCH_OFFSCREEN_SURFACE_FIELDS[] =
 {
-	RDS_MSG_DELETE_OFFSCREEN_SURFACE* dup = NULL;
+	{ offsetof(RDS_MSG_SWITCH_OFFSCREEN_SURFACE, cacheIndex), 1, 4, RDS_FIELD_FIXED, 0 }
+};
 
-	dup = (RDS_MSG_DELETE_OFFSCREEN_SURFACE*) malloc(sizeof(RDS_MSG_DELETE_OFFSCREEN_SURFACE));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_DELETE_OFFSCREEN_SURFACE));
+static RDS_MSG_DEFINITION RDS_MSG_SWITCH_OFFSCREEN_SURFACE_DEFINITION =
+{
+	sizeof(RDS_MSG_SWITCH_OFFSCREEN_SURFACE), "SwitchOffscreenSurface",
+	NULL, NULL,
+	RDS_MSG_ENTRIES(RDS_MSG_SWITCH_OFFSCREEN_SURFACE_FIELDS),
+	NULL, 0
+};
 
-	return (void*) dup;
-}
+/**
+ * DeleteOffscreenSurface
+ */
 
-void freerds_delete_offscreen_surface_free(RDS_MSG_DELETE_OFFSCREEN_SURFACE* msg)
+static const RDS_MSG_FIELD RDS_MSG_DELETE_OFFSCREEN_SURFACE_FIELDS[] =
 {
-	free(msg);
-}
+	{ offsetof(RDS_MSG_DELETE_OFFSCREEN_SURFACE, cacheIndex), 1, 4, RDS_FIELD_FIXED, 0 }
+};
 
 static RDS_MSG_DEFINITION RDS_MSG_DELETE_OFFSCREEN_SURFACE_DEFINITION =
 {
 	sizeof(RDS_MSG_DELETE_OFFSCREEN_SURFACE), "DeleteOffscreenSurface",
-	(pXrdpMessageRead) freerds_read_delete_offscreen_surface,
-	(pXrdpMessageWrite) freerds_write_delete_offscreen_surface,
-	(pXrdpMessageCopy) freerds_delete_offscreen_surface_copy,
-	(pXrdpMessageFree) freerds_delete_offscreen_surface_free
+	NULL, NULL,
+	RDS_MSG_ENTRIES(RDS_MSG_DELETE_OFFSCREEN_SURFACE_FIELDS),
+	NULL, 0
 };
 
 /**
  * PaintOffscreenSurface
  */
 
-int freerds_read_paint_offscreen_surface(wStream* s, RDS_MSG_PAINT_OFFSCREEN_SURFACE* msg)
-{
-	if (Stream_GetRemainingLength(s) < 4 * 8)
-		return -1;
-	Stream_Read_UINT32(s, msg->cacheIndex);
-	Stream_Read_UINT32(s, msg->nLeftRect);
-	Stream_Read_UINT32(s, msg->nTopRect);
-	Stream_Read_UINT32(s, msg->nWidth);
-	Stream_Read_UINT32(s, msg->nHeight);
-	Stream_Read_UINT32(s, msg->nXSrc);
-	Stream_Read_UINT32(s, msg->nYSrc);
-	Stream_Read_UINT32(s, msg->bRop);
-
-	return 0;
-}
-
-int freerds_write_paint_offscreen_surface(wStream* s, RDS_MSG_PAINT_OFFSCREEN_SURFACE* msg)
-{
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 32;
-
-	if (!s)
-		return msg->length;
-
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
-
-	Stream_Write_UINT32(s, msg->cacheIndex);
-	Stream_Write_UINT32(s, msg->nLeftRect);
-	Stream_Write_UINT32(s, msg->nTopRect);
-	Stream_Write_UINT32(s, msg->nWidth);
-	Stream_Write_UINT32(s, msg->nHeight);
-	Stream_Write_UINT32(s, msg->nXSrc);
-	Stream_Write_UINT32(s, msg->nYSrc);
-	Stream_Write_UINT32(s, msg->bRop);
-
-	return 0;
-}
-
-void* freerds_paint_offscreen_surface_copy(RDS_MSG_PAINT_OFFSCREEN_SURFACE* msg)
-{
-	RDS_MSG_PAINT_OFFSCREEN_SURFACE* dup = NULL;
-
-	dup = (RDS_MSG_PAINT_OFFSCREEN_SURFACE*) malloc(sizeof(RDS_MSG_PAINT_OFFSCREEN_SURFACE));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_PAINT_OFFSCREEN_SURFACE));
-
-	return (void*) dup;
-}
-
-void freerds_paint_offscreen_surface_free(RDS_MSG_PAINT_OFFSCREEN_SURFACE* msg)
+static const RDS_MSG_FIELD RDS_MSG_PAINT_OFFSCREEN_SURFACE_FIELDS[] =
 {
-	free(msg);
-}
+	{ offsetof(RDS_MSG_PAINT_OFFSCREEN_SURFACE, cacheIndex), 5, 4, RDS_FIELD_FIXED, 0 },
+	{ offsetof(RDS_MSG_PAINT_OFFSCREEN_SURFACE, nXSrc), 2, 4, RDS_FIELD_FIXED, 0 },
+	{ offsetof(RDS_MSG_PAINT_OFFSCREEN_SURFACE, bRop), 1, 4, RDS_FIELD_FIXED, 0 }
+};
 
 static RDS_MSG_DEFINITION RDS_MSG_PAINT_OFFSCREEN_SURFACE_DEFINITION =
 {
 	sizeof(RDS_MSG_PAINT_OFFSCREEN_SURFACE), "PaintOffscreenSurface",
-	(pXrdpMessageRead) freerds_read_paint_offscreen_surface,
-	(pXrdpMessageWrite) freerds_write_paint_offscreen_surface,
-	(pXrdpMessageCopy) freerds_paint_offscreen_surface_copy,
-	(pXrdpMessageFree) freerds_paint_offscreen_surface_free
+	NULL, NULL,
+	RDS_MSG_ENTRIES(RDS_MSG_PAINT_OFFSCREEN_SURFACE_FIELDS),
+	NULL, 0
 };
 
 /**
@@ -1214,27 +1492,13 @@ int freerds_write_set_palette(wStream* s, RDS_MSG_SET_PALETTE* msg)
 	return 0;
 }
 
-void* freerds_set_palette_copy(RDS_MSG_SET_PALETTE* msg)
-{
-	RDS_MSG_SET_PALETTE* dup = NULL;
-
-	dup = (RDS_MSG_SET_PALETTE*) malloc(sizeof(RDS_MSG_SET_PALETTE));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_SET_PALETTE));
-
-	return (void*) dup;
-}
-
-void freerds_set_palette_free(RDS_MSG_SET_PALETTE* msg)
-{
-	free(msg);
-}
 static RDS_MSG_DEFINITION RDS_MSG_SET_PALETTE_DEFINITION =
 {
 	sizeof(RDS_MSG_SET_PALETTE), "SetPalette",
 	(pXrdpMessageRead) freerds_read_set_palette,
 	(pXrdpMessageWrite) freerds_write_set_palette,
-	(pXrdpMessageCopy) freerds_set_palette_copy,
-	(pXrdpMessageFree) freerds_set_palette_free
+	NULL, 0,
+	NULL, 0
 };
 
 /**
@@ -1251,28 +1515,13 @@ int freerds_write_cache_glyph(wStream* s, RDS_MSG_CACHE_GLYPH* msg)
 	return 0;
 }
 
-void* freerds_cache_glyph_copy(RDS_MSG_CACHE_GLYPH* msg)
-{
-	RDS_MSG_CACHE_GLYPH* dup = NULL;
-
-	dup = (RDS_MSG_CACHE_GLYPH*) malloc(sizeof(RDS_MSG_CACHE_GLYPH));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_CACHE_GLYPH));
-
-	return (void*) dup;
-}
-
-void freerds_cache_glyph_free(RDS_MSG_CACHE_GLYPH* msg)
-{
-	free(msg);
-}
-
 static RDS_MSG_DEFINITION RDS_MSG_CACHE_GLYPH_DEFINITION =
 {
 	sizeof(RDS_MSG_CACHE_GLYPH), "CacheGlyph",
 	(pXrdpMessageRead) freerds_read_cache_glyph,
 	(pXrdpMessageWrite) freerds_write_cache_glyph,
-	(pXrdpMessageCopy) freerds_cache_glyph_copy,
-	(pXrdpMessageFree) freerds_cache_glyph_free
+	NULL, 0,
+	NULL, 0
 };
 
 /**
@@ -1289,28 +1538,13 @@ int freerds_write_glyph_index(wStream* s, RDS_MSG_GLYPH_INDEX* msg)
 	return 0;
 }
 
-void* freerds_glyph_index_copy(RDS_MSG_GLYPH_INDEX* msg)
-{
-	RDS_MSG_GLYPH_INDEX* dup = NULL;
-
-	dup = (RDS_MSG_GLYPH_INDEX*) malloc(sizeof(RDS_MSG_GLYPH_INDEX));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_GLYPH_INDEX));
-
-	return (void*) dup;
-}
-
-void freerds_glyph_index_free(RDS_MSG_GLYPH_INDEX* msg)
-{
-	free(msg);
-}
-
 static RDS_MSG_DEFINITION RDS_MSG_GLYPH_INDEX_DEFINITION =
 {
 	sizeof(RDS_MSG_GLYPH_INDEX), "GlyphIndex",
 	(pXrdpMessageRead) freerds_read_glyph_index,
 	(pXrdpMessageWrite) freerds_write_glyph_index,
-	(pXrdpMessageCopy) freerds_glyph_index_copy,
-	(pXrdpMessageFree) freerds_glyph_index_free
+	NULL, 0,
+	NULL, 0
 };
 
 /**
@@ -1352,9 +1586,9 @@ int freerds_write_set_pointer(wStream* s, RDS_MSG_SET_POINTER* msg)
 	if (!msg->lengthAndMask)
 		msg->lengthAndMask = 32 * (32 / 8);
 
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) +
-			10 + msg->lengthXorMask + msg->lengthAndMask;
+	msg->msgFlags &= (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT);
+	msg->length = freerds_message_length((RDS_MSG_COMMON*) msg,
+			10 + msg->lengthXorMask + msg->lengthAndMask);
 
 	if (!s)
 		return msg->length;
@@ -1384,163 +1618,65 @@ int freerds_write_set_pointer(wStream* s, RDS_MSG_SET_POINTER* msg)
 	return 0;
 }
 
-void* freerds_set_pointer_copy(RDS_MSG_SET_POINTER* msg)
-{
-	RDS_MSG_SET_POINTER* dup = NULL;
-
-	dup = (RDS_MSG_SET_POINTER*) malloc(sizeof(RDS_MSG_SET_POINTER));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_SET_POINTER));
-
-	if (dup->andMaskData)
-	{
-		dup->andMaskData = (BYTE*) malloc(dup->lengthAndMask);
-		CopyMemory(dup->andMaskData, msg->andMaskData, dup->lengthAndMask);
-	}
-
-	if (dup->xorMaskData)
-	{
-		dup->xorMaskData = (BYTE*) malloc(dup->lengthXorMask);
-		CopyMemory(dup->xorMaskData, msg->xorMaskData, dup->lengthXorMask);
-	}
-
-	return (void*) dup;
-}
-
-void freerds_set_pointer_free(RDS_MSG_SET_POINTER* msg)
-{
-	if (msg->andMaskData)
-		free(msg->andMaskData);
-
-	if (msg->xorMaskData)
-		free(msg->xorMaskData);
-
-	free(msg);
-}
-
-static RDS_MSG_DEFINITION RDS_MSG_SET_POINTER_DEFINITION =
-{
-	sizeof(RDS_MSG_SET_POINTER), "SetPointer",
-	(pXrdpMessageRead) freerds_read_set_pointer,
-	(pXrdpMessageWrite) freerds_write_set_pointer,
-	(pXrdpMessageCopy) freerds_set_pointer_copy,
-	(pXrdpMessageFree) freerds_set_pointer_free
-};
-
-/**
- * SetSystemPointer
- */
-
-int freerds_read_set_system_pointer(wStream* s, RDS_MSG_SET_SYSTEM_POINTER* msg)
-{
-	if (Stream_GetRemainingLength(s) < 4)
-		return -1;
-
-	Stream_Read_UINT32(s, msg->ptrType);
-	return 0;
-}
-
-int freerds_write_set_system_pointer(wStream* s, RDS_MSG_SET_SYSTEM_POINTER* msg)
-{
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) +
-			4;
-
-	if (!s)
-		return msg->length;
-
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
-
-	Stream_Write_UINT32(s, msg->ptrType);
-	return 0;
-}
-
-void* freerds_set_system_pointer_copy(RDS_MSG_SET_SYSTEM_POINTER* msg)
-{
-	RDS_MSG_SET_SYSTEM_POINTER* dup = NULL;
-
-	dup = (RDS_MSG_SET_SYSTEM_POINTER*) malloc(sizeof(RDS_MSG_SET_SYSTEM_POINTER));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_SET_SYSTEM_POINTER));
-
-	return (void*) dup;
-}
-
-void freerds_set_system_pointer_free(RDS_MSG_SET_SYSTEM_POINTER* msg)
+static const RDS_MSG_BUFFER RDS_MSG_SET_POINTER_BUFFERS[] =
 {
-	free(msg);
-}
-
-static RDS_MSG_DEFINITION RDS_MSG_SET_SYSTEM_POINTER_DEFINITION =
-{
-	sizeof(RDS_MSG_SET_SYSTEM_POINTER), "SetSystemPointer",
-	(pXrdpMessageRead) freerds_read_set_system_pointer,
-	(pXrdpMessageWrite) freerds_write_set_system_pointer,
-	(pXrdpMessageCopy) freerds_set_system_pointer_copy,
-	(pXrdpMessageFree) freerds_set_system_pointer_free
+	{ offsetof(RDS_MSG_SET_POINTER, xorMaskData), offsetof(RDS_MSG_SET_POINTER, lengthXorMask), 1, 0 },
+	{ offsetof(RDS_MSG_SET_POINTER, andMaskData), offsetof(RDS_MSG_SET_POINTER, lengthAndMask), 1, 0 }
 };
 
-/**
- * SharedFramebuffer
- */
-
-int freerds_read_shared_framebuffer(wStream* s, RDS_MSG_SHARED_FRAMEBUFFER* msg)
-{
-	if (Stream_GetRemainingLength(s) < 4 * 7)
-		return -1;
-
-	Stream_Read_UINT32(s, msg->width);
-	Stream_Read_UINT32(s, msg->height);
-	Stream_Read_UINT32(s, msg->attach);
-	Stream_Read_UINT32(s, msg->scanline);
-	Stream_Read_UINT32(s, msg->segmentId);
-	Stream_Read_UINT32(s, msg->bitsPerPixel);
-	Stream_Read_UINT32(s, msg->bytesPerPixel);
-
-	return 0;
-}
-
-int freerds_write_shared_framebuffer(wStream* s, RDS_MSG_SHARED_FRAMEBUFFER* msg)
+static RDS_MSG_DEFINITION RDS_MSG_SET_POINTER_DEFINITION =
 {
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 28;
-
-	if (!s)
-		return msg->length;
-
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
-
-	Stream_Write_UINT32(s, msg->width);
-	Stream_Write_UINT32(s, msg->height);
-	Stream_Write_UINT32(s, msg->attach);
-	Stream_Write_UINT32(s, msg->scanline);
-	Stream_Write_UINT32(s, msg->segmentId);
-	Stream_Write_UINT32(s, msg->bitsPerPixel);
-	Stream_Write_UINT32(s, msg->bytesPerPixel);
+	sizeof(RDS_MSG_SET_POINTER), "SetPointer",
+	(pXrdpMessageRead) freerds_read_set_pointer,
+	(pXrdpMessageWrite) freerds_write_set_pointer,
+	NULL, 0,
+	RDS_MSG_ENTRIES(RDS_MSG_SET_POINTER_BUFFERS)
+};
 
-	return 0;
-}
+/**
+ * SetSystemPointer
+ */
 
-void* freerds_shared_framebuffer_copy(RDS_MSG_SHARED_FRAMEBUFFER* msg)
+static const RDS_MSG_FIELD RDS_MSG_SET_SYSTEM_POINTER_FIELDS[] =
 {
-	RDS_MSG_SHARED_FRAMEBUFFER* dup = NULL;
+	{ offsetof(RDS_MSG_SET_SYSTEM_POINTER, ptrType), 1, 4, RDS_FIELD_FIXED, 0 }
+};
 
-	dup = (RDS_MSG_SHARED_FRAMEBUFFER*) malloc(sizeof(RDS_MSG_SHARED_FRAMEBUFFER));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_SHARED_FRAMEBUFFER));
+static RDS_MSG_DEFINITION RDS_MSG_SET_SYSTEM_POINTER_DEFINITION =
+{
+	sizeof(RDS_MSG_SET_SYSTEM_POINTER), "SetSystemPointer",
+	NULL, NULL,
+	RDS_MSG_ENTRIES(RDS_MSG_SET_SYSTEM_POINTER_FIELDS),
+	NULL, 0
+};
 
-	return (void*) dup;
-}
+/**
+ * SharedFramebuffer
+ */
 
-void freerds_shared_framebuffer_free(RDS_MSG_SHARED_FRAMEBUFFER* msg)
+static const RDS_MSG_FIELD RDS_MSG_SHARED_FRAMEBUFFER_FIELDS[] =
 {
-	free(msg);
-}
+	{ offsetof(RDS_MSG_SHARED_FRAMEBUFFER, width), 7, 4, RDS_FIELD_FIXED, 0 }
+};
 
 static RDS_MSG_DEFINITION RDS_MSG_SHARED_FRAMEBUFFER_DEFINITION =
 {
 	sizeof(RDS_MSG_SHARED_FRAMEBUFFER), "SharedFramebuffer",
-	(pXrdpMessageRead) freerds_read_shared_framebuffer,
-	(pXrdpMessageWrite) freerds_write_shared_framebuffer,
-	(pXrdpMessageCopy) freerds_shared_framebuffer_copy,
-	(pXrdpMessageFree) freerds_shared_framebuffer_free
+	NULL, NULL,
+	RDS_MSG_ENTRIES(RDS_MSG_SHARED_FRAMEBUFFER_FIELDS),
+	NULL, 0
+};
+
+/**
+ * FrameReady
+ */
+
+static RDS_MSG_DEFINITION RDS_MSG_FRAME_READY_DEFINITION =
+{
+	sizeof(RDS_MSG_FRAME_READY), "FrameReady",
+	NULL, NULL,
+	NULL, 0,
+	NULL, 0
 };
 
 /**
@@ -1557,28 +1693,13 @@ int freerds_write_beep(wStream* s, RDS_MSG_BEEP* msg)
 	return 0;
 }
 
-void* freerds_beep_copy(RDS_MSG_BEEP* msg)
-{
-	RDS_MSG_BEEP* dup = NULL;
-
-	dup = (RDS_MSG_BEEP*) malloc(sizeof(RDS_MSG_BEEP));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_BEEP));
-
-	return (void*) dup;
-}
-
-void freerds_beep_free(RDS_MSG_BEEP* msg)
-{
-	free(msg);
-}
-
 static RDS_MSG_DEFINITION RDS_MSG_BEEP_DEFINITION =
 {
 	sizeof(RDS_MSG_BEEP), "Beep",
 	(pXrdpMessageRead) freerds_read_beep,
 	(pXrdpMessageWrite) freerds_write_beep,
-	(pXrdpMessageCopy) freerds_beep_copy,
-	(pXrdpMessageFree) freerds_beep_free
+	NULL, 0,
+	NULL, 0
 };
 
 /**
@@ -1595,28 +1716,13 @@ int freerds_write_reset(wStream* s, RDS_MSG_RESET* msg)
 	return 0;
 }
 
-void* freerds_reset_copy(RDS_MSG_RESET* msg)
-{
-	RDS_MSG_RESET* dup = NULL;
-
-	dup = (RDS_MSG_RESET*) malloc(sizeof(RDS_MSG_RESET));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_RESET));
-
-	return (void*) dup;
-}
-
-void freerds_reset_free(RDS_MSG_RESET* msg)
-{
-	free(msg);
-}
-
 static RDS_MSG_DEFINITION RDS_MSG_RESET_DEFINITION =
 {
 	sizeof(RDS_MSG_RESET), "Reset",
 	(pXrdpMessageRead) freerds_read_reset,
 	(pXrdpMessageWrite) freerds_write_reset,
-	(pXrdpMessageCopy) freerds_reset_copy,
-	(pXrdpMessageFree) freerds_reset_free
+	NULL, 0,
+	NULL, 0
 };
 
 /**
@@ -1741,11 +1847,11 @@ int freerds_write_window_new_update(wStream* s, RDS_MSG_WINDOW_NEW_UPDATE* msg)
 	int index;
 	UINT32 flags;
 
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) +
+	msg->msgFlags &= (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT);
+	msg->length = freerds_message_length((RDS_MSG_COMMON*) msg,
 			(5 * 4) + (2 + msg->titleInfo.length) + (12 * 4) +
 			(2 + msg->numWindowRects * 8) + (4 + 4) +
-			(2 + msg->numVisibilityRects * 8) + 4;
+			(2 + msg->numVisibilityRects * 8) + 4);
 
 	if (!s)
 		return msg->length;
@@ -1819,272 +1925,718 @@ int freerds_write_window_new_update(wStream* s, RDS_MSG_WINDOW_NEW_UPDATE* msg)
 		Stream_Write_UINT16(s, msg->visibilityRects[index].bottom); /* bottom */
 	}
 
-	flags |= WINDOW_ORDER_FIELD_VISIBILITY;
+	flags |= WINDOW_ORDER_FIELD_VISIBILITY;
+
+	Stream_Write_UINT32(s, flags); /* flags */
+
+	return 0;
+}
+
+static RDS_MSG_DEFINITION RDS_MSG_WINDOW_NEW_UPDATE_DEFINITION =
+{
+	sizeof(RDS_MSG_WINDOW_NEW_UPDATE), "WindowNewUpdate",
+	(pXrdpMessageRead) freerds_read_window_new_update,
+	(pXrdpMessageWrite) freerds_write_window_new_update,
+	NULL, 0,
+	NULL, 0
+};
+
+/**
+ * WindowDelete
+ */
+
+static const RDS_MSG_FIELD RDS_MSG_WINDOW_DELETE_FIELDS[] =
+{
+	{ offsetof(RDS_MSG_WINDOW_DELETE, windowId), 1, 4, RDS_FIELD_FIXED, 0 }
+};
+
+static RDS_MSG_DEFINITION RDS_MSG_WINDOW_DELETE_DEFINITION =
+{
+	sizeof(RDS_MSG_WINDOW_DELETE), "WindowDelete",
+	NULL, NULL,
+	RDS_MSG_ENTRIES(RDS_MSG_WINDOW_DELETE_FIELDS),
+	NULL, 0
+};
+
+/**
+ * LogonUser
+ */
+
+int freerds_read_logon_user(wStream* s, RDS_MSG_LOGON_USER* msg)
+{
+	if (Stream_GetRemainingLength(s) < 12)
+		return -1;
+
+	Stream_Read_UINT32(s, msg->Flags);
+	Stream_Read_UINT32(s, msg->UserLength);
+	Stream_Read_UINT32(s, msg->DomainLength);
+	Stream_Read_UINT32(s, msg->PasswordLength);
+
+	msg->User = msg->Domain = msg->Password = NULL;
+
+	if (msg->UserLength)
+	{
+		msg->User = (char*) malloc(msg->UserLength + 1);
+		Stream_Read(s, msg->User, msg->UserLength);
+		msg->User[msg->UserLength] = '\0';
+	}
+
+	if (msg->DomainLength)
+	{
+		msg->Domain = (char*) malloc(msg->DomainLength + 1);
+		Stream_Read(s, msg->Domain, msg->DomainLength);
+		msg->Domain[msg->DomainLength] = '\0';
+	}
+
+	if (msg->PasswordLength)
+	{
+		msg->Password = (char*) malloc(msg->PasswordLength + 1);
+		Stream_Read(s, msg->Password, msg->PasswordLength);
+		msg->Password[msg->PasswordLength] = '\0';
+	}
+
+	return 0;
+}
+
+int freerds_write_logon_user(wStream* s, RDS_MSG_LOGON_USER* msg)
+{
+	msg->msgFlags &= (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT);
+
+	msg->UserLength = msg->DomainLength = msg->PasswordLength = 0;
+
+	if (msg->User)
+		msg->UserLength = strlen(msg->User);
+
+	if (msg->Domain)
+		msg->DomainLength = strlen(msg->Domain);
+
+	if (msg->Password)
+		msg->PasswordLength = strlen(msg->Password);
+
+	msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, 12 +
+			msg->UserLength + msg->DomainLength + msg->PasswordLength);
+
+	if (!s)
+		return msg->length;
+
+	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+
+	Stream_Write_UINT32(s, msg->Flags);
+	Stream_Write_UINT32(s, msg->UserLength);
+	Stream_Write_UINT32(s, msg->DomainLength);
+	Stream_Write_UINT32(s, msg->PasswordLength);
+
+	if (msg->UserLength)
+		Stream_Write(s, msg->User, msg->UserLength);
+
+	if (msg->DomainLength)
+		Stream_Write(s, msg->Domain, msg->DomainLength);
+
+	if (msg->PasswordLength)
+		Stream_Write(s, msg->Password, msg->PasswordLength);
+
+	return 0;
+}
+
+static const RDS_MSG_BUFFER RDS_MSG_LOGON_USER_BUFFERS[] =
+{
+	{ offsetof(RDS_MSG_LOGON_USER, User), offsetof(RDS_MSG_LOGON_USER, UserLength), 1, 1 },
+	{ offsetof(RDS_MSG_LOGON_USER, Domain), offsetof(RDS_MSG_LOGON_USER, DomainLength), 1, 1 },
+	{ offsetof(RDS_MSG_LOGON_USER, Password), offsetof(RDS_MSG_LOGON_USER, PasswordLength), 1, 1 }
+};
+
+static RDS_MSG_DEFINITION RDS_MSG_LOGON_USER_DEFINITION =
+{
+	sizeof(RDS_MSG_LOGON_USER), "LogonUser",
+	(pXrdpMessageRead) freerds_read_logon_user,
+	(pXrdpMessageWrite) freerds_write_logon_user,
+	NULL, 0,
+	RDS_MSG_ENTRIES(RDS_MSG_LOGON_USER_BUFFERS)
+};
+
+/**
+ * LogoffUser
+ */
+
+static const RDS_MSG_FIELD RDS_MSG_LOGOFF_USER_FIELDS[] =
+{
+	{ offsetof(RDS_MSG_LOGOFF_USER, Flags), 1, 4, RDS_FIELD_FIXED, 0 }
+};
+
+static RDS_MSG_DEFINITION RDS_MSG_LOGOFF_USER_DEFINITION =
+{
+	sizeof(RDS_MSG_LOGOFF_USER), "LogoffUser",
+	NULL, NULL,
+	RDS_MSG_ENTRIES(RDS_MSG_LOGOFF_USER_FIELDS),
+	NULL, 0
+};
+
+/**
+ * PaintRects
+ */
+
+static void freerds_read_rectangle_list(wStream* s, RECTANGLE_16* rects, UINT32 count)
+{
+	UINT32 index;
+
+	for (index = 0; index < count; index++)
+	{
+		Stream_Read_UINT16(s, rects[index].left);
+		Stream_Read_UINT16(s, rects[index].top);
+		Stream_Read_UINT16(s, rects[index].right);
+		Stream_Read_UINT16(s, rects[index].bottom);
+	}
+}
+
+static void freerds_write_rectangle_list(wStream* s, RECTANGLE_16* rects, UINT32 count)
+{
+	UINT32 index;
+
+	for (index = 0; index < count; index++)
+	{
+		Stream_Write_UINT16(s, rects[index].left);
+		Stream_Write_UINT16(s, rects[index].top);
+		Stream_Write_UINT16(s, rects[index].right);
+		Stream_Write_UINT16(s, rects[index].bottom);
+	}
+}
+
+/**
+ * Compact rectangle lists code each rectangle as the offset of its top left
+ * corner from the previous one (from the header rect for the first one)
+ * followed by its size. They cannot be decoded in place, the reader allocates
+ * the list and the caller releases it with free().
+ */
+
+static int freerds_compact_rectangle_list_length(RECTANGLE_16* rects, UINT32 count, RDS_RECT* origin)
+{
+	UINT32 index;
+	int length = 0;
+	INT32 x = origin->x;
+	INT32 y = origin->y;
+
+	for (index = 0; index < count; index++)
+	{
+		length += freerds_varint_length(freerds_zigzag_encode(rects[index].left - x));
+		length += freerds_varint_length(freerds_zigzag_encode(rects[index].top - y));
+		length += freerds_varint_length(rects[index].right - rects[index].left);
+		length += freerds_varint_length(rects[index].bottom - rects[index].top);
+
+		x = rects[index].left;
+		y = rects[index].top;
+	}
+
+	return length;
+}
+
+static void freerds_write_compact_rectangle_list(wStream* s, RECTANGLE_16* rects, UINT32 count, RDS_RECT* origin)
+{
+	UINT32 index;
+	INT32 x = origin->x;
+	INT32 y = origin->y;
+
+	for (index = 0; index < count; index++)
+	{
+		freerds_write_varint(s, freerds_zigzag_encode(rects[index].left - x));
+		freerds_write_varint(s, freerds_zigzag_encode(rects[index].top - y));
+		freerds_write_varint(s, rects[index].right - rects[index].left);
+		freerds_write_varint(s, rects[index].bottom - rects[index].top);
+
+		x = rects[index].left;
+		y = rects[index].top;
+	}
+}
+
+static int freerds_read_compact_rectangle_list(wStream* s, RECTANGLE_16** rects, UINT32 count, RDS_RECT* origin)
+{
+	INT32 dx;
+	INT32 dy;
+	UINT32 index;
+	UINT32 width;
+	UINT32 height;
+	INT32 x = origin->x;
+	INT32 y = origin->y;
+	RECTANGLE_16* list;
+
+	*rects = NULL;
+
+	/* every rectangle takes at least four bytes */
+	if (count > (Stream_GetRemainingLength(s) / 4))
+		return -1;
+
+	if (!count)
+		return 0;
+
+	list = (RECTANGLE_16*) malloc(sizeof(RECTANGLE_16) * count);
+
+	if (!list)
+		return -1;
+
+	for (index = 0; index < count; index++)
+	{
+		if ((freerds_read_zigzag(s, &dx) < 0) || (freerds_read_zigzag(s, &dy) < 0) ||
+				(freerds_read_varint(s, &width) < 0) || (freerds_read_varint(s, &height) < 0))
+		{
+			free(list);
+			return -1;
+		}
+
+		x += dx;
+		y += dy;
+
+		list[index].left = (UINT16) x;
+		list[index].top = (UINT16) y;
+		list[index].right = (UINT16) (x + width);
+		list[index].bottom = (UINT16) (y + height);
+	}
+
+	*rects = list;
+
+	return 0;
+}
+
+static void freerds_rectangle_list_bounds(RECTANGLE_16* rects, UINT32 count, RDS_RECT* rect)
+{
+	UINT32 index;
+	RECTANGLE_16 bounds;
+
+	if (!count)
+	{
+		ZeroMemory(rect, sizeof(RDS_RECT));
+		return;
+	}
+
+	bounds = rects[0];
+
+	for (index = 1; index < count; index++)
+	{
+		if (rects[index].left < bounds.left)
+			bounds.left = rects[index].left;
+
+		if (rects[index].top < bounds.top)
+			bounds.top = rects[index].top;
+
+		if (rects[index].right > bounds.right)
+			bounds.right = rects[index].right;
+
+		if (rects[index].bottom > bounds.bottom)
+			bounds.bottom = rects[index].bottom;
+	}
+
+	rect->x = bounds.left;
+	rect->y = bounds.top;
+	rect->width = bounds.right - bounds.left;
+	rect->height = bounds.bottom - bounds.top;
+}
+
+/**
+ * The count is only stored once the list has been read, so a message that
+ * fails to parse always has a NULL list and a zero count.
+ */
+
+int freerds_read_paint_rects(wStream* s, RDS_MSG_PAINT_RECTS* msg)
+{
+	UINT32 count;
+
+	msg->rects = NULL;
+	msg->numberOfRects = 0;
+
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		if ((freerds_read_varint(s, &msg->fbSegmentId) < 0) ||
+				(freerds_read_varint(s, &count) < 0))
+			return -1;
+
+		if (freerds_read_compact_rectangle_list(s, &msg->rects, count, &msg->rect) < 0)
+			return -1;
+
+		msg->numberOfRects = count;
+
+		return 0;
+	}
+
+	if (Stream_GetRemainingLength(s) < 8)
+		return -1;
 
-	Stream_Write_UINT32(s, flags); /* flags */
+	Stream_Read_UINT32(s, msg->fbSegmentId);
+	Stream_Read_UINT32(s, count);
 
-	return 0;
-}
+	if (count > (Stream_GetRemainingLength(s) / 8))
+		return -1;
 
-void* freerds_window_new_update_copy(RDS_MSG_WINDOW_NEW_UPDATE* msg)
-{
-	RDS_MSG_WINDOW_NEW_UPDATE* dup = NULL;
+	msg->numberOfRects = count;
 
-	dup = (RDS_MSG_WINDOW_NEW_UPDATE*) malloc(sizeof(RDS_MSG_WINDOW_NEW_UPDATE));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_WINDOW_NEW_UPDATE));
+	/* the list is decoded in place, the message points into the stream */
+	msg->rects = (RECTANGLE_16*) Stream_Pointer(s);
+	freerds_read_rectangle_list(s, msg->rects, msg->numberOfRects);
 
-	return (void*) dup;
+	return 0;
 }
 
-void freerds_window_new_update_free(RDS_MSG_WINDOW_NEW_UPDATE* msg)
+int freerds_write_paint_rects(wStream* s, RDS_MSG_PAINT_RECTS* msg)
 {
-	free(msg);
-}
+	msg->msgFlags = RDS_MSG_FLAG_RECT | (msg->msgFlags & (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT));
 
-static RDS_MSG_DEFINITION RDS_MSG_WINDOW_NEW_UPDATE_DEFINITION =
-{
-	sizeof(RDS_MSG_WINDOW_NEW_UPDATE), "WindowNewUpdate",
-	(pXrdpMessageRead) freerds_read_window_new_update,
-	(pXrdpMessageWrite) freerds_write_window_new_update,
-	(pXrdpMessageCopy) freerds_window_new_update_copy,
-	(pXrdpMessageFree) freerds_window_new_update_free
-};
+	freerds_rectangle_list_bounds(msg->rects, msg->numberOfRects, &msg->rect);
 
-/**
- * WindowDelete
- */
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		msg->length = freerds_message_length((RDS_MSG_COMMON*) msg,
+				freerds_varint_length(msg->fbSegmentId) + freerds_varint_length(msg->numberOfRects) +
+				freerds_compact_rectangle_list_length(msg->rects, msg->numberOfRects, &msg->rect));
 
-int freerds_read_window_delete(wStream* s, RDS_MSG_WINDOW_DELETE* msg)
-{
-	if (Stream_GetRemainingLength(s) < 4)
-		return -1;
+		if (!s)
+			return msg->length;
 
-	Stream_Read_UINT32(s, msg->windowId);
+		freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
 
-	return 0;
-}
+		freerds_write_varint(s, msg->fbSegmentId);
+		freerds_write_varint(s, msg->numberOfRects);
+		freerds_write_compact_rectangle_list(s, msg->rects, msg->numberOfRects, &msg->rect);
 
-int freerds_write_window_delete(wStream* s, RDS_MSG_WINDOW_DELETE* msg)
-{
-	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 4;
+		return 0;
+	}
+
+	msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, 8 + (8 * msg->numberOfRects));
 
 	if (!s)
 		return msg->length;
 
 	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
 
-	Stream_Write_UINT32(s, msg->windowId);
+	Stream_Write_UINT32(s, msg->fbSegmentId);
+	Stream_Write_UINT32(s, msg->numberOfRects);
+	freerds_write_rectangle_list(s, msg->rects, msg->numberOfRects);
 
 	return 0;
 }
 
-void* freerds_window_delete_copy(RDS_MSG_WINDOW_DELETE* msg)
-{
-	RDS_MSG_WINDOW_DELETE* dup = NULL;
-
-	dup = (RDS_MSG_WINDOW_DELETE*) malloc(sizeof(RDS_MSG_WINDOW_DELETE));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_WINDOW_DELETE));
-
-	return (void*) dup;
-}
-
-void freerds_window_delete_free(RDS_MSG_WINDOW_DELETE* msg)
+static const RDS_MSG_BUFFER RDS_MSG_PAINT_RECTS_BUFFERS[] =
 {
-	free(msg);
-}
+	{ offsetof(RDS_MSG_PAINT_RECTS, rects), offsetof(RDS_MSG_PAINT_RECTS, numberOfRects), sizeof(RECTANGLE_16), 0 }
+};
 
-static RDS_MSG_DEFINITION RDS_MSG_WINDOW_DELETE_DEFINITION =
+static RDS_MSG_DEFINITION RDS_MSG_PAINT_RECTS_DEFINITION =
 {
-	sizeof(RDS_MSG_WINDOW_DELETE), "WindowDelete",
-	(pXrdpMessageRead) freerds_read_window_delete,
-	(pXrdpMessageWrite) freerds_write_window_delete,
-	(pXrdpMessageCopy) freerds_window_delete_copy,
-	(pXrdpMessageFree) freerds_window_delete_free
+	sizeof(RDS_MSG_PAINT_RECTS), "PaintRects",
+	(pXrdpMessageRead) freerds_read_paint_rects,
+	(pXrdpMessageWrite) freerds_write_paint_rects,
+	NULL, 0,
+	RDS_MSG_ENTRIES(RDS_MSG_PAINT_RECTS_BUFFERS)
 };
 
 /**
- * LogonUser
+ * ScreenBltRects
  */
 
-int freerds_read_logon_user(wStream* s, RDS_MSG_LOGON_USER* msg)
+/* like PaintRects, the list is NULL and its count zero on failure */
+int freerds_read_screen_blt_rects(wStream* s, RDS_MSG_SCREEN_BLT_RECTS* msg)
 {
-	if (Stream_GetRemainingLength(s) < 12)
-		return -1;
+	UINT32 count;
 
-	Stream_Read_UINT32(s, msg->Flags);
-	Stream_Read_UINT32(s, msg->UserLength);
-	Stream_Read_UINT32(s, msg->DomainLength);
-	Stream_Read_UINT32(s, msg->PasswordLength);
+	msg->clipRects = NULL;
+	msg->numberOfClipRects = 0;
 
-	msg->User = msg->Domain = msg->Password = NULL;
-
-	if (msg->UserLength)
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
 	{
-		msg->User = (char*) malloc(msg->UserLength + 1);
-		Stream_Read(s, msg->User, msg->UserLength);
-		msg->User[msg->UserLength] = '\0';
-	}
+		freerds_read_header_rect((RDS_MSG_COMMON*) msg, &msg->nLeftRect, &msg->nTopRect, &msg->nWidth, &msg->nHeight);
 
-	if (msg->DomainLength)
-	{
-		msg->Domain = (char*) malloc(msg->DomainLength + 1);
-		Stream_Read(s, msg->Domain, msg->DomainLength);
-		msg->Domain[msg->DomainLength] = '\0';
-	}
+		if ((freerds_read_source_delta(s, msg->nLeftRect, msg->nTopRect, &msg->nXSrc, &msg->nYSrc) < 0) ||
+				(freerds_read_varint(s, &count) < 0))
+			return -1;
 
-	if (msg->PasswordLength)
-	{
-		msg->Password = (char*) malloc(msg->PasswordLength + 1);
-		Stream_Read(s, msg->Password, msg->PasswordLength);
-		msg->Password[msg->PasswordLength] = '\0';
+		if (freerds_read_compact_rectangle_list(s, &msg->clipRects, count, &msg->rect) < 0)
+			return -1;
+
+		msg->numberOfClipRects = count;
+
+		return 0;
 	}
 
+	if (Stream_GetRemainingLength(s) < 16)
+		return -1;
+
+	Stream_Read_UINT16(s, msg->nLeftRect);
+	Stream_Read_UINT16(s, msg->nTopRect);
+	Stream_Read_UINT16(s, msg->nWidth);
+	Stream_Read_UINT16(s, msg->nHeight);
+	Stream_Read_UINT16(s, msg->nXSrc);
+	Stream_Read_UINT16(s, msg->nYSrc);
+	Stream_Read_UINT32(s, count);
+
+	if (count > (Stream_GetRemainingLength(s) / 8))
+		return -1;
+
+	msg->numberOfClipRects = count;
+
+	msg->clipRects = (RECTANGLE_16*) Stream_Pointer(s);
+	freerds_read_rectangle_list(s, msg->clipRects, msg->numberOfClipRects);
+
 	return 0;
 }
 
-int freerds_write_logon_user(wStream* s, RDS_MSG_LOGON_USER* msg)
+int freerds_write_screen_blt_rects(wStream* s, RDS_MSG_SCREEN_BLT_RECTS* msg)
 {
-	msg->msgFlags = 0;
+	msg->msgFlags = RDS_MSG_FLAG_RECT | (msg->msgFlags & (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT));
 
-	msg->UserLength = msg->DomainLength = msg->PasswordLength = 0;
+	msg->rect.x = msg->nLeftRect;
+	msg->rect.y = msg->nTopRect;
+	msg->rect.width = msg->nWidth;
+	msg->rect.height = msg->nHeight;
 
-	if (msg->User)
-		msg->UserLength = strlen(msg->User);
+	if (msg->msgFlags & RDS_MSG_FLAG_COMPACT)
+	{
+		msg->length = freerds_message_length((RDS_MSG_COMMON*) msg,
+				freerds_write_source_delta(NULL, msg->nLeftRect, msg->nTopRect, msg->nXSrc, msg->nYSrc) +
+				freerds_varint_length(msg->numberOfClipRects) +
+				freerds_compact_rectangle_list_length(msg->clipRects, msg->numberOfClipRects, &msg->rect));
 
-	if (msg->Domain)
-		msg->DomainLength = strlen(msg->Domain);
+		if (!s)
+			return msg->length;
 
-	if (msg->Password)
-		msg->PasswordLength = strlen(msg->Password);
+		freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+
+		freerds_write_source_delta(s, msg->nLeftRect, msg->nTopRect, msg->nXSrc, msg->nYSrc);
+		freerds_write_varint(s, msg->numberOfClipRects);
+		freerds_write_compact_rectangle_list(s, msg->clipRects, msg->numberOfClipRects, &msg->rect);
+
+		return 0;
+	}
 
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 12 +
-			msg->UserLength + msg->DomainLength + msg->PasswordLength;
+	msg->length = freerds_message_length((RDS_MSG_COMMON*) msg, 16 + (8 * msg->numberOfClipRects));
 
 	if (!s)
 		return msg->length;
 
 	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
 
-	Stream_Write_UINT32(s, msg->Flags);
-	Stream_Write_UINT32(s, msg->UserLength);
-	Stream_Write_UINT32(s, msg->DomainLength);
-	Stream_Write_UINT32(s, msg->PasswordLength);
+	Stream_Write_UINT16(s, msg->nLeftRect);
+	Stream_Write_UINT16(s, msg->nTopRect);
+	Stream_Write_UINT16(s, msg->nWidth);
+	Stream_Write_UINT16(s, msg->nHeight);
+	Stream_Write_UINT16(s, msg->nXSrc);
+	Stream_Write_UINT16(s, msg->nYSrc);
+	Stream_Write_UINT32(s, msg->numberOfClipRects);
+	freerds_write_rectangle_list(s, msg->clipRects, msg->numberOfClipRects);
 
-	if (msg->UserLength)
-		Stream_Write(s, msg->User, msg->UserLength);
+	return 0;
+}
 
-	if (msg->DomainLength)
-		Stream_Write(s, msg->Domain, msg->DomainLength);
+static const RDS_MSG_BUFFER RDS_MSG_SCREEN_BLT_RECTS_BUFFERS[] =
+{
+	{ offsetof(RDS_MSG_SCREEN_BLT_RECTS, clipRects), offsetof(RDS_MSG_SCREEN_BLT_RECTS, numberOfClipRects), sizeof(RECTANGLE_16), 0 }
+};
 
-	if (msg->PasswordLength)
-		Stream_Write(s, msg->Password, msg->PasswordLength);
+static RDS_MSG_DEFINITION RDS_MSG_SCREEN_BLT_RECTS_DEFINITION =
+{
+	sizeof(RDS_MSG_SCREEN_BLT_RECTS), "ScreenBltRects",
+	(pXrdpMessageRead) freerds_read_screen_blt_rects,
+	(pXrdpMessageWrite) freerds_write_screen_blt_rects,
+	NULL, 0,
+	RDS_MSG_ENTRIES(RDS_MSG_SCREEN_BLT_RECTS_BUFFERS)
+};
 
-	return 0;
+/**
+ * Generic Functions
+ */
+
+static UINT32* freerds_field_members(RDS_MSG_COMMON* msg, UINT16 offset)
+{
+	return (UINT32*) &(((BYTE*) msg)[offset]);
 }
 
-void* freerds_logon_user_copy(RDS_MSG_LOGON_USER* msg)
+static BOOL freerds_field_is_fixed(RDS_MSG_COMMON* msg, const RDS_MSG_FIELD* field)
 {
-	RDS_MSG_LOGON_USER* dup = NULL;
+	return !(msg->msgFlags & RDS_MSG_FLAG_COMPACT) || (field->Compact == RDS_FIELD_FIXED);
+}
 
-	dup = (RDS_MSG_LOGON_USER*) malloc(sizeof(RDS_MSG_LOGON_USER));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_LOGON_USER));
+/**
+ * Length of the body, the fixed-width part comes straight from the table
+ * and only varints need to look at the values.
+ */
 
-	if (msg->UserLength)
-	{
-		dup->User = malloc(msg->UserLength + 1);
-		CopyMemory(dup->User, msg->User, msg->UserLength);
-		dup->User[msg->UserLength] = '\0';
-	}
+static UINT32 freerds_fields_length(RDS_MSG_DEFINITION* msgDef, RDS_MSG_COMMON* msg, BOOL fixedOnly)
+{
+	int index;
+	UINT32 count;
+	UINT32* base;
+	UINT32* value;
+	UINT32 length = 0;
+	const RDS_MSG_FIELD* field;
 
-	if (msg->DomainLength)
+	for (index = 0; index < msgDef->FieldCount; index++)
 	{
-		dup->Domain = malloc(msg->DomainLength + 1);
-		CopyMemory(dup->Domain, msg->Domain, msg->DomainLength);
-		dup->Domain[msg->DomainLength] = '\0';
-	}
+		field = &(msgDef->Fields[index]);
 
-	if (msg->PasswordLength)
-	{
-		dup->Password = malloc(msg->PasswordLength + 1);
-		CopyMemory(dup->Password, msg->Password, msg->PasswordLength);
-		dup->Password[msg->PasswordLength] = '\0';
-	}
+		if (freerds_field_is_fixed(msg, field))
+		{
+			length += field->Count * field->Size;
+			continue;
+		}
 
-	return (void*) dup;
-}
+		if (fixedOnly)
+			continue;
 
-void freerds_logon_user_free(RDS_MSG_LOGON_USER* msg)
-{
-	free(msg);
-}
+		value = freerds_field_members(msg, field->Offset);
+		base = freerds_field_members(msg, field->Base);
 
-static RDS_MSG_DEFINITION RDS_MSG_LOGON_USER_DEFINITION =
-{
-	sizeof(RDS_MSG_LOGON_USER), "LogonUser",
-	(pXrdpMessageRead) freerds_read_logon_user,
-	(pXrdpMessageWrite) freerds_write_logon_user,
-	(pXrdpMessageCopy) freerds_logon_user_copy,
-	(pXrdpMessageFree) freerds_logon_user_free
-};
+		for (count = 0; count < field->Count; count++)
+		{
+			if (field->Compact == RDS_FIELD_VARINT)
+				length += freerds_varint_length(value[count]);
+			else if (field->Compact == RDS_FIELD_ZIGZAG)
+				length += freerds_varint_length(freerds_zigzag_encode((INT32) value[count]));
+			else if (field->Compact == RDS_FIELD_DELTA)
+				length += freerds_varint_length(freerds_zigzag_encode((INT32) (value[count] - base[count])));
+		}
+	}
+
+	return length;
+}
 
 /**
- * LogoffUser
+ * The fixed-width fields are validated at once and 32-bit runs are moved
+ * with a single copy, the wire format being little endian like the host
+ * (see freerds_peek_message_length). Compact fields are checked as they
+ * are decoded.
  */
 
-int freerds_read_logoff_user(wStream* s, RDS_MSG_LOGOFF_USER* msg)
+static int freerds_read_fields(wStream* s, RDS_MSG_DEFINITION* msgDef, RDS_MSG_COMMON* msg)
 {
-	if (Stream_GetRemainingLength(s) < 4)
+	int index;
+	INT32 delta;
+	UINT32 count;
+	UINT32* base;
+	UINT32* value;
+	const RDS_MSG_FIELD* field;
+
+	if (Stream_GetRemainingLength(s) < freerds_fields_length(msgDef, msg, TRUE))
 		return -1;
 
-	Stream_Read_UINT32(s, msg->Flags);
+	for (index = 0; index < msgDef->FieldCount; index++)
+	{
+		field = &(msgDef->Fields[index]);
+		value = freerds_field_members(msg, field->Offset);
+		base = freerds_field_members(msg, field->Base);
+
+		if (freerds_field_is_fixed(msg, field))
+		{
+			/* a fixed run after a compact one was not covered by the first check */
+			if (Stream_GetRemainingLength(s) < (size_t) (field->Count * field->Size))
+				return -1;
+
+			if (field->Size == 4)
+			{
+				Stream_Read(s, value, field->Count * 4);
+				continue;
+			}
+
+			for (count = 0; count < field->Count; count++)
+				Stream_Read_UINT16(s, value[count]);
+
+			continue;
+		}
+
+		if (field->Compact == RDS_FIELD_RECT)
+		{
+			value[0] = msg->rect.x;
+			value[1] = msg->rect.y;
+			value[2] = msg->rect.width;
+			value[3] = msg->rect.height;
+			continue;
+		}
+
+		for (count = 0; count < field->Count; count++)
+		{
+			if (field->Compact == RDS_FIELD_VARINT)
+			{
+				if (freerds_read_varint(s, &value[count]) < 0)
+					return -1;
+			}
+			else
+			{
+				if (freerds_read_zigzag(s, &delta) < 0)
+					return -1;
+
+				value[count] = delta;
+
+				if (field->Compact == RDS_FIELD_DELTA)
+					value[count] += base[count];
+			}
+		}
+	}
 
 	return 0;
 }
 
-int freerds_write_logoff_user(wStream* s, RDS_MSG_LOGOFF_USER* msg)
+static int freerds_write_fields(wStream* s, RDS_MSG_DEFINITION* msgDef, RDS_MSG_COMMON* msg)
 {
-	msg->msgFlags = 0;
+	int index;
+	UINT32 count;
+	UINT32* base;
+	UINT32* value;
+	const RDS_MSG_FIELD* field;
+
+	msg->msgFlags &= (RDS_MSG_FLAG_INPUT | RDS_MSG_FLAG_COMPACT);
+
+	for (index = 0; index < msgDef->FieldCount; index++)
+	{
+		field = &(msgDef->Fields[index]);
+
+		if (field->Compact != RDS_FIELD_RECT)
+			continue;
+
+		value = freerds_field_members(msg, field->Offset);
+
+		msg->msgFlags |= RDS_MSG_FLAG_RECT;
+		msg->rect.x = value[0];
+		msg->rect.y = value[1];
+		msg->rect.width = value[2];
+		msg->rect.height = value[3];
+	}
 
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 4;
+	msg->length = freerds_message_length(msg, freerds_fields_length(msgDef, msg, FALSE));
 
 	if (!s)
 		return msg->length;
 
-	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
-
-	Stream_Write_UINT32(s, msg->Flags);
+	Stream_EnsureRemainingCapacity(s, msg->length);
 
-	return 0;
-}
+	freerds_write_common_header(s, msg);
 
-void* freerds_logoff_user_copy(RDS_MSG_LOGOFF_USER* msg)
-{
-	RDS_MSG_LOGOFF_USER* dup = NULL;
+	for (index = 0; index < msgDef->FieldCount; index++)
+	{
+		field = &(msgDef->Fields[index]);
+		value = freerds_field_members(msg, field->Offset);
+		base = freerds_field_members(msg, field->Base);
 
-	dup = (RDS_MSG_LOGOFF_USER*) malloc(sizeof(RDS_MSG_LOGOFF_USER));
-	CopyMemory(dup, msg, sizeof(RDS_MSG_LOGOFF_USER));
+		if (freerds_field_is_fixed(msg, field))
+		{
+			if (field->Size == 4)
+			{
+				Stream_Write(s, value, field->Count * 4);
+				continue;
+			}
 
-	return (void*) dup;
-}
+			for (count = 0; count < field->Count; count++)
+				Stream_Write_UINT16(s, value[count]);
 
-void freerds_logoff_user_free(RDS_MSG_LOGOFF_USER* msg)
-{
-	free(msg);
-}
+			continue;
+		}
 
-static RDS_MSG_DEFINITION RDS_MSG_LOGOFF_USER_DEFINITION =
-{
-	sizeof(RDS_MSG_LOGOFF_USER), "LogoffUser",
-	(pXrdpMessageRead) freerds_read_logoff_user,
-	(pXrdpMessageWrite) freerds_write_logoff_user,
-	(pXrdpMessageCopy) freerds_logoff_user_copy,
-	(pXrdpMessageFree) freerds_logoff_user_free
-};
+		for (count = 0; count < field->Count; count++)
+		{
+			if (field->Compact == RDS_FIELD_VARINT)
+				freerds_write_varint(s, value[count]);
+			else if (field->Compact == RDS_FIELD_ZIGZAG)
+				freerds_write_varint(s, freerds_zigzag_encode((INT32) value[count]));
+			else if (field->Compact == RDS_FIELD_DELTA)
+				freerds_write_varint(s, freerds_zigzag_encode((INT32) (value[count] - base[count])));
+		}
+	}
 
-/**
- * Generic Functions
- */
+	return 0;
+}
 
 static RDS_MSG_DEFINITION* RDS_SERVER_MSG_DEFINITIONS[32] =
 {
@@ -2114,10 +2666,10 @@ static RDS_MSG_DEFINITION* RDS_SERVER_MSG_DEFINITIONS[32] =
 	&RDS_MSG_SET_SYSTEM_POINTER_DEFINITION, /* 23 */
 	&RDS_MSG_LOGON_USER_DEFINITION, /* 24 */
 	&RDS_MSG_LOGOFF_USER_DEFINITION, /* 25 */
-	NULL, /* 26 */
-	NULL, /* 27 */
-	NULL, /* 28 */
-	NULL, /* 29 */
+	&RDS_MSG_PAINT_RECTS_DEFINITION, /* 26 */
+	&RDS_MSG_SCREEN_BLT_RECTS_DEFINITION, /* 27 */
+	&RDS_MSG_CAPABILITIES_DEFINITION, /* 28 */
+	&RDS_MSG_FRAME_READY_DEFINITION, /* 29 */
 	NULL, /* 30 */
 	NULL /* 31 */
 };
@@ -2154,20 +2706,27 @@ char* freerds_server_message_name(UINT32 type)
 
 int freerds_server_message_read(wStream* s, RDS_MSG_COMMON* msg)
 {
-	int status = 0;
 	RDS_MSG_DEFINITION* msgDef;
 
+	if (msg->type > 31)
+		return -1;
+
 	msgDef = RDS_SERVER_MSG_DEFINITIONS[msg->type];
 
-	if (msgDef)
-	{
-		if (msgDef->Read)
-			status = msgDef->Read(s, msg);
-	}
+	if (!msgDef)
+		return 0;
+
+	if (msgDef->Read)
+		return msgDef->Read(s, msg);
 
-	return status;
+	return freerds_read_fields(s, msgDef, msg);
 }
 
+/**
+ * Returns the message length, and serializes the message if s is set.
+ * Room is made in s for the message, there is no need to size it first.
+ */
+
 int freerds_server_message_write(wStream* s, RDS_MSG_COMMON* msg)
 {
 	RDS_MSG_DEFINITION* msgDef;
@@ -2180,40 +2739,86 @@ int freerds_server_message_write(wStream* s, RDS_MSG_COMMON* msg)
 
 	msgDef = RDS_SERVER_MSG_DEFINITIONS[msg->type];
 
-	if (msgDef)
+	if (!msgDef)
+		return msg->length;
+
+	if (!msgDef->Write)
 	{
-		if (msgDef->Write)
-			msgDef->Write(s, msg);
+		freerds_write_fields(s, msgDef, msg);
+		return msg->length;
 	}
 
+	/* hand-written codecs have to be sized first */
+	if (s)
+		Stream_EnsureRemainingCapacity(s, msgDef->Write(NULL, msg));
+
+	msgDef->Write(s, msg);
+
 	return msg->length;
 }
 
 void* freerds_server_message_copy(RDS_MSG_COMMON* msg)
 {
-	void* dup = NULL;
+	int index;
+	BYTE* data;
+	BYTE** buffer;
+	UINT32* count;
+	size_t length;
+	RDS_MSG_COMMON* dup;
 	RDS_MSG_DEFINITION* msgDef;
 
 	msgDef = RDS_SERVER_MSG_DEFINITIONS[msg->type];
 
-	if (msgDef)
+	if (!msgDef)
+		return NULL;
+
+	dup = (RDS_MSG_COMMON*) malloc(msgDef->Size);
+
+	if (!dup)
+		return NULL;
+
+	CopyMemory(dup, msg, msgDef->Size);
+
+	for (index = 0; index < msgDef->BufferCount; index++)
 	{
-		if (msgDef->Copy)
-			dup = msgDef->Copy(msg);
+		buffer = (BYTE**) &(((BYTE*) dup)[msgDef->Buffers[index].Offset]);
+		count = freerds_field_members(dup, msgDef->Buffers[index].Length);
+		length = ((size_t) *count) * msgDef->Buffers[index].ElementSize;
+
+		data = NULL;
+
+		if (*buffer && *count)
+		{
+			data = (BYTE*) malloc(length + msgDef->Buffers[index].Terminator);
+
+			if (data)
+			{
+				CopyMemory(data, *buffer, length);
+				ZeroMemory(&data[length], msgDef->Buffers[index].Terminator);
+			}
+		}
+
+		if (!data)
+			*count = 0;
+
+		*buffer = data;
 	}
 
-	return dup;
+	return (void*) dup;
 }
 
 void freerds_server_message_free(RDS_MSG_COMMON* msg)
 {
+	int index;
 	RDS_MSG_DEFINITION* msgDef;
 
 	msgDef = RDS_SERVER_MSG_DEFINITIONS[msg->type];
 
-	if (msgDef)
-	{
-		if (msgDef->Free)
-			msgDef->Free(msg);
-	}
+	if (!msgDef)
+		return;
+
+	for (index = 0; index < msgDef->BufferCount; index++)
+		free(*((BYTE**) &(((BYTE*) msg)[msgDef->Buffers[index].Offset])));
+
+	free(msg);
 }
@@ -22,4 +22,8 @@
 
 #define RDS_ORDER_HEADER_LENGTH		10
 
+#define RDS_COMPACT_HEADER_MARKER	0x80
+#define RDS_COMPACT_HEADER_LENGTH	3
+#define RDS_VARINT_MAX_LENGTH		5
+
 #endif /* RDS_NG_PROTOCOL_H */
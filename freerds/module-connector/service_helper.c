@@ -35,7 +35,7 @@ void* freerds_service_client_thread(void* arg)
 
 	if (connector->hClientPipe)
 	{
-		while (WaitForSingleObject(connector->hClientPipe, INFINITE) == WAIT_OBJECT_0)
+		while (WaitForSingleObject(freerds_transport_get_event_handle(connector), INFINITE) == WAIT_OBJECT_0)
 		{
 			if (freerds_transport_receive(connector) < 0)
 				break;
@@ -55,9 +55,7 @@ void* freerds_service_listener_thread(void* arg)
 
 	while (1)
 	{
-		connector->hClientPipe = freerds_named_pipe_accept(connector->hServerPipe);
-
-		if (!connector->hClientPipe)
+		if (!freerds_transport_accept(connector))
 			break;
 
 		if (service->Accept)
@@ -85,7 +83,7 @@ int freerds_service_start(rdsService* service)
 
 	connector = (rdsModuleConnector*) service;
 
-	connector->hServerPipe = freerds_named_pipe_create_endpoint(connector->SessionId, connector->Endpoint);
+	connector->hServerPipe = freerds_transport_listen(connector);
 
 	if (!connector->hServerPipe)
 		return -1;
@@ -127,6 +125,7 @@ rdsService* freerds_service_new(DWORD SessionId, const char* endpoint)
 
 		connector->OutboundStream = Stream_New(NULL, 8192);
 		connector->InboundStream = Stream_New(NULL, 8192);
+		InitializeCriticalSectionAndSpinCount(&(connector->OutboundLock), 4000);
 
 		connector->InboundTotalLength = 0;
 		connector->InboundTotalCount = 0;
@@ -154,8 +153,11 @@ void freerds_service_free(rdsService* service)
 		WaitForSingleObject(service->ServerThread, INFINITE);
 		CloseHandle(service->ServerThread);
 
+		freerds_transport_close(connector);
+
 		Stream_Free(connector->OutboundStream, TRUE);
 		Stream_Free(connector->InboundStream, TRUE);
+		DeleteCriticalSection(&(connector->OutboundLock));
 
 		if (connector->Endpoint)
 			free(connector->Endpoint);
@@ -0,0 +1,378 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * FreeRDS module connector shared memory transport
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/sysinfo.h>
+
+#include "shm_ring.h"
+
+#define RDS_SHM_RING_MASK		(RDS_SHM_RING_SIZE - 1)
+#define RDS_SHM_RING_WRITE_TIMEOUT	10000
+
+/* the segment is shared between processes, the futexes cannot be private */
+
+static void freerds_shm_ring_futex_wait(volatile UINT32* address, UINT32 value, DWORD nTimeOut)
+{
+	struct timespec timeout;
+
+	timeout.tv_sec = nTimeOut / 1000;
+	timeout.tv_nsec = (nTimeOut % 1000) * 1000000;
+
+	syscall(SYS_futex, address, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void freerds_shm_ring_futex_wake(volatile UINT32* address)
+{
+	syscall(SYS_futex, address, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+void freerds_shm_ring_name(const char* pipeName, char* name, int length)
+{
+	const char* p;
+
+	/* \\.\pipe\FreeRDS_<id>_<endpoint> maps to /FreeRDS_<id>_<endpoint> */
+	p = strrchr(pipeName, '\\');
+	p = p ? p + 1 : pipeName;
+
+	sprintf_s(name, length, "/%s", p);
+}
+
+static rdsShmTransport* freerds_shm_transport_map(const char* name, int fd, BOOL owner)
+{
+	void* address;
+	rdsShmTransport* transport;
+
+	address = mmap(NULL, sizeof(rdsShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (address == MAP_FAILED)
+		return NULL;
+
+	transport = (rdsShmTransport*) malloc(sizeof(rdsShmTransport));
+	ZeroMemory(transport, sizeof(rdsShmTransport));
+
+	strncpy(transport->name, name, sizeof(transport->name) - 1);
+	transport->owner = owner;
+	transport->segment = (rdsShmSegment*) address;
+
+	if (owner)
+	{
+		transport->inbound = &(transport->segment->rings[RDS_SHM_RING_TO_SERVER]);
+		transport->outbound = &(transport->segment->rings[RDS_SHM_RING_TO_CLIENT]);
+	}
+	else
+	{
+		transport->inbound = &(transport->segment->rings[RDS_SHM_RING_TO_CLIENT]);
+		transport->outbound = &(transport->segment->rings[RDS_SHM_RING_TO_SERVER]);
+	}
+
+	return transport;
+}
+
+/**
+ * Called by the module before accepting a connection.
+ */
+
+rdsShmTransport* freerds_shm_transport_create(const char* pipeName)
+{
+	int fd;
+	char name[64];
+	rdsShmSegment* segment;
+	rdsShmTransport* transport;
+
+	freerds_shm_ring_name(pipeName, name, sizeof(name));
+
+	shm_unlink(name);
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, sizeof(rdsShmSegment)) < 0)
+	{
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	transport = freerds_shm_transport_map(name, fd, TRUE);
+	close(fd);
+
+	if (!transport)
+	{
+		shm_unlink(name);
+		return NULL;
+	}
+
+	segment = transport->segment;
+
+	/* consumers start asleep so that the first message rings the doorbell */
+	segment->rings[RDS_SHM_RING_TO_SERVER].sleeping = 1;
+	segment->rings[RDS_SHM_RING_TO_CLIENT].sleeping = 1;
+
+	segment->version = RDS_SHM_RING_VERSION;
+	segment->ringSize = RDS_SHM_RING_SIZE;
+	segment->cookie = GetTickCount() ^ ((UINT32) getpid() << 16);
+	__sync_synchronize();
+	segment->magic = RDS_SHM_RING_MAGIC;
+
+	return transport;
+}
+
+/**
+ * Called by freerds after connecting to the module pipe.
+ */
+
+rdsShmTransport* freerds_shm_transport_open(const char* pipeName)
+{
+	int fd;
+	char name[64];
+	struct stat sb;
+	rdsShmSegment* segment;
+	rdsShmTransport* transport;
+
+	freerds_shm_ring_name(pipeName, name, sizeof(name));
+
+	fd = shm_open(name, O_RDWR, 0);
+
+	if (fd < 0)
+		return NULL;
+
+	if ((fstat(fd, &sb) < 0) || (sb.st_size < (off_t) sizeof(rdsShmSegment)))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	transport = freerds_shm_transport_map(name, fd, FALSE);
+	close(fd);
+
+	if (!transport)
+		return NULL;
+
+	segment = transport->segment;
+
+	if ((segment->magic != RDS_SHM_RING_MAGIC) || (segment->version != RDS_SHM_RING_VERSION) ||
+			(segment->ringSize != RDS_SHM_RING_SIZE))
+	{
+		fprintf(stderr, "freerds_shm_transport_open: incompatible segment %s\n", name);
+		freerds_shm_transport_free(transport);
+		return NULL;
+	}
+
+	return transport;
+}
+
+/**
+ * Once both sides have mapped the segment the name is no longer needed.
+ */
+
+void freerds_shm_transport_unlink(rdsShmTransport* transport)
+{
+	if (transport->owner && transport->name[0])
+	{
+		shm_unlink(transport->name);
+		transport->name[0] = '\0';
+	}
+}
+
+void freerds_shm_transport_free(rdsShmTransport* transport)
+{
+	if (!transport)
+		return;
+
+	freerds_shm_transport_unlink(transport);
+
+	munmap(transport->segment, sizeof(rdsShmSegment));
+	free(transport);
+}
+
+int freerds_shm_transport_read(rdsShmTransport* transport, BYTE* data, UINT32 length)
+{
+	UINT32 head;
+	UINT32 tail;
+	UINT32 offset;
+	UINT32 available;
+	UINT32 chunk;
+	rdsShmRing* ring = transport->inbound;
+
+	head = ring->head;
+	tail = ring->tail;
+	__sync_synchronize();
+
+	available = head - tail;
+
+	/* the indices live in memory the peer can write, never trust them */
+	if (available > RDS_SHM_RING_SIZE)
+		return -1;
+
+	if (length > available)
+		length = available;
+
+	if (!length)
+		return 0;
+
+	offset = tail & RDS_SHM_RING_MASK;
+	chunk = RDS_SHM_RING_SIZE - offset;
+
+	if (chunk > length)
+		chunk = length;
+
+	CopyMemory(data, &(ring->data[offset]), chunk);
+
+	if (length > chunk)
+		CopyMemory(&data[chunk], ring->data, length - chunk);
+
+	__sync_synchronize();
+	ring->tail = tail + length;
+	__sync_synchronize();
+
+	if (ring->waiting)
+	{
+		ring->waiting = 0;
+		freerds_shm_ring_futex_wake(&ring->tail);
+	}
+
+	return length;
+}
+
+static int freerds_shm_transport_ring(rdsShmTransport* transport, HANDLE hDoorbell)
+{
+	BYTE doorbell = 0;
+	rdsShmRing* ring = transport->outbound;
+
+	__sync_synchronize();
+
+	if (!ring->sleeping)
+		return 0;
+
+	ring->sleeping = 0;
+
+	return freerds_named_pipe_write(hDoorbell, &doorbell, 1);
+}
+
+int freerds_shm_transport_write(rdsShmTransport* transport, HANDLE hDoorbell, BYTE* data, UINT32 length)
+{
+	UINT32 head;
+	UINT32 tail;
+	UINT32 offset;
+	UINT32 space;
+	UINT32 chunk;
+	UINT32 total = 0;
+	DWORD elapsed;
+	DWORD stalled = 0;
+	rdsShmRing* ring = transport->outbound;
+
+	while (length > 0)
+	{
+		head = ring->head;
+		tail = ring->tail;
+		__sync_synchronize();
+
+		if ((head - tail) > RDS_SHM_RING_SIZE)
+			return -1;
+
+		space = RDS_SHM_RING_SIZE - (head - tail);
+
+		if (!space)
+		{
+			/* the consumer is behind, make sure it is awake and wait for room */
+			if (freerds_shm_transport_ring(transport, hDoorbell) < 0)
+				return -1;
+
+			if (!stalled)
+				stalled = GetTickCount();
+
+			elapsed = GetTickCount() - stalled;
+
+			if (elapsed >= RDS_SHM_RING_WRITE_TIMEOUT)
+				return -1;
+
+			ring->waiting = 1;
+			__sync_synchronize();
+
+			/* the futex returns at once if the consumer moved tail meanwhile */
+			freerds_shm_ring_futex_wait(&ring->tail, tail, RDS_SHM_RING_WRITE_TIMEOUT - elapsed);
+			continue;
+		}
+
+		stalled = 0;
+
+		if (space > length)
+			space = length;
+
+		offset = head & RDS_SHM_RING_MASK;
+		chunk = RDS_SHM_RING_SIZE - offset;
+
+		if (chunk > space)
+			chunk = space;
+
+		CopyMemory(&(ring->data[offset]), data, chunk);
+
+		if (space > chunk)
+			CopyMemory(ring->data, &data[chunk], space - chunk);
+
+		__sync_synchronize();
+		ring->head = head + space;
+
+		data += space;
+		length -= space;
+		total += space;
+	}
+
+	if (freerds_shm_transport_ring(transport, hDoorbell) < 0)
+		return -1;
+
+	return total;
+}
+
+/**
+ * Announces that the consumer is about to wait on the doorbell.
+ * Returns FALSE if data was published in the meantime, in which
+ * case the caller must read it instead of going to sleep.
+ */
+
+BOOL freerds_shm_transport_sleep(rdsShmTransport* transport)
+{
+	rdsShmRing* ring = transport->inbound;
+
+	ring->sleeping = 1;
+	__sync_synchronize();
+
+	if (ring->head != ring->tail)
+	{
+		ring->sleeping = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
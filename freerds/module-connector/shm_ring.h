@@ -0,0 +1,104 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * FreeRDS module connector shared memory transport
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDS_NG_SHM_RING_H
+#define RDS_NG_SHM_RING_H
+
+#include <freerds/freerds.h>
+
+/**
+ * Shared Memory Ring Transport
+ *
+ * The segment holds two single-producer single-consumer byte rings, one per
+ * direction. The byte stream carried by the rings is exactly what would
+ * otherwise be written to the pipe, so message framing is unchanged.
+ *
+ * The pipe stays connected: it is used as the doorbell, written to only
+ * when the consumer has announced that it is going to sleep, and to
+ * detect the peer going away.
+ *
+ * A producer finding the ring full announces it in waiting and sleeps on a
+ * futex on tail, which the consumer wakes once it has made room.
+ */
+
+#define RDS_SHM_RING_MAGIC		0x474E5252 /* "RRNG" */
+#define RDS_SHM_RING_VERSION		2
+#define RDS_SHM_RING_SIZE		0x100000
+
+#define RDS_TRANSPORT_HELLO_SOCKET	0x00000000
+#define RDS_TRANSPORT_HELLO_SHM		RDS_SHM_RING_MAGIC
+
+#define RDS_TRANSPORT_HELLO_LENGTH	8
+#define RDS_TRANSPORT_HELLO_TIMEOUT	10000
+
+#define RDS_SHM_RING_TO_SERVER		0
+#define RDS_SHM_RING_TO_CLIENT		1
+
+struct rds_shm_ring
+{
+	volatile UINT32 head;
+	BYTE headPadding[60];
+	volatile UINT32 tail;
+	volatile UINT32 sleeping;
+	volatile UINT32 waiting;
+	BYTE tailPadding[52];
+	BYTE data[RDS_SHM_RING_SIZE];
+};
+typedef struct rds_shm_ring rdsShmRing;
+
+struct rds_shm_segment
+{
+	UINT32 magic;
+	UINT32 version;
+	UINT32 ringSize;
+	UINT32 cookie;
+	BYTE padding[48];
+	rdsShmRing rings[2];
+};
+typedef struct rds_shm_segment rdsShmSegment;
+
+struct rds_shm_transport
+{
+	char name[64];
+	BOOL owner;
+	rdsShmSegment* segment;
+	rdsShmRing* inbound;
+	rdsShmRing* outbound;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void freerds_shm_ring_name(const char* pipeName, char* name, int length);
+
+rdsShmTransport* freerds_shm_transport_create(const char* pipeName);
+rdsShmTransport* freerds_shm_transport_open(const char* pipeName);
+void freerds_shm_transport_unlink(rdsShmTransport* transport);
+void freerds_shm_transport_free(rdsShmTransport* transport);
+
+int freerds_shm_transport_read(rdsShmTransport* transport, BYTE* data, UINT32 length);
+int freerds_shm_transport_write(rdsShmTransport* transport, HANDLE hDoorbell, BYTE* data, UINT32 length);
+BOOL freerds_shm_transport_sleep(rdsShmTransport* transport);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RDS_NG_SHM_RING_H */
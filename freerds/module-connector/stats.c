@@ -0,0 +1,194 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * FreeRDS module connector statistics
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include <winpr/crt.h>
+
+#include <freerds/freerds.h>
+
+#define RDS_CLIENT_MSG_BASE	100
+
+static const char* RDS_CLIENT_MSG_NAMES[] =
+{
+	"Unknown", /* 100 */
+	"Unknown", /* 101 */
+	"Capabilities",
+	"RefreshRect",
+	"SynchronizeKeyboardEvent",
+	"ScancodeKeyboardEvent",
+	"VirtualKeyboardEvent",
+	"UnicodeKeyboardEvent",
+	"MouseEvent",
+	"ExtendedMouseEvent",
+	"VBlankEvent",
+	"FlowControl"
+};
+
+static int freerds_stats_index(UINT32 type)
+{
+	if (type < RDS_STATS_CLIENT_INDEX)
+		return type;
+
+	if ((type >= RDS_CLIENT_MSG_BASE) &&
+			((type - RDS_CLIENT_MSG_BASE) < (RDS_STATS_MESSAGE_TYPES - RDS_STATS_CLIENT_INDEX)))
+		return RDS_STATS_CLIENT_INDEX + (type - RDS_CLIENT_MSG_BASE);
+
+	return -1;
+}
+
+static const char* freerds_stats_name(int index)
+{
+	if (index < RDS_STATS_CLIENT_INDEX)
+		return freerds_server_message_name(index);
+
+	index -= RDS_STATS_CLIENT_INDEX;
+
+	if (index < (int) (sizeof(RDS_CLIENT_MSG_NAMES) / sizeof(RDS_CLIENT_MSG_NAMES[0])))
+		return RDS_CLIENT_MSG_NAMES[index];
+
+	return "Unknown";
+}
+
+void freerds_stats_record(RDS_STATS_HISTOGRAM* histogram, UINT32 value)
+{
+	int index = 0;
+
+	while ((index < RDS_STATS_BUCKETS - 1) && (value >> index))
+		index++;
+
+	histogram->buckets[index]++;
+	histogram->count++;
+	histogram->total += value;
+
+	if (value > histogram->max)
+		histogram->max = value;
+}
+
+/**
+ * Called for every message dispatched from the transport.
+ */
+
+void freerds_stats_count_inbound(rdsModuleConnector* connector, UINT32 type, UINT32 length)
+{
+	int index = freerds_stats_index(type);
+
+	connector->InboundTotalCount++;
+	connector->InboundTotalLength += length;
+
+	if (index < 0)
+		return;
+
+	connector->Stats.InboundCount[index]++;
+	connector->Stats.InboundLength[index] += length;
+}
+
+/**
+ * Called for every buffer written to the transport, which always
+ * holds complete messages.
+ */
+
+void freerds_stats_count_outbound(rdsModuleConnector* connector, BYTE* data, DWORD length)
+{
+	int index;
+	UINT32 type;
+	UINT32 size;
+	DWORD offset = 0;
+
+	while (offset < length)
+	{
+		if (freerds_peek_message_length(&data[offset], length - offset, &size) < 1)
+			break;
+
+		if ((size > (length - offset)) || (freerds_peek_message_type(&data[offset], size, &type) < 1))
+			break;
+
+		connector->OutboundTotalCount++;
+		connector->OutboundTotalLength += size;
+
+		index = freerds_stats_index(type);
+
+		if (index >= 0)
+		{
+			connector->Stats.OutboundCount[index]++;
+			connector->Stats.OutboundLength[index] += size;
+		}
+
+		offset += size;
+	}
+}
+
+static void freerds_stats_print_histogram(FILE* fp, const char* name, RDS_STATS_HISTOGRAM* histogram)
+{
+	int index;
+
+	if (!histogram->count)
+		return;
+
+	fprintf(fp, "%s: %d samples, avg %d, max %d\n", name, (int) histogram->count,
+			(int) (histogram->total / histogram->count), (int) histogram->max);
+
+	for (index = 0; index < RDS_STATS_BUCKETS; index++)
+	{
+		if (!histogram->buckets[index])
+			continue;
+
+		if (index == 0)
+			fprintf(fp, "\t0: %d\n", (int) histogram->buckets[index]);
+		else if (index == RDS_STATS_BUCKETS - 1)
+			fprintf(fp, "\t>= %d: %d\n", 1 << (index - 1), (int) histogram->buckets[index]);
+		else
+			fprintf(fp, "\t%d-%d: %d\n", 1 << (index - 1), (1 << index) - 1, (int) histogram->buckets[index]);
+	}
+}
+
+void freerds_stats_print(rdsModuleConnector* connector, FILE* fp)
+{
+	int index;
+	RDS_CONNECTOR_STATS* stats = &(connector->Stats);
+
+	fprintf(fp, "connector %.*s session %d: inbound %u messages %u bytes, outbound %u messages %u bytes\n",
+			RDS_TCP_ENDPOINT_ADDRESS(connector->Endpoint ? connector->Endpoint : ""), (int) connector->SessionId,
+			connector->InboundTotalCount, connector->InboundTotalLength,
+			connector->OutboundTotalCount, connector->OutboundTotalLength);
+
+	for (index = 0; index < RDS_STATS_MESSAGE_TYPES; index++)
+	{
+		if (stats->InboundCount[index])
+		{
+			fprintf(fp, "\tinbound %s: %u messages, %llu bytes\n", freerds_stats_name(index),
+					stats->InboundCount[index], (unsigned long long) stats->InboundLength[index]);
+		}
+
+		if (stats->OutboundCount[index])
+		{
+			fprintf(fp, "\toutbound %s: %u messages, %llu bytes\n", freerds_stats_name(index),
+					stats->OutboundCount[index], (unsigned long long) stats->OutboundLength[index]);
+		}
+	}
+
+	freerds_stats_print_histogram(fp, "messages per wakeup", &(stats->MessagesPerWakeup));
+	freerds_stats_print_histogram(fp, "server queue depth at pack", &(stats->PackQueueDepth));
+
+	fflush(fp);
+}
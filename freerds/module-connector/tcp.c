@@ -0,0 +1,731 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * FreeRDS module connector TCP transport
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/sysinfo.h>
+
+#ifdef WITH_LZ4
+#include <lz4.h>
+#endif
+
+#include "tcp.h"
+
+#define RDS_TCP_READ_LENGTH		0x10000
+#define RDS_TCP_CONNECT_RETRY		100
+
+BOOL freerds_tcp_is_endpoint(const char* endpoint)
+{
+	if (!endpoint)
+		return FALSE;
+
+	return (strncmp(endpoint, RDS_TCP_ENDPOINT_PREFIX, sizeof(RDS_TCP_ENDPOINT_PREFIX) - 1) == 0) ? TRUE : FALSE;
+}
+
+/**
+ * Setting FREERDS_CONNECTOR_COMPRESSION=none on either side disables LZ4.
+ */
+
+UINT32 freerds_tcp_supported_flags(void)
+{
+#ifdef WITH_LZ4
+	char* value = getenv("FREERDS_CONNECTOR_COMPRESSION");
+
+	if (value && (strcmp(value, "none") == 0))
+		return 0;
+
+	return RDS_TCP_FLAG_LZ4;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Fills cookie with 32 hex digits from /dev/urandom.
+ */
+
+int freerds_tcp_generate_cookie(char* cookie, int length)
+{
+	int fd;
+	int index;
+	int status;
+	BYTE random[RDS_TCP_COOKIE_LENGTH];
+
+	if (length < RDS_TCP_COOKIE_STRING_LENGTH)
+		return -1;
+
+	fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+
+	do
+	{
+		status = read(fd, random, sizeof(random));
+	}
+	while ((status < 0) && (errno == EINTR));
+
+	close(fd);
+
+	if (status != sizeof(random))
+		return -1;
+
+	for (index = 0; index < RDS_TCP_COOKIE_LENGTH; index++)
+		sprintf_s(&cookie[index * 2], 3, "%02x", random[index]);
+
+	return 0;
+}
+
+static int freerds_tcp_parse_cookie(const char* value, BYTE* cookie)
+{
+	int index;
+	unsigned int digit;
+
+	if (strlen(value) != (RDS_TCP_COOKIE_LENGTH * 2))
+		return -1;
+
+	for (index = 0; index < RDS_TCP_COOKIE_LENGTH; index++)
+	{
+		if (!isxdigit(value[index * 2]) || !isxdigit(value[(index * 2) + 1]) ||
+				(sscanf(&value[index * 2], "%2x", &digit) != 1))
+			return -1;
+
+		cookie[index] = (BYTE) digit;
+	}
+
+	return 0;
+}
+
+/**
+ * The cookie comes with the endpoint on the freerds side and from the
+ * environment on the module side. Returns -1 if there is none.
+ */
+
+int freerds_tcp_get_cookie(const char* endpoint, BYTE* cookie)
+{
+	const char* value;
+	const char* query = endpoint ? strchr(endpoint, '?') : NULL;
+
+	if (query && (strncmp(query, RDS_TCP_COOKIE_PARAM, sizeof(RDS_TCP_COOKIE_PARAM) - 1) == 0))
+		value = &query[sizeof(RDS_TCP_COOKIE_PARAM) - 1];
+	else
+		value = getenv(RDS_TCP_COOKIE_ENV);
+
+	if (!value)
+		return -1;
+
+	return freerds_tcp_parse_cookie(value, cookie);
+}
+
+/* takes the same time wherever the cookies differ */
+BOOL freerds_tcp_compare_cookie(const BYTE* cookie1, const BYTE* cookie2)
+{
+	int index;
+	BYTE difference = 0;
+
+	for (index = 0; index < RDS_TCP_COOKIE_LENGTH; index++)
+		difference |= cookie1[index] ^ cookie2[index];
+
+	return (difference == 0) ? TRUE : FALSE;
+}
+
+/**
+ * Splits tcp://<host>:<port> or tcp://[<address>]:<port>, an empty host or *
+ * stands for any address. A query such as the cookie is ignored.
+ */
+
+static int freerds_tcp_parse_endpoint(const char* endpoint, char* host, int hostLength, char* port, int portLength)
+{
+	char* p;
+	char* end;
+	char* colon;
+	char address[512];
+
+	if (!freerds_tcp_is_endpoint(endpoint))
+		return -1;
+
+	if (strlen(endpoint) >= sizeof(address))
+		return -1;
+
+	strcpy(address, &endpoint[sizeof(RDS_TCP_ENDPOINT_PREFIX) - 1]);
+
+	p = strchr(address, '?');
+
+	if (p)
+		*p = '\0';
+
+	p = address;
+
+	if (*p == '[')
+	{
+		p++;
+		end = strchr(p, ']');
+
+		if (!end || (end[1] != ':'))
+			return -1;
+
+		colon = &end[1];
+	}
+	else
+	{
+		colon = strrchr(p, ':');
+
+		if (!colon)
+			return -1;
+
+		end = colon;
+	}
+
+	if (((end - p) >= hostLength) || !colon[1] || (strlen(&colon[1]) >= (size_t) portLength))
+		return -1;
+
+	CopyMemory(host, p, end - p);
+	host[end - p] = '\0';
+
+	if (strcmp(host, "*") == 0)
+		host[0] = '\0';
+
+	strcpy(port, &colon[1]);
+
+	return 0;
+}
+
+static struct addrinfo* freerds_tcp_resolve(const char* endpoint, BOOL passive)
+{
+	int status;
+	char host[256];
+	char port[16];
+	struct addrinfo hints;
+	struct addrinfo* result = NULL;
+
+	if (freerds_tcp_parse_endpoint(endpoint, host, sizeof(host), port, sizeof(port)) < 0)
+	{
+		fprintf(stderr, "freerds_tcp_resolve: invalid endpoint %.*s\n", RDS_TCP_ENDPOINT_ADDRESS(endpoint));
+		return NULL;
+	}
+
+	ZeroMemory(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+	status = getaddrinfo(host[0] ? host : NULL, port, &hints, &result);
+
+	if (status != 0)
+	{
+		fprintf(stderr, "freerds_tcp_resolve: %.*s: %s\n", RDS_TCP_ENDPOINT_ADDRESS(endpoint), gai_strerror(status));
+		return NULL;
+	}
+
+	return result;
+}
+
+static void freerds_tcp_set_options(int sockfd)
+{
+	int optval = 1;
+
+	/* input events and small updates must not wait for more data */
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+	fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+}
+
+static int freerds_tcp_poll(int sockfd, short events, DWORD nTimeOut)
+{
+	struct pollfd pfd;
+
+	pfd.fd = sockfd;
+	pfd.events = events;
+
+	if (poll(&pfd, 1, nTimeOut) < 1)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Called by the module, returns a non-blocking listening socket.
+ */
+
+int freerds_tcp_listen(const char* endpoint)
+{
+	int sockfd = -1;
+	int optval = 1;
+	struct addrinfo* ai;
+	struct addrinfo* result;
+
+	result = freerds_tcp_resolve(endpoint, TRUE);
+
+	if (!result)
+		return -1;
+
+	for (ai = result; ai; ai = ai->ai_next)
+	{
+		sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+		if (sockfd < 0)
+			continue;
+
+		setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+		fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+		fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+
+		if ((bind(sockfd, ai->ai_addr, ai->ai_addrlen) == 0) && (listen(sockfd, SOMAXCONN) == 0))
+			break;
+
+		close(sockfd);
+		sockfd = -1;
+	}
+
+	freeaddrinfo(result);
+
+	if (sockfd < 0)
+		fprintf(stderr, "freerds_tcp_listen: failed to listen on %.*s\n", RDS_TCP_ENDPOINT_ADDRESS(endpoint));
+
+	return sockfd;
+}
+
+/**
+ * Waits at most nTimeOut for a connection, fails with ETIMEDOUT otherwise.
+ */
+
+int freerds_tcp_accept(int listenfd, DWORD nTimeOut)
+{
+	int sockfd;
+
+	if (freerds_tcp_poll(listenfd, POLLIN, nTimeOut) < 0)
+	{
+		if (errno != EINTR)
+			errno = ETIMEDOUT;
+
+		return -1;
+	}
+
+	do
+	{
+		sockfd = accept(listenfd, NULL, NULL);
+	}
+	while ((sockfd < 0) && (errno == EINTR));
+
+	if (sockfd < 0)
+		return -1;
+
+	freerds_tcp_set_options(sockfd);
+
+	return sockfd;
+}
+
+static int freerds_tcp_connect_address(struct addrinfo* ai, DWORD nTimeOut)
+{
+	int sockfd;
+	int error = 0;
+	struct pollfd pfd;
+	socklen_t length = sizeof(error);
+
+	sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+	if (sockfd < 0)
+		return -1;
+
+	freerds_tcp_set_options(sockfd);
+
+	if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) == 0)
+		return sockfd;
+
+	if (errno == EINPROGRESS)
+	{
+		pfd.fd = sockfd;
+		pfd.events = POLLOUT;
+
+		if (poll(&pfd, 1, nTimeOut) < 1)
+			error = ETIMEDOUT;
+		else if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+			error = errno;
+
+		if (!error)
+			return sockfd;
+	}
+	else
+	{
+		error = errno;
+	}
+
+	close(sockfd);
+	errno = error;
+
+	return -1;
+}
+
+/**
+ * Called by freerds, the module may still be starting: a refused connection
+ * is retried until nTimeOut has elapsed. Returns a non-blocking socket.
+ */
+
+int freerds_tcp_connect(const char* endpoint, DWORD nTimeOut)
+{
+	int sockfd = -1;
+	DWORD startTime;
+	struct addrinfo* ai;
+	struct addrinfo* result;
+
+	result = freerds_tcp_resolve(endpoint, FALSE);
+
+	if (!result)
+		return -1;
+
+	startTime = GetTickCount();
+
+	while (1)
+	{
+		for (ai = result; ai && (sockfd < 0); ai = ai->ai_next)
+			sockfd = freerds_tcp_connect_address(ai, nTimeOut);
+
+		if ((sockfd >= 0) || (errno != ECONNREFUSED) || ((GetTickCount() - startTime) >= nTimeOut))
+			break;
+
+		Sleep(RDS_TCP_CONNECT_RETRY);
+	}
+
+	freeaddrinfo(result);
+
+	if (sockfd < 0)
+		fprintf(stderr, "freerds_tcp_connect: failed to connect to %.*s\n", RDS_TCP_ENDPOINT_ADDRESS(endpoint));
+
+	return sockfd;
+}
+
+/**
+ * Waits until something listens on the endpoint.
+ */
+
+BOOL freerds_tcp_wait_endpoint(const char* endpoint, DWORD nTimeOut)
+{
+	int sockfd;
+
+	sockfd = freerds_tcp_connect(endpoint, nTimeOut);
+
+	if (sockfd < 0)
+		return FALSE;
+
+	close(sockfd);
+
+	return TRUE;
+}
+
+int freerds_tcp_read_exact(int sockfd, BYTE* data, UINT32 length, DWORD nTimeOut)
+{
+	int status;
+	UINT32 offset = 0;
+
+	while (offset < length)
+	{
+		status = recv(sockfd, &data[offset], length - offset, 0);
+
+		if (status > 0)
+		{
+			offset += status;
+			continue;
+		}
+
+		if (status == 0)
+			return -1;
+
+		if (errno == EINTR)
+			continue;
+
+		if (((errno != EAGAIN) && (errno != EWOULDBLOCK)) || (freerds_tcp_poll(sockfd, POLLIN, nTimeOut) < 0))
+			return -1;
+	}
+
+	return length;
+}
+
+int freerds_tcp_write_all(int sockfd, BYTE* data, UINT32 length)
+{
+	int status;
+	UINT32 offset = 0;
+
+	while (offset < length)
+	{
+		status = send(sockfd, &data[offset], length - offset, MSG_NOSIGNAL);
+
+		if (status >= 0)
+		{
+			offset += status;
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		/* the peer is not reading, give up rather than blocking forever */
+		if (((errno != EAGAIN) && (errno != EWOULDBLOCK)) || (freerds_tcp_poll(sockfd, POLLOUT, RDS_TCP_TIMEOUT) < 0))
+			return -1;
+	}
+
+	return length;
+}
+
+rdsTcpTransport* freerds_tcp_transport_new(int sockfd, UINT32 flags)
+{
+	rdsTcpTransport* tcp;
+
+	tcp = (rdsTcpTransport*) malloc(sizeof(rdsTcpTransport));
+	ZeroMemory(tcp, sizeof(rdsTcpTransport));
+
+	tcp->sockfd = sockfd;
+	tcp->flags = flags;
+	tcp->inbound = Stream_New(NULL, RDS_TCP_READ_LENGTH);
+
+	return tcp;
+}
+
+void freerds_tcp_transport_free(rdsTcpTransport* tcp)
+{
+	if (!tcp)
+		return;
+
+	if (tcp->sockfd >= 0)
+	{
+		shutdown(tcp->sockfd, SHUT_RDWR);
+		close(tcp->sockfd);
+	}
+
+	Stream_Free(tcp->inbound, TRUE);
+	free(tcp->buffer);
+	free(tcp);
+}
+
+/**
+ * Decodes the complete frames at the beginning of the inbound buffer and
+ * appends their payload to s. Returns the number of bytes appended.
+ */
+
+static int freerds_tcp_transport_decode(rdsTcpTransport* tcp, wStream* s)
+{
+	wStream* in;
+	BYTE* buffer;
+	int total = 0;
+	size_t offset = 0;
+	size_t position;
+	UINT32 header;
+	UINT32 wireLength;
+	UINT32 rawLength;
+
+	in = tcp->inbound;
+	buffer = Stream_Buffer(in);
+	position = Stream_GetPosition(in);
+
+	while ((position - offset) >= RDS_TCP_FRAME_HEADER_LENGTH)
+	{
+		Stream_SetPosition(in, offset);
+		Stream_Read_UINT32(in, header);
+		Stream_Read_UINT32(in, rawLength);
+
+		wireLength = header & ~RDS_TCP_FRAME_LZ4;
+
+		if ((rawLength > RDS_TCP_FRAME_MAX_LENGTH) || (wireLength > RDS_TCP_FRAME_MAX_LENGTH) ||
+				(!(header & RDS_TCP_FRAME_LZ4) && (wireLength != rawLength)))
+		{
+			fprintf(stderr, "freerds_tcp_transport_decode: invalid frame (%d/%d)\n",
+					(int) wireLength, (int) rawLength);
+			return -1;
+		}
+
+		if ((position - offset - RDS_TCP_FRAME_HEADER_LENGTH) < wireLength)
+			break;
+
+		Stream_EnsureRemainingCapacity(s, rawLength);
+
+		if (header & RDS_TCP_FRAME_LZ4)
+		{
+#ifdef WITH_LZ4
+			if (LZ4_decompress_safe((const char*) Stream_Pointer(in), (char*) Stream_Pointer(s),
+					wireLength, rawLength) != (int) rawLength)
+			{
+				fprintf(stderr, "freerds_tcp_transport_decode: corrupt compressed frame\n");
+				return -1;
+			}
+#else
+			fprintf(stderr, "freerds_tcp_transport_decode: compressed frame without LZ4 support\n");
+			return -1;
+#endif
+		}
+		else
+		{
+			CopyMemory(Stream_Pointer(s), Stream_Pointer(in), rawLength);
+		}
+
+		Stream_Seek(s, rawLength);
+		total += rawLength;
+
+		offset += RDS_TCP_FRAME_HEADER_LENGTH + wireLength;
+	}
+
+	/* keep the partial frame for the next read */
+	if (offset && (offset < position))
+		MoveMemory(buffer, &buffer[offset], position - offset);
+
+	Stream_SetPosition(in, position - offset);
+
+	return total;
+}
+
+/**
+ * Reads everything available on the socket and appends the payload of every
+ * complete frame to s. Returns the number of bytes appended, 0 if no frame
+ * was completed, or -1 on error or when the peer has gone away.
+ */
+
+int freerds_tcp_transport_read(rdsTcpTransport* tcp, wStream* s)
+{
+	int status;
+	int count;
+	int total = 0;
+	size_t available;
+	wStream* in = tcp->inbound;
+
+	while (1)
+	{
+		Stream_EnsureRemainingCapacity(in, RDS_TCP_READ_LENGTH);
+		available = Stream_Capacity(in) - Stream_GetPosition(in);
+
+		count = recv(tcp->sockfd, Stream_Pointer(in), available, 0);
+
+		if (count < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				break;
+
+			return -1;
+		}
+
+		if (count == 0)
+			return -1;
+
+		Stream_Seek(in, count);
+
+		status = freerds_tcp_transport_decode(tcp, s);
+
+		if (status < 0)
+			return -1;
+
+		total += status;
+
+		/* a short read means the socket has been drained */
+		if ((size_t) count < available)
+			break;
+	}
+
+	return total;
+}
+
+static int freerds_tcp_transport_write_frame(rdsTcpTransport* tcp, BYTE* data, UINT32 length)
+{
+	wStream* s;
+	size_t size;
+	UINT32 header;
+	UINT32 wireLength;
+
+	size = RDS_TCP_FRAME_HEADER_LENGTH + length;
+
+#ifdef WITH_LZ4
+	if (tcp->flags & RDS_TCP_FLAG_LZ4)
+		size = RDS_TCP_FRAME_HEADER_LENGTH + LZ4_compressBound(length);
+#endif
+
+	if (size > tcp->bufferSize)
+	{
+		BYTE* buffer = (BYTE*) realloc(tcp->buffer, size);
+
+		if (!buffer)
+			return -1;
+
+		tcp->buffer = buffer;
+		tcp->bufferSize = size;
+	}
+
+	header = length;
+	wireLength = length;
+
+#ifdef WITH_LZ4
+	if ((tcp->flags & RDS_TCP_FLAG_LZ4) && (length >= RDS_TCP_COMPRESS_THRESHOLD))
+	{
+		int status;
+
+		status = LZ4_compress_default((const char*) data, (char*) &tcp->buffer[RDS_TCP_FRAME_HEADER_LENGTH],
+				length, LZ4_compressBound(length));
+
+		/* incompressible payloads are sent as they are */
+		if ((status > 0) && ((UINT32) status < length))
+		{
+			wireLength = status;
+			header = wireLength | RDS_TCP_FRAME_LZ4;
+		}
+	}
+#endif
+
+	if (!(header & RDS_TCP_FRAME_LZ4))
+		CopyMemory(&tcp->buffer[RDS_TCP_FRAME_HEADER_LENGTH], data, length);
+
+	s = Stream_New(tcp->buffer, RDS_TCP_FRAME_HEADER_LENGTH);
+	Stream_Write_UINT32(s, header);
+	Stream_Write_UINT32(s, length);
+	Stream_Free(s, FALSE);
+
+	return freerds_tcp_write_all(tcp->sockfd, tcp->buffer, RDS_TCP_FRAME_HEADER_LENGTH + wireLength);
+}
+
+int freerds_tcp_transport_write(rdsTcpTransport* tcp, BYTE* data, UINT32 length)
+{
+	UINT32 chunk;
+	UINT32 total = 0;
+
+	while (length > 0)
+	{
+		chunk = (length > RDS_TCP_FRAME_MAX_LENGTH) ? RDS_TCP_FRAME_MAX_LENGTH : length;
+
+		if (freerds_tcp_transport_write_frame(tcp, data, chunk) < 0)
+			return -1;
+
+		data += chunk;
+		length -= chunk;
+		total += chunk;
+	}
+
+	return total;
+}
@@ -0,0 +1,97 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * FreeRDS module connector TCP transport
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDS_NG_TCP_H
+#define RDS_NG_TCP_H
+
+#include <freerds/freerds.h>
+
+/**
+ * TCP Transport
+ *
+ * Selected by an endpoint of the form tcp://<host>:<port>, so that the
+ * module can run on another machine than freerds. The byte stream that
+ * would otherwise be written to the pipe is cut into frames:
+ *
+ * UINT32 wire length, with RDS_TCP_FRAME_LZ4 set if the payload is compressed
+ * UINT32 raw length, the length of the payload once decompressed
+ *
+ * Frames are decoded as soon as they are complete, a partial frame is kept
+ * until the rest of it has been received. Message framing is unchanged.
+ *
+ * File descriptors cannot be passed over TCP: a module sends the pixels of
+ * its framebuffer with the paint messages instead, see
+ * RDS_FRAMEBUFFER_SEGMENT_REMOTE.
+ */
+
+#define RDS_TCP_ENDPOINT_PREFIX		"tcp://"
+
+#define RDS_TRANSPORT_HELLO_TCP		0x50435452 /* "RTCP" */
+
+/* (RDS_TRANSPORT_HELLO_TCP, flags, cookie), the module answers with a zero cookie */
+#define RDS_TCP_HELLO_LENGTH		(RDS_TRANSPORT_HELLO_LENGTH + RDS_TCP_COOKIE_LENGTH)
+
+#define RDS_TCP_FLAG_LZ4		0x00000001
+
+#define RDS_TCP_FRAME_HEADER_LENGTH	8
+#define RDS_TCP_FRAME_LZ4		0x80000000
+#define RDS_TCP_FRAME_MAX_LENGTH	0x00100000
+
+/* smaller frames, such as input batches, are not worth compressing */
+#define RDS_TCP_COMPRESS_THRESHOLD	1024
+
+#define RDS_TCP_TIMEOUT			10000
+
+struct rds_tcp_transport
+{
+	int sockfd;
+	UINT32 flags;
+	wStream* inbound;
+	BYTE* buffer;
+	size_t bufferSize;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+BOOL freerds_tcp_is_endpoint(const char* endpoint);
+UINT32 freerds_tcp_supported_flags(void);
+
+int freerds_tcp_get_cookie(const char* endpoint, BYTE* cookie);
+BOOL freerds_tcp_compare_cookie(const BYTE* cookie1, const BYTE* cookie2);
+
+int freerds_tcp_listen(const char* endpoint);
+int freerds_tcp_connect(const char* endpoint, DWORD nTimeOut);
+int freerds_tcp_accept(int listenfd, DWORD nTimeOut);
+
+int freerds_tcp_read_exact(int sockfd, BYTE* data, UINT32 length, DWORD nTimeOut);
+int freerds_tcp_write_all(int sockfd, BYTE* data, UINT32 length);
+
+rdsTcpTransport* freerds_tcp_transport_new(int sockfd, UINT32 flags);
+void freerds_tcp_transport_free(rdsTcpTransport* tcp);
+
+int freerds_tcp_transport_read(rdsTcpTransport* tcp, wStream* s);
+int freerds_tcp_transport_write(rdsTcpTransport* tcp, BYTE* data, UINT32 length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RDS_NG_TCP_H */
@@ -21,6 +21,11 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
 #include <freerds/freerds.h>
 
 #include <winpr/crt.h>
@@ -29,8 +34,12 @@
 #include <winpr/path.h>
 #include <winpr/print.h>
 #include <winpr/thread.h>
+#include <winpr/sysinfo.h>
 
 #include "protocol.h"
+#include "shm_ring.h"
+#include "tcp.h"
+#include "uring.h"
 
 #include "transport.h"
 
@@ -44,6 +53,12 @@ int freerds_named_pipe_read(HANDLE hNamedPipe, BYTE* data, DWORD length)
 
 	fSuccess = ReadFile(hNamedPipe, data, length, &NumberOfBytesRead, NULL);
 
+	if (!fSuccess && (GetLastError() == ERROR_NO_DATA))
+	{
+		/* non-blocking pipe without pending data */
+		return 0;
+	}
+
 	if (!fSuccess || (NumberOfBytesRead == 0))
 	{
 		return -1;
@@ -271,6 +286,57 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 			}
 			break;
 
+		case RDS_SERVER_PAINT_RECTS:
+			{
+				RDS_MSG_PAINT_RECTS msg;
+				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
+
+				msg.fbSegmentId = 0;
+				msg.framebuffer = NULL;
+
+				msg.rects = NULL;
+
+				if (freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg) < 0)
+				{
+					fprintf(stderr, "freerds_receive_server_message: dropping malformed PaintRects\n");
+					status = -1;
+					break;
+				}
+
+				if (msg.fbSegmentId)
+					msg.framebuffer = &(connector->framebuffer);
+
+				if (server->PaintRects)
+					status = server->PaintRects(connector, &msg);
+
+				/* compact rectangle lists are not decoded in place */
+				if (msg.msgFlags & RDS_MSG_FLAG_COMPACT)
+					free(msg.rects);
+			}
+			break;
+
+		case RDS_SERVER_SCREEN_BLT_RECTS:
+			{
+				RDS_MSG_SCREEN_BLT_RECTS msg;
+				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
+
+				msg.clipRects = NULL;
+
+				if (freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg) < 0)
+				{
+					fprintf(stderr, "freerds_receive_server_message: dropping malformed ScreenBltRects\n");
+					status = -1;
+					break;
+				}
+
+				if (server->ScreenBltRects)
+					status = server->ScreenBltRects(connector, &msg);
+
+				if (msg.msgFlags & RDS_MSG_FLAG_COMPACT)
+					free(msg.clipRects);
+			}
+			break;
+
 		case RDS_SERVER_SET_CLIPPING_REGION:
 			{
 				RDS_MSG_SET_CLIPPING_REGION msg;
@@ -366,6 +432,13 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 				RDS_MSG_SHARED_FRAMEBUFFER msg;
 				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
 				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+
+				/* the fd queue belongs to this thread, the message may be handled on another one */
+				msg.fd = -1;
+
+				if (msg.attach && (msg.segmentId == RDS_FRAMEBUFFER_SEGMENT_MEMFD))
+					msg.fd = freerds_transport_take_fd(connector);
+
 				status = server->SharedFramebuffer(connector, &msg);
 			}
 			break;
@@ -388,6 +461,32 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 			}
 			break;
 
+		case RDS_SERVER_FRAME_READY:
+			{
+				RDS_MSG_FRAME_READY msg;
+				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
+				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+
+				if (server->FrameReady)
+					status = server->FrameReady(connector, &msg);
+			}
+			break;
+
+		case RDS_SERVER_CAPABILITIES:
+			{
+				RDS_MSG_CAPABILITIES msg;
+				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
+				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+
+				/* the module accepted a protocol version, use it for everything sent from now on */
+				if ((msg.Version >= RDS_PROTOCOL_VERSION_1) && (msg.Version <= RDS_PROTOCOL_VERSION))
+					connector->ProtocolVersion = msg.Version;
+
+				fprintf(stderr, "freerds_receive_server_message: using protocol version %d\n",
+						(int) connector->ProtocolVersion);
+			}
+			break;
+
 		default:
 			status = 0;
 			break;
@@ -396,6 +495,39 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 	return status;
 }
 
+/**
+ * Answers the capabilities of freerds with the highest protocol version
+ * both sides support. Messages which were already written keep their
+ * encoding, readers recognize both, so the switch needs no synchronization.
+ */
+
+static int freerds_transport_negotiate(rdsModuleConnector* connector, RDS_MSG_CAPABILITIES* msg)
+{
+	int status;
+	RDS_MSG_CAPABILITIES reply;
+
+	CopyMemory(&reply, msg, sizeof(RDS_MSG_CAPABILITIES));
+
+	reply.type = RDS_SERVER_CAPABILITIES;
+
+	if (reply.Version > RDS_PROTOCOL_VERSION)
+		reply.Version = RDS_PROTOCOL_VERSION;
+
+	if (reply.Version < RDS_PROTOCOL_VERSION_1)
+		reply.Version = RDS_PROTOCOL_VERSION_1;
+
+	status = freerds_server_outbound_write_message(connector, (RDS_MSG_COMMON*) &reply);
+
+	if (status < 0)
+		return -1;
+
+	connector->ProtocolVersion = reply.Version;
+
+	fprintf(stderr, "freerds_transport_negotiate: using protocol version %d\n", (int) connector->ProtocolVersion);
+
+	return 0;
+}
+
 int freerds_receive_client_message(rdsModuleConnector* connector, wStream* s, RDS_MSG_COMMON* common)
 {
 	int status = 0;
@@ -403,6 +535,9 @@ int freerds_receive_client_message(rdsModuleConnector* connector, wStream* s, RD
 
 	client = connector->client;
 
+	if (common->msgFlags & RDS_MSG_FLAG_INPUT)
+		connector->InputSequence = common->inputSequence;
+
 	switch (common->type)
 	{
 		case RDS_CLIENT_SYNCHRONIZE_KEYBOARD_EVENT:
@@ -471,6 +606,30 @@ int freerds_receive_client_message(rdsModuleConnector* connector, wStream* s, RD
 			}
 			break;
 
+		case RDS_CLIENT_CAPABILITIES:
+			{
+				RDS_MSG_CAPABILITIES msg;
+				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
+				freerds_read_capabilities(s, &msg);
+				status = freerds_transport_negotiate(connector, &msg);
+				if ((status == 0) && client->Capabilities)
+					status = client->Capabilities(connector, &msg);
+			}
+			break;
+
+		case RDS_CLIENT_FLOW_CONTROL:
+			{
+				RDS_MSG_FLOW_CONTROL msg;
+				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
+				freerds_read_flow_control(s, &msg);
+				InterlockedExchangeAdd(&(connector->FlowControlCredits), (LONG) msg.credits);
+				if (client->FlowControl)
+					status = client->FlowControl(connector, msg.credits);
+				else
+					status = 0;
+			}
+			break;
+
 		default:
 			status = 0;
 			break;
@@ -483,64 +642,867 @@ int freerds_receive_message(rdsModuleConnector* connector, wStream* s, RDS_MSG_C
 {
 	if (connector->ServerMode)
 		return freerds_receive_client_message(connector, s, common);
+
+	/* every server message received is granted back as a credit, see freerds_message_server_queue_pack */
+	connector->FlowControlPending++;
+
+	return freerds_receive_server_message(connector, s, common);
+}
+
+/**
+ * Transport Negotiation
+ *
+ * Right after connecting, freerds sends an 8-byte hello (transport type,
+ * segment cookie) telling the module whether it could map the shared memory
+ * segment the module created before accepting, and the module answers with
+ * the transport type both sides will use from then on. Setting
+ * FREERDS_CONNECTOR_TRANSPORT=socket on either side disables shared memory.
+ *
+ * With a tcp:// endpoint the hello is (RDS_TRANSPORT_HELLO_TCP, flags, cookie)
+ * in both directions, the module answering with the flags both sides support.
+ * The cookie is the per-session secret the session manager handed to both
+ * ends, see RDS_TCP_COOKIE_PARAM; freerds must present it, the module answers
+ * with a zero cookie.
+ */
+
+static BOOL freerds_transport_shm_enabled(void)
+{
+	char* value = getenv("FREERDS_CONNECTOR_TRANSPORT");
+
+	if (value && (strcmp(value, "socket") == 0))
+		return FALSE;
+
+	return TRUE;
+}
+
+static int freerds_transport_read_exact(HANDLE hNamedPipe, BYTE* data, DWORD length, DWORD nTimeOut)
+{
+	int status;
+	DWORD offset = 0;
+
+	while (offset < length)
+	{
+		if (WaitForSingleObject(hNamedPipe, nTimeOut) != WAIT_OBJECT_0)
+			return -1;
+
+		status = freerds_named_pipe_read(hNamedPipe, &data[offset], length - offset);
+
+		if (status < 0)
+			return -1;
+
+		offset += status;
+	}
+
+	return length;
+}
+
+/**
+ * Called by the module to create the endpoint it accepts freerds on. For a
+ * tcp:// endpoint this is an event on the listening socket.
+ */
+
+HANDLE freerds_transport_listen(rdsModuleConnector* connector)
+{
+	int sockfd;
+	BYTE cookie[RDS_TCP_COOKIE_LENGTH];
+
+	if (!freerds_tcp_is_endpoint(connector->Endpoint))
+		return freerds_named_pipe_create_endpoint(connector->SessionId, connector->Endpoint);
+
+	/* never listen without a secret to check connections against */
+	if (freerds_tcp_get_cookie(connector->Endpoint, cookie) < 0)
+	{
+		fprintf(stderr, "freerds_transport_listen: no cookie for the tcp endpoint, set %s\n",
+				RDS_TCP_COOKIE_ENV);
+		return NULL;
+	}
+
+	sockfd = freerds_tcp_listen(connector->Endpoint);
+
+	if (sockfd < 0)
+		return NULL;
+
+	return CreateFileDescriptorEvent(NULL, FALSE, FALSE, sockfd);
+}
+
+static HANDLE freerds_transport_attach_tcp(rdsModuleConnector* connector, int sockfd, UINT32 flags)
+{
+	connector->TcpTransport = freerds_tcp_transport_new(sockfd, flags);
+
+	/* the event owns its own descriptor, the socket is closed with the transport */
+	connector->hClientPipe = CreateFileDescriptorEvent(NULL, FALSE, FALSE, dup(sockfd));
+
+	connector->ProtocolVersion = RDS_PROTOCOL_VERSION_1;
+	connector->OutboundFd = -1;
+
+	fprintf(stderr, "freerds_transport: using tcp transport%s\n",
+			(flags & RDS_TCP_FLAG_LZ4) ? " with lz4 compression" : "");
+
+	return connector->hClientPipe;
+}
+
+static int freerds_transport_write_tcp_hello(int sockfd, UINT32 flags, const BYTE* cookie)
+{
+	wStream* s;
+	BYTE hello[RDS_TCP_HELLO_LENGTH];
+
+	s = Stream_New(hello, RDS_TCP_HELLO_LENGTH);
+	Stream_Write_UINT32(s, RDS_TRANSPORT_HELLO_TCP);
+	Stream_Write_UINT32(s, flags);
+
+	if (cookie)
+		Stream_Write(s, cookie, RDS_TCP_COOKIE_LENGTH);
 	else
-		return freerds_receive_server_message(connector, s, common);
+		Stream_Zero(s, RDS_TCP_COOKIE_LENGTH);
+
+	Stream_Free(s, FALSE);
+
+	return freerds_tcp_write_all(sockfd, hello, RDS_TCP_HELLO_LENGTH);
 }
 
-int freerds_transport_receive(rdsModuleConnector* connector)
+static int freerds_transport_read_tcp_hello(int sockfd, UINT32* flags, BYTE* cookie)
 {
 	wStream* s;
-	int status;
-	int position;
-	UINT32 length;
-	RDS_MSG_COMMON common;
+	UINT32 type;
+	BYTE hello[RDS_TCP_HELLO_LENGTH];
 
-	s = connector->InboundStream;
+	if (freerds_tcp_read_exact(sockfd, hello, RDS_TCP_HELLO_LENGTH, RDS_TRANSPORT_HELLO_TIMEOUT) < 0)
+		return -1;
 
-	if (Stream_GetPosition(s) < RDS_ORDER_HEADER_LENGTH)
+	s = Stream_New(hello, RDS_TCP_HELLO_LENGTH);
+	Stream_Read_UINT32(s, type);
+	Stream_Read_UINT32(s, *flags);
+	Stream_Read(s, cookie, RDS_TCP_COOKIE_LENGTH);
+	Stream_Free(s, FALSE);
+
+	return (type == RDS_TRANSPORT_HELLO_TCP) ? 0 : -1;
+}
+
+/**
+ * With the socket transport the pipe is driven through io_uring when it is
+ * available, see uring.h. The negotiation reads exactly the hello, so the
+ * socket has nothing buffered on our side by the time it is attached.
+ */
+
+static void freerds_transport_attach_uring(rdsModuleConnector* connector)
+{
+	if (connector->ShmTransport || connector->TcpTransport)
+		return;
+
+	connector->UringTransport = freerds_uring_transport_new(
+			GetNamePipeFileDescriptor(connector->hClientPipe));
+}
+
+/**
+ * Connections which do not send a valid hello with the session cookie, such
+ * as the probes of freerds_tcp_wait_endpoint, are dropped and the next one is
+ * accepted, for at most RDS_TCP_TIMEOUT in all: the module must not hang when
+ * freerds gives up after its probe. It can accept again once the listening
+ * socket is signaled.
+ */
+
+static HANDLE freerds_transport_accept_tcp(rdsModuleConnector* connector)
+{
+	int sockfd;
+	int listenfd;
+	UINT32 flags;
+	DWORD elapsed;
+	DWORD startTime;
+	BYTE cookie[RDS_TCP_COOKIE_LENGTH];
+	BYTE expected[RDS_TCP_COOKIE_LENGTH];
+
+	listenfd = GetEventFileDescriptor(connector->hServerPipe);
+
+	if (listenfd < 0)
+		return NULL;
+
+	if (freerds_tcp_get_cookie(connector->Endpoint, expected) < 0)
+		return NULL;
+
+	startTime = GetTickCount();
+
+	while (1)
 	{
-		status = freerds_named_pipe_read(connector->hClientPipe, Stream_Pointer(s),
-				RDS_ORDER_HEADER_LENGTH - Stream_GetPosition(s));
+		elapsed = GetTickCount() - startTime;
 
-		if (status < 0)
+		if (elapsed >= RDS_TCP_TIMEOUT)
+			return NULL;
+
+		sockfd = freerds_tcp_accept(listenfd, RDS_TCP_TIMEOUT - elapsed);
+
+		if (sockfd < 0)
+		{
+			/* the connection went away between poll and accept */
+			if ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ECONNABORTED))
+				continue;
+
+			return NULL;
+		}
+
+		if ((freerds_transport_read_tcp_hello(sockfd, &flags, cookie) == 0) &&
+				freerds_tcp_compare_cookie(cookie, expected))
+		{
+			flags &= freerds_tcp_supported_flags();
+
+			if (freerds_transport_write_tcp_hello(sockfd, flags, NULL) >= 0)
+				break;
+		}
+
+		close(sockfd);
+	}
+
+	connector->FlowControlCredits = RDS_FLOW_CONTROL_WINDOW;
+
+	return freerds_transport_attach_tcp(connector, sockfd, flags);
+}
+
+static HANDLE freerds_transport_connect_tcp(rdsModuleConnector* connector, DWORD nTimeOut)
+{
+	int sockfd;
+	UINT32 flags;
+	BYTE cookie[RDS_TCP_COOKIE_LENGTH];
+
+	if (freerds_tcp_get_cookie(connector->Endpoint, cookie) < 0)
+	{
+		fprintf(stderr, "freerds_transport_connect: no cookie for the tcp endpoint\n");
+		return NULL;
+	}
+
+	/* unlike a pipe, the module may still be starting up */
+	if (nTimeOut < RDS_TRANSPORT_HELLO_TIMEOUT)
+		nTimeOut = RDS_TRANSPORT_HELLO_TIMEOUT;
+
+	sockfd = freerds_tcp_connect(connector->Endpoint, nTimeOut);
+
+	if (sockfd < 0)
+		return NULL;
+
+	if ((freerds_transport_write_tcp_hello(sockfd, freerds_tcp_supported_flags(), cookie) < 0) ||
+			(freerds_transport_read_tcp_hello(sockfd, &flags, cookie) < 0))
+	{
+		fprintf(stderr, "freerds_transport_connect: transport negotiation failed\n");
+		close(sockfd);
+		return NULL;
+	}
+
+	flags &= freerds_tcp_supported_flags();
+
+	freerds_transport_attach_tcp(connector, sockfd, flags);
+	freerds_capture_start(connector);
+
+	return connector->hClientPipe;
+}
+
+HANDLE freerds_transport_accept(rdsModuleConnector* connector)
+{
+	wStream* s;
+	UINT32 type;
+	UINT32 cookie;
+	char pipeName[255];
+	BYTE hello[RDS_TRANSPORT_HELLO_LENGTH];
+	rdsShmTransport* shm = NULL;
+
+	if (freerds_tcp_is_endpoint(connector->Endpoint))
+		return freerds_transport_accept_tcp(connector);
+
+	freerds_named_pipe_get_endpoint_name(connector->SessionId, connector->Endpoint, pipeName, sizeof(pipeName));
+
+	if (freerds_transport_shm_enabled())
+		shm = freerds_shm_transport_create(pipeName);
+
+	connector->hClientPipe = freerds_named_pipe_accept(connector->hServerPipe);
+
+	if (!connector->hClientPipe)
+	{
+		freerds_shm_transport_free(shm);
+		return NULL;
+	}
+
+	if (freerds_transport_read_exact(connector->hClientPipe, hello,
+			RDS_TRANSPORT_HELLO_LENGTH, RDS_TRANSPORT_HELLO_TIMEOUT) < 0)
+	{
+		fprintf(stderr, "freerds_transport_accept: no transport hello received\n");
+		freerds_shm_transport_free(shm);
+		CloseHandle(connector->hClientPipe);
+		connector->hClientPipe = NULL;
+		return NULL;
+	}
+
+	s = Stream_New(hello, RDS_TRANSPORT_HELLO_LENGTH);
+	Stream_Read_UINT32(s, type);
+	Stream_Read_UINT32(s, cookie);
+
+	connector->FlowControlCredits = RDS_FLOW_CONTROL_WINDOW;
+	connector->ProtocolVersion = RDS_PROTOCOL_VERSION_1;
+	connector->OutboundFd = -1;
+
+	if (shm && (type == RDS_TRANSPORT_HELLO_SHM) && (cookie == shm->segment->cookie))
+	{
+		freerds_shm_transport_unlink(shm);
+		connector->ShmTransport = shm;
+	}
+	else
+	{
+		freerds_shm_transport_free(shm);
+		type = RDS_TRANSPORT_HELLO_SOCKET;
+	}
+
+	Stream_SetPosition(s, 0);
+	Stream_Write_UINT32(s, type);
+	Stream_Free(s, FALSE);
+
+	if (freerds_named_pipe_write(connector->hClientPipe, hello, 4) < 0)
+	{
+		freerds_shm_transport_free(connector->ShmTransport);
+		connector->ShmTransport = NULL;
+		CloseHandle(connector->hClientPipe);
+		connector->hClientPipe = NULL;
+		return NULL;
+	}
+
+	fprintf(stderr, "freerds_transport_accept: using %s transport\n",
+			connector->ShmTransport ? "shared memory" : "socket");
+
+	freerds_transport_attach_uring(connector);
+
+	return connector->hClientPipe;
+}
+
+HANDLE freerds_transport_connect(rdsModuleConnector* connector, DWORD nTimeOut)
+{
+	wStream* s;
+	UINT32 type;
+	HANDLE hClientPipe;
+	BYTE hello[RDS_TRANSPORT_HELLO_LENGTH];
+	rdsShmTransport* shm = NULL;
+
+	if (freerds_tcp_is_endpoint(connector->Endpoint))
+		return freerds_transport_connect_tcp(connector, nTimeOut);
+
+	hClientPipe = freerds_named_pipe_connect(connector->Endpoint, nTimeOut);
+
+	if (!hClientPipe)
+		return NULL;
+
+	if (freerds_transport_shm_enabled())
+		shm = freerds_shm_transport_open(connector->Endpoint);
+
+	s = Stream_New(hello, RDS_TRANSPORT_HELLO_LENGTH);
+	Stream_Write_UINT32(s, shm ? RDS_TRANSPORT_HELLO_SHM : RDS_TRANSPORT_HELLO_SOCKET);
+	Stream_Write_UINT32(s, shm ? shm->segment->cookie : 0);
+
+	if ((freerds_named_pipe_write(hClientPipe, hello, RDS_TRANSPORT_HELLO_LENGTH) < 0) ||
+			(freerds_transport_read_exact(hClientPipe, hello, 4, RDS_TRANSPORT_HELLO_TIMEOUT) < 0))
+	{
+		fprintf(stderr, "freerds_transport_connect: transport negotiation failed\n");
+		Stream_Free(s, FALSE);
+		freerds_shm_transport_free(shm);
+		CloseHandle(hClientPipe);
+		return NULL;
+	}
+
+	Stream_SetPosition(s, 0);
+	Stream_Read_UINT32(s, type);
+	Stream_Free(s, FALSE);
+
+	if (type != RDS_TRANSPORT_HELLO_SHM)
+	{
+		freerds_shm_transport_free(shm);
+		shm = NULL;
+	}
+
+	connector->hClientPipe = hClientPipe;
+	connector->ShmTransport = shm;
+	connector->ProtocolVersion = RDS_PROTOCOL_VERSION_1;
+	connector->OutboundFd = -1;
+
+	freerds_transport_attach_uring(connector);
+	freerds_capture_start(connector);
+
+	return hClientPipe;
+}
+
+/**
+ * File Descriptor Passing
+ *
+ * File descriptors travel as SCM_RIGHTS ancillary data on the pipe. A
+ * descriptor attached with freerds_transport_attach_fd goes out with the
+ * next transport write and is queued by the receiver when it reads the
+ * first byte of that write, so it is available by the time any message of
+ * that write is dispatched. With the shared memory transport it is carried
+ * by an extra doorbell sent before the data is published in the ring. With
+ * io_uring the write goes out as a sendmsg request once every earlier write
+ * has completed. The tcp transport cannot carry descriptors.
+ */
+
+int freerds_transport_get_fd(rdsModuleConnector* connector)
+{
+	if (connector->TcpTransport)
+		return connector->TcpTransport->sockfd;
+
+	return GetNamePipeFileDescriptor(connector->hClientPipe);
+}
+
+/**
+ * The handle, or file descriptor, to wait on before calling
+ * freerds_transport_receive. It is the pipe unless io_uring is used.
+ */
+
+HANDLE freerds_transport_get_event_handle(rdsModuleConnector* connector)
+{
+	if (connector->UringTransport)
+		return freerds_uring_transport_get_event(connector->UringTransport);
+
+	return connector->hClientPipe;
+}
+
+int freerds_transport_get_event_fd(rdsModuleConnector* connector)
+{
+	if (connector->UringTransport)
+		return freerds_uring_transport_get_event_fd(connector->UringTransport);
+
+	return freerds_transport_get_fd(connector);
+}
+
+static int freerds_transport_sendmsg(rdsModuleConnector* connector, BYTE* data, DWORD length, int fd)
+{
+	int status;
+	int pipefd;
+	struct iovec iov;
+	struct msghdr msgh;
+	struct cmsghdr* cmsg;
+	struct pollfd pfd;
+	char control[CMSG_SPACE(sizeof(int))];
+
+	pipefd = freerds_transport_get_fd(connector);
+
+	iov.iov_base = data;
+	iov.iov_len = length;
+
+	ZeroMemory(&msgh, sizeof(msgh));
+	ZeroMemory(control, sizeof(control));
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_control = control;
+	msgh.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msgh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	CopyMemory(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	while (1)
+	{
+		status = sendmsg(pipefd, &msgh, MSG_NOSIGNAL);
+
+		if (status >= 0)
+			break;
+
+		if (errno == EINTR)
+			continue;
+
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
 			return -1;
 
-		if (status > 0)
-			Stream_Seek(s, status);
+		/* the module side of the pipe is non-blocking */
+		pfd.fd = pipefd;
+		pfd.events = POLLOUT;
+
+		if (poll(&pfd, 1, RDS_TRANSPORT_HELLO_TIMEOUT) < 1)
+			return -1;
+	}
+
+	return status;
+}
+
+static int freerds_transport_recvmsg(rdsModuleConnector* connector, BYTE* data, DWORD length, int flags)
+{
+	int fd;
+	int index;
+	int count;
+	int status;
+	struct iovec iov;
+	struct msghdr msgh;
+	struct cmsghdr* cmsg;
+	char control[CMSG_SPACE(sizeof(int) * RDS_TRANSPORT_MAX_FDS)];
+
+	iov.iov_base = data;
+	iov.iov_len = length;
+
+	ZeroMemory(&msgh, sizeof(msgh));
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_control = control;
+	msgh.msg_controllen = sizeof(control);
+
+	do
+	{
+		status = recvmsg(freerds_transport_get_fd(connector), &msgh, flags | MSG_CMSG_CLOEXEC);
+	}
+	while ((status < 0) && (errno == EINTR));
+
+	if (status < 0)
+		return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+
+	if (status == 0)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg))
+	{
+		if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS))
+			continue;
+
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		for (index = 0; index < count; index++)
+		{
+			CopyMemory(&fd, CMSG_DATA(cmsg) + (index * sizeof(int)), sizeof(int));
+
+			if (connector->InboundFdCount < RDS_TRANSPORT_MAX_FDS)
+				connector->InboundFds[connector->InboundFdCount++] = fd;
+			else
+				close(fd);
+		}
 	}
 
-	if (Stream_GetPosition(s) >= RDS_ORDER_HEADER_LENGTH)
+	return status;
+}
+
+/**
+ * The caller keeps ownership of fd, it must stay open until the next write.
+ */
+
+void freerds_transport_attach_fd(rdsModuleConnector* connector, int fd)
+{
+	connector->OutboundFd = fd;
+}
+
+/**
+ * Returns the oldest file descriptor received and not yet taken, or -1.
+ * The caller owns the returned descriptor. Only the thread receiving from
+ * the transport may call this, other threads get the descriptor along with
+ * the message it came with.
+ */
+
+int freerds_transport_take_fd(rdsModuleConnector* connector)
+{
+	int fd;
+	BYTE doorbell[64];
+
+	/* with shared memory the descriptor comes with a doorbell that may not have been read yet */
+	if (!connector->InboundFdCount && connector->ShmTransport)
+		freerds_transport_recvmsg(connector, doorbell, sizeof(doorbell), MSG_DONTWAIT);
+
+	if (!connector->InboundFdCount)
+		return -1;
+
+	fd = connector->InboundFds[0];
+	connector->InboundFdCount--;
+
+	MoveMemory(connector->InboundFds, &(connector->InboundFds[1]), connector->InboundFdCount * sizeof(int));
+
+	return fd;
+}
+
+int freerds_transport_write(rdsModuleConnector* connector, BYTE* data, DWORD length)
+{
+	int fd;
+	int status;
+	BYTE doorbell = 0;
+
+	freerds_stats_count_outbound(connector, data, length);
+
+	if (connector->Capture)
+		freerds_capture_write(connector->Capture, RDS_CAPTURE_OUTBOUND, data, length);
+
+	fd = connector->OutboundFd;
+
+	if (connector->TcpTransport)
 	{
-		length = freerds_peek_common_header_length(Stream_Buffer(s));
+		if (fd >= 0)
+		{
+			fprintf(stderr, "freerds_transport_write: file descriptors cannot be sent over tcp\n");
+			connector->OutboundFd = -1;
+		}
+
+		return freerds_tcp_transport_write(connector->TcpTransport, data, length);
+	}
 
-		if (length - Stream_GetPosition(s))
+	if (connector->UringTransport)
+	{
+		if (fd < 0)
+			return freerds_uring_transport_write(connector->UringTransport, data, length);
+
+		connector->OutboundFd = -1;
+
+		return freerds_uring_transport_write_fd(connector->UringTransport, data, length, fd);
+	}
+
+	if (fd >= 0)
+	{
+		connector->OutboundFd = -1;
+
+		if (connector->ShmTransport)
 		{
-			status = freerds_named_pipe_read(connector->hClientPipe, Stream_Pointer(s),
-				length - Stream_GetPosition(s));
+			if (freerds_transport_sendmsg(connector, &doorbell, 1, fd) < 0)
+				return -1;
+		}
+		else
+		{
+			status = freerds_transport_sendmsg(connector, data, length, fd);
 
 			if (status < 0)
 				return -1;
 
-			if (status > 0)
-				Stream_Seek(s, status);
+			if ((status < (int) length) &&
+					(freerds_named_pipe_write(connector->hClientPipe, &data[status], length - status) < 0))
+				return -1;
+
+			return length;
 		}
 	}
 
-	if (Stream_GetPosition(s) >= RDS_ORDER_HEADER_LENGTH)
+	if (connector->ShmTransport)
+		return freerds_shm_transport_write(connector->ShmTransport, connector->hClientPipe, data, length);
+
+	return freerds_named_pipe_write(connector->hClientPipe, data, length);
+}
+
+void freerds_transport_close(rdsModuleConnector* connector)
+{
+	freerds_uring_transport_free(connector->UringTransport);
+	connector->UringTransport = NULL;
+
+	freerds_shm_transport_free(connector->ShmTransport);
+	connector->ShmTransport = NULL;
+
+	freerds_tcp_transport_free(connector->TcpTransport);
+	connector->TcpTransport = NULL;
+
+	freerds_capture_free(connector->Capture);
+	connector->Capture = NULL;
+
+	while (connector->InboundFdCount > 0)
+		close(connector->InboundFds[--connector->InboundFdCount]);
+}
+
+/**
+ * The inbound stream is used as a receive buffer: every call reads as many
+ * bytes as are available (up to the free space in the buffer) with a single
+ * read, dispatches every complete message found in it and carries a partial
+ * trailing message over to the next call.
+ */
+
+static void freerds_transport_reserve(wStream* s)
+{
+	size_t position;
+	UINT32 length = PIPE_BUFFER_SIZE;
+
+	position = Stream_GetPosition(s);
+
+	/* make room for the pending message and at least a full pipe buffer */
+	if (freerds_peek_message_length(Stream_Buffer(s), position, &length) < 1)
+		length = PIPE_BUFFER_SIZE;
+
+	if (length < PIPE_BUFFER_SIZE)
+		length = PIPE_BUFFER_SIZE;
+
+	if (Stream_Capacity(s) < position + length)
+		Stream_EnsureCapacity(s, position + length);
+}
+
+static int freerds_transport_dispatch(rdsModuleConnector* connector)
+{
+	wStream* s;
+	int status;
+	int count = 0;
+	BYTE* buffer;
+	size_t offset;
+	size_t position;
+	UINT32 length;
+	RDS_MSG_COMMON common;
+
+	s = connector->InboundStream;
+	position = Stream_GetPosition(s);
+	buffer = Stream_Buffer(s);
+	offset = 0;
+
+	while (offset < position)
 	{
-		length = freerds_peek_common_header_length(Stream_Buffer(s));
+		status = freerds_peek_message_length(&buffer[offset], position - offset, &length);
 
-		if (Stream_GetPosition(s) >= length)
+		if (status < 0)
 		{
-			position = Stream_GetPosition(s);
-
+			fprintf(stderr, "freerds_transport_receive: invalid message length %d\n", (int) length);
 			Stream_SetPosition(s, 0);
-			freerds_read_common_header(s, &common);
+			return -1;
+		}
 
-			status = freerds_receive_message(connector, s, &common);
+		if ((status == 0) || ((position - offset) < length))
+			break;
+
+		Stream_SetPosition(s, offset);
+
+		if (freerds_read_common_header(s, &common) < 0)
+		{
+			fprintf(stderr, "freerds_transport_receive: invalid message header\n");
 			Stream_SetPosition(s, 0);
+			return -1;
 		}
+
+		freerds_stats_count_inbound(connector, common.type, length);
+
+		if (connector->Capture)
+			freerds_capture_write(connector->Capture, RDS_CAPTURE_INBOUND, &buffer[offset], length);
+
+		freerds_receive_message(connector, s, &common);
+
+		offset += length;
+		count++;
 	}
 
-	return 0;
+	if (offset && (offset < position))
+		MoveMemory(buffer, &buffer[offset], position - offset);
+
+	Stream_SetPosition(s, position - offset);
+
+	return count;
+}
+
+/**
+ * With the shared memory transport the pipe only carries doorbells: they
+ * are drained, then the inbound ring is consumed until it is empty and the
+ * consumer could announce it is going back to sleep.
+ */
+
+static int freerds_transport_receive_shm(rdsModuleConnector* connector)
+{
+	wStream* s;
+	int status;
+	int count = 0;
+	BYTE doorbell[64];
+
+	s = connector->InboundStream;
+
+	if (WaitForSingleObject(connector->hClientPipe, 0) == WAIT_OBJECT_0)
+	{
+		if (freerds_transport_recvmsg(connector, doorbell, sizeof(doorbell), 0) < 0)
+			return -1;
+	}
+
+	do
+	{
+		while (1)
+		{
+			freerds_transport_reserve(s);
+
+			status = freerds_shm_transport_read(connector->ShmTransport, Stream_Pointer(s),
+					Stream_Capacity(s) - Stream_GetPosition(s));
+
+			if (status < 0)
+			{
+				fprintf(stderr, "freerds_transport_receive: corrupt shared memory ring\n");
+				return -1;
+			}
+
+			if (status == 0)
+				break;
+
+			Stream_Seek(s, status);
+
+			status = freerds_transport_dispatch(connector);
+
+			if (status < 0)
+				return -1;
+
+			count += status;
+		}
+	}
+	while (!freerds_shm_transport_sleep(connector->ShmTransport));
+
+	return count;
+}
+
+/**
+ * Returns the number of messages dispatched, or -1 on error.
+ */
+
+static int freerds_transport_receive_socket(rdsModuleConnector* connector)
+{
+	wStream* s;
+	int status;
+
+	s = connector->InboundStream;
+	freerds_transport_reserve(s);
+
+	status = freerds_transport_recvmsg(connector, Stream_Pointer(s),
+			Stream_Capacity(s) - Stream_GetPosition(s), 0);
+
+	if (status < 0)
+		return -1;
+
+	Stream_Seek(s, status);
+
+	return freerds_transport_dispatch(connector);
+}
+
+/**
+ * With io_uring the data has already been received, the read only collects
+ * it along with the file descriptors that came with it.
+ */
+
+static int freerds_transport_receive_uring(rdsModuleConnector* connector)
+{
+	int status;
+
+	status = freerds_uring_transport_read(connector->UringTransport, connector->InboundStream,
+			connector->InboundFds, &(connector->InboundFdCount));
+
+	if (status < 0)
+		return -1;
+
+	if (status == 0)
+		return 0;
+
+	return freerds_transport_dispatch(connector);
+}
+
+/**
+ * With the tcp transport the payload of every complete frame is appended to
+ * the inbound stream, a partial frame stays in the transport.
+ */
+
+static int freerds_transport_receive_tcp(rdsModuleConnector* connector)
+{
+	int status;
+
+	status = freerds_tcp_transport_read(connector->TcpTransport, connector->InboundStream);
+
+	if (status < 0)
+		return -1;
+
+	if (status == 0)
+		return 0;
+
+	return freerds_transport_dispatch(connector);
+}
+
+int freerds_transport_receive(rdsModuleConnector* connector)
+{
+	int status;
+
+	if (connector->TcpTransport)
+		status = freerds_transport_receive_tcp(connector);
+	else if (connector->ShmTransport)
+		status = freerds_transport_receive_shm(connector);
+	else if (connector->UringTransport)
+		status = freerds_transport_receive_uring(connector);
+	else
+		status = freerds_transport_receive_socket(connector);
+
+	if (status >= 0)
+		freerds_stats_record(&(connector->Stats.MessagesPerWakeup), status);
+
+	return status;
 }
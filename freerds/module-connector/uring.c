@@ -0,0 +1,753 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * FreeRDS module connector io_uring backend
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef WITH_LIBURING
+#include <sys/eventfd.h>
+#include <liburing.h>
+#endif
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/stream.h>
+
+#include "uring.h"
+
+#ifdef WITH_LIBURING
+
+/* user data of the submissions, there is at most one of each in flight */
+#define RDS_URING_RECV		1
+#define RDS_URING_SEND		2
+#define RDS_URING_SENDMSG	3
+#define RDS_URING_CANCEL	4
+
+struct rds_uring_transport
+{
+	int sockfd;
+	int eventfd;
+	HANDLE event;
+	BOOL initialized;
+	struct io_uring ring;
+	CRITICAL_SECTION lock;
+
+	BYTE* recvBuffers;
+	struct io_uring_buf_ring* bufRing;
+	struct msghdr recvMsg;
+	BOOL recvArmed;
+	UINT16 heldBuffers[RDS_URING_RECV_BUFFER_COUNT];
+	int heldCount;
+
+	BYTE* sendBuffers;
+	int sendIndex;
+	BOOL sending;
+	UINT32 sendOffset;
+	UINT32 sendLength;
+	UINT32 pendingLength;
+	BOOL sendmsgPending;
+	int sendmsgStatus;
+
+	BOOL closing;
+	BOOL closed;
+	int error;
+
+	wStream* inbound;
+	int fds[RDS_TRANSPORT_MAX_FDS];
+	int fdCount;
+};
+
+static BOOL freerds_uring_enabled(void)
+{
+	char* value = getenv("FREERDS_CONNECTOR_IO");
+
+	if (value && (strcmp(value, "poll") == 0))
+		return FALSE;
+
+	return TRUE;
+}
+
+static BYTE* freerds_uring_send_buffer(rdsUringTransport* uring, int index)
+{
+	return &(uring->sendBuffers[index * RDS_URING_SEND_BUFFER_SIZE]);
+}
+
+static void freerds_uring_arm_recv(rdsUringTransport* uring)
+{
+	struct io_uring_sqe* sqe;
+
+	sqe = io_uring_get_sqe(&(uring->ring));
+
+	if (!sqe)
+		return;
+
+	io_uring_prep_recvmsg_multishot(sqe, uring->sockfd, &(uring->recvMsg), MSG_CMSG_CLOEXEC);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RDS_URING_RECV_BUFFER_GROUP;
+	io_uring_sqe_set_data64(sqe, RDS_URING_RECV);
+
+	uring->recvArmed = TRUE;
+}
+
+static void freerds_uring_submit_send(rdsUringTransport* uring)
+{
+	struct io_uring_sqe* sqe;
+
+	sqe = io_uring_get_sqe(&(uring->ring));
+
+	if (!sqe)
+	{
+		uring->error = -EBUSY;
+		return;
+	}
+
+	io_uring_prep_write_fixed(sqe, uring->sockfd,
+			freerds_uring_send_buffer(uring, uring->sendIndex) + uring->sendOffset,
+			uring->sendLength - uring->sendOffset, 0, uring->sendIndex);
+	io_uring_sqe_set_data64(sqe, RDS_URING_SEND);
+
+	uring->sending = TRUE;
+}
+
+/**
+ * Sends the pending batch if no send is in flight: the buffers swap roles,
+ * the batch is sent from its buffer while the other one collects the next.
+ */
+
+static void freerds_uring_flush(rdsUringTransport* uring)
+{
+	if (uring->sending || !uring->pendingLength || uring->error || uring->closing)
+		return;
+
+	uring->sendIndex ^= 1;
+	uring->sendOffset = 0;
+	uring->sendLength = uring->pendingLength;
+	uring->pendingLength = 0;
+
+	freerds_uring_submit_send(uring);
+}
+
+static void freerds_uring_return_buffer(rdsUringTransport* uring, UINT16 bid)
+{
+	io_uring_buf_ring_add(uring->bufRing, &(uring->recvBuffers[bid * RDS_URING_RECV_BUFFER_SIZE]),
+			RDS_URING_RECV_BUFFER_SIZE, bid, io_uring_buf_ring_mask(RDS_URING_RECV_BUFFER_COUNT), 0);
+	io_uring_buf_ring_advance(uring->bufRing, 1);
+}
+
+static void freerds_uring_recv_complete(rdsUringTransport* uring, struct io_uring_cqe* cqe)
+{
+	int fd;
+	int index;
+	int count;
+	BYTE* buffer;
+	UINT32 length;
+	unsigned short bid;
+	struct cmsghdr* cmsg;
+	struct io_uring_recvmsg_out* out;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		uring->recvArmed = FALSE;
+
+	if (cqe->res < 0)
+	{
+		/* out of buffers, or cancelled with the thread that armed it: it is armed again */
+		if ((cqe->res != -ENOBUFS) && (cqe->res != -ECANCELED))
+			uring->error = cqe->res;
+
+		return;
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return;
+
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	buffer = &(uring->recvBuffers[bid * RDS_URING_RECV_BUFFER_SIZE]);
+
+	out = io_uring_recvmsg_validate(buffer, cqe->res, &(uring->recvMsg));
+
+	if (!out)
+	{
+		uring->error = -EINVAL;
+	}
+	else
+	{
+		if (out->flags & MSG_CTRUNC)
+			fprintf(stderr, "freerds_uring_recv_complete: file descriptors were truncated\n");
+
+		for (cmsg = io_uring_recvmsg_cmsg_firsthdr(out, &(uring->recvMsg)); cmsg;
+				cmsg = io_uring_recvmsg_cmsg_nexthdr(out, &(uring->recvMsg), cmsg))
+		{
+			if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS))
+				continue;
+
+			count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+			for (index = 0; index < count; index++)
+			{
+				CopyMemory(&fd, CMSG_DATA(cmsg) + (index * sizeof(int)), sizeof(int));
+
+				if (uring->fdCount < RDS_TRANSPORT_MAX_FDS)
+					uring->fds[uring->fdCount++] = fd;
+				else
+					close(fd);
+			}
+		}
+
+		length = io_uring_recvmsg_payload_length(out, cqe->res, &(uring->recvMsg));
+
+		if (length)
+		{
+			Stream_EnsureRemainingCapacity(uring->inbound, length);
+			Stream_Write(uring->inbound, io_uring_recvmsg_payload(out, &(uring->recvMsg)), length);
+		}
+		else if (!(cqe->flags & IORING_CQE_F_MORE))
+		{
+			uring->closed = TRUE;
+		}
+	}
+
+	/* stop receiving until the next read when too much is waiting to be read */
+	if (Stream_GetPosition(uring->inbound) >= RDS_URING_INBOUND_MAX_LENGTH)
+		uring->heldBuffers[uring->heldCount++] = bid;
+	else
+		freerds_uring_return_buffer(uring, bid);
+}
+
+static void freerds_uring_send_complete(rdsUringTransport* uring, struct io_uring_cqe* cqe)
+{
+	uring->sending = FALSE;
+
+	if (cqe->res < 0)
+	{
+		if (uring->closing)
+			return;
+
+		/* requests are also cancelled when the thread that submitted them exits */
+		if ((cqe->res == -EINTR) || (cqe->res == -EAGAIN) || (cqe->res == -ECANCELED))
+			freerds_uring_submit_send(uring);
+		else
+			uring->error = cqe->res;
+
+		return;
+	}
+
+	if (cqe->res == 0)
+	{
+		uring->error = -EPIPE;
+		return;
+	}
+
+	uring->sendOffset += cqe->res;
+
+	/* short write, the socket buffer is full */
+	if ((uring->sendOffset < uring->sendLength) && !uring->closing)
+		freerds_uring_submit_send(uring);
+}
+
+/**
+ * Reaps every completion, then re-arms the receive and sends the pending
+ * batch if needed. Must be called with the lock held, a writer waiting for
+ * a send buffer reaps received data too.
+ */
+
+static int freerds_uring_process(rdsUringTransport* uring)
+{
+	unsigned head;
+	unsigned count = 0;
+	struct io_uring_cqe* cqe;
+
+	io_uring_for_each_cqe(&(uring->ring), head, cqe)
+	{
+		switch (io_uring_cqe_get_data64(cqe))
+		{
+			case RDS_URING_RECV:
+				freerds_uring_recv_complete(uring, cqe);
+				break;
+
+			case RDS_URING_SEND:
+				freerds_uring_send_complete(uring, cqe);
+				break;
+
+			case RDS_URING_SENDMSG:
+				uring->sendmsgPending = FALSE;
+				uring->sendmsgStatus = cqe->res;
+				break;
+
+			default:
+				break;
+		}
+
+		count++;
+	}
+
+	io_uring_cq_advance(&(uring->ring), count);
+
+	if (!uring->closing)
+	{
+		if (!uring->recvArmed && !uring->heldCount && !uring->closed && !uring->error)
+			freerds_uring_arm_recv(uring);
+
+		freerds_uring_flush(uring);
+	}
+
+	io_uring_submit(&(uring->ring));
+
+	return uring->error ? -1 : 0;
+}
+
+/**
+ * Blocks until at least one completion is available and reaps it.
+ */
+
+static int freerds_uring_wait(rdsUringTransport* uring)
+{
+	int status;
+	struct io_uring_cqe* cqe;
+
+	status = io_uring_wait_cqe(&(uring->ring), &cqe);
+
+	if ((status < 0) && (status != -EINTR))
+		return -1;
+
+	freerds_uring_process(uring);
+
+	return 0;
+}
+
+/**
+ * Returns NULL when io_uring cannot be used, the caller then falls back to
+ * the pipe.
+ */
+
+rdsUringTransport* freerds_uring_transport_new(int sockfd)
+{
+	int index;
+	int status;
+	struct iovec iov[2];
+	struct io_uring_cqe* cqe;
+	rdsUringTransport* uring;
+
+	if ((sockfd < 0) || !freerds_uring_enabled())
+		return NULL;
+
+	uring = (rdsUringTransport*) calloc(1, sizeof(rdsUringTransport));
+
+	if (!uring)
+		return NULL;
+
+	uring->sockfd = sockfd;
+	uring->sendIndex = 1;
+	InitializeCriticalSectionAndSpinCount(&(uring->lock), 4000);
+
+	uring->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	uring->inbound = Stream_New(NULL, RDS_URING_RECV_BUFFER_SIZE);
+	uring->recvBuffers = (BYTE*) malloc(RDS_URING_RECV_BUFFER_COUNT * RDS_URING_RECV_BUFFER_SIZE);
+	uring->sendBuffers = (BYTE*) malloc(2 * RDS_URING_SEND_BUFFER_SIZE);
+
+	if ((uring->eventfd < 0) || !uring->inbound || !uring->recvBuffers || !uring->sendBuffers)
+		goto fail;
+
+	if (io_uring_queue_init(RDS_URING_QUEUE_DEPTH, &(uring->ring), 0) < 0)
+		goto fail;
+
+	uring->initialized = TRUE;
+
+	uring->bufRing = io_uring_setup_buf_ring(&(uring->ring), RDS_URING_RECV_BUFFER_COUNT,
+			RDS_URING_RECV_BUFFER_GROUP, 0, &status);
+
+	if (!uring->bufRing)
+		goto fail;
+
+	for (index = 0; index < RDS_URING_RECV_BUFFER_COUNT; index++)
+	{
+		io_uring_buf_ring_add(uring->bufRing, &(uring->recvBuffers[index * RDS_URING_RECV_BUFFER_SIZE]),
+				RDS_URING_RECV_BUFFER_SIZE, index, io_uring_buf_ring_mask(RDS_URING_RECV_BUFFER_COUNT), index);
+	}
+
+	io_uring_buf_ring_advance(uring->bufRing, RDS_URING_RECV_BUFFER_COUNT);
+
+	for (index = 0; index < 2; index++)
+	{
+		iov[index].iov_base = freerds_uring_send_buffer(uring, index);
+		iov[index].iov_len = RDS_URING_SEND_BUFFER_SIZE;
+	}
+
+	if (io_uring_register_buffers(&(uring->ring), iov, 2) < 0)
+		goto fail;
+
+	if (io_uring_register_eventfd(&(uring->ring), uring->eventfd) < 0)
+		goto fail;
+
+	uring->recvMsg.msg_controllen = CMSG_SPACE(sizeof(int) * RDS_TRANSPORT_MAX_FDS);
+
+	freerds_uring_arm_recv(uring);
+
+	if (io_uring_submit(&(uring->ring)) < 1)
+		goto fail;
+
+	/* kernels without multishot recvmsg fail the request right away */
+	if ((io_uring_peek_cqe(&(uring->ring), &cqe) == 0) && (cqe->res < 0))
+		goto fail;
+
+	uring->event = CreateFileDescriptorEvent(NULL, FALSE, FALSE, uring->eventfd);
+
+	if (!uring->event)
+		goto fail;
+
+	fprintf(stderr, "freerds_transport: using io_uring for the socket transport\n");
+
+	return uring;
+
+fail:
+	freerds_uring_transport_free(uring);
+	return NULL;
+}
+
+/**
+ * The socket is still owned by the pipe, it must only be closed once the
+ * transport has been freed.
+ */
+
+void freerds_uring_transport_free(rdsUringTransport* uring)
+{
+	struct io_uring_sqe* sqe;
+	struct io_uring_cqe* cqe;
+	struct __kernel_timespec timeout;
+
+	if (!uring)
+		return;
+
+	if (uring->initialized)
+	{
+		EnterCriticalSection(&(uring->lock));
+
+		timeout.tv_sec = RDS_URING_CLOSE_TIMEOUT / 1000;
+		timeout.tv_nsec = (RDS_URING_CLOSE_TIMEOUT % 1000) * 1000000;
+
+		/* a blocking write would already have sent the last batch, give it a chance to go out */
+		while ((uring->sending || uring->pendingLength) && !uring->error)
+		{
+			if (!uring->sending)
+			{
+				freerds_uring_flush(uring);
+				io_uring_submit(&(uring->ring));
+			}
+			else if (io_uring_wait_cqe_timeout(&(uring->ring), &cqe, &timeout) < 0)
+			{
+				break;
+			}
+			else
+			{
+				freerds_uring_process(uring);
+			}
+		}
+
+		uring->closing = TRUE;
+		sqe = io_uring_get_sqe(&(uring->ring));
+
+		if (sqe && (uring->recvArmed || uring->sending || uring->sendmsgPending))
+		{
+			io_uring_prep_cancel64(sqe, 0, IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL);
+			io_uring_sqe_set_data64(sqe, RDS_URING_CANCEL);
+			io_uring_submit(&(uring->ring));
+
+			/* the buffers must outlive every request using them */
+			while (uring->recvArmed || uring->sending || uring->sendmsgPending)
+			{
+				if (freerds_uring_wait(uring) < 0)
+					break;
+			}
+		}
+
+		if (uring->bufRing)
+		{
+			io_uring_free_buf_ring(&(uring->ring), uring->bufRing,
+					RDS_URING_RECV_BUFFER_COUNT, RDS_URING_RECV_BUFFER_GROUP);
+		}
+
+		io_uring_queue_exit(&(uring->ring));
+
+		LeaveCriticalSection(&(uring->lock));
+	}
+
+	while (uring->fdCount > 0)
+		close(uring->fds[--uring->fdCount]);
+
+	/* the event owns the eventfd once it has been created */
+	if (uring->event)
+		CloseHandle(uring->event);
+	else if (uring->eventfd >= 0)
+		close(uring->eventfd);
+
+	if (uring->inbound)
+		Stream_Free(uring->inbound, TRUE);
+
+	free(uring->recvBuffers);
+	free(uring->sendBuffers);
+
+	DeleteCriticalSection(&(uring->lock));
+
+	free(uring);
+}
+
+HANDLE freerds_uring_transport_get_event(rdsUringTransport* uring)
+{
+	return uring->event;
+}
+
+int freerds_uring_transport_get_event_fd(rdsUringTransport* uring)
+{
+	return uring->eventfd;
+}
+
+/**
+ * Appends everything received since the last call to s and moves the file
+ * descriptors that came with it to fds. Returns the number of bytes
+ * appended, or -1 once the stream has ended and everything was read.
+ */
+
+int freerds_uring_transport_read(rdsUringTransport* uring, wStream* s, int* fds, int* fdCount)
+{
+	int index;
+	int status;
+	int length;
+	eventfd_t value;
+
+	/* reset the event first, a completion posted while reaping sets it again */
+	eventfd_read(uring->eventfd, &value);
+
+	EnterCriticalSection(&(uring->lock));
+
+	status = freerds_uring_process(uring);
+
+	for (index = 0; index < uring->fdCount; index++)
+	{
+		if (*fdCount < RDS_TRANSPORT_MAX_FDS)
+			fds[(*fdCount)++] = uring->fds[index];
+		else
+			close(uring->fds[index]);
+	}
+
+	uring->fdCount = 0;
+
+	length = (int) Stream_GetPosition(uring->inbound);
+
+	if (length)
+	{
+		Stream_EnsureRemainingCapacity(s, length);
+		Stream_Write(s, Stream_Buffer(uring->inbound), length);
+		Stream_SetPosition(uring->inbound, 0);
+
+		while (uring->heldCount > 0)
+			freerds_uring_return_buffer(uring, uring->heldBuffers[--uring->heldCount]);
+
+		freerds_uring_process(uring);
+
+		/* report the end of the stream on the next wakeup */
+		if (uring->closed || (status < 0))
+			eventfd_write(uring->eventfd, 1);
+	}
+	else if (uring->closed || (status < 0))
+	{
+		length = -1;
+	}
+
+	LeaveCriticalSection(&(uring->lock));
+
+	return length;
+}
+
+/**
+ * Returns once data has been copied to a send buffer, it only waits for a
+ * send to complete when both buffers are full.
+ */
+
+int freerds_uring_transport_write(rdsUringTransport* uring, BYTE* data, UINT32 length)
+{
+	int status;
+	UINT32 count;
+	UINT32 total = length;
+
+	EnterCriticalSection(&(uring->lock));
+
+	freerds_uring_process(uring);
+
+	while ((length > 0) && !uring->error)
+	{
+		if (uring->pendingLength == RDS_URING_SEND_BUFFER_SIZE)
+		{
+			if (!uring->sending)
+			{
+				freerds_uring_flush(uring);
+				io_uring_submit(&(uring->ring));
+			}
+			else if (freerds_uring_wait(uring) < 0)
+			{
+				uring->error = -EIO;
+			}
+
+			continue;
+		}
+
+		count = RDS_URING_SEND_BUFFER_SIZE - uring->pendingLength;
+
+		if (count > length)
+			count = length;
+
+		CopyMemory(freerds_uring_send_buffer(uring, uring->sendIndex ^ 1) + uring->pendingLength, data, count);
+		uring->pendingLength += count;
+
+		data += count;
+		length -= count;
+	}
+
+	freerds_uring_flush(uring);
+	io_uring_submit(&(uring->ring));
+
+	status = uring->error ? -1 : (int) total;
+
+	LeaveCriticalSection(&(uring->lock));
+
+	return status;
+}
+
+/**
+ * Sends data with fd attached as SCM_RIGHTS, after everything written
+ * before it. The caller keeps ownership of fd.
+ */
+
+int freerds_uring_transport_write_fd(rdsUringTransport* uring, BYTE* data, UINT32 length, int fd)
+{
+	int status;
+	struct iovec iov;
+	struct msghdr msgh;
+	struct cmsghdr* cmsg;
+	struct io_uring_sqe* sqe;
+	char control[CMSG_SPACE(sizeof(int))];
+
+	EnterCriticalSection(&(uring->lock));
+
+	freerds_uring_process(uring);
+
+	while ((uring->sending || uring->pendingLength) && !uring->error)
+	{
+		if (!uring->sending)
+		{
+			freerds_uring_flush(uring);
+			io_uring_submit(&(uring->ring));
+		}
+		else if (freerds_uring_wait(uring) < 0)
+		{
+			uring->error = -EIO;
+		}
+	}
+
+	sqe = uring->error ? NULL : io_uring_get_sqe(&(uring->ring));
+
+	if (!sqe)
+	{
+		LeaveCriticalSection(&(uring->lock));
+		return -1;
+	}
+
+	iov.iov_base = data;
+	iov.iov_len = length;
+
+	ZeroMemory(&msgh, sizeof(msgh));
+	ZeroMemory(control, sizeof(control));
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_control = control;
+	msgh.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msgh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	CopyMemory(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	io_uring_prep_sendmsg(sqe, uring->sockfd, &msgh, MSG_NOSIGNAL);
+	io_uring_sqe_set_data64(sqe, RDS_URING_SENDMSG);
+
+	uring->sendmsgPending = TRUE;
+	io_uring_submit(&(uring->ring));
+
+	/* msgh lives on the stack, the request must complete before returning */
+	while (uring->sendmsgPending)
+	{
+		if (freerds_uring_wait(uring) < 0)
+			break;
+	}
+
+	status = uring->sendmsgPending ? -1 : uring->sendmsgStatus;
+
+	/* the rest of a short send goes out like any other write */
+	if ((status >= 0) && ((UINT32) status < length) &&
+			(freerds_uring_transport_write(uring, &data[status], length - status) < 0))
+		status = -1;
+
+	LeaveCriticalSection(&(uring->lock));
+
+	return (status < 0) ? -1 : (int) length;
+}
+
+#else
+
+rdsUringTransport* freerds_uring_transport_new(int sockfd)
+{
+	return NULL;
+}
+
+void freerds_uring_transport_free(rdsUringTransport* uring)
+{
+
+}
+
+HANDLE freerds_uring_transport_get_event(rdsUringTransport* uring)
+{
+	return NULL;
+}
+
+int freerds_uring_transport_get_event_fd(rdsUringTransport* uring)
+{
+	return -1;
+}
+
+int freerds_uring_transport_read(rdsUringTransport* uring, wStream* s, int* fds, int* fdCount)
+{
+	return -1;
+}
+
+int freerds_uring_transport_write(rdsUringTransport* uring, BYTE* data, UINT32 length)
+{
+	return -1;
+}
+
+int freerds_uring_transport_write_fd(rdsUringTransport* uring, BYTE* data, UINT32 length, int fd)
+{
+	return -1;
+}
+
+#endif
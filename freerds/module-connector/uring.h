@@ -0,0 +1,80 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * FreeRDS module connector io_uring backend
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDS_NG_URING_H
+#define RDS_NG_URING_H
+
+#include <freerds/freerds.h>
+
+/**
+ * io_uring Backend
+ *
+ * When built with liburing, the socket transport drives its pipe through an
+ * io_uring instead of ReadFile/WriteFile:
+ *
+ * A single multishot recvmsg stays armed on the socket and fills buffers
+ * from a provided buffer ring, file descriptors passed with SCM_RIGHTS come
+ * with the payload they were sent with.
+ *
+ * Writes are copied into one of two registered send buffers. At most one
+ * send is in flight, writes made meanwhile are batched into the other buffer
+ * and submitted together once it completes.
+ *
+ * Completions are signalled on an eventfd, which replaces the pipe as the
+ * handle the connector waits on. Whoever holds the transport lock reaps
+ * every completion: received payload is kept until the next read and a
+ * completed send submits the pending batch.
+ *
+ * The backend is only used when the kernel supports everything above and
+ * can be disabled with FREERDS_CONNECTOR_IO=poll, in both cases the socket
+ * transport keeps using the pipe directly.
+ */
+
+#define RDS_URING_QUEUE_DEPTH		64
+
+#define RDS_URING_RECV_BUFFER_COUNT	64
+#define RDS_URING_RECV_BUFFER_SIZE	0x8000
+#define RDS_URING_RECV_BUFFER_GROUP	0
+
+/* received data kept until the next read before the socket is left to fill up */
+#define RDS_URING_INBOUND_MAX_LENGTH	0x400000
+
+#define RDS_URING_SEND_BUFFER_SIZE	0x40000
+
+#define RDS_URING_CLOSE_TIMEOUT		1000
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+rdsUringTransport* freerds_uring_transport_new(int sockfd);
+void freerds_uring_transport_free(rdsUringTransport* uring);
+
+HANDLE freerds_uring_transport_get_event(rdsUringTransport* uring);
+int freerds_uring_transport_get_event_fd(rdsUringTransport* uring);
+
+int freerds_uring_transport_read(rdsUringTransport* uring, wStream* s, int* fds, int* fdCount);
+int freerds_uring_transport_write(rdsUringTransport* uring, BYTE* data, UINT32 length);
+int freerds_uring_transport_write_fd(rdsUringTransport* uring, BYTE* data, UINT32 length, int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RDS_NG_URING_H */
@@ -33,9 +33,17 @@ typedef struct rds_module_connector rdsModuleConnector;
 
 typedef struct rds_connection rdsConnection;
 
+typedef struct rds_shm_transport rdsShmTransport;
+typedef struct rds_tcp_transport rdsTcpTransport;
+typedef struct rds_uring_transport rdsUringTransport;
+
+typedef struct rds_capture rdsCapture;
+
 /* Common Data Types */
 
 #define RDS_MSG_FLAG_RECT		0x00000001
+#define RDS_MSG_FLAG_INPUT		0x00000002
+#define RDS_MSG_FLAG_COMPACT		0x00000004
 
 /**
  * RDS_RECT matches the memory layout of pixman_rectangle32_t:
@@ -60,7 +68,8 @@ typedef struct _RDS_RECT RDS_RECT;
 	UINT32 type; \
 	UINT32 length; \
 	UINT32 msgFlags; \
-	RDS_RECT rect
+	RDS_RECT rect; \
+	UINT32 inputSequence
 
 struct _RDS_MSG_COMMON
 {
@@ -68,6 +77,45 @@ struct _RDS_MSG_COMMON
 };
 typedef struct _RDS_MSG_COMMON RDS_MSG_COMMON;
 
+/**
+ * Dirty Tile Bitmap
+ *
+ * Modules may place a bitmap of dirty 64x64 tiles in the shared framebuffer,
+ * right after the pixels at RDS_TILE_BITMAP_OFFSET. Drawing sets bits with
+ * atomic ORs and a FrameReady message tells freerds to take them, which it
+ * does by atomically clearing each word while scanning the bitmap.
+ *
+ * A module rendering into a private back buffer sets the double buffer flag
+ * and only writes the shared pixels when presenting a frame, between
+ * freerds_frame_write_begin and freerds_frame_write_end. The sequence is odd
+ * while a frame is being presented, freerds_frame_read_rect uses it to copy
+ * a consistent area out of the shared pixels, retrying torn reads.
+ */
+
+#define RDS_TILE_SIZE			64
+#define RDS_TILE_BITMAP_MAGIC		0x454C4954 /* "TILE" */
+
+#define RDS_TILE_BITMAP_FLAG_DOUBLE_BUFFER	0x00000001
+
+#define RDS_TILE_BITMAP_OFFSET(_size)	(((_size) + 63) & ~((size_t) 63))
+
+struct _RDS_TILE_BITMAP
+{
+	UINT32 magic;
+	UINT32 width;
+	UINT32 height;
+	UINT32 tilesX;
+	UINT32 tilesY;
+	UINT32 stride;
+	UINT32 flags;
+	volatile UINT32 sequence;
+	UINT32 padding[8];
+	volatile UINT32 words[1];
+};
+typedef struct _RDS_TILE_BITMAP RDS_TILE_BITMAP;
+
+typedef void (*pRdsTileBitmapRect)(void* context, RDS_RECT* rect);
+
 struct _RDS_FRAMEBUFFER
 {
 	int fbWidth;
@@ -78,10 +126,44 @@ struct _RDS_FRAMEBUFFER
 	int fbBitsPerPixel;
 	int fbBytesPerPixel;
 	BYTE* fbSharedMemory;
+	size_t fbMappedSize;
+	RDS_TILE_BITMAP* tiles;
+	/* copied from the tile bitmap when it was attached, the module may change the header */
+	int tilesWidth;
+	int tilesHeight;
+	UINT32 tilesX;
+	UINT32 tilesY;
+	UINT32 tilesStride;
+	UINT32 tilesFlags;
 	void* image;
 };
 typedef struct _RDS_FRAMEBUFFER RDS_FRAMEBUFFER;
 
+/**
+ * A framebuffer with this segment id is a sealed memfd whose file
+ * descriptor is passed along with the SharedFramebuffer message,
+ * see freerds_transport_attach_fd. A remote framebuffer cannot be
+ * shared at all: freerds keeps a private copy, updated from the pixels
+ * carried by the PaintRect messages. Otherwise it is a SysV segment id.
+ */
+
+#define RDS_FRAMEBUFFER_SEGMENT_MEMFD	-1
+#define RDS_FRAMEBUFFER_SEGMENT_REMOTE	-2
+
+/**
+ * A module listening on a tcp:// endpoint only accepts a freerds presenting
+ * the session cookie in its hello. freerds takes it from the endpoint it is
+ * given, tcp://<host>:<port>?cookie=<hex>, the module from its environment.
+ */
+
+#define RDS_TCP_COOKIE_LENGTH		16
+#define RDS_TCP_COOKIE_STRING_LENGTH	((RDS_TCP_COOKIE_LENGTH * 2) + 1)
+#define RDS_TCP_COOKIE_PARAM		"?cookie="
+#define RDS_TCP_COOKIE_ENV		"FREERDS_CONNECTOR_COOKIE"
+
+/* printf arguments for "%.*s" which keep the cookie out of the logs */
+#define RDS_TCP_ENDPOINT_ADDRESS(_endpoint)	(int) strcspn((_endpoint), "?"), (_endpoint)
+
 #define RDS_CODEC_JPEG			0x00000001
 #define RDS_CODEC_NSCODEC		0x00000002
 #define RDS_CODEC_REMOTEFX		0x00000004
@@ -91,6 +173,8 @@ extern "C" {
 #endif
 
 UINT32 freerds_peek_common_header_length(BYTE* data);
+int freerds_peek_message_length(BYTE* data, size_t size, UINT32* length);
+int freerds_peek_message_type(BYTE* data, size_t size, UINT32* type);
 
 int freerds_read_common_header(wStream* s, RDS_MSG_COMMON* msg);
 int freerds_write_common_header(wStream* s, RDS_MSG_COMMON* msg);
@@ -110,6 +194,35 @@ int freerds_write_common_header(wStream* s, RDS_MSG_COMMON* msg);
 #define RDS_CLIENT_MOUSE_EVENT			108
 #define RDS_CLIENT_EXTENDED_MOUSE_EVENT		109
 #define RDS_CLIENT_VBLANK_EVENT			110
+#define RDS_CLIENT_FLOW_CONTROL			111
+
+/**
+ * Flow Control
+ *
+ * A module starts with RDS_FLOW_CONTROL_WINDOW message credits and spends
+ * one per message it writes. freerds grants credits back as it consumes
+ * messages. Modules out of credits should hold back drawing messages and
+ * report the accumulated damage once credits are granted again. Other
+ * messages, except the few controlling the connection itself, should be
+ * queued locally until then rather than written.
+ */
+
+#define RDS_FLOW_CONTROL_WINDOW			1024
+
+/**
+ * Protocol Version
+ *
+ * freerds sends the highest version it supports in the Capabilities message
+ * right after connecting and the module answers with the version both sides
+ * will use. Modules which do not answer keep using version 1. Version 2
+ * enables the compact encoding, see freerds_write_common_header. Version 3
+ * lets modules report damage through the dirty tile bitmap and FrameReady.
+ */
+
+#define RDS_PROTOCOL_VERSION_1			1
+#define RDS_PROTOCOL_VERSION_2			2
+#define RDS_PROTOCOL_VERSION_3			3
+#define RDS_PROTOCOL_VERSION			RDS_PROTOCOL_VERSION_3
 
 struct _RDS_MSG_SYNCHRONIZE_KEYBOARD_EVENT
 {
@@ -174,6 +287,7 @@ struct _RDS_MSG_CAPABILITIES
 	UINT32 DesktopWidth;
 	UINT32 DesktopHeight;
 	UINT32 ColorDepth;
+	UINT32 Version;
 };
 typedef struct _RDS_MSG_CAPABILITIES RDS_MSG_CAPABILITIES;
 
@@ -192,6 +306,14 @@ struct _RDS_MSG_VBLANK_EVENT
 };
 typedef struct _RDS_MSG_VBLANK_EVENT RDS_MSG_VBLANK_EVENT;
 
+struct _RDS_MSG_FLOW_CONTROL
+{
+	DEFINE_MSG_COMMON();
+
+	UINT32 credits;
+};
+typedef struct _RDS_MSG_FLOW_CONTROL RDS_MSG_FLOW_CONTROL;
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -224,6 +346,9 @@ int freerds_write_refresh_rect(wStream* s, RDS_MSG_REFRESH_RECT* msg);
 int freerds_read_vblank_event(wStream* s, RDS_MSG_VBLANK_EVENT* msg);
 int freerds_write_vblank_event(wStream* s, RDS_MSG_VBLANK_EVENT* msg);
 
+int freerds_read_flow_control(wStream* s, RDS_MSG_FLOW_CONTROL* msg);
+int freerds_write_flow_control(wStream* s, RDS_MSG_FLOW_CONTROL* msg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -256,6 +381,10 @@ int freerds_write_vblank_event(wStream* s, RDS_MSG_VBLANK_EVENT* msg);
 #define RDS_SERVER_SET_SYSTEM_POINTER		23
 #define RDS_SERVER_LOGON_USER			24
 #define RDS_SERVER_LOGOFF_USER			25
+#define RDS_SERVER_PAINT_RECTS			26
+#define RDS_SERVER_SCREEN_BLT_RECTS		27
+#define RDS_SERVER_CAPABILITIES			28
+#define RDS_SERVER_FRAME_READY			29
 
 struct _RDS_MSG_BEGIN_UPDATE
 {
@@ -312,6 +441,38 @@ struct _RDS_MSG_PAINT_RECT
 };
 typedef struct _RDS_MSG_PAINT_RECT RDS_MSG_PAINT_RECT;
 
+/**
+ * Rectangle lists use RECTANGLE_16 with exclusive right and bottom
+ * coordinates, like the X server BoxRec. The common header rect holds
+ * the bounding box of the list.
+ */
+
+struct _RDS_MSG_PAINT_RECTS
+{
+	DEFINE_MSG_COMMON();
+
+	UINT32 fbSegmentId;
+	UINT32 numberOfRects;
+	RECTANGLE_16* rects;
+	RDS_FRAMEBUFFER* framebuffer;
+};
+typedef struct _RDS_MSG_PAINT_RECTS RDS_MSG_PAINT_RECTS;
+
+struct _RDS_MSG_SCREEN_BLT_RECTS
+{
+	DEFINE_MSG_COMMON();
+
+	INT32 nLeftRect;
+	INT32 nTopRect;
+	INT32 nWidth;
+	INT32 nHeight;
+	INT32 nXSrc;
+	INT32 nYSrc;
+	UINT32 numberOfClipRects;
+	RECTANGLE_16* clipRects;
+};
+typedef struct _RDS_MSG_SCREEN_BLT_RECTS RDS_MSG_SCREEN_BLT_RECTS;
+
 struct _RDS_MSG_DSTBLT
 {
 	DEFINE_MSG_COMMON();
@@ -581,9 +742,18 @@ struct _RDS_MSG_SHARED_FRAMEBUFFER
 	int segmentId;
 	int bitsPerPixel;
 	int bytesPerPixel;
+
+	/* not on the wire, the memfd taken by the receiving thread or -1 */
+	int fd;
 };
 typedef struct _RDS_MSG_SHARED_FRAMEBUFFER RDS_MSG_SHARED_FRAMEBUFFER;
 
+struct _RDS_MSG_FRAME_READY
+{
+	DEFINE_MSG_COMMON();
+};
+typedef struct _RDS_MSG_FRAME_READY RDS_MSG_FRAME_READY;
+
 union _RDS_MSG_SERVER
 {
 	RDS_MSG_BEGIN_UPDATE BeginUpdate;
@@ -609,6 +779,10 @@ union _RDS_MSG_SERVER
 	RDS_MSG_RESET Reset;
 	RDS_MSG_WINDOW_NEW_UPDATE WindowNewUpdate;
 	RDS_MSG_WINDOW_DELETE WindowDelete;
+	RDS_MSG_PAINT_RECTS PaintRects;
+	RDS_MSG_SCREEN_BLT_RECTS ScreenBltRects;
+	RDS_MSG_CAPABILITIES Capabilities;
+	RDS_MSG_FRAME_READY FrameReady;
 };
 typedef union _RDS_MSG_SERVER RDS_MSG_SERVER;
 
@@ -626,6 +800,8 @@ typedef int (*pRdsClientUnicodeKeyboardEvent)(rdsModuleConnector* connector, DWO
 typedef int (*pRdsClientMouseEvent)(rdsModuleConnector* connector, DWORD flags, DWORD x, DWORD y);
 typedef int (*pRdsClientExtendedMouseEvent)(rdsModuleConnector* connector, DWORD flags, DWORD x, DWORD y);
 typedef int (*pRdsClientVBlankEvent)(rdsModuleConnector *connector);
+typedef int (*pRdsClientFlowControl)(rdsModuleConnector* connector, UINT32 credits);
+typedef int (*pRdsClientCapabilities)(rdsModuleConnector* connector, RDS_MSG_CAPABILITIES* msg);
 
 struct rds_client_interface
 {
@@ -636,6 +812,8 @@ struct rds_client_interface
 	pRdsClientMouseEvent MouseEvent;
 	pRdsClientExtendedMouseEvent ExtendedMouseEvent;
 	pRdsClientVBlankEvent VBlankEvent;
+	pRdsClientFlowControl FlowControl;
+	pRdsClientCapabilities Capabilities;
 };
 typedef struct rds_client_interface rdsClientInterface;
 
@@ -669,6 +847,10 @@ typedef int (*pRdsServerWindowDelete)(rdsModuleConnector* connector, RDS_MSG_WIN
 typedef int (*pRdsServerLogonUser)(rdsModuleConnector* connector, RDS_MSG_LOGON_USER* msg);
 typedef int (*pRdsServerLogoffUser)(rdsModuleConnector* connector, RDS_MSG_LOGOFF_USER* msg);
 
+typedef int (*pRdsServerPaintRects)(rdsModuleConnector* connector, RDS_MSG_PAINT_RECTS* msg);
+typedef int (*pRdsServerScreenBltRects)(rdsModuleConnector* connector, RDS_MSG_SCREEN_BLT_RECTS* msg);
+typedef int (*pRdsServerFrameReady)(rdsModuleConnector* connector, RDS_MSG_FRAME_READY* msg);
+
 struct rds_server_interface
 {
 	pRdsServerBeginUpdate BeginUpdate;
@@ -697,9 +879,83 @@ struct rds_server_interface
 	pRdsServerWindowDelete WindowDelete;
 	pRdsServerLogonUser LogonUser;
 	pRdsServerLogoffUser LogoffUser;
+	pRdsServerPaintRects PaintRects;
+	pRdsServerScreenBltRects ScreenBltRects;
+	pRdsServerFrameReady FrameReady;
 };
 typedef struct rds_server_interface rdsServerInterface;
 
+#define RDS_TRANSPORT_MAX_FDS		4
+
+/**
+ * Connector Statistics
+ *
+ * Messages are counted by type as they are written to and dispatched from
+ * the transport, server message types at their own index and client message
+ * types after them. Histogram bucket 0 counts zero, bucket n counts values
+ * in [2^(n-1), 2^n), the last bucket is open ended.
+ */
+
+#define RDS_STATS_MESSAGE_TYPES		64
+#define RDS_STATS_CLIENT_INDEX		32
+#define RDS_STATS_BUCKETS		12
+
+struct _RDS_STATS_HISTOGRAM
+{
+	UINT32 count;
+	UINT64 total;
+	UINT32 max;
+	UINT32 buckets[RDS_STATS_BUCKETS];
+};
+typedef struct _RDS_STATS_HISTOGRAM RDS_STATS_HISTOGRAM;
+
+struct _RDS_CONNECTOR_STATS
+{
+	UINT32 InboundCount[RDS_STATS_MESSAGE_TYPES];
+	UINT64 InboundLength[RDS_STATS_MESSAGE_TYPES];
+	UINT32 OutboundCount[RDS_STATS_MESSAGE_TYPES];
+	UINT64 OutboundLength[RDS_STATS_MESSAGE_TYPES];
+	RDS_STATS_HISTOGRAM MessagesPerWakeup;
+	RDS_STATS_HISTOGRAM PackQueueDepth;
+};
+typedef struct _RDS_CONNECTOR_STATS RDS_CONNECTOR_STATS;
+
+/**
+ * Connector Capture
+ *
+ * With FREERDS_CAPTURE_DIR set, freerds records the message stream of every
+ * session into <dir>/freerds-<session>-<tick>.rdscap: each message exactly as
+ * it was dispatched or written, and each time the server list is packed the
+ * area posted to the encoder along with its pixels. freerds --replay feeds
+ * a capture back into the graphics pipeline.
+ *
+ * The file starts with a 16-byte header (magic, version, session id, zero),
+ * followed by records made of a 12-byte header (type, milliseconds since the
+ * start of the capture, length) and length bytes of data. A framebuffer
+ * record holds the painted rect, its bytes per pixel and then its rows,
+ * tightly packed. The rect is empty if nothing was painted.
+ */
+
+#define RDS_CAPTURE_MAGIC		0x50414352 /* "RCAP" */
+#define RDS_CAPTURE_VERSION		1
+
+#define RDS_CAPTURE_HEADER_LENGTH	16
+#define RDS_CAPTURE_RECORD_LENGTH	12
+#define RDS_CAPTURE_FRAMEBUFFER_LENGTH	20
+
+#define RDS_CAPTURE_INBOUND		1
+#define RDS_CAPTURE_OUTBOUND		2
+#define RDS_CAPTURE_FRAMEBUFFER		3
+
+struct _RDS_CAPTURE_RECORD
+{
+	UINT32 type;
+	UINT32 timestamp;
+	UINT32 length;
+	BYTE* data;
+};
+typedef struct _RDS_CAPTURE_RECORD RDS_CAPTURE_RECORD;
+
 struct rds_module_connector
 {
 
@@ -711,12 +967,28 @@ struct rds_module_connector
 	rdsServerInterface* server;
 	HANDLE hClientPipe;
 	HANDLE hServerPipe;
+	rdsShmTransport* ShmTransport;
+	rdsTcpTransport* TcpTransport;
+	rdsUringTransport* UringTransport;
 	wStream* OutboundStream;
 	wStream* InboundStream;
+	CRITICAL_SECTION OutboundLock;
+	UINT32 InputSequence;
+	BOOL OutboundMotionPending;
+	UINT16 OutboundMotionType;
+	size_t OutboundMotionOffset;
 	UINT32 InboundTotalLength;
 	UINT32 InboundTotalCount;
 	UINT32 OutboundTotalLength;
 	UINT32 OutboundTotalCount;
+	RDS_CONNECTOR_STATS Stats;
+	rdsCapture* Capture;
+	LONG FlowControlCredits;
+	LONG FlowControlPending;
+	UINT32 ProtocolVersion;
+	int OutboundFd;
+	int InboundFds[RDS_TRANSPORT_MAX_FDS];
+	int InboundFdCount;
 	pRdsGetEventHandles GetEventHandles;
 	pRdsCheckEventHandles CheckEventHandles;
 
@@ -726,14 +998,20 @@ struct rds_module_connector
 	HANDLE SocketEvent;
 
 	RDS_FRAMEBUFFER framebuffer;
+	RDS_FRAMEBUFFER snapshot;
+	CRITICAL_SECTION FramebufferLock;
 
 	int fps;
 	int MaxFps;
 	HANDLE StopEvent;
 	HANDLE ServerTimer;
 	HANDLE ServerThread;
+	HANDLE EncoderThread;
 	wLinkedList* ServerList;
 	wMessageQueue* ServerQueue;
+	LONG ServerQueueDepth;
+	LONG MaxServerQueueDepth;
+	BOOL FrameReadyPending;
 	rdsServerInterface* ServerProxy;
 };
 
@@ -763,7 +1041,9 @@ FREERDP_API rdsClientInterface* freerds_server_inbound_interface_new(void);
 FREERDP_API int freerds_named_pipe_read(HANDLE hNamedPipe, BYTE* data, DWORD length);
 FREERDP_API int freerds_named_pipe_write(HANDLE hNamedPipe, BYTE* data, DWORD length);
 
+FREERDP_API int freerds_server_outbound_append_message(rdsModuleConnector* connector, wStream* s, RDS_MSG_COMMON* msg);
 FREERDP_API int freerds_server_outbound_write_message(rdsModuleConnector* connector, RDS_MSG_COMMON* msg);
+FREERDP_API int freerds_client_outbound_flush(rdsModuleConnector* connector);
 
 FREERDP_API void freerds_named_pipe_get_endpoint_name(DWORD id, const char *endpoint, char *dest, int len);
 FREERDP_API int freerds_named_pipe_clean(const char* pipeName);
@@ -775,7 +1055,50 @@ FREERDP_API HANDLE freerds_named_pipe_connect_endpoint(DWORD id, const char* end
 FREERDP_API HANDLE freerds_named_pipe_create_endpoint(DWORD id, const char* endpoint);
 FREERDP_API HANDLE freerds_named_pipe_accept(HANDLE hServerPipe);
 
+FREERDP_API BOOL freerds_tcp_wait_endpoint(const char* endpoint, DWORD nTimeOut);
+FREERDP_API int freerds_tcp_generate_cookie(char* cookie, int length);
+
+FREERDP_API HANDLE freerds_transport_listen(rdsModuleConnector* connector);
+FREERDP_API HANDLE freerds_transport_accept(rdsModuleConnector* connector);
+FREERDP_API HANDLE freerds_transport_connect(rdsModuleConnector* connector, DWORD nTimeOut);
+FREERDP_API int freerds_transport_write(rdsModuleConnector* connector, BYTE* data, DWORD length);
 FREERDP_API int freerds_transport_receive(rdsModuleConnector* connector);
+FREERDP_API void freerds_transport_close(rdsModuleConnector* connector);
+FREERDP_API int freerds_transport_get_fd(rdsModuleConnector* connector);
+FREERDP_API HANDLE freerds_transport_get_event_handle(rdsModuleConnector* connector);
+FREERDP_API int freerds_transport_get_event_fd(rdsModuleConnector* connector);
+
+FREERDP_API int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RDS_MSG_COMMON* common);
+
+FREERDP_API void freerds_stats_record(RDS_STATS_HISTOGRAM* histogram, UINT32 value);
+FREERDP_API void freerds_stats_count_inbound(rdsModuleConnector* connector, UINT32 type, UINT32 length);
+FREERDP_API void freerds_stats_count_outbound(rdsModuleConnector* connector, BYTE* data, DWORD length);
+FREERDP_API void freerds_stats_print(rdsModuleConnector* connector, FILE* fp);
+
+FREERDP_API rdsCapture* freerds_capture_new(const char* filename, DWORD sessionId);
+FREERDP_API rdsCapture* freerds_capture_open(const char* filename, DWORD* sessionId);
+FREERDP_API void freerds_capture_free(rdsCapture* capture);
+FREERDP_API void freerds_capture_start(rdsModuleConnector* connector);
+FREERDP_API int freerds_capture_write(rdsCapture* capture, UINT32 type, BYTE* data, UINT32 length);
+FREERDP_API int freerds_capture_write_framebuffer(rdsCapture* capture, RDS_FRAMEBUFFER* framebuffer, RDS_RECT* rect);
+FREERDP_API int freerds_capture_read(rdsCapture* capture, RDS_CAPTURE_RECORD* record);
+
+FREERDP_API void freerds_transport_attach_fd(rdsModuleConnector* connector, int fd);
+FREERDP_API int freerds_transport_take_fd(rdsModuleConnector* connector);
+
+FREERDP_API int freerds_framebuffer_memfd_create(size_t size, size_t* mappedSize, BYTE** data);
+FREERDP_API BYTE* freerds_framebuffer_memfd_map(int fd, size_t size, size_t* mappedSize);
+FREERDP_API void freerds_framebuffer_detach(RDS_FRAMEBUFFER* framebuffer);
+
+FREERDP_API size_t freerds_tile_bitmap_size(int width, int height);
+FREERDP_API RDS_TILE_BITMAP* freerds_tile_bitmap_init(BYTE* data, int width, int height);
+FREERDP_API RDS_TILE_BITMAP* freerds_tile_bitmap_attach(RDS_FRAMEBUFFER* framebuffer, BYTE* data, size_t size);
+FREERDP_API void freerds_tile_bitmap_mark(RDS_TILE_BITMAP* tiles, int x, int y, int width, int height);
+FREERDP_API int freerds_tile_bitmap_collect(RDS_FRAMEBUFFER* framebuffer, pRdsTileBitmapRect callback, void* context);
+
+FREERDP_API void freerds_frame_write_begin(RDS_TILE_BITMAP* tiles);
+FREERDP_API UINT32 freerds_frame_write_end(RDS_TILE_BITMAP* tiles);
+FREERDP_API int freerds_frame_read_rect(RDS_FRAMEBUFFER* framebuffer, BYTE* data, RDS_RECT* rect);
 
 #ifdef __cplusplus
 }
@@ -25,4 +25,7 @@
 int freerds_icp_IsChannelAllowed(int sessionId, char *channelName, BOOL *isAllowed);
 int freerds_icp_Ping(BOOL *pong);
 int freerds_icp_GetUserSession(char *username, char * domain, UINT32 *sessionID, char **serviceEndpoint);
+int freerds_icp_GetChannelPolicy(UINT32 sessionId);
+int freerds_icp_IsChannelAllowedCached(UINT32 sessionId, char *channelName, BOOL *isAllowed);
+void freerds_icp_ReleaseChannelPolicy(UINT32 sessionId);
 #endif // _ICP_CLIENT_STUBS_H
@@ -29,7 +29,7 @@ namespace freerds{
 	namespace sessionmanager{
 		namespace call{
 
-		CallIn::CallIn() {
+		CallIn::CallIn() : mConnectionId(0) {
 
 		};
 
@@ -48,6 +48,14 @@ namespace freerds{
 			return 1; // for all CallIns
 		}
 
+		void CallIn::setConnectionId(uint32_t connectionId) {
+			mConnectionId = connectionId;
+		}
+
+		uint32_t CallIn::getConnectionId() {
+			return mConnectionId;
+		}
+
 
 		}
 	}
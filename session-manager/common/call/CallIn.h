@@ -42,7 +42,12 @@ namespace freerds{
 
 				virtual int doStuff() = 0;
 
+				// the rpc connection the call came in on, see RpcEngine
+				void setConnectionId(uint32_t connectionId);
+				uint32_t getConnectionId();
 
+			private:
+				uint32_t mConnectionId;
 			};
 
 		}
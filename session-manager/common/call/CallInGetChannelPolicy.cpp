@@ -0,0 +1,118 @@
+/**
+ * Class for rpc call GetChannelPolicy (freerds to session manager)
+ *
+ * Copyright 2013 Thinstuff Technologies GmbH
+ * Copyright 2013 DI (FH) Martin Haimberger <martin.haimberger@thinstuff.at>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "CallInGetChannelPolicy.h"
+#include <appcontext/ApplicationContext.h>
+#include <sstream>
+
+using freerds::icp::GetChannelPolicyRequest;
+using freerds::icp::GetChannelPolicyResponse;
+using freerds::icp::ChannelPolicy;
+using freerds::icp::ChannelRule;
+
+namespace freerds{
+	namespace sessionmanager{
+		namespace call{
+
+		static void addChannelRules(ChannelPolicy * policy, std::string channels, bool allowed) {
+			std::string channelName;
+			std::istringstream stream(channels);
+
+			while (std::getline(stream, channelName, ',')) {
+				if (channelName.empty()) {
+					continue;
+				}
+				ChannelRule * rule = policy->add_rules();
+				rule->set_channelname(channelName);
+				rule->set_channelallowed(allowed);
+			}
+		}
+
+		CallInGetChannelPolicy::CallInGetChannelPolicy() {
+
+		};
+
+		CallInGetChannelPolicy::~CallInGetChannelPolicy() {
+
+		};
+
+		unsigned long CallInGetChannelPolicy::getCallType() {
+			return freerds::icp::GetChannelPolicy;
+		};
+
+		/**
+		 * The policy is built from the channel.defaultallowed property
+		 * (true if unset) and the comma separated channel names in
+		 * channel.allowed and channel.denied.
+		 */
+		void CallInGetChannelPolicy::fillChannelPolicy(long sessionID, ChannelPolicy * policy) {
+			bool defaultAllowed = true;
+			std::string channels;
+			configNS::PropertyManager * propertyManager = APP_CONTEXT.getPropertyManager();
+
+			propertyManager->getPropertyBool(sessionID, "channel.defaultallowed", defaultAllowed);
+			policy->set_defaultallowed(defaultAllowed);
+
+			if (propertyManager->getPropertyString(sessionID, "channel.allowed", channels)) {
+				addChannelRules(policy, channels, true);
+			}
+			channels.clear();
+			if (propertyManager->getPropertyString(sessionID, "channel.denied", channels)) {
+				addChannelRules(policy, channels, false);
+			}
+		}
+
+		int CallInGetChannelPolicy::decodeRequest() {
+			// decode protocol buffers
+			GetChannelPolicyRequest req;
+			if (!req.ParseFromString(mEncodedRequest)) {
+				// failed to parse
+				mResult = 1;// will report error with answer
+				return -1;
+			}
+			mSessionID = req.sessionid();
+			return 0;
+		};
+
+		int CallInGetChannelPolicy::encodeResponse() {
+			// encode protocol buffers
+			GetChannelPolicyResponse resp;
+			fillChannelPolicy(mSessionID, resp.mutable_channelpolicy());
+
+			if (!resp.SerializeToString(&mEncodedResponse)) {
+				// failed to serialize
+				mResult = 1;
+				return -1;
+			}
+			return 0;
+		};
+
+		int CallInGetChannelPolicy::doStuff() {
+			return 0;
+		}
+
+
+		}
+	}
+}
+
@@ -22,6 +22,7 @@
 #endif
 
 #include "CallInGetUserSession.h"
+#include "CallInGetChannelPolicy.h"
 #include <appcontext/ApplicationContext.h>
 
 using freerds::icp::GetUserSessionRequest;
@@ -65,6 +66,7 @@ namespace freerds{
 
 			resp.set_sessionid(mSessionID);
 			resp.set_serviceendpoint(mPipeName);
+			CallInGetChannelPolicy::fillChannelPolicy(mSessionID, resp.mutable_channelpolicy());
 
 			if (!resp.SerializeToString(&mEncodedResponse)) {
 				// failed to serialize
@@ -29,7 +29,7 @@ namespace freerds{
 	namespace sessionmanager{
 		namespace call{
 
-		CallOut::CallOut():mAnswer(NULL) {
+		CallOut::CallOut():mAnswer(NULL),mAutoDelete(false) {
 
 		};
 
@@ -70,6 +70,14 @@ namespace freerds{
 			mErrorDescription = error;
 		}
 
+		void CallOut::setAutoDelete(bool autoDelete) {
+			mAutoDelete = autoDelete;
+		}
+
+		bool CallOut::getAutoDelete() {
+			return mAutoDelete;
+		}
+
 
 		}
 	}
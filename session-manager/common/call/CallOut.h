@@ -47,9 +47,13 @@ namespace freerds{
 				void	setResult(uint32_t result);
 				void	setErrorDescription(std::string error);
 
+				// the rpc engine deletes the call once it is answered or failed
+				void	setAutoDelete(bool autoDelete);
+				bool	getAutoDelete();
 
 			private :
 				HANDLE mAnswer;
+				bool mAutoDelete;
 
 
 			};
@@ -0,0 +1,90 @@
+/**
+ * Class for rpc call ChannelPolicyChanged (session manager to freerds)
+ *
+ * Copyright 2013 Thinstuff Technologies GmbH
+ * Copyright 2013 DI (FH) Martin Haimberger <martin.haimberger@thinstuff.at>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "CallOutChannelPolicyChanged.h"
+#include <appcontext/ApplicationContext.h>
+
+using freerds::icp::ChannelPolicyChangedRequest;
+using freerds::icp::ChannelPolicyChangedResponse;
+
+namespace freerds{
+	namespace sessionmanager{
+		namespace call{
+
+		CallOutChannelPolicyChanged::CallOutChannelPolicyChanged():mSessionID(0) {
+
+		};
+
+		CallOutChannelPolicyChanged::~CallOutChannelPolicyChanged() {
+
+		};
+
+		unsigned long CallOutChannelPolicyChanged::getCallType() {
+			return freerds::icp::ChannelPolicyChanged;
+		};
+
+		void CallOutChannelPolicyChanged::setSessionID(long sessionID) {
+			mSessionID = sessionID;
+		}
+
+		int CallOutChannelPolicyChanged::encodeRequest() {
+			// encode protocol buffers
+			ChannelPolicyChangedRequest req;
+			req.set_sessionid(mSessionID);
+
+			if (!req.SerializeToString(&mEncodedRequest)) {
+				// failed to serialize
+				mResult = 1;
+				return -1;
+			}
+			return 0;
+		};
+
+		int CallOutChannelPolicyChanged::decodeResponse() {
+			// decode protocol buffers
+			ChannelPolicyChangedResponse resp;
+			if (!resp.ParseFromString(mEncodedResponse)) {
+				// failed to parse
+				mResult = 1;
+				return -1;
+			}
+			return 0;
+		};
+
+		/**
+		 * Tells freerds to drop its cached channel policy for sessionID,
+		 * 0 for all sessions. Nobody waits for the answer, the rpc engine
+		 * deletes the call once it arrived.
+		 */
+		void CallOutChannelPolicyChanged::notify(long sessionID) {
+			CallOutChannelPolicyChanged * call = new CallOutChannelPolicyChanged();
+			call->setSessionID(sessionID);
+			call->setAutoDelete(true);
+			call->encodeRequest();
+			APP_CONTEXT.getRpcOutgoingQueue()->addElement(call);
+		}
+
+		}
+	}
+}
+
@@ -0,0 +1,54 @@
+/**
+ * Class for rpc call ChannelPolicyChanged (session manager to freerds)
+ *
+ * Copyright 2013 Thinstuff Technologies GmbH
+ * Copyright 2013 DI (FH) Martin Haimberger <martin.haimberger@thinstuff.at>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CALL_OUT_CHANNEL_POLICY_CHANGED_H_
+#define CALL_OUT_CHANNEL_POLICY_CHANGED_H_
+#include <string>
+#include "CallOut.h"
+#include <ICP.pb.h>
+
+
+namespace freerds{
+	namespace sessionmanager{
+		namespace call{
+			class CallOutChannelPolicyChanged: public CallOut{
+
+			public:
+				CallOutChannelPolicyChanged();
+				virtual ~CallOutChannelPolicyChanged();
+
+				virtual unsigned long getCallType();
+				virtual int encodeRequest();
+				virtual int decodeResponse();
+
+				void setSessionID(long sessionID);
+
+				static void notify(long sessionID);
+
+			private:
+				long mSessionID;
+
+			};
+		}
+	}
+}
+
+namespace callNS = freerds::sessionmanager::call;
+
+#endif // CALL_OUT_CHANNEL_POLICY_CHANGED_H_
@@ -30,6 +30,7 @@
 
 #include <winpr/wlog.h>
 #include <appcontext/ApplicationContext.h>
+#include <call/CallOutChannelPolicyChanged.h>
 
 namespace freerds{
 	namespace sessionmanager{
@@ -38,60 +39,64 @@ namespace freerds{
 			static wLog * logger_PropertyManager = WLog_Get("freerds.sessionmanager.config.propertymanager");
 
 			PropertyManager::PropertyManager() {
-
+				if (!InitializeCriticalSectionAndSpinCount(&mCSection,
+				        0x00000400) )
+				{
+					 WLog_Print(logger_PropertyManager, WLOG_FATAL, "cannot init PropertyManager critical section!");
+				}
 			};
 
 			PropertyManager::~PropertyManager() {
-
+				DeleteCriticalSection(&mCSection);
 			};
 
 
 			bool PropertyManager::getPropertyBool(long sessionID, std::string path, bool &value) {
 				// only global config for now
-				if (mPropertyGlobalMap.find(path) != mPropertyGlobalMap.end()) {
-					PROPERTY_STORE_HELPER internStore = mPropertyGlobalMap[path];
-					if (internStore.type != BoolType) {
-						return false;
-					} else {
-						value = internStore.boolValue;
-						return true;
+				bool found = false;
+				EnterCriticalSection(&mCSection);
+				TPropertyMap::iterator it = mPropertyGlobalMap.find(path);
+				if (it != mPropertyGlobalMap.end()) {
+					if (it->second.type == BoolType) {
+						value = it->second.boolValue;
+						found = true;
 					}
-				} else {
-					// element not found
-					return false;
 				}
+				// element not found otherwise
+				LeaveCriticalSection(&mCSection);
+				return found;
 			}
 
 			bool PropertyManager::getPropertyNumber(long sessionID, std::string path, long &value) {
 				// only global config for now
-				if (mPropertyGlobalMap.find(path) != mPropertyGlobalMap.end()) {
-					PROPERTY_STORE_HELPER internStore = mPropertyGlobalMap[path];
-					if (internStore.type != NumberType) {
-						return false;
-					} else {
-						value = internStore.numberValue;
-						return true;
+				bool found = false;
+				EnterCriticalSection(&mCSection);
+				TPropertyMap::iterator it = mPropertyGlobalMap.find(path);
+				if (it != mPropertyGlobalMap.end()) {
+					if (it->second.type == NumberType) {
+						value = it->second.numberValue;
+						found = true;
 					}
-				} else {
-					// element not found
-					return false;
 				}
+				// element not found otherwise
+				LeaveCriticalSection(&mCSection);
+				return found;
 			}
 
 			bool PropertyManager::getPropertyString(long sessionID, std::string path, std::string &value) {
 				// only global config for now
-				if (mPropertyGlobalMap.find(path) != mPropertyGlobalMap.end()) {
-					PROPERTY_STORE_HELPER internStore = mPropertyGlobalMap[path];
-					if (internStore.type != StringType) {
-						return false;
-					} else {
-						value = internStore.stringValue;
-						return true;
+				bool found = false;
+				EnterCriticalSection(&mCSection);
+				TPropertyMap::iterator it = mPropertyGlobalMap.find(path);
+				if (it != mPropertyGlobalMap.end()) {
+					if (it->second.type == StringType) {
+						value = it->second.stringValue;
+						found = true;
 					}
-				} else {
-					// element not found
-					return false;
 				}
+				// element not found otherwise
+				LeaveCriticalSection(&mCSection);
+				return found;
 			}
 
 			int PropertyManager::setPropertyBool(PROPERTY_LEVEL level, long sessionID,
@@ -101,8 +106,7 @@ namespace freerds{
 				helper.type = BoolType;
 				helper.boolValue = value;
 
-				mPropertyGlobalMap.insert(std::make_pair(path,helper));
-				return 0;
+				return setPropertyInternal(path, helper);
 			}
 
 			int PropertyManager::setPropertyNumber(PROPERTY_LEVEL level, long sessionID,
@@ -112,8 +116,7 @@ namespace freerds{
 				helper.type = NumberType;
 				helper.numberValue = value;
 
-				mPropertyGlobalMap.insert(std::make_pair(path,helper));
-				return 0;
+				return setPropertyInternal(path, helper);
 			}
 
 			int PropertyManager::setPropertyString(PROPERTY_LEVEL level, long sessionID,
@@ -123,7 +126,18 @@ namespace freerds{
 				helper.type = StringType;
 				helper.stringValue = value;
 
-				mPropertyGlobalMap.insert(std::make_pair(path,helper));
+				return setPropertyInternal(path, helper);
+			}
+
+			int PropertyManager::setPropertyInternal(std::string path, PROPERTY_STORE_HELPER helper) {
+				EnterCriticalSection(&mCSection);
+				mPropertyGlobalMap[path] = helper;
+				LeaveCriticalSection(&mCSection);
+
+				if (path.compare(0, 8, "channel.") == 0) {
+					// freerds caches the channel policy per session
+					callNS::CallOutChannelPolicyChanged::notify(0);
+				}
 				return 0;
 			}
 
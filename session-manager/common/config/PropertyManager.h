@@ -28,6 +28,7 @@
 
 #include <string>
 #include <map>
+#include <winpr/synch.h>
 #include "PropertyLevel.h"
 
 namespace freerds{
@@ -74,9 +75,13 @@ namespace freerds{
 			int loadProperties();
 
 		private:
+			int setPropertyInternal(std::string path, PROPERTY_STORE_HELPER helper);
+
 			TPropertyMap mPropertyGlobalMap;
 			TPropertyPropertyMap mPropertyGroupMap;
 			TPropertyPropertyMap mPropertyUserMap;
+			// rpc calls read the properties from several threads
+			CRITICAL_SECTION mCSection;
 		};
 		}
 	}
@@ -25,6 +25,7 @@
 
 #include <winpr/pipe.h>
 #include <winpr/thread.h>
+#include <winpr/sysinfo.h>
 #include <call/CallFactory.h>
 #include <arpa/inet.h>
 #include <winpr/wlog.h>
@@ -44,7 +45,9 @@ static wLog * logger_RPCEngine = WLog_Get("freerds.pbrpc.RpcEngine");
 
 
 RpcEngine::RpcEngine() :
-		mPacktLength(0), mHeaderRead(0), mPayloadRead(0) {
+		mhWorkerThreads(NULL), mWorkerCount(0), mConnectionId(0),
+		mPacktLength(0), mHeaderRead(0), mPayloadRead(0),
+		mPayloadBuffer(PIPE_BUFFER_SIZE) {
 	mhStopEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
 	WLog_SetLogLevel(logger_RPCEngine, WLOG_ERROR);
 }
@@ -70,6 +73,10 @@ HANDLE RpcEngine::createServerPipe(const char* endpoint) {
 
 int RpcEngine::startEngine() {
 
+	if (startWorkers() != CLIENT_SUCCESS) {
+		return CLIENT_ERROR;
+	}
+
 	mhServerThread = CreateThread(NULL, 0,
 			(LPTHREAD_START_ROUTINE) RpcEngine::listenerThread, (void*) this,
 			CREATE_SUSPENDED, NULL);
@@ -86,9 +93,108 @@ int RpcEngine::stopEngine() {
 		CloseHandle(mhServerThread);
 		mhServerThread = NULL;
 	}
+	stopWorkers();
+	return CLIENT_SUCCESS;
+}
+
+int RpcEngine::startWorkers() {
+	SYSTEM_INFO sysinfo;
+
+	GetSystemInfo(&sysinfo);
+	mWorkerCount = sysinfo.dwNumberOfProcessors * RPC_ENGINE_WORKERS_PER_CPU;
+	if (mWorkerCount < RPC_ENGINE_MIN_WORKERS) {
+		mWorkerCount = RPC_ENGINE_MIN_WORKERS;
+	}
+
+	mhWorkerThreads = new HANDLE[mWorkerCount];
+
+	for (DWORD i = 0; i < mWorkerCount; i++) {
+		mhWorkerThreads[i] = CreateThread(NULL, 0,
+				(LPTHREAD_START_ROUTINE) RpcEngine::workerThread, (void*) this,
+				0, NULL);
+		if (!mhWorkerThreads[i]) {
+			WLog_Print(logger_RPCEngine, WLOG_ERROR, "could not create worker thread");
+			mWorkerCount = i;
+			break;
+		}
+	}
+	if (mWorkerCount == 0) {
+		delete[] mhWorkerThreads;
+		mhWorkerThreads = NULL;
+		return CLIENT_ERROR;
+	}
+	WLog_Print(logger_RPCEngine, WLOG_TRACE, "started %d worker threads",mWorkerCount);
 	return CLIENT_SUCCESS;
 }
 
+void RpcEngine::stopWorkers() {
+	if (!mhWorkerThreads) {
+		return;
+	}
+	SetEvent(mhStopEvent);
+	for (DWORD i = 0; i < mWorkerCount; i++) {
+		WaitForSingleObject(mhWorkerThreads[i],INFINITE);
+		CloseHandle(mhWorkerThreads[i]);
+	}
+	delete[] mhWorkerThreads;
+	mhWorkerThreads = NULL;
+	mWorkerCount = 0;
+
+	flushPendingCalls();
+}
+
+/**
+ * Drops the calls nobody picked up anymore.
+ */
+void RpcEngine::flushPendingCalls() {
+	callNS::CallIn * pendingCall = mPendingCalls.getElement();
+	while (pendingCall != NULL) {
+		delete pendingCall;
+		pendingCall = mPendingCalls.getElement();
+	}
+}
+
+/**
+ * Runs the CallIns handed over by processData. The finished call goes to the
+ * outgoing queue, so all writes to the pipe stay on the rpc thread and the
+ * answers are sent in the order the calls complete.
+ */
+void* RpcEngine::workerThread(void* arg) {
+	RpcEngine* engine;
+	DWORD nCount;
+	HANDLE events[2];
+
+	engine = (RpcEngine*) arg;
+	nCount = 0;
+	events[nCount++] = engine->mhStopEvent;
+	events[nCount++] = engine->mPendingCalls.getSignalHandle();
+
+	while (1) {
+		WaitForMultipleObjects(nCount, events, FALSE, INFINITE);
+
+		if (WaitForSingleObject(engine->mhStopEvent, 0) == WAIT_OBJECT_0) {
+			break;
+		}
+
+		callNS::CallIn * callIn = engine->mPendingCalls.getElement();
+		if (callIn == NULL) {
+			// another worker was faster
+			continue;
+		}
+
+		WLog_Print(logger_RPCEngine, WLOG_TRACE, "processing call for callType=%d and callID=%d",callIn->getCallType(),callIn->getTag());
+		// call the implementation ...
+		callIn->decodeRequest();
+		if (!callIn->doStuff()) {
+			callIn->encodeResponse();
+		}
+		// the rpc thread sends the result
+		APP_CONTEXT.getRpcOutgoingQueue()->addElement(callIn);
+	}
+
+	return NULL;
+}
+
 int RpcEngine::createServerPipe() {
 	mhServerPipe = createServerPipe("\\\\.\\pipe\\FreeRDS_SessionManager");
 
@@ -116,7 +222,13 @@ void* RpcEngine::listenerThread(void* arg) {
 		if (!clientPipe)
 			break;
 
-		if (engine->serveClient() == CLIENT_ERROR ) {
+		int status = engine->serveClient();
+
+		// whatever the old client asked for is not answered to the next one
+		InterlockedIncrement(&engine->mConnectionId);
+		engine->flushPendingCalls();
+
+		if (status == CLIENT_ERROR ) {
 			break;
 		}
 		engine->resetStatus();
@@ -199,6 +311,16 @@ int RpcEngine::readHeader() {
 	if (mHeaderRead == 4) {
 		mPacktLength = ntohl(*(DWORD *)mHeaderBuffer);
 		WLog_Print(logger_RPCEngine, WLOG_TRACE, "header read, packet size %d",mPacktLength);
+
+		// such a length means the stream is out of sync
+		if (mPacktLength > RPC_ENGINE_MAX_MESSAGE_LENGTH) {
+			WLog_Print(logger_RPCEngine, WLOG_ERROR, "packet size %u exceeds the maximum, dropping client",mPacktLength);
+			return CLIENT_DISCONNECTED;
+		}
+		// the buffer only grows, the next packets mostly fit
+		if (mPayloadBuffer.size() < mPacktLength) {
+			mPayloadBuffer.resize(mPacktLength);
+		}
 	}
 	return CLIENT_SUCCESS;
 }
@@ -208,7 +330,7 @@ int RpcEngine::readPayload() {
 	DWORD lpNumberOfBytesRead = 0;
 	BOOL fSuccess;
 
-	fSuccess = ReadFile(mhClientPipe, mPayloadBuffer + mPayloadRead,
+	fSuccess = ReadFile(mhClientPipe, &mPayloadBuffer[mPayloadRead],
 			mPacktLength - mPayloadRead, &lpNumberOfBytesRead,
 			NULL);
 
@@ -223,7 +345,7 @@ int RpcEngine::readPayload() {
 
 int RpcEngine::processData() {
 	mpbRPC.Clear();
-	mpbRPC.ParseFromArray(mPayloadBuffer, mPayloadRead);
+	mpbRPC.ParseFromArray(&mPayloadBuffer[0], mPayloadRead);
 
 	uint32_t callID = mpbRPC.tag();
 	uint32_t callType = mpbRPC.msgtype();
@@ -255,6 +377,9 @@ int RpcEngine::processData() {
 			} else if (mpbRPC.status() == RPCBase_RPCSTATUS_NOTFOUND) {
 				foundCallOut->setResult(2);
 			}
+			if (foundCallOut->getAutoDelete()) {
+				delete foundCallOut;
+			}
 		}
 
 
@@ -272,15 +397,10 @@ int RpcEngine::processData() {
 			callNS::CallIn* createdCallIn = (callNS::CallIn*)createdCall;
 			createdCallIn->setEncodedRequest(mpbRPC.payload());
 			createdCallIn->setTag(callID);
+			createdCallIn->setConnectionId(mConnectionId);
 			WLog_Print(logger_RPCEngine, WLOG_TRACE, "call upacked for callType=%d and callID=%d",callType,callID);
-			// call the implementation ...
-			createdCallIn->decodeRequest();
-			if (!createdCallIn->doStuff()) {
-				createdCallIn->encodeResponse();
-			}
-			// send the result
-			send(createdCall);
-			delete createdCall;
+			// a worker calls the implementation
+			mPendingCalls.addElement(createdCallIn);
 		} else {
 			WLog_Print(logger_RPCEngine, WLOG_ERROR, "callobject had wrong baseclass, callType=%d",callType);
 			sendError(callID, callType);
@@ -439,9 +559,26 @@ int RpcEngine::processOutgoingCall(freerds::sessionmanager::call::Call* call) {
 			} else {
 				WLog_Print(logger_RPCEngine, WLOG_ERROR, "error sending call, informing call");
 				callOut->setResult(1); // for failed
+				if (callOut->getAutoDelete()) {
+					delete callOut;
+				}
 				return CLIENT_ERROR;
 			}
 
+	} else if (call->getDerivedType() == 1) {
+		// a CallIn finished by a worker, send the answer
+		callNS::CallIn * callIn = (callNS::CallIn *)call;
+		if (callIn->getConnectionId() != (uint32_t) mConnectionId) {
+			WLog_Print(logger_RPCEngine, WLOG_TRACE, "dropping answer for callID=%d, its client is gone",call->getTag());
+			delete call;
+			return CLIENT_SUCCESS;
+		}
+		int retValue = send(call);
+		if (retValue != CLIENT_SUCCESS) {
+			WLog_Print(logger_RPCEngine, WLOG_ERROR, "error sending answer for callID=%d",call->getTag());
+		}
+		delete call;
+		return retValue;
 	} else {
 		WLog_Print(logger_RPCEngine, WLOG_ERROR, "call was no outgoing call, wrong type in queue, dropping packet!");
 		delete call;
@@ -24,12 +24,22 @@
 #include <pbRPC.pb.h>
 #include <call/Call.h>
 #include <call/CallOut.h>
+#include <call/CallIn.h>
+#include <utils/SignalingQueue.h>
 #include <list>
+#include <vector>
 
 
 
 #define PIPE_BUFFER_SIZE	0xFFFF
 
+// same limit as PBRPC_MAX_MESSAGE_LENGTH on the freerds side
+#define RPC_ENGINE_MAX_MESSAGE_LENGTH	0x4000000
+
+// CallIns mostly wait on processes and pipes, so there are more workers than cpus
+#define RPC_ENGINE_WORKERS_PER_CPU	2
+#define RPC_ENGINE_MIN_WORKERS	4
+
 namespace freerds{
 	namespace pbrpc{
 
@@ -49,6 +59,9 @@ namespace freerds{
 			int createServerPipe();
 			HANDLE createServerPipe(const char* endpoint);
 			static void* listenerThread(void* arg);
+			static void* workerThread(void* arg);
+			int startWorkers();
+			void stopWorkers();
 			int read();
 			int readHeader();
 			int readPayload();
@@ -57,6 +70,7 @@ namespace freerds{
 			int sendError(uint32_t callID, uint32_t callType);
 			int sendInternal(std::string data);
 			int processOutgoingCall(freerds::sessionmanager::call::Call * call);
+			void flushPendingCalls();
 
 
 
@@ -67,13 +81,19 @@ namespace freerds{
 
 			HANDLE mhStopEvent;
 
+			HANDLE * mhWorkerThreads;
+			DWORD mWorkerCount;
+			SignalingQueue<callNS::CallIn> mPendingCalls;
+			// bumped for every client, answers for an earlier one are dropped
+			volatile LONG mConnectionId;
+
 			DWORD mPacktLength;
 
 			DWORD mHeaderRead;
 			BYTE mHeaderBuffer[4];
 
 			DWORD mPayloadRead;
-			BYTE mPayloadBuffer[PIPE_BUFFER_SIZE];
+			std::vector<BYTE> mPayloadBuffer;
 
 			RPCBase mpbRPC;
 			std::list<callNS::CallOut*> mAnswerWaitingQueue;
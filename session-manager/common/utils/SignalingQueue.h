@@ -63,11 +63,26 @@ public:
 
 	QueueElement * getElementLockFree() {
 		QueueElement * element;
+		if (mlist.empty()) {
+			return NULL;
+		}
 		element = mlist.front();
 		mlist.pop_front();
 		return element;
 	}
 
+	// takes a single element, the event stays set as long as elements are left
+	QueueElement * getElement() {
+		QueueElement * element;
+		EnterCriticalSection(&mCSection);
+		element = getElementLockFree();
+		if (mlist.empty()) {
+			ResetEvent(mSignalHandle);
+		}
+		LeaveCriticalSection(&mCSection);
+		return element;
+	}
+
 	void unlockQueue () {
 		LeaveCriticalSection(&mCSection);
 	}
@@ -23,7 +23,9 @@
 
 #include <winpr/crt.h>
 
+#include <unistd.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <freerdp/freerdp.h>
@@ -144,6 +146,9 @@ int rds_check_shared_framebuffer(rdsContext* rds)
 		msg.bitsPerPixel = rds->framebuffer.fbBitsPerPixel;
 		msg.bytesPerPixel = rds->framebuffer.fbBytesPerPixel;
 
+		if (rds->framebuffer.fbMappedSize)
+			freerds_transport_attach_fd(connector, rds->framebufferFd);
+
 		msg.type = RDS_SERVER_SHARED_FRAMEBUFFER;
 		connector->server->SharedFramebuffer(connector, &msg);
 
@@ -309,10 +314,22 @@ BOOL rds_post_connect(freerdp* instance)
 	rds->framebuffer.fbScanline = rds->framebuffer.fbWidth * rds->framebuffer.fbBytesPerPixel;
 	rds->framebufferSize = rds->framebuffer.fbScanline * rds->framebuffer.fbHeight;
 
-	rds->framebuffer.fbSegmentId = shmget(IPC_PRIVATE, rds->framebufferSize,
-			IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+	rds->framebufferFd = freerds_framebuffer_memfd_create(rds->framebufferSize,
+			&(rds->framebuffer.fbMappedSize), &(rds->framebuffer.fbSharedMemory));
+
+	if (rds->framebufferFd >= 0)
+	{
+		rds->framebuffer.fbSegmentId = RDS_FRAMEBUFFER_SEGMENT_MEMFD;
+	}
+	else
+	{
+		rds->framebuffer.fbMappedSize = 0;
 
-	rds->framebuffer.fbSharedMemory = (BYTE*) shmat(rds->framebuffer.fbSegmentId, 0, 0);
+		rds->framebuffer.fbSegmentId = shmget(IPC_PRIVATE, rds->framebufferSize,
+				IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+
+		rds->framebuffer.fbSharedMemory = (BYTE*) shmat(rds->framebuffer.fbSegmentId, 0, 0);
+	}
 
 	gdi_init(instance, flags, rds->framebuffer.fbSharedMemory);
 	gdi = instance->context->gdi;
@@ -555,6 +572,15 @@ void rds_freerdp_client_free(freerdp* instance, rdpContext* context)
 		rds->service = NULL;
 	}
 
+	if (rds->framebuffer.fbMappedSize)
+	{
+		munmap(rds->framebuffer.fbSharedMemory, rds->framebuffer.fbMappedSize);
+		close(rds->framebufferFd);
+
+		rds->framebuffer.fbSharedMemory = NULL;
+		rds->framebuffer.fbMappedSize = 0;
+	}
+
 	WLog_Uninit();
 }
 
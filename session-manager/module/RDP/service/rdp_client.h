@@ -53,6 +53,7 @@ struct rds_context
 	HANDLE ChannelsThread;
 
 	int framebufferSize;
+	int framebufferFd;
 	RDS_FRAMEBUFFER framebuffer;
 };
 
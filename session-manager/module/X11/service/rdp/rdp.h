@@ -113,6 +113,7 @@ struct _rdpScreenInfoRec
 	int bitsPerPixel;
 	int sizeInBytes;
 	char* pfbMemory;
+	char* pfbBackMemory;
 	Pixel blackPixel;
 	Pixel whitePixel;
 	/* wrapped screen functions */
@@ -144,7 +145,13 @@ struct _rdpScreenInfoRec
 
 	int segmentId;
 	int sharedMemory;
+	int doubleBuffer;
+	char* endpoint;
 	int fbAttached;
+	int fbMemfd;
+	size_t fbMappedSize;
+	size_t fbSegmentSize;
+	RDS_TILE_BITMAP* tiles;
 
 	int rdp_width;
 	int rdp_height;
@@ -270,11 +277,15 @@ UINT32 rdpup_convert_opcode(int opcode);
 UINT32 rdp_dstblt_rop(int opcode);
 int rdpup_init(void);
 int rdpup_check(void);
+int rdpup_flush(void);
 int rdpup_begin_update(void);
 int rdpup_end_update(void);
 int rdpup_check_attach_framebuffer();
+int rdpup_detach_framebuffer(void);
 int rdpup_opaque_rect(RDS_MSG_OPAQUE_RECT* msg);
 int rdpup_screen_blt(short x, short y, int cx, int cy, short srcx, short srcy);
+int rdpup_screen_blt_rects(short x, short y, int cx, int cy, short srcx, short srcy,
+		BoxPtr boxes, int numberOfBoxes, int reverse);
 int rdpup_patblt(RDS_MSG_PATBLT* msg);
 int rdpup_dstblt(RDS_MSG_DSTBLT* msg);
 int rdpup_set_clipping_region(RDS_MSG_SET_CLIPPING_REGION* msg);
@@ -60,8 +60,6 @@ static RegionPtr rdpCopyAreaWndToWnd(WindowPtr pSrcWnd, WindowPtr pDstWnd, GCPtr
 	int num_clips;
 	int dx;
 	int dy;
-	int j;
-	BoxRec box;
 	RegionPtr rv;
 	RegionRec clip_reg;
 
@@ -94,26 +92,11 @@ static RegionPtr rdpCopyAreaWndToWnd(WindowPtr pSrcWnd, WindowPtr pDstWnd, GCPtr
 			dx = dstx - srcx;
 			dy = dsty - srcy;
 
-			if ((dy < 0) || ((dy == 0) && (dx < 0)))
-			{
-				for (j = 0; j < num_clips; j++)
-				{
-					box = REGION_RECTS(&clip_reg)[j];
-					rdpup_set_clip(box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
-					rdpup_screen_blt(ldstx, ldsty, w, h, lsrcx, lsrcy);
-				}
-			}
-			else
-			{
-				for (j = num_clips - 1; j >= 0; j--)
-				{
-					box = REGION_RECTS(&clip_reg)[j];
-					rdpup_set_clip(box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
-					rdpup_screen_blt(ldstx, ldsty, w, h, lsrcx, lsrcy);
-				}
-			}
+			/* copy the clip boxes in the order that does not overwrite the source */
+			rdpup_screen_blt_rects(ldstx, ldsty, w, h, lsrcx, lsrcy,
+					REGION_RECTS(&clip_reg), num_clips,
+					!((dy < 0) || ((dy == 0) && (dx < 0))));
 
-			rdpup_reset_clip();
 			rdpup_end_update();
 		}
 	}
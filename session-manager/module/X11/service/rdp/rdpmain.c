@@ -28,7 +28,9 @@ Sets up the  functions
 #include "glx_extinit.h"
 
 #include <stdio.h>
+#include <unistd.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <winpr/crt.h>
@@ -177,6 +179,7 @@ static void rdpWakeupHandler(ScreenPtr pScreen, unsigned long result, pointer pR
 
 static void rdpBlockHandler1(pointer blockData, OSTimePtr pTimeout, pointer pReadmask)
 {
+	rdpup_flush();
 }
 
 static void rdpWakeupHandler1(pointer blockData, int result, pointer pReadmask)
@@ -220,6 +223,7 @@ static Bool rdpScreenInit(ScreenPtr pScreen, int argc, char** argv)
 	int dpix;
 	int dpiy;
 	int ret;
+	char* pixels;
 	Bool vis_found;
 	VisualPtr vis;
 	PictureScreenPtr ps;
@@ -260,19 +264,59 @@ static Bool rdpScreenInit(ScreenPtr pScreen, int argc, char** argv)
 
 	if (!g_rdpScreen.pfbMemory)
 	{
+		size_t segmentSize;
+
 		g_rdpScreen.sizeInBytes = (g_rdpScreen.paddedWidthInBytes * g_rdpScreen.height);
 
+		/* the dirty tile bitmap lives in the same segment, right after the pixels */
+		segmentSize = RDS_TILE_BITMAP_OFFSET(g_rdpScreen.sizeInBytes) +
+				freerds_tile_bitmap_size(g_rdpScreen.width, g_rdpScreen.height);
+
 		if (g_rdpScreen.sharedMemory)
 		{
-			/* allocate shared memory segment */
-			g_rdpScreen.segmentId = shmget(IPC_PRIVATE, g_rdpScreen.sizeInBytes,
-					IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-
-			/* attach the shared memory segment */
-			g_rdpScreen.pfbMemory = (char*) shmat(g_rdpScreen.segmentId, 0, 0);
-
-			ErrorF("sizeInBytes %d segmentId: %d pfbMemory: %p\n",
-					g_rdpScreen.sizeInBytes, g_rdpScreen.segmentId, g_rdpScreen.pfbMemory);
+			/* prefer a sealed memfd passed to freerds, fall back to a SysV segment */
+			g_rdpScreen.fbMemfd = freerds_framebuffer_memfd_create(segmentSize,
+					&g_rdpScreen.fbMappedSize, (BYTE**) &g_rdpScreen.pfbMemory);
+
+			if (g_rdpScreen.fbMemfd >= 0)
+			{
+				g_rdpScreen.segmentId = RDS_FRAMEBUFFER_SEGMENT_MEMFD;
+			}
+			else
+			{
+				/* allocate shared memory segment */
+				g_rdpScreen.segmentId = shmget(IPC_PRIVATE, segmentSize,
+						IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+
+				/* attach the shared memory segment */
+				g_rdpScreen.pfbMemory = (char*) shmat(g_rdpScreen.segmentId, 0, 0);
+
+				if (g_rdpScreen.pfbMemory == (char*) -1)
+					g_rdpScreen.pfbMemory = NULL;
+			}
+
+			if (g_rdpScreen.pfbMemory)
+			{
+				g_rdpScreen.fbSegmentSize = segmentSize;
+				g_rdpScreen.tiles = freerds_tile_bitmap_init((BYTE*) &g_rdpScreen.pfbMemory[
+						RDS_TILE_BITMAP_OFFSET(g_rdpScreen.sizeInBytes)], g_rdpScreen.width, g_rdpScreen.height);
+			}
+
+			/* the shared segment becomes the front buffer, X draws into the back buffer */
+			if (g_rdpScreen.doubleBuffer && g_rdpScreen.tiles)
+			{
+				g_rdpScreen.pfbBackMemory = (char*) malloc(g_rdpScreen.sizeInBytes);
+
+				if (g_rdpScreen.pfbBackMemory)
+				{
+					ZeroMemory(g_rdpScreen.pfbBackMemory, g_rdpScreen.sizeInBytes);
+					g_rdpScreen.tiles->flags |= RDS_TILE_BITMAP_FLAG_DOUBLE_BUFFER;
+				}
+			}
+
+			ErrorF("sizeInBytes %d segmentId: %d pfbMemory: %p pfbBackMemory: %p\n",
+					g_rdpScreen.sizeInBytes, g_rdpScreen.segmentId, g_rdpScreen.pfbMemory,
+					g_rdpScreen.pfbBackMemory);
 		}
 		else
 		{
@@ -305,22 +349,24 @@ static Bool rdpScreenInit(ScreenPtr pScreen, int argc, char** argv)
 
 	miSetPixmapDepths();
 
+	pixels = g_rdpScreen.pfbBackMemory ? g_rdpScreen.pfbBackMemory : g_rdpScreen.pfbMemory;
+
 	switch (g_rdpScreen.bitsPerPixel)
 	{
 		case 8:
-			ret = fbScreenInit(pScreen, g_rdpScreen.pfbMemory,
+			ret = fbScreenInit(pScreen, pixels,
 					g_rdpScreen.width, g_rdpScreen.height,
 					dpix, dpiy, g_rdpScreen.paddedWidthInBytes, 8);
 			break;
 
 		case 16:
-			ret = fbScreenInit(pScreen, g_rdpScreen.pfbMemory,
+			ret = fbScreenInit(pScreen, pixels,
 					g_rdpScreen.width, g_rdpScreen.height,
 					dpix, dpiy, g_rdpScreen.paddedWidthInBytes / 2, 16);
 			break;
 
 		case 32:
-			ret = fbScreenInit(pScreen, g_rdpScreen.pfbMemory,
+			ret = fbScreenInit(pScreen, pixels,
 					g_rdpScreen.width, g_rdpScreen.height,
 					dpix, dpiy, g_rdpScreen.paddedWidthInBytes / 4, 32);
 			break;
@@ -604,6 +650,23 @@ int ddxProcessArgument(int argc, char **argv, int i)
 		return 2;
 	}
 
+	if (strcmp(argv[i], "-doublebuffer") == 0)
+	{
+		g_rdpScreen.doubleBuffer = 1;
+		return 1;
+	}
+
+	if (strcmp(argv[i], "-connector") == 0)
+	{
+		if (i + 1 >= argc)
+		{
+			UseMsg();
+		}
+
+		g_rdpScreen.endpoint = argv[i + 1];
+		return 2;
+	}
+
 	return 0;
 }
 
@@ -714,7 +777,20 @@ void ddxGiveUp(enum ExitCode error)
 
 	ErrorF("ddxGiveUp:\n");
 
-	if (g_rdpScreen.sharedMemory)
+	g_rdpScreen.tiles = NULL;
+
+	free(g_rdpScreen.pfbBackMemory);
+	g_rdpScreen.pfbBackMemory = NULL;
+
+	if (g_rdpScreen.sharedMemory && (g_rdpScreen.fbMemfd >= 0))
+	{
+		munmap(g_rdpScreen.pfbMemory, g_rdpScreen.fbMappedSize);
+		g_rdpScreen.pfbMemory = NULL;
+
+		close(g_rdpScreen.fbMemfd);
+		g_rdpScreen.fbMemfd = -1;
+	}
+	else if (g_rdpScreen.sharedMemory)
 	{
 		/* detach shared memory segment */
 		shmdt(g_rdpScreen.pfbMemory);
@@ -775,6 +851,9 @@ void ddxUseMsg(void)
 	ErrorF("X11rdp specific options\n");
 	ErrorF("-geometry WxH          set framebuffer width & height\n");
 	ErrorF("-depth D               set framebuffer depth\n");
+	ErrorF("-doublebuffer          draw into a private buffer, present to freerds on flush\n");
+	ErrorF("-connector tcp://H:P   accept freerds on a tcp endpoint instead of a local pipe\n");
+	ErrorF("                       requires the session cookie in %s\n", RDS_TCP_COOKIE_ENV);
 	ErrorF("\n");
 	exit(1);
 }
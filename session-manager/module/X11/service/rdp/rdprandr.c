@@ -116,6 +116,9 @@ Bool rdpRRScreenSetSize(ScreenPtr pScreen, CARD16 width, CARD16 height,
 {
 	PixmapPtr screenPixmap;
 	BoxRec box;
+	size_t sizeInBytes;
+	size_t segmentSize;
+	char* backMemory;
 
 	ErrorF("rdpRRScreenSetSize: width %d height %d mmWidth %d mmHeight %d\n",
 			width, height, (int)mmWidth, (int)mmHeight);
@@ -126,12 +129,55 @@ Bool rdpRRScreenSetSize(ScreenPtr pScreen, CARD16 width, CARD16 height,
 		return FALSE;
 	}
 
+	sizeInBytes = PixmapBytePad(width, g_rdpScreen.depth) * height;
+
+	if (g_rdpScreen.fbSegmentSize)
+	{
+		/* the shared segment keeps its size, the tile bitmap has to fit after the pixels */
+		segmentSize = g_rdpScreen.tiles ? RDS_TILE_BITMAP_OFFSET(sizeInBytes) +
+				freerds_tile_bitmap_size(width, height) : sizeInBytes;
+
+		if (segmentSize > g_rdpScreen.fbSegmentSize)
+		{
+			ErrorF("  error width %d height %d does not fit the shared framebuffer\n", width, height);
+			return FALSE;
+		}
+	}
+
+	if (g_rdpScreen.pfbBackMemory)
+	{
+		backMemory = (char*) realloc(g_rdpScreen.pfbBackMemory, sizeInBytes);
+
+		if (!backMemory)
+		{
+			ErrorF("  error resizing the back buffer\n");
+			return FALSE;
+		}
+
+		g_rdpScreen.pfbBackMemory = backMemory;
+	}
+
+	/* freerds attaches again with the new layout */
+	rdpup_detach_framebuffer();
+
 	g_rdpScreen.width = width;
 	g_rdpScreen.height = height;
 	g_rdpScreen.paddedWidthInBytes =
 			PixmapBytePad(g_rdpScreen.width, g_rdpScreen.depth);
 	g_rdpScreen.sizeInBytes =
 			g_rdpScreen.paddedWidthInBytes * g_rdpScreen.height;
+
+	if (g_rdpScreen.tiles)
+	{
+		/* the tile bitmap follows the pixels, where freerds looks for it */
+		UINT32 flags = g_rdpScreen.tiles->flags;
+
+		g_rdpScreen.tiles = freerds_tile_bitmap_init((BYTE*) &g_rdpScreen.pfbMemory[
+				RDS_TILE_BITMAP_OFFSET(g_rdpScreen.sizeInBytes)], g_rdpScreen.width, g_rdpScreen.height);
+
+		if (g_rdpScreen.tiles)
+			g_rdpScreen.tiles->flags = flags;
+	}
 	pScreen->width = width;
 	pScreen->height = height;
 	pScreen->mmWidth = mmWidth;
@@ -147,7 +193,7 @@ Bool rdpRRScreenSetSize(ScreenPtr pScreen, CARD16 width, CARD16 height,
 		pScreen->ModifyPixmapHeader(screenPixmap, width, height,
 				g_rdpScreen.depth, g_rdpScreen.bitsPerPixel,
 				g_rdpScreen.paddedWidthInBytes,
-				g_rdpScreen.pfbMemory);
+				g_rdpScreen.pfbBackMemory ? g_rdpScreen.pfbBackMemory : g_rdpScreen.pfbMemory);
 		ErrorF("  pixmap resized to %dx%d\n",
 				screenPixmap->drawable.width, screenPixmap->drawable.height);
 	}
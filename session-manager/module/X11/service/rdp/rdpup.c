@@ -34,11 +34,27 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 		do { if (_level < LOG_LEVEL) { ErrorF _args ; ErrorF("\n"); } } while (0)
 
 static int g_clientfd = -1;
+static int g_listenfd = -1;
 static rdsService* g_Service;
 static int g_connected = 0;
 
+#define RDPUP_OUTPUT_BUFFER_SIZE	65536
+#define RDPUP_BACKLOG_MAX_SIZE		(4 * 1024 * 1024)
+
+static wStream* g_OutputStream = NULL;
+static wStream* g_BacklogStream = NULL;
+static int g_update_depth = 0;
+
+static RegionRec g_damage;
+static RegionRec g_frame_damage;
+
+#define RDPUP_MAX_PAINT_RECTS	256
+
+static RECTANGLE_16 g_paint_rects[RDPUP_MAX_PAINT_RECTS];
+static int g_paint_rect_count = 0;
+static int g_frame_pending = 0;
+
 static int g_button_mask = 0;
-static BYTE* pfbBackBufferMemory = NULL;
 
 extern ScreenPtr g_pScreen;
 extern int g_Bpp;
@@ -222,19 +238,386 @@ UINT32 rdp_dstblt_rop(int opcode)
 	return rop;
 }
 
+/**
+ * Drawing messages are accumulated in g_OutputStream and written to the
+ * pipe in one go at the end of an update, when the buffer is full or from
+ * the block handler before the X server goes to sleep.
+ */
+
+static int rdpup_flush_output(void)
+{
+	int status = 0;
+	int length;
+	rdsModuleConnector* connector = (rdsModuleConnector*) g_Service;
+
+	if (!g_OutputStream)
+		return 0;
+
+	length = (int) Stream_GetPosition(g_OutputStream);
+
+	if (length < 1)
+		return 0;
+
+	if (g_connected)
+	{
+		status = freerds_transport_write(connector, Stream_Buffer(g_OutputStream), length);
+
+		if (status < 0)
+		{
+			LLOGLN(0, ("rdpup_flush: failed to write %d bytes", length));
+		}
+	}
+
+	Stream_SetPosition(g_OutputStream, 0);
+
+	return status;
+}
+
+static BOOL rdpup_remote_enabled(void)
+{
+	rdsModuleConnector* connector = (rdsModuleConnector*) g_Service;
+
+	return (connector && connector->TcpTransport) ? TRUE : FALSE;
+}
+
+/**
+ * Over tcp freerds cannot map the framebuffer: the pixels of every area are
+ * sent along in PaintRect messages, cut into bands that fit the output buffer.
+ */
+
+#define RDPUP_REMOTE_PAINT_LENGTH	(RDPUP_OUTPUT_BUFFER_SIZE - 256)
+
+static BYTE g_remote_paint_data[RDPUP_REMOTE_PAINT_LENGTH];
+
+static void rdpup_send_remote_rect(RECTANGLE_16* rect)
+{
+	int y;
+	int row;
+	int rows;
+	int band;
+	int rowLength;
+	RDS_MSG_PAINT_RECT msg;
+
+	rowLength = (rect->right - rect->left) * g_Bpp;
+
+	if (rowLength < 1)
+		return;
+
+	rows = RDPUP_REMOTE_PAINT_LENGTH / rowLength;
+
+	for (y = rect->top; y < rect->bottom; y += band)
+	{
+		band = rect->bottom - y;
+
+		if (band > rows)
+			band = rows;
+
+		for (row = 0; row < band; row++)
+		{
+			memcpy(&g_remote_paint_data[row * rowLength], &g_rdpScreen.pfbMemory[((size_t) (y + row) *
+					g_rdpScreen.paddedWidthInBytes) + (rect->left * g_Bpp)], rowLength);
+		}
+
+		ZeroMemory(&msg, sizeof(RDS_MSG_PAINT_RECT));
+
+		msg.nLeftRect = rect->left;
+		msg.nTopRect = y;
+		msg.nWidth = rect->right - rect->left;
+		msg.nHeight = band;
+		msg.bitmapData = g_remote_paint_data;
+		msg.bitmapDataLength = band * rowLength;
+
+		msg.type = RDS_SERVER_PAINT_RECT;
+		rdpup_update((RDS_MSG_COMMON*) &msg);
+	}
+}
+
+/**
+ * Areas passed to rdpup_send_area are collected and sent as a single
+ * PaintRects message, right before any other message so that ordering
+ * is preserved, or when the output is flushed.
+ */
+
+static void rdpup_flush_paint_rects(void)
+{
+	int index;
+	int count;
+	RDS_MSG_PAINT_RECTS msg;
+
+	if (g_paint_rect_count < 1)
+		return;
+
+	if (rdpup_remote_enabled())
+	{
+		count = g_paint_rect_count;
+		g_paint_rect_count = 0;
+
+		for (index = 0; index < count; index++)
+			rdpup_send_remote_rect(&g_paint_rects[index]);
+
+		return;
+	}
+
+	msg.fbSegmentId = g_rdpScreen.segmentId;
+	msg.numberOfRects = g_paint_rect_count;
+	msg.rects = g_paint_rects;
+	msg.framebuffer = NULL;
+
+	g_paint_rect_count = 0;
+
+	msg.type = RDS_SERVER_PAINT_RECTS;
+	rdpup_update((RDS_MSG_COMMON*) &msg);
+}
+
+static void rdpup_add_paint_rect(int x, int y, int w, int h)
+{
+	RECTANGLE_16* last;
+
+	if (g_paint_rect_count > 0)
+	{
+		last = &g_paint_rects[g_paint_rect_count - 1];
+
+		/* repeated or contained areas are common with text and fills */
+		if ((x >= last->left) && (y >= last->top) &&
+				(x + w <= last->right) && (y + h <= last->bottom))
+		{
+			return;
+		}
+	}
+
+	if (g_paint_rect_count >= RDPUP_MAX_PAINT_RECTS)
+		rdpup_flush_paint_rects();
+
+	g_paint_rects[g_paint_rect_count].left = x;
+	g_paint_rects[g_paint_rect_count].top = y;
+	g_paint_rects[g_paint_rect_count].right = x + w;
+	g_paint_rects[g_paint_rect_count].bottom = y + h;
+	g_paint_rect_count++;
+}
+
+/**
+ * With protocol version 3 areas are marked in the dirty tile bitmap shared
+ * with freerds instead, and announced by a single FrameReady per flush.
+ */
+
+static BOOL rdpup_tiles_enabled(void)
+{
+	rdsModuleConnector* connector = (rdsModuleConnector*) g_Service;
+
+	/* the tile bitmap lives in the framebuffer, which a remote freerds cannot see */
+	return g_connected && g_rdpScreen.tiles && (connector->ProtocolVersion >= RDS_PROTOCOL_VERSION_3) &&
+			!connector->TcpTransport;
+}
+
+static void rdpup_send_frame_ready(void)
+{
+	RDS_MSG_FRAME_READY msg;
+	rdsModuleConnector* connector = (rdsModuleConnector*) g_Service;
+
+	/* out of credits, the tiles stay dirty until freerds grants credits again */
+	if (!g_frame_pending || (connector->FlowControlCredits <= 0))
+		return;
+
+	g_frame_pending = 0;
+
+	msg.type = RDS_SERVER_FRAME_READY;
+	rdpup_update((RDS_MSG_COMMON*) &msg);
+}
+
+static void rdpup_report_area(int x, int y, int w, int h)
+{
+	if (rdpup_tiles_enabled())
+	{
+		freerds_tile_bitmap_mark(g_rdpScreen.tiles, x, y, w, h);
+		g_frame_pending = 1;
+		return;
+	}
+
+	rdpup_add_paint_rect(x, y, w, h);
+}
+
+/**
+ * With double buffering the X server draws into a private back buffer and
+ * the areas damaged since the last flush are copied to the shared front
+ * buffer here, under the frame sequence lock. They are reported to freerds
+ * only once copied, so freerds never encodes a partially drawn frame.
+ */
+
+static void rdpup_present_frame(void)
+{
+	int index;
+	int count;
+	int y;
+	BoxPtr boxes;
+	size_t offset;
+	size_t length;
+
+	if (!RegionNotEmpty(&g_frame_damage))
+		return;
+
+	count = REGION_NUM_RECTS(&g_frame_damage);
+	boxes = REGION_RECTS(&g_frame_damage);
+
+	freerds_frame_write_begin(g_rdpScreen.tiles);
+
+	for (index = 0; index < count; index++)
+	{
+		length = (boxes[index].x2 - boxes[index].x1) * g_Bpp;
+
+		for (y = boxes[index].y1; y < boxes[index].y2; y++)
+		{
+			offset = ((size_t) y * g_rdpScreen.paddedWidthInBytes) + (boxes[index].x1 * g_Bpp);
+			memcpy(&g_rdpScreen.pfbMemory[offset], &g_rdpScreen.pfbBackMemory[offset], length);
+		}
+	}
+
+	for (index = 0; index < count; index++)
+	{
+		rdpup_report_area(boxes[index].x1, boxes[index].y1,
+				boxes[index].x2 - boxes[index].x1, boxes[index].y2 - boxes[index].y1);
+	}
+
+	freerds_frame_write_end(g_rdpScreen.tiles);
+
+	RegionEmpty(&g_frame_damage);
+}
+
+int rdpup_flush(void)
+{
+	rdpup_present_frame();
+	rdpup_flush_paint_rects();
+	rdpup_send_frame_ready();
+	return rdpup_flush_output();
+}
+
+/**
+ * When freerds runs out of credits for us, drawing messages are not written:
+ * their bounds are accumulated in g_damage and reported as a single paint
+ * once freerds grants credits again, so the X server never waits on freerds.
+ */
+
+static void rdpup_add_damage(RDS_RECT* rect)
+{
+	BoxRec box;
+	RegionRec reg;
+
+	box.x1 = rect->x;
+	box.y1 = rect->y;
+	box.x2 = rect->x + rect->width;
+	box.y2 = rect->y + rect->height;
+
+	RegionInit(&reg, &box, 0);
+	RegionUnion(&g_damage, &g_damage, &reg);
+	RegionUninit(&reg);
+}
+
+static void rdpup_send_damage(void)
+{
+	BoxRec box;
+
+	if (!RegionNotEmpty(&g_damage))
+		return;
+
+	box = *RegionExtents(&g_damage);
+	RegionEmpty(&g_damage);
+
+	rdpup_send_area(box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
+}
+
+/**
+ * Messages which cannot be folded into damage, such as pointer, glyph or
+ * window updates, are kept in order in g_BacklogStream while we are out of
+ * credits. They are serialized right away and spend their credits then, so
+ * the backlog is written as is once freerds grants credits again.
+ */
+
+static BOOL rdpup_is_control_message(UINT32 type)
+{
+	switch (type)
+	{
+		case RDS_SERVER_SHARED_FRAMEBUFFER:
+		case RDS_SERVER_RESET:
+		case RDS_SERVER_LOGON_USER:
+		case RDS_SERVER_LOGOFF_USER:
+		case RDS_SERVER_CAPABILITIES:
+			return TRUE;
+
+		default:
+			return FALSE;
+	}
+}
+
+static void rdpup_add_backlog(RDS_MSG_COMMON* msg, int length)
+{
+	rdsModuleConnector* connector = (rdsModuleConnector*) g_Service;
+
+	if (!g_BacklogStream)
+		g_BacklogStream = Stream_New(NULL, RDPUP_OUTPUT_BUFFER_SIZE);
+
+	if ((Stream_GetPosition(g_BacklogStream) + length) > RDPUP_BACKLOG_MAX_SIZE)
+	{
+		LLOGLN(0, ("rdpup_update: backlog full, dropping %s message", freerds_server_message_name(msg->type)));
+		return;
+	}
+
+	freerds_server_outbound_append_message(connector, g_BacklogStream, msg);
+}
+
+static void rdpup_send_backlog(void)
+{
+	int length;
+	rdsModuleConnector* connector = (rdsModuleConnector*) g_Service;
+
+	if (!g_BacklogStream)
+		return;
+
+	length = (int) Stream_GetPosition(g_BacklogStream);
+
+	if (length < 1)
+		return;
+
+	rdpup_flush_output();
+
+	if (freerds_transport_write(connector, Stream_Buffer(g_BacklogStream), length) < 0)
+	{
+		LLOGLN(0, ("rdpup_send_backlog: failed to write %d bytes", length));
+	}
+
+	Stream_SetPosition(g_BacklogStream, 0);
+}
+
+int rds_client_flow_control(rdsModuleConnector* connector, UINT32 credits)
+{
+	if (connector->FlowControlCredits > 0)
+	{
+		rdpup_send_backlog();
+		rdpup_send_damage();
+		rdpup_flush();
+	}
+
+	return 0;
+}
+
 int rdpup_begin_update(void)
 {
+	g_update_depth++;
 	return 0;
 }
 
 int rdpup_end_update(void)
 {
+	if (g_update_depth > 0)
+		g_update_depth--;
+
+	if (g_update_depth == 0)
+		rdpup_flush();
+
 	return 0;
 }
 
 int rdpup_update(RDS_MSG_COMMON* msg)
 {
-	int status;
+	int length;
 	rdsModuleConnector* connector = (rdsModuleConnector*) g_Service;
 
 	if (g_connected)
@@ -245,7 +628,50 @@ int rdpup_update(RDS_MSG_COMMON* msg)
 			return 0;
 		}
 
-		status = freerds_server_outbound_write_message(connector, (RDS_MSG_COMMON*) msg);
+		if (!g_OutputStream)
+			g_OutputStream = Stream_New(NULL, RDPUP_OUTPUT_BUFFER_SIZE);
+
+		if (msg->type != RDS_SERVER_PAINT_RECTS)
+			rdpup_flush_paint_rects();
+
+		msg->msgFlags = 0;
+		length = freerds_server_message_write(NULL, msg);
+
+		if ((msg->msgFlags & RDS_MSG_FLAG_RECT) && (connector->FlowControlCredits <= 0))
+		{
+			if (msg->type == RDS_SERVER_PAINT_RECTS)
+			{
+				UINT32 index;
+				RDS_RECT rect;
+				RDS_MSG_PAINT_RECTS* paintRects = (RDS_MSG_PAINT_RECTS*) msg;
+
+				for (index = 0; index < paintRects->numberOfRects; index++)
+				{
+					rect.x = paintRects->rects[index].left;
+					rect.y = paintRects->rects[index].top;
+					rect.width = paintRects->rects[index].right - paintRects->rects[index].left;
+					rect.height = paintRects->rects[index].bottom - paintRects->rects[index].top;
+					rdpup_add_damage(&rect);
+				}
+			}
+			else
+			{
+				rdpup_add_damage(&msg->rect);
+			}
+
+			return 0;
+		}
+
+		if ((connector->FlowControlCredits <= 0) && !rdpup_is_control_message(msg->type))
+		{
+			rdpup_add_backlog(msg, length);
+			return 0;
+		}
+
+		if ((Stream_GetPosition(g_OutputStream) + length) > RDPUP_OUTPUT_BUFFER_SIZE)
+			rdpup_flush_output();
+
+		freerds_server_outbound_append_message(connector, g_OutputStream, msg);
 
 		LLOGLN(0, ("rdpup_update: adding %s message (%d)", freerds_server_message_name(msg->type), msg->type));
 	}
@@ -271,6 +697,16 @@ int rdpup_check_attach_framebuffer()
 		msg.bitsPerPixel = g_rdpScreen.depth;
 		msg.bytesPerPixel = g_Bpp;
 
+		if (rdpup_remote_enabled())
+		{
+			msg.segmentId = RDS_FRAMEBUFFER_SEGMENT_REMOTE;
+		}
+		else if (g_rdpScreen.fbMemfd >= 0)
+		{
+			/* the descriptor goes out with the write carrying this message or an earlier one */
+			freerds_transport_attach_fd((rdsModuleConnector*) g_Service, g_rdpScreen.fbMemfd);
+		}
+
 		msg.type = RDS_SERVER_SHARED_FRAMEBUFFER;
 		rdpup_update((RDS_MSG_COMMON*) &msg);
 
@@ -280,6 +716,43 @@ int rdpup_check_attach_framebuffer()
 	return 0;
 }
 
+/**
+ * The framebuffer layout changes with the screen size, freerds drops its
+ * mapping and attaches again with the new geometry on the next update.
+ */
+
+int rdpup_detach_framebuffer(void)
+{
+	RDS_MSG_SHARED_FRAMEBUFFER msg;
+
+	if (!g_connected || !g_rdpScreen.fbAttached)
+		return 0;
+
+	/* whatever is still pending refers to the old layout */
+	rdpup_flush();
+
+	ZeroMemory(&msg, sizeof(RDS_MSG_SHARED_FRAMEBUFFER));
+
+	msg.type = RDS_SERVER_SHARED_FRAMEBUFFER;
+	msg.attach = 0;
+	msg.width = g_rdpScreen.width;
+	msg.height = g_rdpScreen.height;
+	msg.scanline = g_rdpScreen.paddedWidthInBytes;
+	msg.segmentId = g_rdpScreen.segmentId;
+	msg.bitsPerPixel = g_rdpScreen.depth;
+	msg.bytesPerPixel = g_Bpp;
+
+	if (rdpup_remote_enabled())
+		msg.segmentId = RDS_FRAMEBUFFER_SEGMENT_REMOTE;
+
+	rdpup_update((RDS_MSG_COMMON*) &msg);
+	rdpup_flush_output();
+
+	g_rdpScreen.fbAttached = 0;
+
+	return 0;
+}
+
 int rdpup_opaque_rect(RDS_MSG_OPAQUE_RECT* msg)
 {
 	rdpup_check_attach_framebuffer();
@@ -309,6 +782,54 @@ int rdpup_screen_blt(short x, short y, int cx, int cy, short srcx, short srcy)
 	return 0;
 }
 
+/**
+ * A ScreenBlt clipped to a list of boxes, in the order they must be
+ * copied in, replacing a SetClippingRegion/ScreenBlt pair per box.
+ */
+
+int rdpup_screen_blt_rects(short x, short y, int cx, int cy, short srcx, short srcy,
+		BoxPtr boxes, int numberOfBoxes, int reverse)
+{
+	int index;
+	BoxPtr box;
+	RDS_MSG_SCREEN_BLT_RECTS msg;
+
+	if (numberOfBoxes < 1)
+		return 0;
+
+	rdpup_check_attach_framebuffer();
+
+	msg.nLeftRect = x;
+	msg.nTopRect = y;
+	msg.nWidth = cx;
+	msg.nHeight = cy;
+	msg.nXSrc = srcx;
+	msg.nYSrc = srcy;
+
+	msg.numberOfClipRects = numberOfBoxes;
+	msg.clipRects = (RECTANGLE_16*) malloc(sizeof(RECTANGLE_16) * numberOfBoxes);
+
+	if (!msg.clipRects)
+		return -1;
+
+	for (index = 0; index < numberOfBoxes; index++)
+	{
+		box = &boxes[reverse ? (numberOfBoxes - 1 - index) : index];
+
+		msg.clipRects[index].left = box->x1;
+		msg.clipRects[index].top = box->y1;
+		msg.clipRects[index].right = box->x2;
+		msg.clipRects[index].bottom = box->y2;
+	}
+
+	msg.type = RDS_SERVER_SCREEN_BLT_RECTS;
+	rdpup_update((RDS_MSG_COMMON*) &msg);
+
+	free(msg.clipRects);
+
+	return 0;
+}
+
 int rdpup_patblt(RDS_MSG_PATBLT* msg)
 {
 	rdpup_check_attach_framebuffer();
@@ -385,9 +906,6 @@ int rdpup_set_pointer(RDS_MSG_SET_POINTER* msg)
 
 void rdpup_send_area(int x, int y, int w, int h)
 {
-	int bitmapLength;
-	RDS_MSG_PAINT_RECT msg;
-
 	if (x < 0)
 		x = 0;
 
@@ -422,39 +940,26 @@ void rdpup_send_area(int x, int y, int w, int h)
 	if (w * h < 1)
 		return;
 
-	bitmapLength = w * h * g_Bpp;
+	rdpup_check_attach_framebuffer();
 
-	if (g_rdpScreen.sharedMemory && !g_rdpScreen.fbAttached)
+	if (g_rdpScreen.pfbBackMemory)
 	{
-		RDS_MSG_SHARED_FRAMEBUFFER msg;
-
-		msg.attach = 1;
-		msg.width = g_rdpScreen.width;
-		msg.height = g_rdpScreen.height;
-		msg.scanline = g_rdpScreen.paddedWidthInBytes;
-		msg.segmentId = g_rdpScreen.segmentId;
-		msg.bitsPerPixel = g_rdpScreen.depth;
-		msg.bytesPerPixel = g_Bpp;
-
-		msg.type = RDS_SERVER_SHARED_FRAMEBUFFER;
-		rdpup_update((RDS_MSG_COMMON*) &msg);
-
-		g_rdpScreen.fbAttached = 1;
+		BoxRec box;
+		RegionRec reg;
+
+		box.x1 = x;
+		box.y1 = y;
+		box.x2 = x + w;
+		box.y2 = y + h;
+
+		/* presented and reported at the next flush */
+		RegionInit(&reg, &box, 0);
+		RegionUnion(&g_frame_damage, &g_frame_damage, &reg);
+		RegionUninit(&reg);
+		return;
 	}
 
-	msg.nLeftRect = x;
-	msg.nTopRect = y;
-	msg.nWidth = w;
-	msg.nHeight = h;
-	msg.nXSrc = 0;
-	msg.nYSrc = 0;
-
-	msg.fbSegmentId = g_rdpScreen.segmentId;
-	msg.bitmapData = NULL;
-	msg.bitmapDataLength = 0;
-
-	msg.type = RDS_SERVER_PAINT_RECT;
-	rdpup_update((RDS_MSG_COMMON*) &msg);
+	rdpup_report_area(x, y, w, h);
 }
 
 void rdpup_shared_framebuffer(RDS_MSG_SHARED_FRAMEBUFFER* msg)
@@ -685,10 +1190,19 @@ int rds_service_accept(rdsService* service)
 {
 	rdsModuleConnector* connector = (rdsModuleConnector*) service;
 
-	g_clientfd = GetNamePipeFileDescriptor(connector->hClientPipe);
+	g_clientfd = freerds_transport_get_event_fd(connector);
 
 	g_con_number++;
 	g_connected = 1;
+	g_update_depth = 0;
+	g_paint_rect_count = 0;
+	g_frame_pending = 0;
+	RegionEmpty(&g_damage);
+
+	if (g_OutputStream)
+		Stream_SetPosition(g_OutputStream, 0);
+	if (g_BacklogStream)
+		Stream_SetPosition(g_BacklogStream, 0);
 	g_rdpScreen.fbAttached = 0;
 	AddEnabledDevice(g_clientfd);
 
@@ -697,6 +1211,30 @@ int rds_service_accept(rdsService* service)
 	return 0;
 }
 
+/**
+ * A tcp accept gives up after a while, see freerds_transport_accept. The
+ * listening socket is then watched by the X server so that freerds can
+ * still connect later without blocking the main loop in the meantime.
+ */
+
+static void rdpup_accept(void)
+{
+	rdsService* service = g_Service;
+	rdsModuleConnector* connector = (rdsModuleConnector*) service;
+
+	if (freerds_transport_accept(connector))
+	{
+		if (g_listenfd >= 0)
+			RemoveEnabledDevice(g_listenfd);
+
+		service->Accept(service);
+	}
+	else if (g_listenfd >= 0)
+	{
+		AddEnabledDevice(g_listenfd);
+	}
+}
+
 int rdpup_init(void)
 {
 	int DisplayId;
@@ -712,11 +1250,12 @@ int rdpup_init(void)
 		return 0;
 	}
 
-	pfbBackBufferMemory = (BYTE*) malloc(g_rdpScreen.sizeInBytes);
+	RegionInit(&g_damage, NullBox, 0);
+	RegionInit(&g_frame_damage, NullBox, 0);
 
 	if (!g_Service)
 	{
-		g_Service = freerds_service_new(DisplayId, "X11");
+		g_Service = freerds_service_new(DisplayId, g_rdpScreen.endpoint ? g_rdpScreen.endpoint : "X11");
 
 		service = g_Service;
 		connector = (rdsModuleConnector*) service;
@@ -729,10 +1268,17 @@ int rdpup_init(void)
 		connector->client->UnicodeKeyboardEvent = rds_client_unicode_keyboard_event;
 		connector->client->MouseEvent = rds_client_mouse_event;
 		connector->client->ExtendedMouseEvent = rds_client_extended_mouse_event;
+		connector->client->FlowControl = rds_client_flow_control;
 
-		connector->hServerPipe = freerds_named_pipe_create_endpoint(connector->SessionId, connector->Endpoint);
-		connector->hClientPipe = freerds_named_pipe_accept(connector->hServerPipe);
-		service->Accept(service);
+		connector->hServerPipe = freerds_transport_listen(connector);
+
+		if (connector->hServerPipe)
+		{
+			if (g_rdpScreen.endpoint)
+				g_listenfd = GetEventFileDescriptor(connector->hServerPipe);
+
+			rdpup_accept();
+		}
 	}
 
 	return 1;
@@ -740,16 +1286,27 @@ int rdpup_init(void)
 
 int rdpup_check(void)
 {
+	int count = 0;
 	rdsModuleConnector* connector;
 	rdsService* service = g_Service;
 
 	connector = (rdsModuleConnector*) service;
 
-	if (connector->hClientPipe)
+	if (!connector->hClientPipe && (g_listenfd >= 0))
+	{
+		if (WaitForSingleObject(connector->hServerPipe, 0) == WAIT_OBJECT_0)
+			rdpup_accept();
+	}
+	else if (connector->hClientPipe)
 	{
-		if (WaitForSingleObject(connector->hClientPipe, 0) == WAIT_OBJECT_0)
+		/* drain everything freerds has sent since the last wakeup */
+		while (WaitForSingleObject(freerds_transport_get_event_handle(connector), 0) == WAIT_OBJECT_0)
 		{
-			freerds_transport_receive(connector);
+			if (freerds_transport_receive(connector) <= 0)
+				break;
+
+			if (++count >= 16)
+				break;
 		}
 	}
 
@@ -110,20 +110,25 @@ char * x11_rds_module_start(RDS_MODULE_COMMON * module)
 	char envstr[256];
 	rdsModuleX11* x11;
 	struct passwd* pwnam;
-	char lpCommandLine[256];
+	char lpCommandLine[512];
+	char connectorArgs[320];
+	char tcpHost[256];
+	char tcpCookie[RDS_TCP_COOKIE_STRING_LENGTH];
+	long tcpPort;
 
 	char* filename;
 	char* pipeName;
 
 	long xres,yres,colordepth;
+	bool doubleBuffer;
 
 	x11 = (rdsModuleX11*) module;
 
 	SessionId = x11->commonModule.sessionId;
 	displayNum = SessionId+10;
 
-	pipeName = (char *)malloc(256);
-	freerds_named_pipe_get_endpoint_name(displayNum, "X11", pipeName, 256);
+	pipeName = (char *)malloc(512);
+	freerds_named_pipe_get_endpoint_name(displayNum, "X11", pipeName, 512);
 
 	filename = GetNamedPipeUnixDomainSocketFilePathA(pipeName);
 
@@ -153,10 +158,46 @@ char * x11_rds_module_start(RDS_MODULE_COMMON * module)
 		colordepth = 24;
 	}
 
+	if (!gGetPropertyBool(x11->commonModule.sessionId,"module.x11.doublebuffer",&doubleBuffer)) {
+		doubleBuffer = false;
+	}
+
+	if (!gGetPropertyNumber(x11->commonModule.sessionId,"module.x11.tcpport",&tcpPort)) {
+		tcpPort = 0;
+	}
+
+	connectorArgs[0] = '\0';
+
+	if (tcpPort > 0) {
+		/**
+		 * freerds may run on another host, it reaches the session over tcp.
+		 * X11rdp only listens on the configured address, and only accepts
+		 * freerds with the cookie both get from us: X11rdp through its
+		 * environment, freerds through the endpoint we return.
+		 */
+		if (!gGetPropertyString(x11->commonModule.sessionId,"module.x11.tcphost",tcpHost,sizeof(tcpHost))) {
+			strcpy(tcpHost, "127.0.0.1");
+		}
+
+		if (freerds_tcp_generate_cookie(tcpCookie, sizeof(tcpCookie)) < 0) {
+			fprintf(stderr, "Failed to generate the connector cookie\n");
+			free(pipeName);
+			return NULL;
+		}
+
+		sprintf_s(pipeName, 512, "tcp://%s:%d%s%s", tcpHost, (int) (tcpPort + displayNum),
+				RDS_TCP_COOKIE_PARAM, tcpCookie);
+		sprintf_s(connectorArgs, sizeof(connectorArgs), " -connector tcp://%s:%d",
+				tcpHost, (int) (tcpPort + displayNum));
+
+		SetEnvironmentVariableEBA(x11->commonModule.envBlock, RDS_TCP_COOKIE_ENV, tcpCookie);
+	}
+
 	x11_rds_module_reset_process_informations(x11);
 
-	sprintf_s(lpCommandLine, sizeof(lpCommandLine), "%s :%d -geometry %dx%d -depth %d -uds -terminate",
-			"X11rdp", (int) (displayNum), xres, yres, colordepth);
+	sprintf_s(lpCommandLine, sizeof(lpCommandLine), "%s :%d -geometry %dx%d -depth %d%s%s -uds -terminate",
+			"X11rdp", (int) (displayNum), xres, yres, colordepth, doubleBuffer ? " -doublebuffer" : "",
+			connectorArgs);
 
 	status = CreateProcessA(NULL, lpCommandLine,
 			NULL, NULL, FALSE, 0, *(x11->commonModule.envBlock), NULL,
@@ -164,9 +205,18 @@ char * x11_rds_module_start(RDS_MODULE_COMMON * module)
 
 	fprintf(stderr, "Process started: %d\n", status);
 
-	if (!WaitNamedPipeA(pipeName, 5 * 1000))
+	/* the session's own processes must not learn the cookie */
+	if (tcpPort > 0)
+		SetEnvironmentVariableEBA(x11->commonModule.envBlock, RDS_TCP_COOKIE_ENV, NULL);
+
+	if (tcpPort > 0)
+		status = freerds_tcp_wait_endpoint(pipeName, 5 * 1000);
+	else
+		status = WaitNamedPipeA(pipeName, 5 * 1000);
+
+	if (!status)
 	{
-		fprintf(stderr, "WaitNamedPipe failure: %s\n", pipeName);
+		fprintf(stderr, "WaitNamedPipe failure: %.*s\n", RDS_TCP_ENDPOINT_ADDRESS(pipeName));
 		return NULL;
 	}
 #if 0